@@ -3,18 +3,50 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <time.h>
+#include <zlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "TCPServer/TCPServer.h"
 #include "types.h"
 
-#define MAX_METHODS 6
-#define MAX_ROUTES 512
+#define MAX_METHODS 7
 #define STATIC_MAP_CAP 4096
+#define ROUTE_CACHE_MAX_VARY 4
+#define ROUTE_CACHE_KEY_MAX 2048
+#define RESPONSE_CACHE_SHARDS 8
+#define RESPONSE_CACHE_DEFAULT_BUDGET (8u << 20)
+#define STATIC_CACHE_DEFAULT_BUDGET (16u << 20)
+#define STATIC_CACHE_DEFAULT_TTL_MS 1000
+#define CHUNK_LINE_MAX 4096
+// Largest chunk pulled from a response producer, and how many are pulled per
+// drain before the loop moves on to other connections.
+#define RESPONSE_STREAM_CHUNK 16384
+#define RESPONSE_STREAM_BURST 4
+#define WEBSOCKET_PING_INTERVAL_MS 30000
+#define WEBSOCKET_MAX_PENDING (1u << 20)
+// HTTP/2: concurrent streams per connection, output queued before DATA
+// framing waits for a drain, and the HPACK table size we decode against.
+#define H2_MAX_STREAMS 100
+#define H2_SEND_QUEUE (1u << 16)
+#define HPACK_TABLE_SIZE 4096
+// Compression: zlib level, the default budget and bucket count of the
+// compressed static-file LRU, and the block size of the request arena.
+#define COMPRESS_LEVEL 6
+#define COMPRESS_CACHE_DEFAULT_BUDGET (4u << 20)
+#define COMPRESS_CACHE_BUCKETS 256
+#define ARENA_BLOCK 16384
 
 typedef struct {
   char*  key;
@@ -26,6 +58,39 @@ typedef struct {
   size_t count;
 } StaticMap;
 
+enum ChunkState {
+  CHUNK_SIZE = 0,
+  CHUNK_DATA,
+  CHUNK_DATA_CRLF,
+  CHUNK_TRAILERS,
+  CHUNK_DONE,
+};
+
+// Incremental Transfer-Encoding: chunked decoder. The decoded body is
+// compacted in place at bytes + bytes_off while raw_off tracks how far the
+// wire bytes have been consumed; raw_off never trails the decoded end.
+struct ChunkDecoder {
+  enum ChunkState state;
+  size_t chunk_left;
+  size_t raw_off;
+  size_t body_len;
+  size_t body_total;
+};
+
+// Bump allocator for memory that lives until the current request has been
+// answered. It is reset rather than freed between requests, so a keep-alive
+// connection keeps reusing its first block.
+struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t len;
+  size_t cap;
+  byte data[];
+};
+
+struct Arena {
+  struct ArenaBlock *head;
+};
+
 struct HTTPConn {
   byte *bytes;
   size_t bytes_len;
@@ -34,35 +99,267 @@ struct HTTPConn {
   bool parsed_headers;
   bool sent_continue;
 
+  struct ChunkDecoder chunk;
   http_request *req;
+  // Response bodies built for req, such as compressed output.
+  struct Arena arena;
+
+  // Host and router the current request was matched against; the router
+  // is pinned until the request completes so a swap cannot free it.
+  const struct VHost *vhost;
+  struct ExpressRouter *router;
+  struct Route *route;
+  const struct MethodRoute *stream;
+  void *stream_ctx;
+  bool stream_started;
+  size_t stream_seen;
+  http_response stream_res;
+
+  // Body of the last response, still being pulled from set_response_stream.
+  // Reading stays paused until it ends so pipelined requests wait their turn.
+  response_producer producer;
+  void *producer_ctx;
+  bool producer_chunked;
+  bool producer_close;
+
+  // SSE channel this connection subscribes to, and its slot there.
+  struct SseChannel *sse;
+  size_t sse_index;
+  bool sse_chunked;
+
+  // Set once the connection has been upgraded; bytes are frames from then.
+  struct ExpressWebSocket *ws;
+  struct H2Session *h2;
 };
 
 struct MethodRoute {
   route_handler handler;
+
+  // Streaming routes: handler runs once headers are parsed, body bytes go to
+  // on_body_chunk as they arrive and on_body_end builds the response.
+  bool streaming;
+  body_chunk_handler on_body_chunk;
+  route_handler on_body_end;
+  size_t max_body_size;
+
+  // WebSocket routes: handler answers the upgrade and these take over.
+  ExpressWebSocketHandlers *websocket;
+};
+
+struct RouteCache {
+  uint64_t ttl_ns;
+  char *vary[ROUTE_CACHE_MAX_VARY];
+  size_t vary_len;
 };
 
 struct Route {
   struct MethodRoute handlers[MAX_METHODS];
+  // Bit per registered method; GET implies HEAD and OPTIONS is always
+  // answered.
+  uint32_t methods;
+  // Global, prefix and route middleware in run order; built at freeze.
+  middleware_handler *chain;
+  size_t chain_len;
+  // Set by router_cache_route; NULL when responses are not cached.
+  struct RouteCache *cache;
+  // Set by router_etag_route.
+  bool etag;
+  // Built at freeze: the OPTIONS answer from the status code on, and the
+  // CORS policy covering this route, if any.
+  char *options_head;
+  size_t options_head_len;
+  const struct CorsPolicy *cors;
   char *route;
+  // Names of the :param / *wildcard segments, in path order.
+  char *param_names[MAX_PARAMS];
+  size_t params_len;
+};
+
+// Compressed radix tree over route patterns. Static edges carry a shared
+// label; ":name" and "*name" segments hang off dedicated children so a
+// lookup walks the path once, whatever the number of routes.
+struct RadixNode {
+  char *label;
+  size_t label_len;
+  struct RadixNode **children;
+  size_t children_len;
+  struct RadixNode *param;
+  struct RadixNode *wildcard;
+  struct Route *route;
+};
+
+// One slot of the frozen exact-match table, padded to a cache line so a
+// lookup touches a single line after the seed fetch.
+struct RouteSlot {
+  _Alignas(64) uint64_t hash;
+  const char *path;
+  size_t path_len;
+  struct Route *route;
+};
+
+// Minimal perfect hash over the routes without parameters, built by
+// router_freeze with the hash-and-displace scheme: a key's bucket picks a
+// seed, and the seed places it in a slot no other key uses.
+struct FrozenRoutes {
+  struct RouteSlot *slots;
+  uint32_t *seeds;
+  uint32_t slots_len;
+  uint32_t buckets_len;
+};
+
+struct CorsPolicy {
+  char *prefix;
+  size_t prefix_len;
+  ExpressCors cors;
+};
+
+// A middleware registration. prefix and route are both NULL for global
+// middleware; at most one of them is set otherwise.
+struct MiddlewareEntry {
+  middleware_handler fn;
+  const char *prefix;
+  size_t prefix_len;
+  struct Route *route;
 };
 
 typedef struct ExpressRouter {
-  struct Route routes[MAX_ROUTES];
-  size_t routes_off;
-  middleware_handler mware_func;
+  struct RadixNode root;
+  struct Route **routes;
+  size_t routes_len;
+  size_t routes_cap;
+  bool frozen;
+  struct FrozenRoutes exact;
+  struct MiddlewareEntry *mware;
+  size_t mware_len;
+  size_t mware_cap;
+  // Backing store for every Route chain plus the global chain that runs for
+  // requests no route matched.
+  middleware_handler *chains;
+  size_t global_chain_len;
   route_handler fallback;
+
+  // Created at freeze when any route opted into caching.
+  struct ResponseCache *cache;
+  size_t cache_budget;
+
+  struct CorsPolicy *cors;
+  size_t cors_len;
+
+  // Content types compressed for clients accepting it. The LRU of
+  // compressed static files is created at freeze when any rule exists.
+  struct CompressRule *compress;
+  size_t compress_len;
+  struct CompressCache *compress_cache;
+  size_t compress_budget;
+
+  // Owners: the creator plus every server publishing it. pins counts
+  // in-flight requests and is only touched on the event-loop thread.
+  atomic_size_t refs;
+  size_t pins;
 } ExpressRouter;
 
+// A router replaced by server_swap_router, waiting for the loop to pass a
+// quiescent point and for its pinned requests to finish.
+struct RetiredRouter {
+  ExpressRouter *router;
+  struct RetiredRouter *next;
+};
+
+// A virtual host: the router and static files served for one Host name.
+// The router and public_path given to server_new form the default host.
+struct VHost {
+  // Lowercased; a wildcard "*.example.com" is stored as ".example.com".
+  char *name;
+  size_t name_len;
+  uint64_t hash;
+  // Read without locks by the loop; written by server_swap_router.
+  _Atomic(ExpressRouter *) router;
+  char* public_path;
+  StaticMap static_map;
+  // Served files, keyed on the request path; NULL without a public_path.
+  struct ResponseCache *static_cache;
+};
+
+// Subscribers of one SSE channel on one server; loop-private.
+struct SseChannel {
+  char *name;
+  size_t name_len;
+  uint64_t hash;
+  struct SseChannel *next;
+  TCPConn **subs;
+  size_t subs_len;
+  size_t subs_cap;
+};
+
+// An event from express_sse_broadcast waiting for a server's loop. buf
+// holds the event framed as an HTTP chunk; raw_off/raw_len is the event
+// alone, for HTTP/1.0 subscribers.
+struct SseEvent {
+  struct SseEvent *next;
+  TCPSharedBuf *buf;
+  size_t raw_off;
+  size_t raw_len;
+  uint64_t hash;
+  size_t channel_len;
+  char channel[];
+};
+
+// An upgraded connection. Loop-private; freed when its TCPConn closes.
+struct ExpressWebSocket {
+  TCPConn *conn;
+  struct ExpressServer *server;
+  ExpressWebSocketHandlers handlers;
+  void *user;
+  size_t index;
+
+  // Fragments of the message in progress.
+  byte *message;
+  size_t message_len;
+  size_t message_cap;
+  bool message_binary;
+  bool in_message;
+
+  uint64_t last_seen_ns;
+  uint64_t close_sent_ns;
+  uint64_t ping_ns;
+  bool ping_sent;
+  // closing: our close frame is out. closed: no more frames either way.
+  bool closing;
+  bool closed;
+  uint16_t close_code;
+};
+
 typedef struct ExpressServer {
   void *user_ctx;
-  ExpressRouter *router;
+  struct VHost default_host;
+  // Open-addressed by VHost.hash; exact names and wildcard suffixes share
+  // the table since only suffixes start with '.'.
+  struct VHost **vhosts;
+  size_t vhosts_cap;
+  size_t vhosts_len;
+  _Atomic(struct RetiredRouter *) retired;
+  // Loop-private: retired routers still pinned by requests.
+  struct RetiredRouter *draining;
   TCPServer *tcp_server;
 
+  // SSE: broadcasts land in sse_inbox from any thread and on_tick hands
+  // them to the channels, a chained table by SseChannel.hash.
+  _Atomic(struct SseEvent *) sse_inbox;
+  struct SseChannel **sse_channels;
+  size_t sse_channels_cap;
+  size_t sse_channels_len;
+  size_t sse_max_pending;
+  struct ExpressServer *sse_next;
+
+  // Upgraded connections, for keepalive pings on the tick.
+  struct ExpressWebSocket **websockets;
+  size_t websockets_len;
+  size_t websockets_cap;
+
   size_t total_requests;
   size_t max_body_size;
-
-  char* public_path;
-  StaticMap static_map;
+  size_t static_cache_budget;
+  uint64_t static_cache_ttl_ns;
 } ExpressServer;
 
 static int caseless_stricmp(const char *lhs, const char *rhs) {
@@ -181,7 +478,7 @@ static const char* mime_type_for_path(const char* path) {
   return "application/octet-stream";
 }
 
-static bool try_serve_static_file(ExpressServer* s, http_request* req,
+static bool try_serve_static_file(const struct VHost* s, http_request* req,
                                    http_response* res, byte** out_buf) {
   if (s->public_path == NULL) return false;
 
@@ -205,6 +502,11 @@ static bool try_serve_static_file(ExpressServer* s, http_request* req,
   FILE* f = fopen(fpath, "rb");
   if (!f) return false;
 
+  // The size scanned at startup is stale once the file is edited.
+  struct stat st;
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode))
+    file_size = (size_t)st.st_size;
+
   byte* buf = malloc(file_size > 0 ? file_size : 1);
   if (!buf) {
     fclose(f);
@@ -450,19 +752,71 @@ static bool ensure_http_conn_cap(struct HTTPConn *conn, size_t need) {
   return true;
 }
 
-static void http_request_cleanup(http_request *req) {
-  if (req == NULL)
+static void segment_release(const segment_ownership *owner) {
+  if (owner->release != NULL)
+    owner->release(owner->ctx);
+  if (owner->shared != NULL)
+    tcp_shared_release(owner->shared);
+}
+
+static size_t response_segments_bytes(const http_response *res) {
+  size_t n = 0;
+  for (size_t i = 0; i < res->segments_len; i++)
+    n += res->segments[i].len;
+  return n;
+}
+
+// Releases the segments while keeping the array for further appends.
+static void response_drop_segments(http_response *res) {
+  for (size_t i = 0; i < res->segments_len; i++)
+    segment_release(&res->segments[i].owner);
+  res->segments_len = 0;
+}
+
+// Copies body then segments, content_length bytes in all, into dst.
+static void response_gather(const http_response *res, byte *dst) {
+  size_t off = res->content_length - response_segments_bytes(res);
+  if (off > 0)
+    memcpy(dst, res->body, off);
+  for (size_t i = 0; i < res->segments_len; i++) {
+    if (res->segments[i].len > 0)
+      memcpy(dst + off, res->segments[i].data, res->segments[i].len);
+    off += res->segments[i].len;
+  }
+}
+
+static void response_cleanup(http_response *res) {
+  if (res == NULL)
     return;
 
-  for (size_t i = 0; i < req->request_params_len; i++) {
-    free(req->request_params[i].key);
-    free(req->request_params[i].value);
+  response_drop_segments(res);
+  free(res->segments);
+  res->segments = NULL;
+  res->segments_cap = 0;
+
+  if (res->producer != NULL)
+    (void)res->producer(res->producer_ctx, NULL, 0);
+  res->producer = NULL;
+
+  for (size_t i = 0; i < res->cookies_len; i++) {
+    free(res->cookies[i].name);
+    free(res->cookies[i].value);
   }
+  res->cookies_len = 0;
 
-  for (size_t i = 0; i < req->route_params_len; i++) {
-    free(req->route_params[i].key);
-    free(req->route_params[i].value);
+  for (size_t i = 0; i < res->headers_len; i++) {
+    free(res->headers[i].key);
+    free(res->headers[i].value);
   }
+  free(res->headers);
+  res->headers = NULL;
+  res->headers_len = 0;
+  res->headers_cap = 0;
+}
+
+static void http_request_cleanup(http_request *req) {
+  if (req == NULL)
+    return;
 
   for (size_t i = 0; i < req->headers_len; i++) {
     free(req->headers[i].key);
@@ -477,15 +831,74 @@ static void http_request_cleanup(http_request *req) {
   free(req);
 }
 
+static void *arena_alloc(struct Arena *a, size_t n) {
+  if (n > SIZE_MAX - sizeof(struct ArenaBlock) - 7)
+    return NULL;
+  n = (n + 7) & ~(size_t)7;
+  struct ArenaBlock *b = a->head;
+  if (b == NULL || b->cap - b->len < n) {
+    size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+    b = (struct ArenaBlock *)malloc(sizeof(*b) + cap);
+    if (b == NULL)
+      return NULL;
+    b->next = a->head;
+    b->len = 0;
+    b->cap = cap;
+    a->head = b;
+  }
+  void *p = b->data + b->len;
+  b->len += n;
+  return p;
+}
+
+// Frees every block but the first, which is kept if it has the standard
+// size.
+static void arena_reset(struct Arena *a) {
+  while (a->head != NULL &&
+         (a->head->next != NULL || a->head->cap != ARENA_BLOCK)) {
+    struct ArenaBlock *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+  if (a->head != NULL)
+    a->head->len = 0;
+}
+
+static void arena_free(struct Arena *a) {
+  while (a->head != NULL) {
+    struct ArenaBlock *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+}
+
 static void http_conn_clear_request(struct HTTPConn *conn) {
   if (conn == NULL)
     return;
 
+  if (conn->stream != NULL && conn->stream_started &&
+      conn->stream->on_body_chunk != NULL && conn->req != NULL) {
+    // The body never completed; a NULL chunk tells the handler to drop
+    // whatever it set up for this upload.
+    conn->stream->on_body_chunk(conn->stream_ctx, conn->req, NULL, 0);
+  }
+  response_cleanup(&conn->stream_res);
+  if (conn->router != NULL)
+    conn->router->pins--;
+  conn->router = NULL;
+  conn->vhost = NULL;
+  conn->route = NULL;
+  conn->stream = NULL;
+  conn->stream_started = false;
+  conn->stream_seen = 0;
+
   http_request_cleanup(conn->req);
   conn->req = NULL;
   conn->parsed_headers = false;
   conn->sent_continue = false;
   conn->bytes_off = 0;
+  memset(&conn->chunk, 0, sizeof(conn->chunk));
+  arena_reset(&conn->arena);
 }
 
 static void http_conn_reset(struct HTTPConn *conn) {
@@ -517,11 +930,27 @@ static void http_conn_consume_bytes(struct HTTPConn *conn, size_t consumed) {
   conn->bytes[remaining] = '\0';
 }
 
+static bool http_conn_append(struct HTTPConn *conn, const byte *bytes,
+                             size_t len) {
+  if (len > SIZE_MAX - conn->bytes_len - 1 ||
+      !ensure_http_conn_cap(conn, conn->bytes_len + len + 1))
+    return false;
+
+  memcpy(conn->bytes + conn->bytes_len, bytes, len);
+  conn->bytes_len += len;
+  conn->bytes[conn->bytes_len] = '\0';
+  return true;
+}
+
 static void http_conn_destroy(struct HTTPConn *conn) {
   if (conn == NULL)
     return;
 
+  if (conn->producer != NULL)
+    (void)conn->producer(conn->producer_ctx, NULL, 0);
+
   http_conn_reset(conn);
+  arena_free(&conn->arena);
   free(conn);
 }
 
@@ -529,7 +958,6 @@ static http_response response_default(void) {
   http_response res;
   memset(&res, 0, sizeof(res));
   res.status_code = "200";
-  set_response_header(&res, "Server", SERVER_VERSION);
   return res;
 }
 
@@ -556,6 +984,7 @@ static void response_set_static(http_response *res, const char *status_code,
   if (res == NULL)
     return;
 
+  response_drop_segments(res);
   res->status_code = (char *)status_code;
   res->body = (byte *)body;
   res->content_length = body == NULL ? 0 : strlen(body);
@@ -700,22 +1129,152 @@ static const char *reason_phrase(const char *status_code) {
   }
 }
 
-static void parse_query_string(http_request *req, const char *query) {
+// Index of the first '%' or '+' in s[0, len), or len when the range needs
+// no decoding.
+static size_t find_url_escape(const char *s, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i pct = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8('+');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+    if (mask != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+#endif
+  for (; i < len; i++) {
+    if (s[i] == '%' || s[i] == '+')
+      return i;
+  }
+  return len;
+}
+
+// True when an origin-form path has no escapes, dot segments or empty
+// segments, which is nearly every request; those skip canonicalization.
+// Dots inside a segment, as in "/app.js", are fine.
+static bool path_is_canonical(const char *path, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  // Any '%', "//" or "/." sends the block to the exact check below; "/."
+  // only starts a dot segment when the segment is "." or "..".
+  const __m128i pct = _mm_set1_epi8('%');
+  const __m128i dot = _mm_set1_epi8('.');
+  const __m128i slash = _mm_set1_epi8('/');
+  for (; i + 17 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(path + i));
+    __m128i next = _mm_loadu_si128((const __m128i *)(path + i + 1));
+    __m128i follows = _mm_or_si128(_mm_cmpeq_epi8(next, slash),
+                                   _mm_cmpeq_epi8(next, dot));
+    __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(v, slash), follows);
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, pct));
+    if (_mm_movemask_epi8(hit) != 0)
+      break;
+  }
+#endif
+  for (; i < len; i++) {
+    if (path[i] == '%')
+      return false;
+    if (path[i] != '/' || i + 1 == len)
+      continue;
+    if (path[i + 1] == '/')
+      return false;
+    if (path[i + 1] == '.') {
+      size_t end = i + 2 < len && path[i + 2] == '.' ? i + 3 : i + 2;
+      if (end == len || path[end] == '/')
+        return false;
+    }
+  }
+  return true;
+}
+
+static void url_decode_in_place(char *s) {
+  size_t len = strlen(s);
+  size_t r = find_url_escape(s, len);
+  if (r == len)
+    return;
+
+  size_t w = r;
+  while (r < len) {
+    char c = url_decode_char(s + r);
+    if (s[r] == '%' && c != '\0') {
+      r += 3;
+    } else {
+      // Malformed escapes are kept literally.
+      if (s[r] != '+')
+        c = s[r];
+      r++;
+    }
+    s[w++] = c;
+  }
+  s[w] = '\0';
+}
+
+// Percent-decodes an origin-form path and resolves empty, "." and ".."
+// segments in place, in a single pass. ".." never climbs above the root.
+// Returns false for malformed escapes or an encoded NUL.
+static bool canonicalize_path(char *path) {
+  size_t len = strlen(path);
+  if (path[0] != '/' || path_is_canonical(path, len))
+    return true;
+
+  size_t w = 1;
+  size_t seg = 1;
+  for (size_t r = 1; r <= len; r++) {
+    char c = path[r];
+    if (c == '%') {
+      if (from_hex_digit(path[r + 1]) < 0 || from_hex_digit(path[r + 2]) < 0)
+        return false;
+      c = url_decode_char(path + r);
+      if (c == '\0')
+        return false;
+      r += 2;
+    }
+
+    if (c != '/' && r < len) {
+      path[w++] = c;
+      continue;
+    }
+
+    size_t n = w - seg;
+    if (n == 1 && path[seg] == '.') {
+      w = seg;
+    } else if (n == 2 && path[seg] == '.' && path[seg + 1] == '.') {
+      w = seg > 1 ? seg - 1 : 1;
+      while (w > 1 && path[w - 1] != '/')
+        w--;
+    } else if (n > 0 && c == '/') {
+      path[w++] = '/';
+    }
+    seg = w;
+  }
+
+  path[w] = '\0';
+  return true;
+}
+
+// Splits the query string in place; keys and values point into req->route.
+static void parse_query_string(http_request *req, char *query) {
   while (*query && req->request_params_len < MAX_PARAMS) {
-    const char *eq = strchr(query, '=');
-    if (!eq) break;
-    const char *amp = strchr(eq + 1, '&');
-    const char *val_end = amp ? amp : query + strlen(query);
-    size_t klen = (size_t)(eq - query);
-    size_t vlen = (size_t)(val_end - (eq + 1));
-    char *k = malloc(klen + 1);
-    char *v = malloc(vlen + 1);
-    if (!k || !v) { free(k); free(v); break; }
-    memcpy(k, query, klen); k[klen] = '\0';
-    memcpy(v, eq + 1, vlen); v[vlen] = '\0';
-    req->request_params[req->request_params_len].key   = k;
-    req->request_params[req->request_params_len].value = v;
-    req->request_params_len++;
+    char *amp = strchr(query, '&');
+    if (amp)
+      *amp = '\0';
+
+    if (*query != '\0') {
+      char *eq = strchr(query, '=');
+      char *value = query + strlen(query);
+      if (eq) {
+        *eq = '\0';
+        value = eq + 1;
+      }
+      url_decode_in_place(query);
+      url_decode_in_place(value);
+      req->request_params[req->request_params_len].key = query;
+      req->request_params[req->request_params_len].value = value;
+      req->request_params_len++;
+    }
+
     if (!amp) break;
     query = amp + 1;
   }
@@ -754,8 +1313,10 @@ static bool parse_request_line(http_request *req, const char *request_line) {
   char *q = strchr(req->route, '?');
   if (q) {
     *q = '\0';
-    parse_query_string(req, q + 1);
+    req->query = q + 1;
   }
+  if (!canonicalize_path(req->route))
+    return false;
 
   cursor = skip_const_ascii_whitespace(route_end, line_end);
   const char *version_end = find_ascii_whitespace(cursor, line_end);
@@ -783,6 +1344,79 @@ static int32_t add_cookie_to_request(http_request *req, char *name, char *value)
   return 0;
 }
 
+static int32_t parse_cookie_header(http_request *req, const char *value) {
+  const char *cursor = value;
+
+  while (*cursor != '\0') {
+    const char *delimiter = strchr(cursor, '=');
+    if (delimiter == NULL)
+      return PARSE_HEADERS_ERR_INVALID;
+
+    size_t ckey_len = (size_t)(delimiter - cursor);
+    if (ckey_len >= 1024)
+      return PARSE_HEADERS_ERR_INVALID;
+
+    const char *semicolon = strchr(delimiter, ';');
+    const char *value_start = delimiter + 1;
+    const char *value_end =
+        semicolon != NULL ? semicolon : value + strlen(value);
+    size_t cval_len = (size_t)(value_end - value_start);
+    if (cval_len >= 4096)
+      return PARSE_HEADERS_ERR_INVALID;
+
+    char *lhs = (char *)malloc(ckey_len + 1);
+    if (lhs == NULL)
+      return PARSE_HEADERS_ERR_ALLOC;
+    strncpy(lhs, cursor, ckey_len);
+    lhs[ckey_len] = '\0';
+
+    char *rhs = (char *)malloc(cval_len + 1);
+    if (rhs == NULL) {
+      free(lhs);
+      return PARSE_HEADERS_ERR_ALLOC;
+    }
+    strncpy(rhs, value_start, cval_len);
+    rhs[cval_len] = '\0';
+
+    int32_t ret = add_cookie_to_request(req, lhs, rhs);
+    if (ret != 0) {
+      free(lhs);
+      free(rhs);
+      return PARSE_HEADERS_ERR_CAPACITY;
+    }
+    if (semicolon == NULL)
+      break;
+    cursor = semicolon + 1;
+    while (*cursor == ' ') cursor++;
+  }
+
+  return 0;
+}
+
+// Cookies and query parameters are only split out of the raw request on
+// first access; most routes never look at them.
+static void ensure_request_cookies(http_request *req) {
+  if (req->cookies_parsed)
+    return;
+  req->cookies_parsed = true;
+
+  for (size_t i = 0; i < req->headers_len; i++) {
+    if (caseless_stricmp(req->headers[i].key, "Cookie") != 0)
+      continue;
+    if (parse_cookie_header(req, req->headers[i].value) != 0)
+      break;
+  }
+}
+
+static void ensure_request_params(http_request *req) {
+  if (req->params_parsed)
+    return;
+  req->params_parsed = true;
+
+  if (req->query != NULL)
+    parse_query_string(req, req->query);
+}
+
 static int32_t parse_headers(const struct HTTPConn *c, http_request *req) {
   if (c == NULL || req == NULL || c->bytes == NULL)
     return PARSE_HEADERS_ERR_INVALID;
@@ -797,12 +1431,16 @@ static int32_t parse_headers(const struct HTTPConn *c, http_request *req) {
 
   req->headers_len = 0;
   req->cookie_len = 0;
+  req->cookies_parsed = false;
+  req->query = NULL;
+  req->params_parsed = false;
   req->host = NULL;
   req->content_length = 0;
   req->content_type = NULL;
   req->body = NULL;
 
   size_t host_count = 0;
+  bool saw_content_length = false;
 
   if (!parse_request_line(req, (char *)c->bytes))
     return PARSE_HEADERS_ERR_REQUEST_LINE;
@@ -840,6 +1478,8 @@ static int32_t parse_headers(const struct HTTPConn *c, http_request *req) {
 
     req->headers[req->headers_len].key = key;
     req->headers[req->headers_len].value = value;
+    req->headers[req->headers_len].key_len = strlen(key);
+    req->headers[req->headers_len].value_len = strlen(value);
     req->headers_len++;
 
     if (caseless_stricmp(key, "Host") == 0) {
@@ -854,53 +1494,9 @@ static int32_t parse_headers(const struct HTTPConn *c, http_request *req) {
       if (!parse_content_length_value(value, &content_length))
         return PARSE_HEADERS_ERR_CONTENT_LENGTH;
       req->content_length = content_length;
+      saw_content_length = true;
     } else if (caseless_stricmp(key, "Transfer-Encoding") == 0 && caseless_stricmp(value, "chunked") == 0) {
          req->chunked = true;
-    } else if (caseless_stricmp(key, "Cookie") == 0) {
-      const char *cursor = value;
-
-      while (*cursor != '\0') {
-        const char *delimiter = strchr(cursor, '=');
-        if (delimiter == NULL)
-          return PARSE_HEADERS_ERR_INVALID;
-
-        size_t ckey_len = (size_t)(delimiter - cursor);
-        if (ckey_len >= 1024)
-          return PARSE_HEADERS_ERR_INVALID;
-
-        const char *semicolon = strchr(delimiter, ';');
-        const char *value_start = delimiter + 1;
-        const char *value_end =
-            semicolon != NULL ? semicolon : value + strlen(value);
-        size_t cval_len = (size_t)(value_end - value_start);
-        if (cval_len >= 4096)
-          return PARSE_HEADERS_ERR_INVALID;
-
-        char *lhs = (char *)malloc(ckey_len + 1);
-        if (lhs == NULL)
-          return PARSE_HEADERS_ERR_ALLOC;
-        strncpy(lhs, cursor, ckey_len);
-        lhs[ckey_len] = '\0';
-
-        char *rhs = (char *)malloc(cval_len + 1);
-        if (rhs == NULL) {
-          free(lhs);
-          return PARSE_HEADERS_ERR_ALLOC;
-        }
-        strncpy(rhs, value_start, cval_len);
-        rhs[cval_len] = '\0';
-
-        int32_t ret = add_cookie_to_request(req, lhs, rhs);
-        if (ret != 0) {
-          free(lhs);
-          free(rhs);
-          return PARSE_HEADERS_ERR_CAPACITY;
-        }
-        if (semicolon == NULL)
-          break;
-        cursor = semicolon + 1;
-        while (*cursor == ' ') cursor++;
-      }
     }
 
     line = line_end + 2;
@@ -908,10 +1504,144 @@ static int32_t parse_headers(const struct HTTPConn *c, http_request *req) {
 
   if (strcmp(req->version, "HTTP/1.1") == 0 && host_count != 1)
     return PARSE_HEADERS_ERR_INVALID;
+  if (req->chunked && saw_content_length)
+    return PARSE_HEADERS_ERR_INVALID;
 
   return (int32_t)header_bytes;
 }
 
+static bool parse_chunk_size_line(const char *start, const char *end,
+                                  size_t *out) {
+  size_t size = 0;
+  const char *p = start;
+  for (; p < end; p++) {
+    int digit = from_hex_digit(*p);
+    if (digit < 0)
+      break;
+    if (size > (SIZE_MAX >> 4))
+      return false;
+    size = (size << 4) | (size_t)digit;
+  }
+  if (p == start)
+    return false;
+
+  // Chunk extensions are permitted but carry nothing we act on.
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  if (p < end && *p != ';')
+    return false;
+
+  *out = size;
+  return true;
+}
+
+static int32_t add_trailer_to_request(http_request *req, const char *line,
+                                      const char *line_end) {
+  const char *colon = memchr(line, ':', (size_t)(line_end - line));
+  if (colon == NULL)
+    return DECODE_CHUNKED_ERR_INVALID;
+  if (req->headers_len >= MAX_HEADERS)
+    return DECODE_CHUNKED_ERR_INVALID;
+
+  char *key = clone_trimmed_range(line, colon);
+  char *value = clone_trimmed_range(colon + 1, line_end);
+  if (key == NULL || value == NULL || *key == '\0') {
+    free(key);
+    free(value);
+    return DECODE_CHUNKED_ERR_INVALID;
+  }
+
+  req->headers[req->headers_len].key = key;
+  req->headers[req->headers_len].value = value;
+  req->headers[req->headers_len].key_len = strlen(key);
+  req->headers[req->headers_len].value_len = strlen(value);
+  req->headers_len++;
+  return 0;
+}
+
+// Decodes as much of a chunked body as has arrived. Returns 1 once the
+// terminating chunk and trailers are consumed, 0 when more bytes are needed
+// and a DECODE_CHUNKED_ERR_* code otherwise. max_body_size is enforced
+// against each declared chunk before its data is buffered.
+static int32_t http_conn_decode_chunked(struct HTTPConn *conn,
+                                        http_request *req,
+                                        size_t max_body_size) {
+  struct ChunkDecoder *d = &conn->chunk;
+  if (d->raw_off < conn->bytes_off)
+    d->raw_off = conn->bytes_off;
+
+  while (d->state != CHUNK_DONE && d->raw_off < conn->bytes_len) {
+    byte *raw = conn->bytes + d->raw_off;
+    size_t avail = conn->bytes_len - d->raw_off;
+
+    if (d->state == CHUNK_DATA) {
+      size_t n = avail < d->chunk_left ? avail : d->chunk_left;
+      byte *dst = conn->bytes + conn->bytes_off + d->body_len;
+      if (dst != raw)
+        memmove(dst, raw, n);
+      d->body_len += n;
+      d->raw_off += n;
+      d->chunk_left -= n;
+      if (d->chunk_left == 0)
+        d->state = CHUNK_DATA_CRLF;
+      continue;
+    }
+
+    if (d->state == CHUNK_DATA_CRLF) {
+      if (avail < 2)
+        break;
+      if (raw[0] != '\r' || raw[1] != '\n')
+        return DECODE_CHUNKED_ERR_INVALID;
+      d->raw_off += 2;
+      d->state = CHUNK_SIZE;
+      continue;
+    }
+
+    const byte *lf = memchr(raw, '\n', avail);
+    if (lf == NULL) {
+      if (avail > CHUNK_LINE_MAX)
+        return DECODE_CHUNKED_ERR_INVALID;
+      break;
+    }
+    if (lf == raw || lf[-1] != '\r')
+      return DECODE_CHUNKED_ERR_INVALID;
+
+    const char *line = (const char *)raw;
+    const char *line_end = (const char *)lf - 1;
+    d->raw_off += (size_t)(lf - raw) + 1;
+
+    if (d->state == CHUNK_SIZE) {
+      size_t size = 0;
+      if (!parse_chunk_size_line(line, line_end, &size))
+        return DECODE_CHUNKED_ERR_INVALID;
+      if (size > max_body_size || d->body_total > max_body_size - size)
+        return DECODE_CHUNKED_ERR_TOO_LARGE;
+      d->body_total += size;
+      d->chunk_left = size;
+      d->state = size == 0 ? CHUNK_TRAILERS : CHUNK_DATA;
+    } else if (line == line_end) {
+      d->state = CHUNK_DONE;
+    } else {
+      int32_t ret = add_trailer_to_request(req, line, line_end);
+      if (ret != 0)
+        return ret;
+    }
+  }
+
+  // Slide any undecoded tail down onto the decoded body so framing overhead
+  // never accumulates in the connection buffer.
+  size_t body_end = conn->bytes_off + d->body_len;
+  if (d->state != CHUNK_DONE && d->raw_off > body_end) {
+    size_t tail = conn->bytes_len - d->raw_off;
+    memmove(conn->bytes + body_end, conn->bytes + d->raw_off, tail);
+    conn->bytes_len = body_end + tail;
+    conn->bytes[conn->bytes_len] = '\0';
+    d->raw_off = body_end;
+  }
+
+  return d->state == CHUNK_DONE ? 1 : 0;
+}
+
 static bool response_has_header(const http_response *res, const char *key) {
   if (res == NULL || key == NULL)
     return false;
@@ -969,18 +1699,6 @@ static const char *response_http_version(const http_request *req) {
   return "HTTP/1.1";
 }
 
-static bool response_must_not_have_body(const http_request *req,
-                                        const http_response *res) {
-  const char *status_code = validated_response_status_code(res);
-
-  if (request_is_head(req))
-    return true;
-  if (status_code[0] == '1')
-    return true;
-
-  return strcmp(status_code, "204") == 0 || strcmp(status_code, "304") == 0;
-}
-
 static bool write_continue_response(TCPConn *c) {
   return tcp_conn_write_str(c, "HTTP/1.1 100 Continue\r\n\r\n");
 }
@@ -999,6 +1717,8 @@ static const char *method_name(enum Method method) {
     return "PATCH";
   case HEAD:
     return "HEAD";
+  case OPTIONS:
+    return "OPTIONS";
   default:
     return NULL;
   }
@@ -1008,13 +1728,7 @@ static bool route_supports_method(const struct Route *route,
                                   enum Method method) {
   if (route == NULL || method >= MAX_METHODS)
     return false;
-
-  if (method == HEAD) {
-    return route->handlers[HEAD].handler != NULL ||
-           route->handlers[GET].handler != NULL;
-  }
-
-  return route->handlers[method].handler != NULL;
+  return (route->methods >> method) & 1u;
 }
 
 static bool append_allow_method(char *buffer, size_t buffer_size, size_t *off,
@@ -1043,8 +1757,8 @@ static bool build_allow_header_value(const struct Route *route, char *buffer,
   if (route == NULL || buffer == NULL || buffer_size == 0)
     return false;
 
-  static const enum Method allow_order[] = {GET, HEAD,   POST,
-                                            PUT, DELETE, PATCH};
+  static const enum Method allow_order[] = {GET,    HEAD,  POST,   PUT,
+                                            DELETE, PATCH, OPTIONS};
 
   size_t off = 0;
   buffer[0] = '\0';
@@ -1088,33 +1802,20 @@ static bool response_should_close(const http_request *req,
       return false;
   }
 
-  return !request_should_keep_alive(req);
-}
-
-static void response_cleanup(http_response *res) {
-  if (res == NULL)
-    return;
-
-  for (size_t i = 0; i < res->cookies_len; i++) {
-    free(res->cookies[i].name);
-    free(res->cookies[i].value);
-  }
-  res->cookies_len = 0;
+  // An HTTP/1.0 client learns where a streamed body ends from the close.
+  if (res != NULL && res->producer != NULL && req != NULL &&
+      !request_is_head(req) && strcmp(req->version, "HTTP/1.0") == 0)
+    return true;
 
-  for (size_t i = 0; i < res->headers_len; i++) {
-    free(res->headers[i].key);
-    free(res->headers[i].value);
-  }
-  free(res->headers);
-  res->headers = NULL;
-  res->headers_len = 0;
-  res->headers_cap = 0;
+  return !request_should_keep_alive(req);
 }
 
 param *get_request_param(http_request *req, const char *key) {
   if (req == NULL || key == NULL)
     return NULL;
 
+  ensure_request_params(req);
+
   for (size_t i = 0; i < req->request_params_len; i++) {
     if (req->request_params[i].key == NULL)
       continue;
@@ -1160,6 +1861,8 @@ char *get_cookie(http_request *req, char *key) {
   if (req == NULL || key == NULL)
     return NULL;
 
+  ensure_request_cookies(req);
+
   for (size_t i = 0; i < req->cookie_len; i++) {
     if (caseless_stricmp(req->cookies[i].name, key) == 0)
       return req->cookies[i].value;
@@ -1168,11 +1871,15 @@ char *get_cookie(http_request *req, char *key) {
 }
 
 
+static bool has_crlf(const char *s) {
+  return strchr(s, '\r') != NULL || strchr(s, '\n') != NULL;
+}
+
 bool set_response_cookie(http_response *res, const char *name,
                          const char *value) {
   if (res == NULL || name == NULL || value == NULL)
     return false;
-  if (res->cookies_len >= MAX_COOKIES)
+  if (res->cookies_len >= MAX_COOKIES || has_crlf(name) || has_crlf(value))
     return false;
 
   char *name_copy = malloc(strlen(name) + 1);
@@ -1204,10 +1911,28 @@ size_t get_request_body_len(http_request *req) {
   return req->content_length;
 }
 
-char *get_request_content_type(http_request *req) {
-  if (req == NULL)
-    return NULL;
-  if (req->content_type != NULL)
+static void *json_arena_alloc(void *ctx, size_t len) {
+  return arena_alloc((struct Arena *)ctx, len);
+}
+
+json_value get_request_json(http_request *req) {
+  if (req == NULL || req->conn == NULL)
+    return json_root(NULL);
+  if (!req->json_parsed) {
+    req->json_parsed = true;
+    struct HTTPConn *conn =
+        (struct HTTPConn *)tcp_conn_get_user((TCPConn *)req->conn);
+    if (conn != NULL && req->body != NULL && req->content_length > 0)
+      req->json = json_parse(req->body, req->content_length,
+                             json_arena_alloc, &conn->arena);
+  }
+  return json_root((const json_doc *)req->json);
+}
+
+char *get_request_content_type(http_request *req) {
+  if (req == NULL)
+    return NULL;
+  if (req->content_type != NULL)
     return req->content_type;
 
   header *content_type = get_request_header(req, "Content-Type");
@@ -1235,6 +1960,9 @@ bool set_response_header(http_response *res, const char *key,
                          const char *value) {
   if (res == NULL || key == NULL || value == NULL)
     return false;
+  // Checked here so the serializer can copy fields without scanning them.
+  if (has_crlf(key) || has_crlf(value))
+    return false;
 
   if (res->headers_len == res->headers_cap) {
     size_t new_cap = res->headers_cap ? res->headers_cap * 2 : 8;
@@ -1245,13 +1973,19 @@ bool set_response_header(http_response *res, const char *key,
     res->headers_cap = new_cap;
   }
 
-  char *k = strdup(key);
+  size_t key_len = strlen(key);
+  size_t value_len = strlen(value);
+  char *k = malloc(key_len + 1);
   if (!k) return false;
-  char *v = strdup(value);
+  char *v = malloc(value_len + 1);
   if (!v) { free(k); return false; }
+  memcpy(k, key, key_len + 1);
+  memcpy(v, value, value_len + 1);
 
-  res->headers[res->headers_len].key   = k;
-  res->headers[res->headers_len].value = v;
+  res->headers[res->headers_len].key       = k;
+  res->headers[res->headers_len].value     = v;
+  res->headers[res->headers_len].key_len   = key_len;
+  res->headers[res->headers_len].value_len = value_len;
   res->headers_len++;
   return true;
 }
@@ -1264,10 +1998,68 @@ bool set_response_body(http_response *res, const byte *body,
     return false;
 
   res->body = (byte *)body;
-  res->content_length = body_len;
+  res->content_length = body_len + response_segments_bytes(res);
+  return true;
+}
+
+void clear_response_body(http_response *res) {
+  if (res == NULL)
+    return;
+  // Zero-length segments only own scratch memory, which the handler may
+  // still be using.
+  size_t kept = 0;
+  for (size_t i = 0; i < res->segments_len; i++) {
+    if (res->segments[i].len == 0)
+      res->segments[kept++] = res->segments[i];
+    else
+      segment_release(&res->segments[i].owner);
+  }
+  res->segments_len = kept;
+  res->body = NULL;
+  res->content_length = 0;
+}
+
+bool append_response_segment(http_response *res, const byte *data,
+                             size_t len, segment_ownership ownership) {
+  if (res == NULL || res->producer != NULL || (data == NULL && len > 0))
+    return false;
+
+  if (res->segments_len == res->segments_cap) {
+    size_t new_cap = res->segments_cap == 0 ? 4 : res->segments_cap * 2;
+    response_segment *next = (response_segment *)realloc(
+        res->segments, new_cap * sizeof(*next));
+    if (next == NULL)
+      return false;
+    res->segments = next;
+    res->segments_cap = new_cap;
+  }
+  if (ownership.shared != NULL)
+    tcp_shared_retain(ownership.shared);
+  res->segments[res->segments_len].data = data;
+  res->segments[res->segments_len].len = len;
+  res->segments[res->segments_len].owner = ownership;
+  res->segments_len++;
+  res->content_length += len;
   return true;
 }
 
+void *alloc_response_buffer(http_response *res, size_t len) {
+  if (res == NULL)
+    return NULL;
+  if (res->arena != NULL)
+    return arena_alloc((struct Arena *)res->arena, len);
+
+  // Streamed routes answer outside dispatch, where the arena may be
+  // reset under them; the block rides along as an empty segment instead.
+  void *p = malloc(len > 0 ? len : 1);
+  if (p != NULL &&
+      !append_response_segment(res, NULL, 0, SEGMENT_FREE(p))) {
+    free(p);
+    p = NULL;
+  }
+  return p;
+}
+
 bool set_response_status(http_response *res, const char *status) {
   if (res == NULL || !parse_http_status_code(status, NULL))
     return false;
@@ -1276,6 +2068,26 @@ bool set_response_status(http_response *res, const char *status) {
   return true;
 }
 
+bool set_response_stream(http_response *res, response_producer producer,
+                         void *ctx) {
+  if (res == NULL || producer == NULL)
+    return false;
+
+  if (res->producer != NULL)
+    (void)res->producer(res->producer_ctx, NULL, 0);
+  response_drop_segments(res);
+  res->producer = producer;
+  res->producer_ctx = ctx;
+  res->body = NULL;
+  res->content_length = 0;
+  return true;
+}
+
+void end_response(http_response *res) {
+  if (res != NULL)
+    res->finished = true;
+}
+
 bool set_response_redirect(http_response *res, const char *location,
                            const char *status) {
   if (res == NULL || location == NULL) return false;
@@ -1285,222 +2097,5449 @@ bool set_response_redirect(http_response *res, const char *location,
          set_response_header(res, "Location", location);
 }
 
-static bool has_crlf(const char *s) {
-  return strchr(s, '\r') != NULL || strchr(s, '\n') != NULL;
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "74757677787980818283848586878889909192939495969798"
+    "99";
+
+// Writes v in decimal, two digits per step, and returns the digit count.
+// dst needs room for 20 bytes.
+static size_t format_u64(char *dst, uint64_t v) {
+  char tmp[20];
+  size_t i = sizeof(tmp);
+  while (v >= 100) {
+    size_t pair = (size_t)(v % 100) * 2;
+    v /= 100;
+    i -= 2;
+    memcpy(tmp + i, digit_pairs + pair, 2);
+  }
+  if (v >= 10) {
+    i -= 2;
+    memcpy(tmp + i, digit_pairs + v * 2, 2);
+  } else {
+    tmp[--i] = (char)('0' + v);
+  }
+  memcpy(dst, tmp + i, sizeof(tmp) - i);
+  return sizeof(tmp) - i;
+}
+
+#define STATUS_LINE_MAX 48
+
+// "HTTP/1.1 NNN Reason\r\n" for every code from 100 to 599; HTTP/1.0
+// responses patch the minor version after copying.
+static char status_lines[500][STATUS_LINE_MAX];
+static uint8_t status_line_lens[500];
+static pthread_once_t status_lines_once = PTHREAD_ONCE_INIT;
+
+static void status_lines_init(void) {
+  for (unsigned code = 100; code < 600; code++) {
+    char digits[4] = {(char)('0' + code / 100), (char)('0' + code / 10 % 10),
+                      (char)('0' + code % 10), '\0'};
+    const char *reason = reason_phrase(digits);
+    size_t reason_len = strlen(reason);
+    char *line = status_lines[code - 100];
+    memcpy(line, "HTTP/1.1 ", 9);
+    memcpy(line + 9, digits, 3);
+    line[12] = ' ';
+    memcpy(line + 13, reason, reason_len);
+    memcpy(line + 13 + reason_len, "\r\n", 2);
+    status_line_lens[code - 100] = (uint8_t)(15 + reason_len);
+  }
+}
+
+static uint16_t response_status(const http_response *res) {
+  uint16_t code = 200;
+  if (res != NULL && res->status_code != NULL &&
+      !parse_http_status_code(res->status_code, &code))
+    code = 500;
+  return code;
+}
+
+// "Date: <IMF-fixdate>\r\nServer: ExpressC/1.5\r\n", kept per event-loop
+// thread and rebuilt when the second changes. date_line_len covers only the
+// Date line, for responses that name their own Server.
+static _Thread_local char date_block[96];
+static _Thread_local size_t date_block_len;
+static _Thread_local size_t date_line_len;
+static _Thread_local time_t date_block_second = (time_t)-1;
+
+// Formatted by hand: strftime names days and months after the process
+// locale, which an application may have changed.
+static void date_block_refresh(void) {
+  static const char days[] = "SunMonTueWedThuFriSat";
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+  time_t now = time(NULL);
+  if (now == date_block_second)
+    return;
+  date_block_second = now;
+
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  char *p = date_block;
+  memcpy(p, "Date: ", 6);
+  p += 6;
+  memcpy(p, days + tm.tm_wday * 3, 3);
+  memcpy(p + 3, ", ", 2);
+  memcpy(p + 5, digit_pairs + tm.tm_mday * 2, 2);
+  p[7] = ' ';
+  memcpy(p + 8, months + tm.tm_mon * 3, 3);
+  p[11] = ' ';
+  p += 12;
+  p += format_u64(p, (uint64_t)tm.tm_year + 1900);
+  *p++ = ' ';
+  memcpy(p, digit_pairs + tm.tm_hour * 2, 2);
+  p[2] = ':';
+  memcpy(p + 3, digit_pairs + tm.tm_min * 2, 2);
+  p[5] = ':';
+  memcpy(p + 6, digit_pairs + tm.tm_sec * 2, 2);
+  memcpy(p + 8, " GMT\r\n", 6);
+  p += 14;
+  date_line_len = (size_t)(p - date_block);
+
+  static const char server[] = "Server: " SERVER_VERSION "\r\n";
+  memcpy(p, server, sizeof(server) - 1);
+  date_block_len = date_line_len + sizeof(server) - 1;
+}
+
+// The Date/Server lines to send, or only Date when the response carries its
+// own Server header. Refreshes lazily off the event loop (benchmarks).
+static size_t date_block_for(bool own_server) {
+  if (date_block_len == 0)
+    date_block_refresh();
+  return own_server ? date_line_len : date_block_len;
+}
+
+// Serialization target: starts in a caller-provided stack buffer and moves
+// to the heap only when a header block outgrows it.
+struct OutBuf {
+  byte *data;
+  size_t len;
+  size_t cap;
+  bool heap;
+};
+
+static void outbuf_init(struct OutBuf *b, byte *stack, size_t cap) {
+  b->data = stack;
+  b->len = 0;
+  b->cap = cap;
+  b->heap = false;
+}
+
+static bool outbuf_reserve(struct OutBuf *b, size_t extra) {
+  if (b->cap - b->len >= extra)
+    return true;
+
+  size_t cap = b->cap;
+  while (cap - b->len < extra) {
+    if (cap > SIZE_MAX / 2)
+      return false;
+    cap *= 2;
+  }
+  byte *next = b->heap ? (byte *)realloc(b->data, cap) : (byte *)malloc(cap);
+  if (next == NULL)
+    return false;
+  if (!b->heap)
+    memcpy(next, b->data, b->len);
+  b->data = next;
+  b->cap = cap;
+  b->heap = true;
+  return true;
+}
+
+// Callers reserve first; puts never check capacity.
+static void outbuf_put(struct OutBuf *b, const void *src, size_t n) {
+  memcpy(b->data + b->len, src, n);
+  b->len += n;
+}
+
+static void outbuf_release(struct OutBuf *b) {
+  if (b->heap)
+    free(b->data);
+}
+
+static bool header_key_is(const header *h, const char *key, size_t key_len) {
+  return h->key_len == key_len && strncasecmp(h->key, key, key_len) == 0;
+}
+
+// Header fields append_response_fields saw the handler set itself.
+enum {
+  FIELD_CONNECTION = 1u << 0,
+  FIELD_SERVER = 1u << 1,
+};
+
+// Appends Content-Length (unless the handler set one), the handler's
+// headers and Set-Cookie lines, sized up front and copied with memcpy.
+// Everything the response says about itself goes through here; the status
+// line, Date and Connection depend on the request and the clock. Reports
+// the FIELD_* headers the handler set itself.
+static bool append_response_fields(const http_response *res, uint16_t status,
+                                   struct OutBuf *b, uint32_t *seen) {
+  size_t need = sizeof("Content-Length: \r\n") + 20;
+  bool has_length = false;
+  *seen = 0;
+
+  if (res != NULL) {
+    for (size_t i = 0; i < res->headers_len; i++) {
+      const header *h = &res->headers[i];
+      if (h->key == NULL || h->value == NULL)
+        continue;
+      need += h->key_len + h->value_len + 4;
+      has_length = has_length || header_key_is(h, "Content-Length", 14);
+      if (header_key_is(h, "Connection", 10))
+        *seen |= FIELD_CONNECTION;
+      else if (header_key_is(h, "Server", 6))
+        *seen |= FIELD_SERVER;
+    }
+    for (size_t i = 0; i < res->cookies_len; i++) {
+      need += sizeof("Set-Cookie: =\r\n") + strlen(res->cookies[i].name) +
+              strlen(res->cookies[i].value);
+    }
+  }
+  if (!outbuf_reserve(b, need))
+    return false;
+
+  // 1xx, 204 and 304 responses never carry Content-Length.
+  if (!has_length && (res == NULL || res->producer == NULL) &&
+      status >= 200 && status != 204 && status != 304) {
+    outbuf_put(b, "Content-Length: ", 16);
+    b->len += format_u64((char *)b->data + b->len,
+                         res != NULL ? res->content_length : 0);
+    outbuf_put(b, "\r\n", 2);
+  }
+  if (res == NULL)
+    return true;
+
+  for (size_t i = 0; i < res->headers_len; i++) {
+    const header *h = &res->headers[i];
+    if (h->key == NULL || h->value == NULL)
+      continue;
+    outbuf_put(b, h->key, h->key_len);
+    outbuf_put(b, ": ", 2);
+    outbuf_put(b, h->value, h->value_len);
+    outbuf_put(b, "\r\n", 2);
+  }
+  for (size_t i = 0; i < res->cookies_len; i++) {
+    outbuf_put(b, "Set-Cookie: ", 12);
+    outbuf_put(b, res->cookies[i].name, strlen(res->cookies[i].name));
+    outbuf_put(b, "=", 1);
+    outbuf_put(b, res->cookies[i].value, strlen(res->cookies[i].value));
+    outbuf_put(b, "\r\n", 2);
+  }
+  return true;
+}
+
+static const char *connection_header_line(const http_request *req,
+                                          bool close) {
+  if (close)
+    return "Connection: close\r\n";
+  if (req != NULL && strcmp(req->version, "HTTP/1.0") == 0)
+    return "Connection: keep-alive\r\n";
+  return NULL;
+}
+
+// Whether a response with this status carries a body at all.
+static bool status_allows_body(uint16_t status) {
+  return status >= 200 && status != 204 && status != 304;
+}
+
+// Serializes the status line and header block, including the blank line.
+static bool serialize_response_head(const http_request *req,
+                                    const http_response *res, uint16_t status,
+                                    bool close, struct OutBuf *b) {
+  pthread_once(&status_lines_once, status_lines_init);
+  size_t line_len = status_line_lens[status - 100];
+  if (!outbuf_reserve(b, line_len))
+    return false;
+  outbuf_put(b, status_lines[status - 100], line_len);
+  if (req != NULL && strcmp(req->version, "HTTP/1.0") == 0)
+    b->data[b->len - line_len + 7] = '0';
+
+  uint32_t seen = 0;
+  if (!append_response_fields(res, status, b, &seen))
+    return false;
+
+  static const char chunked[] = "Transfer-Encoding: chunked\r\n";
+  size_t chunked_len = res != NULL && res->producer != NULL &&
+                               status_allows_body(status) &&
+                               (req == NULL ||
+                                strcmp(req->version, "HTTP/1.0") != 0)
+                           ? sizeof(chunked) - 1
+                           : 0;
+  size_t date_len = date_block_for(seen & FIELD_SERVER);
+  const char *connection = connection_header_line(req, close);
+  size_t connection_len = connection != NULL && !(seen & FIELD_CONNECTION)
+                              ? strlen(connection)
+                              : 0;
+  if (!outbuf_reserve(b, chunked_len + date_len + connection_len + 2))
+    return false;
+  outbuf_put(b, chunked, chunked_len);
+  outbuf_put(b, date_block, date_len);
+  if (connection_len != 0)
+    outbuf_put(b, connection, connection_len);
+  outbuf_put(b, "\r\n", 2);
+  return true;
+}
+
+// Head, body and segments in one writev. Shared segments the socket does
+// not take are queued by reference; the rest is copied, as with any write.
+static bool write_response_segments(TCPConn *c, const struct OutBuf *head,
+                                    const http_response *res) {
+  struct iovec iov_stack[32];
+  TCPSharedBuf *shared_stack[32];
+  size_t n = res->segments_len + 2;
+  struct iovec *iov = iov_stack;
+  TCPSharedBuf **shared = shared_stack;
+  if (n > 32) {
+    iov = (struct iovec *)malloc(n * sizeof(*iov));
+    shared = (TCPSharedBuf **)malloc(n * sizeof(*shared));
+    if (iov == NULL || shared == NULL || n > INT_MAX) {
+      free(iov);
+      free(shared);
+      return false;
+    }
+  }
+
+  int iovcnt = 0;
+  iov[iovcnt].iov_base = (void *)head->data;
+  iov[iovcnt].iov_len  = head->len;
+  shared[iovcnt++] = NULL;
+  size_t body_len = res->content_length - response_segments_bytes(res);
+  if (body_len > 0) {
+    iov[iovcnt].iov_base = (void *)res->body;
+    iov[iovcnt].iov_len  = body_len;
+    shared[iovcnt++] = NULL;
+  }
+  for (size_t i = 0; i < res->segments_len; i++) {
+    if (res->segments[i].len == 0)
+      continue;
+    iov[iovcnt].iov_base = (void *)res->segments[i].data;
+    iov[iovcnt].iov_len  = res->segments[i].len;
+    shared[iovcnt++] = res->segments[i].owner.shared;
+  }
+  bool ok = tcp_conn_writev_shared(c, iov, shared, iovcnt);
+  if (iov != iov_stack) {
+    free(iov);
+    free(shared);
+  }
+  return ok;
 }
 
 static bool write_response(TCPConn *c, const http_request *req,
                            const http_response *res) {
-  char headers[8192];
-  size_t header_offset = 0;
-  const char *status_code = validated_response_status_code(res);
-  const char *reason = reason_phrase(status_code);
-  const char *version = response_http_version(req);
-  size_t content_length = res != NULL ? res->content_length : 0;
+  byte stack[8192];
+  struct OutBuf head;
+  outbuf_init(&head, stack, sizeof(stack));
+  uint16_t status = response_status(res);
   bool close = response_should_close(req, res);
-  bool omit_body = response_must_not_have_body(req, res);
+  bool omit_body = request_is_head(req) || !status_allows_body(status);
+
+  if (!serialize_response_head(req, res, status, close, &head)) {
+    outbuf_release(&head);
+    return false;
+  }
+
+  bool ok;
+  if (omit_body || res == NULL || res->segments_len == 0) {
+    struct iovec iov[2];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = (void *)head.data;
+    iov[iovcnt].iov_len  = head.len;
+    iovcnt++;
+    if (!omit_body && res != NULL && res->body != NULL &&
+        res->content_length > 0) {
+      iov[iovcnt].iov_base = (void *)res->body;
+      iov[iovcnt].iov_len  = res->content_length;
+      iovcnt++;
+    }
+    ok = tcp_conn_writev(c, iov, iovcnt);
+  } else {
+    ok = write_response_segments(c, &head, res);
+  }
+  outbuf_release(&head);
+  if (!ok)
+    return false;
+
+  // A streamed body closes the connection once it ends.
+  if (close && (omit_body || res == NULL || res->producer == NULL))
+    tcp_conn_close_after_write(c);
+  return true;
+}
+
+// Defined with the rest of HTTP/2 further down.
+struct H2Session;
+static bool h2_send_preserialized(struct H2Session *h2, const void *head,
+                                  size_t head_len, const void *tail,
+                                  size_t tail_len, bool own_server);
+static void h2_destroy(struct H2Session *h2);
+
+// Sends a response serialized ahead of time: head runs from the status code
+// through the header fields, tail is the blank line plus any body. Only the
+// HTTP version, Date/Server and Connection are filled in per request.
+static bool write_preserialized(TCPConn *c, const http_request *req,
+                                const void *head, size_t head_len,
+                                const void *tail, size_t tail_len,
+                                bool close, bool own_server) {
+  struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
+  if (conn != NULL && conn->h2 != NULL)
+    return h2_send_preserialized(conn->h2, head, head_len, tail, tail_len,
+                                 own_server);
+
+  const char *connection = connection_header_line(req, close);
+  struct iovec iov[5];
+  int iovcnt = 0;
+  iov[iovcnt].iov_base = (void *)response_http_version(req);
+  iov[iovcnt].iov_len = 8;
+  iovcnt++;
+  iov[iovcnt].iov_base = (void *)head;
+  iov[iovcnt].iov_len = head_len;
+  iovcnt++;
+  iov[iovcnt].iov_len = date_block_for(own_server);
+  iov[iovcnt].iov_base = date_block;
+  iovcnt++;
+  if (connection != NULL) {
+    iov[iovcnt].iov_base = (void *)connection;
+    iov[iovcnt].iov_len = strlen(connection);
+    iovcnt++;
+  }
+  iov[iovcnt].iov_base = (void *)tail;
+  iov[iovcnt].iov_len = tail_len;
+  iovcnt++;
+  return tcp_conn_writev(c, iov, iovcnt);
+}
+
+// A cached GET response. data holds the key, then the serialized status
+// line remainder and header fields (head_len bytes), then the blank line and
+// the body. The HTTP version and Connection header depend on the request
+// and are spliced in when the entry is sent.
+struct CacheLink {
+  struct CacheLink *prev;
+  struct CacheLink *next;
+};
+
+struct CacheEntry {
+  // First member, so a link in the LRU list converts back to its entry.
+  struct CacheLink lru;
+  uint64_t hash;
+  uint64_t expires_ns;
+  struct CacheEntry *chain_next;
+  size_t key_len;
+  size_t path_len;
+  size_t head_len;
+  size_t body_len;
+  // The header fields a 304 repeats start at fields_off into the head; the
+  // response's ETag, if any, follows the body.
+  size_t fields_off;
+  size_t etag_len;
+  bool own_server;
+  byte data[];
+};
+
+// Shards keep each lock and LRU list short so express_cache_invalidate from
+// another thread rarely contends with the event loop.
+struct CacheShard {
+  pthread_mutex_t lock;
+  struct CacheEntry **buckets;
+  size_t buckets_len;
+  size_t count;
+  size_t bytes;
+  size_t budget;
+  struct CacheLink lru;
+};
+
+struct ResponseCache {
+  struct CacheShard shards[RESPONSE_CACHE_SHARDS];
+  struct ResponseCache *next;
+};
+
+// Every live cache, so express_cache_invalidate reaches all routers.
+static pthread_mutex_t response_cache_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ResponseCache *response_cache_registry;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t cache_entry_size(const struct CacheEntry *e) {
+  return sizeof(*e) + e->key_len + e->head_len + 2 + e->body_len;
+}
 
-  int written =
-      snprintf(headers + header_offset, sizeof(headers) - header_offset,
-               "%s %s %s\r\n", version, status_code, reason);
-  if (written < 0 || (size_t)written >= sizeof(headers) - header_offset)
+static void cache_lru_unlink(struct CacheEntry *e) {
+  e->lru.prev->next = e->lru.next;
+  e->lru.next->prev = e->lru.prev;
+}
+
+static void cache_lru_push_front(struct CacheShard *shard,
+                                 struct CacheEntry *e) {
+  e->lru.prev = &shard->lru;
+  e->lru.next = shard->lru.next;
+  shard->lru.next->prev = &e->lru;
+  shard->lru.next = &e->lru;
+}
+
+static void cache_shard_remove(struct CacheShard *shard, struct CacheEntry *e) {
+  struct CacheEntry **link =
+      &shard->buckets[e->hash & (shard->buckets_len - 1)];
+  while (*link != e)
+    link = &(*link)->chain_next;
+  *link = e->chain_next;
+  cache_lru_unlink(e);
+  shard->count--;
+  shard->bytes -= cache_entry_size(e);
+  free(e);
+}
+
+static struct CacheEntry *cache_shard_find(struct CacheShard *shard,
+                                           uint64_t hash, const char *key,
+                                           size_t key_len) {
+  if (shard->buckets_len == 0)
+    return NULL;
+  struct CacheEntry *e = shard->buckets[hash & (shard->buckets_len - 1)];
+  for (; e != NULL; e = e->chain_next) {
+    if (e->hash == hash && e->key_len == key_len &&
+        memcmp(e->data, key, key_len) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static bool cache_shard_grow(struct CacheShard *shard) {
+  size_t len = shard->buckets_len ? shard->buckets_len * 2 : 64;
+  struct CacheEntry **buckets =
+      (struct CacheEntry **)calloc(len, sizeof(*buckets));
+  if (buckets == NULL)
     return false;
-  header_offset += (size_t)written;
+  for (size_t i = 0; i < shard->buckets_len; i++) {
+    struct CacheEntry *e = shard->buckets[i];
+    while (e != NULL) {
+      struct CacheEntry *next = e->chain_next;
+      e->chain_next = buckets[e->hash & (len - 1)];
+      buckets[e->hash & (len - 1)] = e;
+      e = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->buckets_len = len;
+  return true;
+}
+
+static struct ResponseCache *response_cache_new(size_t budget) {
+  struct ResponseCache *cache =
+      (struct ResponseCache *)calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return NULL;
+  for (size_t i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+    struct CacheShard *shard = &cache->shards[i];
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->budget = budget / RESPONSE_CACHE_SHARDS;
+    shard->lru.prev = &shard->lru;
+    shard->lru.next = &shard->lru;
+  }
+
+  pthread_mutex_lock(&response_cache_registry_lock);
+  cache->next = response_cache_registry;
+  response_cache_registry = cache;
+  pthread_mutex_unlock(&response_cache_registry_lock);
+  return cache;
+}
+
+static void response_cache_destroy(struct ResponseCache *cache) {
+  if (cache == NULL)
+    return;
+
+  pthread_mutex_lock(&response_cache_registry_lock);
+  struct ResponseCache **link = &response_cache_registry;
+  while (*link != cache)
+    link = &(*link)->next;
+  *link = cache->next;
+  pthread_mutex_unlock(&response_cache_registry_lock);
+
+  for (size_t i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+    struct CacheShard *shard = &cache->shards[i];
+    while (shard->lru.next != &shard->lru)
+      cache_shard_remove(shard, (struct CacheEntry *)shard->lru.next);
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(cache);
+}
+
+static struct CacheShard *response_cache_shard(struct ResponseCache *cache,
+                                               uint64_t hash) {
+  return &cache->shards[(hash >> 59) % RESPONSE_CACHE_SHARDS];
+}
+
+// Builds the lookup key for req: canonical path, query, then the value of
+// each Vary header, each field after the path led by a NUL. The path is
+// decoded and may itself hold a '?', so the query always gets its field,
+// empty when absent, and no two requests share a key. Only GET is cached
+// and HEAD shares its entries, so the method is implied. Returns 0 if the
+// key does not fit.
+static size_t route_cache_key(const struct RouteCache *policy,
+                              http_request *req, char *key, size_t cap,
+                              size_t *path_len) {
+  size_t off = strlen(req->route);
+  if (off + 1 >= cap)
+    return 0;
+  memcpy(key, req->route, off);
+  *path_len = off;
+
+  const char *query = req->query != NULL ? req->query : "";
+  size_t query_len = strlen(query);
+  if (off + query_len + 2 >= cap)
+    return 0;
+  key[off++] = '\0';
+  memcpy(key + off, query, query_len);
+  off += query_len;
+
+  for (size_t i = 0; i < policy->vary_len; i++) {
+    header *h = get_request_header(req, policy->vary[i]);
+    const char *value = h != NULL && h->value != NULL ? h->value : "";
+    size_t len = strlen(value);
+    if (off + len + 2 >= cap)
+      return 0;
+    key[off++] = '\0';
+    memcpy(key + off, value, len);
+    off += len;
+  }
+  return off;
+}
 
-  if (!response_has_header(res, "Content-Length")) {
-    written = snprintf(headers + header_offset, sizeof(headers) - header_offset,
-                       "Content-Length: %zu\r\n", content_length);
-    if (written < 0 || (size_t)written >= sizeof(headers) - header_offset)
+// Whether an If-None-Match list names tag, compared weakly: a W/ prefix
+// on either side is ignored.
+static bool etag_list_matches(const char *list, const char *tag,
+                              size_t tag_len) {
+  if (tag_len > 2 && tag[0] == 'W' && tag[1] == '/') {
+    tag += 2;
+    tag_len -= 2;
+  }
+  const char *p = list;
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    if (*p == '\0')
+      return false;
+    if (*p == '*')
+      return true;
+    if (p[0] == 'W' && p[1] == '/')
+      p += 2;
+    if (*p != '"')
+      return false;
+    const char *close = strchr(p + 1, '"');
+    if (close == NULL)
       return false;
-    header_offset += (size_t)written;
+    if ((size_t)(close + 1 - p) == tag_len && memcmp(p, tag, tag_len) == 0)
+      return true;
+    p = close + 1;
+  }
+}
+
+static bool response_sets_field(const http_response *res, const char *name,
+                                size_t name_len) {
+  for (size_t i = 0; i < res->headers_len; i++) {
+    const header *h = &res->headers[i];
+    if (h->key != NULL && h->value != NULL &&
+        header_key_is(h, name, name_len))
+      return true;
+  }
+  return false;
+}
+
+// Drops the fields from first on that one before first already names, so
+// headers set by middleware win over those of a cacheable response.
+static void response_drop_shadowed(http_response *res, size_t first) {
+  size_t kept = first;
+  for (size_t i = first; i < res->headers_len; i++) {
+    header h = res->headers[i];
+    bool shadowed = false;
+    for (size_t j = 0; j < first && !shadowed; j++)
+      shadowed = res->headers[j].key != NULL &&
+                 header_key_is(&h, res->headers[j].key,
+                               res->headers[j].key_len);
+    if (shadowed) {
+      free(h.key);
+      free(h.value);
+    } else {
+      res->headers[kept++] = h;
+    }
+  }
+  res->headers_len = kept;
+}
+
+// Appends the entry's fields from fields_off on. With live set, they are
+// merged with the headers and cookies the request's middleware set, which
+// replace stored fields of the same name; Connection and Content-Length
+// are left to the server.
+static bool cache_entry_put_fields(const struct CacheEntry *e,
+                                   const http_response *live,
+                                   struct OutBuf *b, bool *own_server) {
+  const char *p = (const char *)e->data + e->key_len + e->fields_off;
+  const char *end = (const char *)e->data + e->key_len + e->head_len;
+  size_t need = (size_t)(end - p);
+  *own_server = e->own_server;
+  if (live != NULL) {
+    for (size_t i = 0; i < live->headers_len; i++)
+      need += live->headers[i].key_len + live->headers[i].value_len + 4;
+    for (size_t i = 0; i < live->cookies_len; i++)
+      need += sizeof("Set-Cookie: =\r\n") + strlen(live->cookies[i].name) +
+              strlen(live->cookies[i].value);
+  }
+  if (!outbuf_reserve(b, need))
+    return false;
+  if (live == NULL) {
+    outbuf_put(b, p, (size_t)(end - p));
+    return true;
+  }
+
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', (size_t)(end - p));
+    const char *next = eol != NULL ? eol + 1 : end;
+    const char *colon = (const char *)memchr(p, ':', (size_t)(next - p));
+    if (colon == NULL || !response_sets_field(live, p, (size_t)(colon - p)))
+      outbuf_put(b, p, (size_t)(next - p));
+    p = next;
+  }
+  for (size_t i = 0; i < live->headers_len; i++) {
+    const header *h = &live->headers[i];
+    if (h->key == NULL || h->value == NULL ||
+        header_key_is(h, "Connection", 10) ||
+        header_key_is(h, "Content-Length", 14))
+      continue;
+    if (header_key_is(h, "Server", 6))
+      *own_server = true;
+    outbuf_put(b, h->key, h->key_len);
+    outbuf_put(b, ": ", 2);
+    outbuf_put(b, h->value, h->value_len);
+    outbuf_put(b, "\r\n", 2);
+  }
+  for (size_t i = 0; i < live->cookies_len; i++) {
+    outbuf_put(b, "Set-Cookie: ", 12);
+    outbuf_put(b, live->cookies[i].name, strlen(live->cookies[i].name));
+    outbuf_put(b, "=", 1);
+    outbuf_put(b, live->cookies[i].value, strlen(live->cookies[i].value));
+    outbuf_put(b, "\r\n", 2);
+  }
+  return true;
+}
+
+// Answers a conditional hit with 304 and the stored fields, less the
+// body and its length.
+static bool cache_entry_send_304(TCPConn *c, const http_request *req,
+                                 const struct CacheEntry *e,
+                                 const http_response *live, bool close) {
+  byte stack[4096];
+  struct OutBuf head;
+  bool own_server = false;
+  outbuf_init(&head, stack, sizeof(stack));
+  size_t line_len = status_line_lens[304 - 100] - 8;
+  if (!outbuf_reserve(&head, line_len)) {
+    outbuf_release(&head);
+    return false;
+  }
+  outbuf_put(&head, status_lines[304 - 100] + 8, line_len);
+  if (!cache_entry_put_fields(e, live, &head, &own_server)) {
+    outbuf_release(&head);
+    return false;
+  }
+  bool ok = write_preserialized(c, req, head.data, head.len, "\r\n", 2,
+                                close, own_server);
+  outbuf_release(&head);
+  return ok;
+}
+
+// Sends the cached response for key, if a fresh one exists, with a single
+// writev. Returns false on a miss. live holds the headers and cookies
+// middleware set for this request, merged into the stored ones.
+static bool response_cache_send(struct ResponseCache *cache, TCPConn *c,
+                                const http_request *req, const char *key,
+                                size_t key_len, uint64_t hash,
+                                const http_response *live, bool close,
+                                bool *write_ok) {
+  struct CacheShard *shard = response_cache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  struct CacheEntry *e = cache_shard_find(shard, hash, key, key_len);
+  if (e != NULL && e->expires_ns <= monotonic_ns()) {
+    cache_shard_remove(shard, e);
+    e = NULL;
+  }
+  if (e == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+  }
+  cache_lru_unlink(e);
+  cache_lru_push_front(shard, e);
+
+  const header *if_none_match =
+      e->etag_len != 0
+          ? get_request_header((http_request *)req, "If-None-Match")
+          : NULL;
+  if (if_none_match != NULL && if_none_match->value != NULL &&
+      etag_list_matches(if_none_match->value,
+                        (const char *)e->data + e->key_len + e->head_len + 2 +
+                            e->body_len,
+                        e->etag_len)) {
+    *write_ok = cache_entry_send_304(c, req, e, live, close);
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+  }
+
+  const byte *tail = e->data + e->key_len + e->head_len;
+  size_t tail_len = 2 + (request_is_head(req) ? 0 : e->body_len);
+  if (live == NULL || (live->headers_len == 0 && live->cookies_len == 0)) {
+    *write_ok = write_preserialized(c, req, e->data + e->key_len,
+                                    e->head_len, tail, tail_len, close,
+                                    e->own_server);
+  } else {
+    byte stack[4096];
+    struct OutBuf head;
+    bool own_server = false;
+    outbuf_init(&head, stack, sizeof(stack));
+    // The status line and Content-Length come before fields_off.
+    *write_ok = false;
+    if (outbuf_reserve(&head, e->fields_off)) {
+      outbuf_put(&head, e->data + e->key_len, e->fields_off);
+      if (cache_entry_put_fields(e, live, &head, &own_server))
+        *write_ok = write_preserialized(c, req, head.data, head.len, tail,
+                                        tail_len, close, own_server);
+    }
+    outbuf_release(&head);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+}
+
+static bool response_cacheable(const http_response *res) {
+  return res->status_code != NULL && strcmp(res->status_code, "200") == 0 &&
+         res->cookies_len == 0 && !response_has_header(res, "Connection") &&
+         res->producer == NULL &&
+         (res->body != NULL ||
+          res->content_length == response_segments_bytes(res));
+}
+
+static void response_cache_store(struct ResponseCache *cache, uint64_t ttl_ns,
+                                 const char *key, size_t key_len,
+                                 size_t path_len, uint64_t hash,
+                                 const http_response *res) {
+  byte stack[8192];
+  struct OutBuf head;
+  uint32_t seen = 0;
+  outbuf_init(&head, stack, sizeof(stack));
+  // The status line without its "HTTP/1.x" prefix.
+  pthread_once(&status_lines_once, status_lines_init);
+  outbuf_put(&head, status_lines[200 - 100] + 8, status_line_lens[200 - 100] - 8);
+  size_t fields_off = head.len;
+  if (!append_response_fields(res, 200, &head, &seen)) {
+    outbuf_release(&head);
+    return;
+  }
+  size_t head_len = head.len;
+  // Content-Length comes first when the server adds it.
+  if (head_len - fields_off > 16 &&
+      memcmp(head.data + fields_off, "Content-Length: ", 16) == 0) {
+    const byte *eol = (const byte *)memchr(head.data + fields_off, '\n',
+                                           head_len - fields_off);
+    if (eol != NULL)
+      fields_off = (size_t)(eol + 1 - head.data);
+  }
+  const char *etag = NULL;
+  size_t etag_len = 0;
+  for (size_t i = 0; i < res->headers_len; i++) {
+    const header *h = &res->headers[i];
+    if (h->key != NULL && h->value != NULL && header_key_is(h, "ETag", 4)) {
+      etag = h->value;
+      etag_len = h->value_len;
+    }
+  }
+
+  struct CacheShard *shard = response_cache_shard(cache, hash);
+  size_t size = sizeof(struct CacheEntry) + key_len + head_len + 2 +
+                res->content_length + etag_len;
+  struct CacheEntry *e =
+      size <= shard->budget ? (struct CacheEntry *)malloc(size) : NULL;
+  if (e == NULL) {
+    outbuf_release(&head);
+    return;
+  }
+  e->hash = hash;
+  e->expires_ns = monotonic_ns() + ttl_ns;
+  e->key_len = key_len;
+  e->path_len = path_len;
+  e->head_len = head_len;
+  e->body_len = res->content_length;
+  e->fields_off = fields_off;
+  e->etag_len = etag_len;
+  e->own_server = (seen & FIELD_SERVER) != 0;
+  byte *p = e->data;
+  memcpy(p, key, key_len);
+  memcpy(p + key_len, head.data, head_len);
+  outbuf_release(&head);
+  memcpy(p + key_len + head_len, "\r\n", 2);
+  if (e->body_len > 0)
+    response_gather(res, p + key_len + head_len + 2);
+  if (etag_len > 0)
+    memcpy(p + key_len + head_len + 2 + e->body_len, etag, etag_len);
+
+  pthread_mutex_lock(&shard->lock);
+  struct CacheEntry *old = cache_shard_find(shard, hash, key, key_len);
+  if (old != NULL)
+    cache_shard_remove(shard, old);
+  while (shard->bytes + size > shard->budget)
+    cache_shard_remove(shard, (struct CacheEntry *)shard->lru.prev);
+  if (shard->count >= shard->buckets_len && !cache_shard_grow(shard)) {
+    pthread_mutex_unlock(&shard->lock);
+    free(e);
+    return;
+  }
+  struct CacheEntry **bucket =
+      &shard->buckets[hash & (shard->buckets_len - 1)];
+  e->chain_next = *bucket;
+  *bucket = e;
+  cache_lru_push_front(shard, e);
+  shard->count++;
+  shard->bytes += size;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+size_t express_cache_invalidate(const char *prefix) {
+  if (prefix == NULL)
+    return 0;
+
+  size_t prefix_len = strlen(prefix);
+  size_t dropped = 0;
+  pthread_mutex_lock(&response_cache_registry_lock);
+  for (struct ResponseCache *cache = response_cache_registry; cache != NULL;
+       cache = cache->next) {
+    for (size_t i = 0; i < RESPONSE_CACHE_SHARDS; i++) {
+      struct CacheShard *shard = &cache->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      struct CacheLink *link = shard->lru.next;
+      while (link != &shard->lru) {
+        struct CacheEntry *e = (struct CacheEntry *)link;
+        link = link->next;
+        if (e->path_len >= prefix_len &&
+            memcmp(e->data, prefix, prefix_len) == 0) {
+          cache_shard_remove(shard, e);
+          dropped++;
+        }
+      }
+      pthread_mutex_unlock(&shard->lock);
+    }
+  }
+  pthread_mutex_unlock(&response_cache_registry_lock);
+  return dropped;
+}
+
+static enum Method get_method_from_str(char *method) {
+  if (method == NULL) {
+    return (enum Method)MAX_METHODS;
+  }
+
+  // Dispatch on length and first byte; one memcmp confirms the token.
+  switch (strlen(method)) {
+  case 3:
+    if (method[0] == 'G' && memcmp(method, "GET", 3) == 0)
+      return GET;
+    if (method[0] == 'P' && memcmp(method, "PUT", 3) == 0)
+      return PUT;
+    break;
+  case 4:
+    if (method[0] == 'P' && memcmp(method, "POST", 4) == 0)
+      return POST;
+    if (method[0] == 'H' && memcmp(method, "HEAD", 4) == 0)
+      return HEAD;
+    break;
+  case 5:
+    if (method[0] == 'P' && memcmp(method, "PATCH", 5) == 0)
+      return PATCH;
+    break;
+  case 6:
+    if (method[0] == 'D' && memcmp(method, "DELETE", 6) == 0)
+      return DELETE;
+    break;
+  case 7:
+    if (method[0] == 'O' && memcmp(method, "OPTIONS", 7) == 0)
+      return OPTIONS;
+    break;
+  }
+
+  return (enum Method)MAX_METHODS;
+}
+
+static struct RadixNode *radix_node_new(const char *label, size_t len) {
+  struct RadixNode *n = (struct RadixNode *)calloc(1, sizeof(*n));
+  if (n == NULL)
+    return NULL;
+  n->label = (char *)malloc(len + 1);
+  if (n->label == NULL) {
+    free(n);
+    return NULL;
+  }
+  memcpy(n->label, label, len);
+  n->label[len] = '\0';
+  n->label_len = len;
+  return n;
+}
+
+static void radix_node_destroy(struct RadixNode *n) {
+  if (n == NULL)
+    return;
+  for (size_t i = 0; i < n->children_len; i++)
+    radix_node_destroy(n->children[i]);
+  free(n->children);
+  radix_node_destroy(n->param);
+  radix_node_destroy(n->wildcard);
+  free(n->label);
+  free(n);
+}
+
+static bool radix_add_child(struct RadixNode *n, struct RadixNode *child) {
+  struct RadixNode **next = (struct RadixNode **)realloc(
+      n->children, (n->children_len + 1) * sizeof(*next));
+  if (next == NULL)
+    return false;
+  n->children = next;
+  n->children[n->children_len++] = child;
+  return true;
+}
+
+static struct RadixNode *radix_static_child(const struct RadixNode *n,
+                                            char first) {
+  for (size_t i = 0; i < n->children_len; i++) {
+    if (n->children[i]->label[0] == first)
+      return n->children[i];
+  }
+  return NULL;
+}
+
+// Inserts a static run of the pattern below n, splitting edges that only
+// share a prefix with it. Returns the node the run ends at.
+static struct RadixNode *radix_insert_static(struct RadixNode *n,
+                                             const char *s, size_t len) {
+  while (len > 0) {
+    struct RadixNode *child = radix_static_child(n, s[0]);
+    if (child == NULL) {
+      child = radix_node_new(s, len);
+      if (child == NULL || !radix_add_child(n, child)) {
+        radix_node_destroy(child);
+        return NULL;
+      }
+      return child;
+    }
+
+    size_t common = 0;
+    while (common < len && common < child->label_len &&
+           child->label[common] == s[common])
+      common++;
+
+    if (common < child->label_len) {
+      struct RadixNode *mid = radix_node_new(child->label, common);
+      if (mid == NULL)
+        return NULL;
+      mid->children =
+          (struct RadixNode **)malloc(sizeof(*mid->children));
+      if (mid->children == NULL) {
+        radix_node_destroy(mid);
+        return NULL;
+      }
+
+      memmove(child->label, child->label + common,
+              child->label_len - common + 1);
+      child->label_len -= common;
+      mid->children[0] = child;
+      mid->children_len = 1;
+      for (size_t i = 0; i < n->children_len; i++) {
+        if (n->children[i] == child)
+          n->children[i] = mid;
+      }
+      child = mid;
+    }
+
+    n = child;
+    s += common;
+    len -= common;
+  }
+  return n;
+}
+
+static struct Route *route_new(char *pattern) {
+  struct Route *t = (struct Route *)calloc(1, sizeof(*t));
+  if (t == NULL)
+    return NULL;
+  t->route = pattern;
+  return t;
+}
+
+static void route_destroy(struct Route *t) {
+  if (t == NULL)
+    return;
+  for (size_t i = 0; i < t->params_len; i++)
+    free(t->param_names[i]);
+  for (size_t i = 0; i < MAX_METHODS; i++)
+    free(t->handlers[i].websocket);
+  if (t->cache != NULL) {
+    for (size_t i = 0; i < t->cache->vary_len; i++)
+      free(t->cache->vary[i]);
+    free(t->cache);
+  }
+  free(t->options_head);
+  free(t);
+}
+
+// Walks (and extends) the tree along a pattern such as /users/:id or
+// /files/*path and returns the node it ends at. Parameter names are
+// collected into names; patterns whose wildcard is not last are rejected.
+static struct RadixNode *radix_insert(struct RadixNode *root,
+                                      const char *pattern,
+                                      char *names[MAX_PARAMS],
+                                      size_t *names_len) {
+  struct RadixNode *n = root;
+  const char *p = pattern;
+  *names_len = 0;
+
+  while (*p != '\0') {
+    if (*p == ':' || *p == '*') {
+      bool wildcard = *p == '*';
+      const char *name = ++p;
+      while (*p != '\0' && *p != '/')
+        p++;
+      if (p == name || *names_len >= MAX_PARAMS || (wildcard && *p != '\0'))
+        return NULL;
+
+      struct RadixNode **slot = wildcard ? &n->wildcard : &n->param;
+      if (*slot == NULL && (*slot = radix_node_new("", 0)) == NULL)
+        return NULL;
+      names[(*names_len)++] = strndup(name, (size_t)(p - name));
+      n = *slot;
+      continue;
+    }
+
+    const char *run = p;
+    while (*p != '\0' && !((*p == ':' || *p == '*') && p[-1] == '/'))
+      p++;
+    n = radix_insert_static(n, run, (size_t)(p - run));
+    if (n == NULL)
+      return NULL;
+  }
+  return n;
+}
+
+struct RadixMatch {
+  size_t starts[MAX_PARAMS];
+  size_t lens[MAX_PARAMS];
+  size_t len;
+};
+
+// Static edges win over :params, which win over *wildcards; a failed static
+// branch backtracks into the parameter alternatives.
+static struct Route *radix_lookup(const struct RadixNode *n, const char *path,
+                                  size_t off, size_t len,
+                                  struct RadixMatch *m) {
+  if (off == len && n->route != NULL)
+    return n->route;
+
+  if (off < len) {
+    const struct RadixNode *child = radix_static_child(n, path[off]);
+    if (child != NULL && len - off >= child->label_len &&
+        memcmp(path + off, child->label, child->label_len) == 0) {
+      struct Route *t =
+          radix_lookup(child, path, off + child->label_len, len, m);
+      if (t != NULL)
+        return t;
+    }
+  }
+
+  if (n->param != NULL && off < len && path[off] != '/' &&
+      m->len < MAX_PARAMS) {
+    const char *slash = memchr(path + off, '/', len - off);
+    size_t end = slash != NULL ? (size_t)(slash - path) : len;
+    m->starts[m->len] = off;
+    m->lens[m->len] = end - off;
+    m->len++;
+    struct Route *t = radix_lookup(n->param, path, end, len, m);
+    if (t != NULL)
+      return t;
+    m->len--;
+  }
+
+  if (n->wildcard != NULL && n->wildcard->route != NULL &&
+      m->len < MAX_PARAMS) {
+    m->starts[m->len] = off;
+    m->lens[m->len] = len - off;
+    m->len++;
+    return n->wildcard->route;
+  }
+
+  return NULL;
+}
+
+static uint64_t route_hash(const char *s, size_t len) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// XXH64: four independent lanes over 32-byte stripes, so long bodies hash
+// at several bytes per cycle where route_hash manages one.
+#define XXH_P1 0x9e3779b185ebca87ull
+#define XXH_P2 0xc2b2ae3d27d4eb4full
+#define XXH_P3 0x165667b19e3779f9ull
+#define XXH_P4 0x85ebca77c2b2ae63ull
+#define XXH_P5 0x27d4eb2f165667c5ull
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh_read64(const byte *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  return xxh_rotl(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+  acc ^= xxh_round(0, v);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t body_hash(const byte *p, size_t len, uint64_t seed) {
+  const byte *end = p + len;
+  uint64_t h;
+  if (len >= 32) {
+    uint64_t v1 = seed + XXH_P1 + XXH_P2;
+    uint64_t v2 = seed + XXH_P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_P1;
+    do {
+      v1 = xxh_round(v1, xxh_read64(p));
+      v2 = xxh_round(v2, xxh_read64(p + 8));
+      v3 = xxh_round(v3, xxh_read64(p + 16));
+      v4 = xxh_round(v4, xxh_read64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+    h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) +
+        xxh_rotl(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = seed + XXH_P5;
+  }
+  h += (uint64_t)len;
+
+  for (; end - p >= 8; p += 8) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if (end - p >= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    h ^= (uint64_t)v * XXH_P1;
+    h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * XXH_P5;
+    h = xxh_rotl(h, 11) * XXH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint32_t route_slot_index(uint64_t hash, uint32_t seed, uint32_t n) {
+  uint64_t x = hash ^ ((uint64_t)seed * 0x9e3779b97f4a7c15ull);
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  return (uint32_t)(((x & 0xffffffffu) * n) >> 32);
+}
+
+static uint32_t route_bucket_index(uint64_t hash, uint32_t buckets) {
+  return (uint32_t)(((hash >> 32) * buckets) >> 32);
+}
+
+static struct Route *frozen_lookup(const struct FrozenRoutes *f,
+                                   const char *path, size_t len) {
+  if (f->slots_len == 0)
+    return NULL;
+
+  uint64_t h = route_hash(path, len);
+  uint32_t seed = f->seeds[route_bucket_index(h, f->buckets_len)];
+  const struct RouteSlot *slot =
+      &f->slots[route_slot_index(h, seed, f->slots_len)];
+  if (slot->hash != h || slot->path_len != len ||
+      memcmp(slot->path, path, len) != 0)
+    return NULL;
+  return slot->route;
+}
+
+static void frozen_routes_destroy(struct FrozenRoutes *f) {
+  free(f->slots);
+  free(f->seeds);
+  memset(f, 0, sizeof(*f));
+}
+
+static int compare_bucket_size(const void *lhs, const void *rhs) {
+  const uint32_t *a = (const uint32_t *)lhs;
+  const uint32_t *b = (const uint32_t *)rhs;
+  return (b[1] > a[1]) - (b[1] < a[1]);
+}
+
+static bool frozen_routes_build(struct FrozenRoutes *f, struct Route **routes,
+                                size_t routes_len) {
+  uint32_t n = 0;
+  for (size_t i = 0; i < routes_len; i++) {
+    if (routes[i]->params_len == 0)
+      n++;
+  }
+  if (n == 0)
+    return true;
+
+  uint32_t buckets = n / 4 + 1;
+  uint64_t *hashes = (uint64_t *)malloc(n * sizeof(*hashes));
+  struct Route **keys = (struct Route **)malloc(n * sizeof(*keys));
+  uint32_t *order = (uint32_t *)calloc(buckets, 2 * sizeof(*order));
+  uint32_t *members = (uint32_t *)malloc(n * sizeof(*members));
+  uint32_t *member_off = (uint32_t *)calloc(buckets + 1, sizeof(*member_off));
+  bool *taken = (bool *)calloc(n, sizeof(*taken));
+  f->seeds = (uint32_t *)calloc(buckets, sizeof(*f->seeds));
+  f->slots = (struct RouteSlot *)aligned_alloc(
+      _Alignof(struct RouteSlot), n * sizeof(*f->slots));
+  bool ok = hashes && keys && order && members && member_off && taken &&
+            f->seeds && f->slots;
+
+  for (size_t i = 0, k = 0; ok && i < routes_len; i++) {
+    if (routes[i]->params_len != 0)
+      continue;
+    keys[k] = routes[i];
+    hashes[k] = route_hash(routes[i]->route, strlen(routes[i]->route));
+    member_off[route_bucket_index(hashes[k], buckets) + 1]++;
+    k++;
+  }
+
+  // Group keys by bucket, then seat the largest buckets first.
+  for (uint32_t b = 0; ok && b < buckets; b++) {
+    order[2 * b] = b;
+    order[2 * b + 1] = member_off[b + 1];
+    member_off[b + 1] += member_off[b];
+  }
+  uint32_t *cursor = ok ? (uint32_t *)calloc(buckets, sizeof(*cursor)) : NULL;
+  ok = ok && cursor != NULL;
+  for (uint32_t k = 0; ok && k < n; k++) {
+    uint32_t b = route_bucket_index(hashes[k], buckets);
+    members[member_off[b] + cursor[b]++] = k;
+  }
+  free(cursor);
+  if (ok)
+    qsort(order, buckets, 2 * sizeof(*order), compare_bucket_size);
+
+  uint32_t slots[64];
+  for (uint32_t i = 0; ok && i < buckets && order[2 * i + 1] > 0; i++) {
+    uint32_t b = order[2 * i];
+    uint32_t size = order[2 * i + 1];
+    const uint32_t *bucket_keys = members + member_off[b];
+    bool placed = false;
+
+    for (uint32_t seed = 0; !placed && seed < (1u << 20); seed++) {
+      placed = size <= 64;
+      for (uint32_t j = 0; placed && j < size; j++) {
+        slots[j] = route_slot_index(hashes[bucket_keys[j]], seed, n);
+        placed = !taken[slots[j]];
+        for (uint32_t q = 0; placed && q < j; q++)
+          placed = slots[q] != slots[j];
+      }
+      if (placed) {
+        f->seeds[b] = seed;
+        for (uint32_t j = 0; j < size; j++)
+          taken[slots[j]] = true;
+      }
+    }
+    ok = placed;
+  }
+
+  for (uint32_t k = 0; ok && k < n; k++) {
+    uint32_t b = route_bucket_index(hashes[k], buckets);
+    struct RouteSlot *slot =
+        &f->slots[route_slot_index(hashes[k], f->seeds[b], n)];
+    memset(slot, 0, sizeof(*slot));
+    slot->hash = hashes[k];
+    slot->path = keys[k]->route;
+    slot->path_len = strlen(keys[k]->route);
+    slot->route = keys[k];
+  }
+
+  free(hashes);
+  free(keys);
+  free(order);
+  free(members);
+  free(member_off);
+  free(taken);
+  if (!ok) {
+    frozen_routes_destroy(f);
+    return false;
+  }
+  f->slots_len = n;
+  f->buckets_len = buckets;
+  return true;
+}
+
+static struct Route *find_route(ExpressRouter *r, http_request *req) {
+  if (r == NULL || req == NULL)
+    return NULL;
+
+  size_t len = strlen(req->route);
+  struct Route *t = frozen_lookup(&r->exact, req->route, len);
+  if (t != NULL)
+    return t;
+
+  struct RadixMatch m;
+  m.len = 0;
+  t = radix_lookup(&r->root, req->route, 0, len, &m);
+  if (t == NULL || m.len == 0)
+    return t;
+
+  // Parameter values are NUL-terminated slices of one copy of the path;
+  // nothing is allocated per parameter.
+  memcpy(req->params_buf, req->route, len + 1);
+  for (size_t i = 0; i < m.len && i < t->params_len; i++) {
+    req->params_buf[m.starts[i] + m.lens[i]] = '\0';
+    req->route_params[i].key = t->param_names[i];
+    req->route_params[i].value = req->params_buf + m.starts[i];
+  }
+  req->route_params_len = m.len < t->params_len ? m.len : t->params_len;
+  return t;
+}
+
+static struct Route *router_route_for_pattern(ExpressRouter *r,
+                                              char *pattern) {
+  char *names[MAX_PARAMS];
+  size_t names_len = 0;
+  struct RadixNode *n = radix_insert(&r->root, pattern, names, &names_len);
+  if (n == NULL) {
+    for (size_t i = 0; i < names_len; i++)
+      free(names[i]);
+    return NULL;
+  }
+
+  if (n->route != NULL) {
+    bool same = n->route->params_len == names_len;
+    for (size_t i = 0; same && i < names_len; i++)
+      same = names[i] != NULL && strcmp(names[i], n->route->param_names[i]) == 0;
+    for (size_t i = 0; i < names_len; i++)
+      free(names[i]);
+    return same ? n->route : NULL;
+  }
+
+  if (r->routes_len == r->routes_cap) {
+    size_t cap = r->routes_cap ? r->routes_cap * 2 : 16;
+    struct Route **next =
+        (struct Route **)realloc(r->routes, cap * sizeof(*next));
+    if (next == NULL)
+      goto fail;
+    r->routes = next;
+    r->routes_cap = cap;
+  }
+
+  struct Route *t = route_new(pattern);
+  if (t == NULL)
+    goto fail;
+  for (size_t i = 0; i < names_len; i++) {
+    if (names[i] == NULL) {
+      route_destroy(t);
+      goto fail;
+    }
+    t->param_names[i] = names[i];
+  }
+  t->params_len = names_len;
+  n->route = t;
+  r->routes[r->routes_len++] = t;
+  return t;
+
+fail:
+  for (size_t i = 0; i < names_len; i++)
+    free(names[i]);
+  return NULL;
+}
+
+// Response compression. Bodies whose Content-Type matches a router rule are
+// gzip- or deflate-encoded for clients that accept it: buffered bodies in
+// one pass into the request arena, streamed ones as they are produced.
+enum ContentEncoding {
+  ENCODING_IDENTITY = 0,
+  ENCODING_GZIP,
+  ENCODING_DEFLATE,
+};
+
+struct CompressRule {
+  char *content_type;
+  size_t content_type_len;
+  size_t min_size;
+};
+
+// A compressed static file, keyed on a hash of the uncompressed bytes so an
+// edited file misses instead of serving stale output.
+struct CompressEntry {
+  // First member, so a link in the LRU list converts back to its entry.
+  struct CacheLink lru;
+  struct CompressEntry *chain_next;
+  uint64_t hash;
+  size_t raw_len;
+  enum ContentEncoding encoding;
+  size_t len;
+  byte data[];
+};
+
+struct CompressCache {
+  pthread_mutex_t lock;
+  struct CompressEntry *buckets[COMPRESS_CACHE_BUCKETS];
+  struct CacheLink lru;
+  size_t bytes;
+  size_t budget;
+};
+
+static struct CompressCache *compress_cache_new(size_t budget) {
+  struct CompressCache *cache =
+      (struct CompressCache *)calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return NULL;
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->lru.prev = &cache->lru;
+  cache->lru.next = &cache->lru;
+  cache->budget = budget;
+  return cache;
+}
+
+static void compress_cache_remove(struct CompressCache *cache,
+                                  struct CompressEntry *e) {
+  struct CompressEntry **link =
+      &cache->buckets[e->hash & (COMPRESS_CACHE_BUCKETS - 1)];
+  while (*link != e)
+    link = &(*link)->chain_next;
+  *link = e->chain_next;
+  e->lru.prev->next = e->lru.next;
+  e->lru.next->prev = e->lru.prev;
+  cache->bytes -= sizeof(*e) + e->len;
+  free(e);
+}
+
+static void compress_cache_destroy(struct CompressCache *cache) {
+  if (cache == NULL)
+    return;
+  while (cache->lru.next != &cache->lru)
+    compress_cache_remove(cache, (struct CompressEntry *)cache->lru.next);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+// Call with the lock held. A hit moves to the front of the LRU.
+static struct CompressEntry *compress_cache_find(struct CompressCache *cache,
+                                                 uint64_t hash, size_t raw_len,
+                                                 enum ContentEncoding encoding) {
+  struct CompressEntry *e =
+      cache->buckets[hash & (COMPRESS_CACHE_BUCKETS - 1)];
+  for (; e != NULL; e = e->chain_next) {
+    if (e->hash != hash || e->raw_len != raw_len || e->encoding != encoding)
+      continue;
+    e->lru.prev->next = e->lru.next;
+    e->lru.next->prev = e->lru.prev;
+    e->lru.prev = &cache->lru;
+    e->lru.next = cache->lru.next;
+    cache->lru.next->prev = &e->lru;
+    cache->lru.next = &e->lru;
+    return e;
+  }
+  return NULL;
+}
+
+static void compress_cache_put(struct CompressCache *cache, uint64_t hash,
+                               size_t raw_len, enum ContentEncoding encoding,
+                               const byte *data, size_t len) {
+  size_t size = sizeof(struct CompressEntry) + len;
+  if (size > cache->budget)
+    return;
+  struct CompressEntry *e = (struct CompressEntry *)malloc(size);
+  if (e == NULL)
+    return;
+  e->hash = hash;
+  e->raw_len = raw_len;
+  e->encoding = encoding;
+  e->len = len;
+  memcpy(e->data, data, len);
+
+  pthread_mutex_lock(&cache->lock);
+  // Another loop may have compressed the same file meanwhile.
+  if (compress_cache_find(cache, hash, raw_len, encoding) != NULL) {
+    pthread_mutex_unlock(&cache->lock);
+    free(e);
+    return;
+  }
+  while (cache->bytes + size > cache->budget)
+    compress_cache_remove(cache, (struct CompressEntry *)cache->lru.prev);
+  struct CompressEntry **bucket =
+      &cache->buckets[hash & (COMPRESS_CACHE_BUCKETS - 1)];
+  e->chain_next = *bucket;
+  *bucket = e;
+  e->lru.prev = &cache->lru;
+  e->lru.next = cache->lru.next;
+  cache->lru.next->prev = &e->lru;
+  cache->lru.next = &e->lru;
+  cache->bytes += size;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// The encoding to answer with from Accept-Encoding: gzip over deflate at
+// equal weight, and neither when the client gave them (or "*") q=0.
+static enum ContentEncoding accept_encoding_pick(http_request *req) {
+  header *h = get_request_header(req, "Accept-Encoding");
+  if (h == NULL || h->value == NULL)
+    return ENCODING_IDENTITY;
+
+  // Weights in thousandths; -1 when not listed.
+  int32_t gzip = -1;
+  int32_t deflate = -1;
+  int32_t any = -1;
+  const char *p = h->value;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      p++;
+    const char *token = p;
+    while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+      p++;
+    size_t token_len = (size_t)(p - token);
+
+    int32_t q = 1000;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == ';') {
+      p++;
+      while (*p == ' ' || *p == '\t')
+        p++;
+      if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+        p += 2;
+        q = *p == '1' ? 1000 : 0;
+        if (*p == '0' || *p == '1')
+          p++;
+        if (*p == '.') {
+          p++;
+          for (int32_t scale = 100; isdigit((unsigned char)*p); scale /= 10) {
+            q += (*p - '0') * scale;
+            p++;
+          }
+        }
+        if (q > 1000)
+          q = 1000;
+      }
+    }
+    while (*p != '\0' && *p != ',')
+      p++;
+
+    if (token_len == 4 && strncasecmp(token, "gzip", 4) == 0)
+      gzip = q;
+    else if (token_len == 7 && strncasecmp(token, "deflate", 7) == 0)
+      deflate = q;
+    else if (token_len == 1 && *token == '*')
+      any = q;
+  }
+
+  if (gzip < 0)
+    gzip = any;
+  if (deflate < 0)
+    deflate = any;
+  if (gzip > 0 && gzip >= deflate)
+    return ENCODING_GZIP;
+  return deflate > 0 ? ENCODING_DEFLATE : ENCODING_IDENTITY;
+}
+
+static int32_t deflate_stream_init(z_stream *z, enum ContentEncoding encoding) {
+  memset(z, 0, sizeof(*z));
+  // 15-bit window; +16 asks zlib for the gzip wrapper instead of zlib's.
+  return deflateInit2(z, COMPRESS_LEVEL, Z_DEFLATED,
+                      encoding == ENCODING_GZIP ? 31 : 15, 8,
+                      Z_DEFAULT_STRATEGY);
+}
+
+// One stream per encoding per loop thread, reset between bodies rather
+// than reallocated: a deflate state is a few hundred KiB. A thread-specific
+// key ends them when their thread exits.
+struct DeflateStreams {
+  z_stream z[2];
+  bool ready[2];
+};
+static _Thread_local struct DeflateStreams deflate_streams;
+static pthread_key_t deflate_streams_key;
+static bool deflate_streams_keyed;
+static pthread_once_t deflate_streams_once = PTHREAD_ONCE_INIT;
+
+static void deflate_streams_release(void *p) {
+  struct DeflateStreams *d = (struct DeflateStreams *)p;
+  for (size_t i = 0; i < 2; i++) {
+    if (d->ready[i])
+      (void)deflateEnd(&d->z[i]);
+    d->ready[i] = false;
+  }
+}
+
+static void deflate_streams_key_init(void) {
+  deflate_streams_keyed =
+      pthread_key_create(&deflate_streams_key, deflate_streams_release) == 0;
+}
+
+// Compresses len bytes of in into the arena. Returns the output, or NULL
+// if it would not be smaller than the input.
+static byte *deflate_into_arena(struct Arena *arena, const byte *in,
+                                size_t len, enum ContentEncoding encoding,
+                                size_t *out_len) {
+  size_t slot = encoding == ENCODING_GZIP ? 0 : 1;
+  z_stream *z = &deflate_streams.z[slot];
+  if (!deflate_streams.ready[slot]) {
+    pthread_once(&deflate_streams_once, deflate_streams_key_init);
+    if (deflate_stream_init(z, encoding) != Z_OK)
+      return NULL;
+    deflate_streams.ready[slot] = true;
+    if (deflate_streams_keyed)
+      (void)pthread_setspecific(deflate_streams_key, &deflate_streams);
+  } else if (deflateReset(z) != Z_OK) {
+    return NULL;
+  }
+  if (len > UINT_MAX)
+    return NULL;
+
+  size_t cap = deflateBound(z, (uLong)len);
+  byte *out = (byte *)arena_alloc(arena, cap);
+  if (out == NULL)
+    return NULL;
+  z->next_in = (Bytef *)in;
+  z->avail_in = (uInt)len;
+  z->next_out = out;
+  z->avail_out = (uInt)cap;
+  if (deflate(z, Z_FINISH) != Z_STREAM_END || z->total_out >= len)
+    return NULL;
+  *out_len = z->total_out;
+  return out;
+}
+
+// Wraps a response producer, compressing what it produces.
+struct CompressStream {
+  response_producer inner;
+  void *inner_ctx;
+  bool inner_done;
+  z_stream z;
+  byte in[RESPONSE_STREAM_CHUNK];
+};
+
+static void compress_stream_free(struct CompressStream *cs) {
+  if (!cs->inner_done)
+    (void)cs->inner(cs->inner_ctx, NULL, 0);
+  deflateEnd(&cs->z);
+  free(cs);
+}
+
+static ssize_t compress_stream_produce(void *ctx, byte *buf, size_t cap) {
+  struct CompressStream *cs = (struct CompressStream *)ctx;
+  if (buf == NULL) {
+    compress_stream_free(cs);
+    return 0;
+  }
+
+  cs->z.next_out = buf;
+  cs->z.avail_out = cap < UINT_MAX ? (uInt)cap : UINT_MAX;
+  // The inner producer is pulled until the compressor has something to
+  // show for it, since small writes may all sit in its window.
+  while (cs->z.avail_out == cap) {
+    if (cs->z.avail_in == 0 && !cs->inner_done) {
+      ssize_t n = cs->inner(cs->inner_ctx, cs->in, sizeof(cs->in));
+      if (n < 0) {
+        cs->inner_done = true;
+        compress_stream_free(cs);
+        return -1;
+      }
+      cs->inner_done = n == 0;
+      cs->z.next_in = cs->in;
+      cs->z.avail_in = (uInt)((size_t)n < sizeof(cs->in) ? (size_t)n
+                                                          : sizeof(cs->in));
+    }
+    int32_t rc = deflate(&cs->z, cs->inner_done ? Z_FINISH : Z_NO_FLUSH);
+    if (rc == Z_STREAM_END)
+      break;
+    if (rc != Z_OK && rc != Z_BUF_ERROR) {
+      compress_stream_free(cs);
+      return -1;
+    }
+  }
+
+  size_t produced = cap - cs->z.avail_out;
+  if (produced == 0)
+    compress_stream_free(cs);
+  return (ssize_t)produced;
+}
+
+static const struct CompressRule *compress_rule_for(const ExpressRouter *r,
+                                                    const char *type) {
+  // Events must reach subscribers as they happen, not once the
+  // compressor's window fills.
+  if (strncasecmp(type, "text/event-stream", 17) == 0)
+    return NULL;
+  for (size_t i = 0; i < r->compress_len; i++) {
+    const struct CompressRule *rule = &r->compress[i];
+    if (strncasecmp(type, rule->content_type, rule->content_type_len) == 0)
+      return rule;
+  }
+  return NULL;
+}
+
+// Tags a finished 200 with a weak ETag hashed over its body and, when the
+// request's If-None-Match already names it, turns it into a 304 so the
+// body is never sent. The tag is taken before compression, so every
+// encoding of the body shares it.
+static void response_etag(http_request *req, http_response *res) {
+  if (response_status(res) != 200 || res->producer != NULL ||
+      response_has_header(res, "ETag") ||
+      (res->body == NULL &&
+       res->content_length != response_segments_bytes(res)))
+    return;
+
+  size_t body_len = res->content_length - response_segments_bytes(res);
+  uint64_t h = body_hash(res->body, body_len, 0);
+  // Segments chain through the seed rather than hashing a joined copy.
+  for (size_t i = 0; i < res->segments_len; i++)
+    h = body_hash(res->segments[i].data, res->segments[i].len, h);
+
+  static const char hex[] = "0123456789abcdef";
+  char tag[sizeof("W/\"0123456789abcdef\"")];
+  memcpy(tag, "W/\"", 3);
+  for (int i = 0; i < 16; i++)
+    tag[3 + i] = hex[(h >> (60 - 4 * i)) & 0xf];
+  memcpy(tag + 19, "\"", 2);
+  if (!set_response_header(res, "ETag", tag))
+    return;
+
+  header *if_none_match = get_request_header(req, "If-None-Match");
+  if (if_none_match == NULL || if_none_match->value == NULL ||
+      !etag_list_matches(if_none_match->value, tag, sizeof(tag) - 1))
+    return;
+  response_drop_segments(res);
+  res->status_code = "304";
+  res->body = NULL;
+  res->content_length = 0;
+}
+
+// Compresses res in place if a rule covers it and the client accepts an
+// encoding. static_file marks a body worth keeping compressed in the
+// router's LRU, since the same bytes will be asked for again.
+static void response_compress(const ExpressRouter *r, http_request *req,
+                              http_response *res, struct Arena *arena,
+                              bool static_file) {
+  header *type = get_response_header(res, "Content-Type");
+  if (type == NULL || !status_allows_body(response_status(res)) ||
+      response_status(res) == 206 ||
+      response_has_header(res, "Content-Encoding") ||
+      response_has_header(res, "Content-Length"))
+    return;
+  const struct CompressRule *rule = compress_rule_for(r, type->value);
+  if (rule == NULL ||
+      (res->producer == NULL && res->content_length < rule->min_size))
+    return;
+
+  // Set whether or not this client gets it compressed, so shared caches
+  // keep the variants apart.
+  (void)set_response_header(res, "Vary", "Accept-Encoding");
+  enum ContentEncoding encoding = accept_encoding_pick(req);
+  if (encoding == ENCODING_IDENTITY)
+    return;
+  const char *name = encoding == ENCODING_GZIP ? "gzip" : "deflate";
+
+  if (res->producer != NULL) {
+    struct CompressStream *cs =
+        (struct CompressStream *)malloc(sizeof(*cs));
+    if (cs == NULL || deflate_stream_init(&cs->z, encoding) != Z_OK) {
+      free(cs);
+      return;
+    }
+    cs->inner = res->producer;
+    cs->inner_ctx = res->producer_ctx;
+    cs->inner_done = false;
+    res->producer = compress_stream_produce;
+    res->producer_ctx = cs;
+    (void)set_response_header(res, "Content-Encoding", name);
+    return;
+  }
+  if (res->segments_len != 0) {
+    byte *flat = (byte *)arena_alloc(arena, res->content_length);
+    if (flat == NULL)
+      return;
+    response_gather(res, flat);
+    response_drop_segments(res);
+    res->body = flat;
+  }
+  if (res->body == NULL)
+    return;
+
+  byte *out = NULL;
+  size_t out_len = 0;
+  uint64_t hash = 0;
+  if (static_file && r->compress_cache != NULL) {
+    hash = body_hash(res->body, res->content_length, 0);
+    pthread_mutex_lock(&r->compress_cache->lock);
+    struct CompressEntry *e = compress_cache_find(
+        r->compress_cache, hash, res->content_length, encoding);
+    if (e != NULL && (out = (byte *)arena_alloc(arena, e->len)) != NULL) {
+      memcpy(out, e->data, e->len);
+      out_len = e->len;
+    }
+    pthread_mutex_unlock(&r->compress_cache->lock);
+  }
+  if (out == NULL) {
+    out = deflate_into_arena(arena, res->body, res->content_length, encoding,
+                             &out_len);
+    if (out == NULL)
+      return;
+    if (static_file && r->compress_cache != NULL)
+      compress_cache_put(r->compress_cache, hash, res->content_length,
+                         encoding, out, out_len);
+  }
+
+  res->body = out;
+  res->content_length = out_len;
+  (void)set_response_header(res, "Content-Encoding", name);
+}
+
+ExpressRouter *router_new() {
+  ExpressRouter *r = (ExpressRouter *)calloc(1, sizeof(ExpressRouter));
+  if (r == NULL)
+    return NULL;
+  atomic_init(&r->refs, 1);
+  return r;
+}
+
+static void router_retain(ExpressRouter *r) {
+  atomic_fetch_add_explicit(&r->refs, 1, memory_order_relaxed);
+}
+
+// True if pattern lies under prefix on a segment boundary; prefix_len
+// excludes any trailing slash, and "/" covers everything.
+static bool pattern_has_prefix(const char *pattern, const char *prefix,
+                               size_t prefix_len) {
+  if (prefix_len == 1)
+    return true;
+  return strncmp(pattern, prefix, prefix_len) == 0 &&
+         (pattern[prefix_len] == '\0' || pattern[prefix_len] == '/');
+}
+
+static size_t trimmed_prefix_len(const char *prefix) {
+  size_t len = strlen(prefix);
+  while (len > 1 && prefix[len - 1] == '/')
+    len--;
+  return len;
+}
+
+static int32_t router_push_middleware(ExpressRouter *r,
+                                      const struct MiddlewareEntry *entry) {
+  if (r->mware_len == r->mware_cap) {
+    size_t cap = r->mware_cap ? r->mware_cap * 2 : 8;
+    struct MiddlewareEntry *next = (struct MiddlewareEntry *)realloc(
+        r->mware, cap * sizeof(*next));
+    if (next == NULL)
+      return -1;
+    r->mware = next;
+    r->mware_cap = cap;
+  }
+  r->mware[r->mware_len++] = *entry;
+  return 0;
+}
+
+int32_t router_add_middleware(ExpressRouter *r, middleware_handler mware_func) {
+  if (r == NULL || r->frozen || mware_func == NULL)
+    return -1;
+
+  struct MiddlewareEntry entry = {mware_func, NULL, 0, NULL};
+  return router_push_middleware(r, &entry);
+}
+
+int32_t router_add_prefix_middleware(ExpressRouter *r, const char *prefix,
+                                     middleware_handler mware_func) {
+  if (r == NULL || r->frozen || prefix == NULL || prefix[0] != '/' ||
+      mware_func == NULL)
+    return -1;
+
+  struct MiddlewareEntry entry = {mware_func, prefix,
+                                  trimmed_prefix_len(prefix), NULL};
+  return router_push_middleware(r, &entry);
+}
+
+int32_t router_add_route_middleware(ExpressRouter *r, const char *route,
+                                    middleware_handler mware_func) {
+  if (r == NULL || r->frozen || route == NULL || mware_func == NULL)
+    return -1;
+
+  for (size_t i = 0; i < r->routes_len; i++) {
+    if (strcmp(r->routes[i]->route, route) != 0)
+      continue;
+    struct MiddlewareEntry entry = {mware_func, NULL, 0, r->routes[i]};
+    return router_push_middleware(r, &entry);
+  }
+  return -1;
+}
+
+int32_t router_cache_route(ExpressRouter *r, const char *route,
+                           uint32_t ttl_ms, const char *const *vary,
+                           size_t vary_len) {
+  if (r == NULL || r->frozen || route == NULL || ttl_ms == 0 ||
+      vary_len > ROUTE_CACHE_MAX_VARY || (vary_len > 0 && vary == NULL))
+    return -1;
+
+  struct Route *t = NULL;
+  for (size_t i = 0; i < r->routes_len && t == NULL; i++) {
+    if (strcmp(r->routes[i]->route, route) == 0)
+      t = r->routes[i];
+  }
+  if (t == NULL || t->cache != NULL)
+    return -1;
+
+  struct RouteCache *policy =
+      (struct RouteCache *)calloc(1, sizeof(*policy));
+  if (policy == NULL)
+    return -1;
+  policy->ttl_ns = (uint64_t)ttl_ms * 1000000ull;
+  for (size_t i = 0; i < vary_len; i++) {
+    policy->vary[i] = vary[i] != NULL ? strdup(vary[i]) : NULL;
+    if (policy->vary[i] == NULL) {
+      for (size_t j = 0; j < i; j++)
+        free(policy->vary[j]);
+      free(policy);
+      return -1;
+    }
+    policy->vary_len++;
+  }
+  t->cache = policy;
+  return 0;
+}
+
+int32_t router_etag_route(ExpressRouter *r, const char *route) {
+  if (r == NULL || r->frozen || route == NULL)
+    return -1;
+
+  for (size_t i = 0; i < r->routes_len; i++) {
+    if (strcmp(r->routes[i]->route, route) == 0) {
+      r->routes[i]->etag = true;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int32_t router_set_cache_budget(ExpressRouter *r, size_t bytes) {
+  if (r == NULL || r->frozen || bytes == 0)
+    return -1;
+  r->cache_budget = bytes;
+  return 0;
+}
+
+int32_t router_add_compression(ExpressRouter *r, const char *content_type,
+                               size_t min_size) {
+  if (r == NULL || r->frozen || content_type == NULL ||
+      content_type[0] == '\0')
+    return -1;
+
+  struct CompressRule *next = (struct CompressRule *)realloc(
+      r->compress, (r->compress_len + 1) * sizeof(*next));
+  if (next == NULL)
+    return -1;
+  r->compress = next;
+
+  struct CompressRule *rule = &r->compress[r->compress_len];
+  rule->content_type = strdup(content_type);
+  if (rule->content_type == NULL)
+    return -1;
+  rule->content_type_len = strlen(content_type);
+  rule->min_size = min_size;
+  r->compress_len++;
+  return 0;
+}
+
+int32_t router_set_compression_budget(ExpressRouter *r, size_t bytes) {
+  if (r == NULL || r->frozen || bytes == 0)
+    return -1;
+  r->compress_budget = bytes;
+  return 0;
+}
+
+static char *strdup_or_null(const char *s) {
+  return s != NULL ? strdup(s) : NULL;
+}
+
+static void cors_policy_clear(struct CorsPolicy *p) {
+  free(p->prefix);
+  free((char *)p->cors.allow_origin);
+  free((char *)p->cors.allow_headers);
+  free((char *)p->cors.expose_headers);
+}
+
+int32_t router_add_cors(ExpressRouter *r, const char *prefix,
+                        const ExpressCors *cors) {
+  if (r == NULL || r->frozen || prefix == NULL || prefix[0] != '/' ||
+      cors == NULL || cors->allow_origin == NULL)
+    return -1;
+  if (has_crlf(cors->allow_origin) ||
+      (cors->allow_headers != NULL && has_crlf(cors->allow_headers)) ||
+      (cors->expose_headers != NULL && has_crlf(cors->expose_headers)))
+    return -1;
+
+  struct CorsPolicy *next = (struct CorsPolicy *)realloc(
+      r->cors, (r->cors_len + 1) * sizeof(*next));
+  if (next == NULL)
+    return -1;
+  r->cors = next;
+
+  struct CorsPolicy *p = &r->cors[r->cors_len];
+  memset(p, 0, sizeof(*p));
+  p->prefix = strdup(prefix);
+  p->prefix_len = trimmed_prefix_len(prefix);
+  p->cors = *cors;
+  p->cors.allow_origin = strdup(cors->allow_origin);
+  p->cors.allow_headers = strdup_or_null(cors->allow_headers);
+  p->cors.expose_headers = strdup_or_null(cors->expose_headers);
+  if (p->prefix == NULL || p->cors.allow_origin == NULL ||
+      (cors->allow_headers != NULL && p->cors.allow_headers == NULL) ||
+      (cors->expose_headers != NULL && p->cors.expose_headers == NULL)) {
+    cors_policy_clear(p);
+    return -1;
+  }
+  r->cors_len++;
+  return 0;
+}
+
+// Serializes each route's OPTIONS answer once, so a preflight costs one
+// writev: the Allow list doubles as Access-Control-Allow-Methods.
+static bool router_build_options(ExpressRouter *r) {
+  for (size_t k = 0; k < r->routes_len; k++) {
+    struct Route *t = r->routes[k];
+    t->methods |= 1u << OPTIONS;
+
+    t->cors = NULL;
+    for (size_t i = 0; i < r->cors_len; i++) {
+      const struct CorsPolicy *p = &r->cors[i];
+      if (pattern_has_prefix(t->route, p->prefix, p->prefix_len) &&
+          (t->cors == NULL || p->prefix_len > t->cors->prefix_len))
+        t->cors = p;
+    }
+
+    char allow[64];
+    char head[2048];
+    if (!build_allow_header_value(t, allow, sizeof(allow)))
+      return false;
+    int n = snprintf(head, sizeof(head), " 204 No Content\r\nAllow: %s\r\n",
+                     allow);
+    if (t->cors != NULL && n > 0 && (size_t)n < sizeof(head)) {
+      const ExpressCors *c = &t->cors->cors;
+      n += snprintf(head + n, sizeof(head) - (size_t)n,
+                    "Access-Control-Allow-Origin: %s\r\n"
+                    "Access-Control-Allow-Methods: %s\r\n",
+                    c->allow_origin, allow);
+      if (c->allow_headers != NULL && (size_t)n < sizeof(head))
+        n += snprintf(head + n, sizeof(head) - (size_t)n,
+                      "Access-Control-Allow-Headers: %s\r\n",
+                      c->allow_headers);
+      if (c->max_age != 0 && (size_t)n < sizeof(head))
+        n += snprintf(head + n, sizeof(head) - (size_t)n,
+                      "Access-Control-Max-Age: %u\r\n", c->max_age);
+      if (c->allow_credentials && (size_t)n < sizeof(head))
+        n += snprintf(head + n, sizeof(head) - (size_t)n,
+                      "Access-Control-Allow-Credentials: true\r\n");
+    }
+    if (n < 0 || (size_t)n >= sizeof(head))
+      return false;
+
+    t->options_head = (char *)malloc((size_t)n);
+    if (t->options_head == NULL)
+      return false;
+    memcpy(t->options_head, head, (size_t)n);
+    t->options_head_len = (size_t)n;
+  }
+  return true;
+}
+
+// Adds the CORS headers a browser checks on the actual (non-preflight)
+// response.
+static void apply_cors_headers(const struct CorsPolicy *p,
+                               http_response *res) {
+  (void)set_response_header(res, "Access-Control-Allow-Origin",
+                            p->cors.allow_origin);
+  if (p->cors.allow_credentials)
+    (void)set_response_header(res, "Access-Control-Allow-Credentials",
+                              "true");
+  if (p->cors.expose_headers != NULL)
+    (void)set_response_header(res, "Access-Control-Expose-Headers",
+                              p->cors.expose_headers);
+}
+
+static bool middleware_applies(const struct MiddlewareEntry *m,
+                               const struct Route *t, int scope) {
+  if (scope == 0)
+    return m->prefix == NULL && m->route == NULL;
+  if (scope == 2)
+    return m->route == t;
+  return m->prefix != NULL &&
+         pattern_has_prefix(t->route, m->prefix, m->prefix_len);
+}
+
+// Lays out every route's chain (global, then prefix, then route scope, each
+// in registration order) in one array so dispatch walks contiguous memory.
+static bool router_build_chains(ExpressRouter *r) {
+  size_t global = 0;
+  size_t total = 0;
+  for (size_t i = 0; i < r->mware_len; i++)
+    global += middleware_applies(&r->mware[i], NULL, 0);
+  total = global;
+  for (size_t k = 0; k < r->routes_len; k++) {
+    for (size_t i = 0; i < r->mware_len; i++) {
+      total += middleware_applies(&r->mware[i], r->routes[k], 1) ||
+               middleware_applies(&r->mware[i], r->routes[k], 2);
+    }
+    total += global;
+  }
+  if (total == 0)
+    return true;
+
+  r->chains = (middleware_handler *)malloc(total * sizeof(*r->chains));
+  if (r->chains == NULL)
+    return false;
+
+  size_t off = 0;
+  for (size_t i = 0; i < r->mware_len; i++) {
+    if (middleware_applies(&r->mware[i], NULL, 0))
+      r->chains[off++] = r->mware[i].fn;
+  }
+  r->global_chain_len = off;
+
+  for (size_t k = 0; k < r->routes_len; k++) {
+    struct Route *t = r->routes[k];
+    t->chain = r->chains + off;
+    for (int scope = 0; scope < 3; scope++) {
+      for (size_t i = 0; i < r->mware_len; i++) {
+        if (middleware_applies(&r->mware[i], t, scope))
+          r->chains[off++] = r->mware[i].fn;
+      }
+    }
+    t->chain_len = (size_t)(r->chains + off - t->chain);
+  }
+  return true;
+}
+
+// Runs a middleware chain until one of them calls end_response. Returns
+// false if the request was answered.
+static bool run_middleware(middleware_handler *chain, size_t chain_len,
+                           void *ctx, http_request *req, http_response *res) {
+  for (size_t i = 0; i < chain_len && !res->finished; i++)
+    chain[i](ctx, req, res);
+  return !res->finished;
+}
+
+int32_t router_set_fallback(ExpressRouter *r, route_handler handler) {
+  if (r == NULL || handler == NULL) return -1;
+  if (r->fallback != NULL) return -1;
+  r->fallback = handler;
+  return 0;
+}
+
+static int32_t router_add_method(ExpressRouter *r, char *route,
+                                 enum Method method,
+                                 const struct MethodRoute *entry) {
+  if (r == NULL || r->frozen || route == NULL || route[0] != '/' ||
+      method >= MAX_METHODS)
+    return -1;
+  struct Route *t = router_route_for_pattern(r, route);
+  if (t == NULL)
+    return -1;
+  if (t->handlers[method].handler != NULL || t->handlers[method].streaming)
+    return -1;
+  t->handlers[method] = *entry;
+  t->methods |= 1u << method;
+  if (method == GET)
+    t->methods |= 1u << HEAD;
+  return 0;
+}
+
+int32_t router_add(ExpressRouter *r, char *route, enum Method method,
+                   route_handler routing_func) {
+  if (routing_func == NULL)
+    return -1;
+
+  struct MethodRoute entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.handler = routing_func;
+  return router_add_method(r, route, method, &entry);
+}
+
+int32_t router_add_stream(ExpressRouter *r, char *route, enum Method method,
+                          route_handler on_headers,
+                          body_chunk_handler on_body_chunk,
+                          route_handler on_body_end, size_t max_body_size) {
+  if (on_body_chunk == NULL || on_body_end == NULL || method == HEAD)
+    return -1;
+
+  struct MethodRoute entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.handler = on_headers;
+  entry.streaming = true;
+  entry.on_body_chunk = on_body_chunk;
+  entry.on_body_end = on_body_end;
+  entry.max_body_size = max_body_size;
+  return router_add_method(r, route, method, &entry);
+}
+
+// SHA-1, only for deriving Sec-WebSocket-Accept.
+static void sha1_digest(const byte *data, size_t len, byte out[20]) {
+  uint32_t h[5] = {0x67452301u, 0xEFCDAB89u, 0x98BADCFEu, 0x10325476u,
+                   0xC3D2E1F0u};
+  size_t blocks = (len + 8) / 64 + 1;
+  uint64_t bits = (uint64_t)len * 8;
+
+  for (size_t blk = 0; blk < blocks; blk++) {
+    byte block[64];
+    for (size_t j = 0; j < 64; j++) {
+      size_t pos = blk * 64 + j;
+      block[j] = pos < len ? data[pos] : pos == len ? 0x80 : 0;
+    }
+    if (blk == blocks - 1) {
+      for (int j = 0; j < 8; j++)
+        block[63 - j] = (byte)(bits >> (8 * j));
+    }
+
+    uint32_t w[80];
+    for (int t = 0; t < 16; t++)
+      w[t] = (uint32_t)block[4 * t] << 24 | (uint32_t)block[4 * t + 1] << 16 |
+             (uint32_t)block[4 * t + 2] << 8 | block[4 * t + 3];
+    for (int t = 16; t < 80; t++) {
+      uint32_t v = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+      w[t] = v << 1 | v >> 31;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int t = 0; t < 80; t++) {
+      uint32_t f, k;
+      if (t < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999u;
+      } else if (t < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1u;
+      } else if (t < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDCu;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6u;
+      }
+      uint32_t temp = (a << 5 | a >> 27) + f + e + k + w[t];
+      e = d;
+      d = c;
+      c = b << 30 | b >> 2;
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  for (int i = 0; i < 5; i++) {
+    out[4 * i] = (byte)(h[i] >> 24);
+    out[4 * i + 1] = (byte)(h[i] >> 16);
+    out[4 * i + 2] = (byte)(h[i] >> 8);
+    out[4 * i + 3] = (byte)h[i];
+  }
+}
+
+// Writes the padded base64 of data to out, which needs 4 * ceil(len / 3)
+// bytes plus a terminator.
+static void base64_encode(const byte *data, size_t len, char *out) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if (i + 1 < len)
+      v |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < len)
+      v |= data[i + 2];
+    out[o++] = alphabet[v >> 18 & 63];
+    out[o++] = alphabet[v >> 12 & 63];
+    out[o++] = i + 1 < len ? alphabet[v >> 6 & 63] : '=';
+    out[o++] = i + 2 < len ? alphabet[v & 63] : '=';
+  }
+  out[o] = '\0';
+}
+
+static void websocket_upgrade(void *ctx, http_request *req,
+                              http_response *res) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  (void)ctx;
+
+  header *upgrade = get_request_header(req, "Upgrade");
+  header *connection = get_request_header(req, "Connection");
+  header *version = get_request_header(req, "Sec-WebSocket-Version");
+  header *key = get_request_header(req, "Sec-WebSocket-Key");
+  if (strcmp(req->method, "GET") != 0 ||
+      strcmp(req->version, "HTTP/1.1") != 0 || upgrade == NULL ||
+      !header_value_has_token(upgrade->value, "websocket") ||
+      connection == NULL ||
+      !header_value_has_token(connection->value, "upgrade")) {
+    response_set_static(res, "400", "Bad Request");
+    return;
+  }
+  if (version == NULL || strcmp(version->value, "13") != 0) {
+    response_set_static(res, "426", "Upgrade Required");
+    (void)set_response_header(res, "Sec-WebSocket-Version", "13");
+    return;
+  }
+  // The key is 16 random bytes in base64.
+  if (key == NULL || strlen(key->value) != 24) {
+    response_set_static(res, "400", "Bad Request");
+    return;
+  }
+
+  byte input[24 + sizeof(guid) - 1];
+  memcpy(input, key->value, 24);
+  memcpy(input + 24, guid, sizeof(guid) - 1);
+  byte digest[20];
+  char accept[29];
+  sha1_digest(input, sizeof(input), digest);
+  base64_encode(digest, sizeof(digest), accept);
+
+  (void)set_response_status(res, "101");
+  (void)set_response_header(res, "Upgrade", "websocket");
+  (void)set_response_header(res, "Connection", "Upgrade");
+  (void)set_response_header(res, "Sec-WebSocket-Accept", accept);
+}
+
+int32_t router_add_websocket(ExpressRouter *r, char *route,
+                             const ExpressWebSocketHandlers *handlers) {
+  if (handlers == NULL || handlers->on_message == NULL)
+    return -1;
+
+  struct MethodRoute entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.handler = websocket_upgrade;
+  entry.websocket =
+      (ExpressWebSocketHandlers *)malloc(sizeof(*entry.websocket));
+  if (entry.websocket == NULL)
+    return -1;
+  *entry.websocket = *handlers;
+  if (router_add_method(r, route, GET, &entry) != 0) {
+    free(entry.websocket);
+    return -1;
+  }
+  return 0;
+}
+
+// Marks an SSE response. Its body comes from broadcasts, so the connection
+// never pulls from it; it only sees the NULL call when a response is
+// dropped.
+static ssize_t sse_body(void *ctx, byte *buf, size_t cap) {
+  (void)ctx;
+  (void)buf;
+  (void)cap;
+  return -1;
+}
+
+static void sse_subscribe(void *ctx, http_request *req, http_response *res) {
+  (void)ctx;
+  (void)req;
+  (void)set_response_header(res, "Content-Type", "text/event-stream");
+  (void)set_response_header(res, "Cache-Control", "no-cache");
+  (void)set_response_stream(res, sse_body, NULL);
+}
+
+int32_t router_add_sse(ExpressRouter *r, char *route) {
+  struct MethodRoute entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.handler = sse_subscribe;
+  return router_add_method(r, route, GET, &entry);
+}
+
+int32_t router_freeze(ExpressRouter *r) {
+  if (r == NULL)
+    return -1;
+  if (r->frozen)
+    return 0;
+  bool cached = false;
+  for (size_t i = 0; i < r->routes_len && !cached; i++)
+    cached = r->routes[i]->cache != NULL;
+  if (cached) {
+    r->cache = response_cache_new(r->cache_budget
+                                      ? r->cache_budget
+                                      : RESPONSE_CACHE_DEFAULT_BUDGET);
+    if (r->cache == NULL)
+      return -1;
+  }
+  if (r->compress_len != 0) {
+    r->compress_cache = compress_cache_new(
+        r->compress_budget ? r->compress_budget
+                           : COMPRESS_CACHE_DEFAULT_BUDGET);
+    if (r->compress_cache == NULL) {
+      response_cache_destroy(r->cache);
+      r->cache = NULL;
+      return -1;
+    }
+  }
+
+  if (!router_build_options(r) || !router_build_chains(r) ||
+      !frozen_routes_build(&r->exact, r->routes, r->routes_len)) {
+    for (size_t i = 0; i < r->routes_len; i++) {
+      free(r->routes[i]->options_head);
+      r->routes[i]->options_head = NULL;
+    }
+    free(r->chains);
+    r->chains = NULL;
+    response_cache_destroy(r->cache);
+    r->cache = NULL;
+    compress_cache_destroy(r->compress_cache);
+    r->compress_cache = NULL;
+    return -1;
+  }
+  r->frozen = true;
+  return 0;
+}
+
+void router_destroy(ExpressRouter *r) {
+  if (r == NULL)
+    return;
+  if (atomic_fetch_sub_explicit(&r->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  frozen_routes_destroy(&r->exact);
+  response_cache_destroy(r->cache);
+  compress_cache_destroy(r->compress_cache);
+  for (size_t i = 0; i < r->compress_len; i++)
+    free(r->compress[i].content_type);
+  free(r->compress);
+  for (size_t i = 0; i < r->cors_len; i++)
+    cors_policy_clear(&r->cors[i]);
+  free(r->cors);
+  free(r->mware);
+  free(r->chains);
+  for (size_t i = 0; i < r->root.children_len; i++)
+    radix_node_destroy(r->root.children[i]);
+  free(r->root.children);
+  radix_node_destroy(r->root.param);
+  radix_node_destroy(r->root.wildcard);
+  for (size_t i = 0; i < r->routes_len; i++)
+    route_destroy(r->routes[i]);
+  free(r->routes);
+  free(r);
+}
+
+void pause_request_body(http_request *req) {
+  if (req == NULL || req->conn == NULL)
+    return;
+  tcp_conn_pause_read((TCPConn *)req->conn);
+}
+
+void resume_request_body(http_request *req) {
+  if (req == NULL || req->conn == NULL)
+    return;
+  tcp_conn_resume_read((TCPConn *)req->conn);
+}
+
+static uint64_t host_hash(const char *name, size_t len) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)tolower((unsigned char)name[i]);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static struct VHost *vhost_table_find(const ExpressServer *s,
+                                      const char *name, size_t len) {
+  if (s->vhosts_len == 0)
+    return NULL;
+
+  uint64_t h = host_hash(name, len);
+  size_t mask = s->vhosts_cap - 1;
+  for (size_t i = (size_t)h & mask;; i = (i + 1) & mask) {
+    struct VHost *v = s->vhosts[i];
+    if (v == NULL)
+      return NULL;
+    if (v->hash == h && v->name_len == len &&
+        strncasecmp(v->name, name, len) == 0)
+      return v;
+  }
+}
+
+static bool vhost_table_insert(ExpressServer *s, struct VHost *v) {
+  if ((s->vhosts_len + 1) * 2 > s->vhosts_cap) {
+    size_t cap = s->vhosts_cap ? s->vhosts_cap * 2 : 16;
+    struct VHost **table = (struct VHost **)calloc(cap, sizeof(*table));
+    if (table == NULL)
+      return false;
+    for (size_t i = 0; i < s->vhosts_cap; i++) {
+      struct VHost *old = s->vhosts[i];
+      if (old == NULL)
+        continue;
+      size_t j = (size_t)old->hash & (cap - 1);
+      while (table[j] != NULL)
+        j = (j + 1) & (cap - 1);
+      table[j] = old;
+    }
+    free(s->vhosts);
+    s->vhosts = table;
+    s->vhosts_cap = cap;
+  }
+
+  size_t j = (size_t)v->hash & (s->vhosts_cap - 1);
+  while (s->vhosts[j] != NULL)
+    j = (j + 1) & (s->vhosts_cap - 1);
+  s->vhosts[j] = v;
+  s->vhosts_len++;
+  return true;
+}
+
+// Picks the host for a Host header value: an exact name first, then the
+// most specific wildcard, else the default host. The port and a trailing
+// dot are ignored.
+static const struct VHost *server_find_vhost(const ExpressServer *s,
+                                             const char *host) {
+  if (host == NULL || s->vhosts_len == 0)
+    return &s->default_host;
+
+  size_t len = strlen(host);
+  if (host[0] == '[') {
+    const char *end = strchr(host, ']');
+    len = end != NULL ? (size_t)(end - host) + 1 : len;
+  } else {
+    const char *colon = memchr(host, ':', len);
+    if (colon != NULL)
+      len = (size_t)(colon - host);
+  }
+  if (len > 0 && host[len - 1] == '.')
+    len--;
+
+  const struct VHost *v = vhost_table_find(s, host, len);
+  for (size_t i = 1; v == NULL && i < len; i++) {
+    if (host[i] == '.')
+      v = vhost_table_find(s, host + i, len - i);
+  }
+  return v != NULL ? v : &s->default_host;
+}
+
+static bool vhost_init(struct VHost *v, ExpressRouter *router,
+                       const char *public_path, size_t static_cache_budget) {
+  if (router_freeze(router) != 0)
+    return false;
+
+  v->public_path = NULL;
+  v->static_cache = NULL;
+  memset(&v->static_map, 0, sizeof(v->static_map));
+  if (public_path != NULL) {
+    v->public_path = strdup(public_path);
+    if (v->public_path == NULL)
+      return false;
+    v->static_cache = response_cache_new(static_cache_budget);
+    if (v->static_cache == NULL)
+      return false;
+    scan_dir(&v->static_map, v->public_path, "");
+  }
+  router_retain(router);
+  atomic_init(&v->router, router);
+  return true;
+}
+
+static void vhost_clear(struct VHost *v) {
+  response_cache_destroy(v->static_cache);
+  static_map_destroy(&v->static_map);
+  free(v->public_path);
+  free(v->name);
+  router_destroy(atomic_load(&v->router));
+}
+
+int32_t server_add_vhost(ExpressServer *server, const char *host,
+                         ExpressRouter *router, const char *public_path) {
+  if (server == NULL || host == NULL || router == NULL)
+    return -1;
+
+  // "*.example.com" is kept as its ".example.com" suffix.
+  const char *name = host[0] == '*' && host[1] == '.' ? host + 1 : host;
+  size_t len = strlen(name);
+  if (len == 0 || len > 255 || (name[0] == '.' && len == 1) ||
+      strpbrk(name, ":/ \t") != NULL || (name != host + 1 && name[0] == '.'))
+    return -1;
+  if (vhost_table_find(server, name, len) != NULL)
+    return -1;
+
+  struct VHost *v = (struct VHost *)calloc(1, sizeof(*v));
+  if (v == NULL)
+    return -1;
+  v->name = strdup(name);
+  if (v->name == NULL) {
+    free(v);
+    return -1;
+  }
+  for (size_t i = 0; i < len; i++)
+    v->name[i] = (char)tolower((unsigned char)v->name[i]);
+  v->name_len = len;
+  v->hash = host_hash(v->name, len);
+
+  if (!vhost_init(v, router, public_path, server->static_cache_budget)) {
+    free(v->public_path);
+    free(v->name);
+    free(v);
+    return -1;
+  }
+  if (!vhost_table_insert(server, v)) {
+    vhost_clear(v);
+    free(v);
+    return -1;
+  }
+  return 0;
+}
+
+static pthread_mutex_t sse_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static ExpressServer *sse_registry;
+
+static struct SseChannel *sse_channel_find(const ExpressServer *s,
+                                           const char *name, size_t len,
+                                           uint64_t hash) {
+  if (s->sse_channels_cap == 0)
+    return NULL;
+  struct SseChannel *ch = s->sse_channels[hash & (s->sse_channels_cap - 1)];
+  for (; ch != NULL; ch = ch->next) {
+    if (ch->hash == hash && ch->name_len == len &&
+        memcmp(ch->name, name, len) == 0)
+      return ch;
+  }
+  return NULL;
+}
+
+static bool sse_channels_grow(ExpressServer *s) {
+  size_t cap = s->sse_channels_cap ? s->sse_channels_cap * 2 : 16;
+  struct SseChannel **table =
+      (struct SseChannel **)calloc(cap, sizeof(*table));
+  if (table == NULL)
+    return false;
+  for (size_t i = 0; i < s->sse_channels_cap; i++) {
+    struct SseChannel *ch = s->sse_channels[i];
+    while (ch != NULL) {
+      struct SseChannel *next = ch->next;
+      ch->next = table[ch->hash & (cap - 1)];
+      table[ch->hash & (cap - 1)] = ch;
+      ch = next;
+    }
+  }
+  free(s->sse_channels);
+  s->sse_channels = table;
+  s->sse_channels_cap = cap;
+  return true;
+}
+
+static void sse_channel_free(struct SseChannel *ch) {
+  free(ch->name);
+  free(ch->subs);
+  free(ch);
+}
+
+// Adds c to the channel named by req's path, creating it on first use.
+static bool sse_join(ExpressServer *s, TCPConn *c, struct HTTPConn *conn,
+                     const http_request *req) {
+  size_t len = strlen(req->route);
+  uint64_t hash = route_hash(req->route, len);
+  struct SseChannel *ch = sse_channel_find(s, req->route, len, hash);
+  if (ch == NULL) {
+    if (s->sse_channels_len >= s->sse_channels_cap && !sse_channels_grow(s))
+      return false;
+    ch = (struct SseChannel *)calloc(1, sizeof(*ch));
+    if (ch == NULL)
+      return false;
+    ch->name = strndup(req->route, len);
+    if (ch->name == NULL) {
+      free(ch);
+      return false;
+    }
+    ch->name_len = len;
+    ch->hash = hash;
+    ch->next = s->sse_channels[hash & (s->sse_channels_cap - 1)];
+    s->sse_channels[hash & (s->sse_channels_cap - 1)] = ch;
+    s->sse_channels_len++;
+  }
+
+  if (ch->subs_len == ch->subs_cap) {
+    size_t cap = ch->subs_cap ? ch->subs_cap * 2 : 8;
+    TCPConn **subs = (TCPConn **)realloc(ch->subs, cap * sizeof(*subs));
+    if (subs == NULL)
+      return false;
+    ch->subs = subs;
+    ch->subs_cap = cap;
+  }
+  conn->sse = ch;
+  conn->sse_index = ch->subs_len;
+  conn->sse_chunked = strcmp(req->version, "HTTP/1.0") != 0;
+  ch->subs[ch->subs_len++] = c;
+  return true;
+}
+
+// Removes the connection from its channel, freeing the channel once empty.
+static void sse_leave(ExpressServer *s, struct HTTPConn *conn) {
+  struct SseChannel *ch = conn->sse;
+  if (ch == NULL)
+    return;
+  conn->sse = NULL;
+
+  TCPConn *last = ch->subs[--ch->subs_len];
+  if (conn->sse_index < ch->subs_len) {
+    ch->subs[conn->sse_index] = last;
+    ((struct HTTPConn *)tcp_conn_get_user(last))->sse_index = conn->sse_index;
+  }
+  if (ch->subs_len != 0)
+    return;
+
+  struct SseChannel **link = &s->sse_channels[ch->hash &
+                                              (s->sse_channels_cap - 1)];
+  while (*link != ch)
+    link = &(*link)->next;
+  *link = ch->next;
+  s->sse_channels_len--;
+  sse_channel_free(ch);
+}
+
+// Queues one event on every subscriber of its channel, dropping those
+// whose backlog is past the watermark.
+static void sse_deliver(ExpressServer *s, const struct SseEvent *ev) {
+  struct SseChannel *ch =
+      sse_channel_find(s, ev->channel, ev->channel_len, ev->hash);
+  size_t i = 0;
+  while (ch != NULL && i < ch->subs_len) {
+    TCPConn *c = ch->subs[i];
+    struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
+    bool ok = tcp_conn_pending(c) <= s->sse_max_pending &&
+              (conn->sse_chunked
+                   ? tcp_conn_write_shared(c, ev->buf, 0,
+                                           ev->raw_off + ev->raw_len + 2)
+                   : tcp_conn_write_shared(c, ev->buf, ev->raw_off,
+                                           ev->raw_len));
+    if (ok) {
+      i++;
+      continue;
+    }
+    // The last subscriber moves into slot i; a channel left empty is freed.
+    bool last = ch->subs_len == 1;
+    sse_leave(s, conn);
+    tcp_conn_close_now(c);
+    if (last)
+      break;
+  }
+}
+
+// Writes data as SSE "data:" lines, splitting on CR, LF and CRLF, followed
+// by the blank line ending the event. With out NULL only measures.
+static size_t sse_format_event(const char *data, size_t len, char *out) {
+  size_t n = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i < len && data[i] != '\r' && data[i] != '\n')
+      continue;
+    if (out != NULL) {
+      memcpy(out + n, "data: ", 6);
+      memcpy(out + n + 6, data + start, i - start);
+      out[n + 6 + i - start] = '\n';
+    }
+    n += 6 + (i - start) + 1;
+    if (i + 1 < len && data[i] == '\r' && data[i + 1] == '\n')
+      i++;
+    start = i + 1;
+  }
+  if (out != NULL)
+    out[n] = '\n';
+  return n + 1;
+}
+
+int32_t express_sse_broadcast(const char *channel, const char *data,
+                              size_t len) {
+  static const char hex_digits[] = "0123456789abcdef";
+  if (channel == NULL || (data == NULL && len > 0))
+    return -1;
+
+  size_t raw_len = sse_format_event(data, len, NULL);
+  size_t hex_len = 0;
+  for (size_t v = raw_len; v != 0; v >>= 4)
+    hex_len++;
+  TCPSharedBuf *buf = tcp_shared_new(hex_len + 2 + raw_len + 2);
+  if (buf == NULL)
+    return -1;
+  char *p = (char *)tcp_shared_data(buf);
+  for (size_t i = 0, v = raw_len; i < hex_len; i++, v >>= 4)
+    p[hex_len - 1 - i] = hex_digits[v & 15];
+  memcpy(p + hex_len, "\r\n", 2);
+  (void)sse_format_event(data, len, p + hex_len + 2);
+  memcpy(p + hex_len + 2 + raw_len, "\r\n", 2);
+
+  size_t channel_len = strlen(channel);
+  uint64_t hash = route_hash(channel, channel_len);
+  int32_t rc = 0;
+  pthread_mutex_lock(&sse_registry_lock);
+  for (ExpressServer *s = sse_registry; s != NULL; s = s->sse_next) {
+    struct SseEvent *ev =
+        (struct SseEvent *)malloc(sizeof(*ev) + channel_len + 1);
+    if (ev == NULL) {
+      rc = -1;
+      continue;
+    }
+    tcp_shared_retain(buf);
+    ev->buf = buf;
+    ev->raw_off = hex_len + 2;
+    ev->raw_len = raw_len;
+    ev->hash = hash;
+    ev->channel_len = channel_len;
+    memcpy(ev->channel, channel, channel_len + 1);
+    ev->next = atomic_load_explicit(&s->sse_inbox, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&s->sse_inbox, &ev->next,
+                                                  ev, memory_order_release,
+                                                  memory_order_relaxed))
+      ;
+    tcp_server_wake(s->tcp_server);
+  }
+  pthread_mutex_unlock(&sse_registry_lock);
+  tcp_shared_release(buf);
+  return rc;
+}
+
+// Takes the pending broadcasts in the order they were made.
+static struct SseEvent *sse_take_inbox(ExpressServer *s) {
+  struct SseEvent *ev =
+      atomic_exchange_explicit(&s->sse_inbox, NULL, memory_order_acquire);
+  struct SseEvent *ordered = NULL;
+  while (ev != NULL) {
+    struct SseEvent *next = ev->next;
+    ev->next = ordered;
+    ordered = ev;
+    ev = next;
+  }
+  return ordered;
+}
+
+static void sse_event_free(struct SseEvent *ev) {
+  tcp_shared_release(ev->buf);
+  free(ev);
+}
+
+enum {
+  WS_CONTINUATION = 0x0,
+  WS_TEXT = 0x1,
+  WS_BINARY = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xA,
+};
+
+// XORs a client payload with its masking key in place.
+static void websocket_unmask(byte *p, size_t len, const byte key[4]) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  uint32_t k;
+  memcpy(&k, key, 4);
+  const __m128i mask = _mm_set1_epi32((int)k);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, mask));
+  }
+#endif
+  for (; i < len; i++)
+    p[i] ^= key[i & 3];
+}
+
+static bool utf8_valid(const byte *s, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+#if defined(__SSE2__)
+    if (i + 16 <= len &&
+        _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i))) == 0) {
+      i += 16;
+      continue;
+    }
+#endif
+    byte c = s[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+
+    size_t n;
+    uint32_t cp;
+    if ((c & 0xE0) == 0xC0) {
+      n = 1;
+      cp = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+      n = 2;
+      cp = c & 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+      n = 3;
+      cp = c & 0x07;
+    } else {
+      return false;
+    }
+    if (len - i <= n)
+      return false;
+    for (size_t k = 1; k <= n; k++) {
+      if ((s[i + k] & 0xC0) != 0x80)
+        return false;
+      cp = cp << 6 | (s[i + k] & 0x3F);
+    }
+    // Overlong forms, surrogates and values past U+10FFFF.
+    if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) ||
+        (n == 3 && cp < 0x10000) || cp > 0x10FFFF ||
+        (cp >= 0xD800 && cp <= 0xDFFF))
+      return false;
+    i += n + 1;
+  }
+  return true;
+}
+
+// Server frames are unmasked, so one header serves every recipient.
+static size_t websocket_frame_header(byte *out, uint8_t opcode, size_t len) {
+  out[0] = (byte)(0x80 | opcode);
+  if (len < 126) {
+    out[1] = (byte)len;
+    return 2;
+  }
+  if (len <= 0xFFFF) {
+    out[1] = 126;
+    out[2] = (byte)(len >> 8);
+    out[3] = (byte)len;
+    return 4;
+  }
+  out[1] = 127;
+  for (int i = 0; i < 8; i++)
+    out[2 + i] = (byte)((uint64_t)len >> (56 - 8 * i));
+  return 10;
+}
+
+// Writes iov as one piece of output. Behind pending output it goes on the
+// segment queue, which unlike the connection buffer has no fixed cap.
+static bool conn_write_queued(TCPConn *c, const struct iovec *iov,
+                              int iovcnt) {
+  if (tcp_conn_pending(c) == 0)
+    return tcp_conn_writev(c, iov, iovcnt);
+
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  TCPSharedBuf *buf = tcp_shared_new(total);
+  if (buf == NULL)
+    return false;
+  byte *p = tcp_shared_data(buf);
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len != 0)
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  bool ok = tcp_conn_write_shared(c, buf, 0, total);
+  tcp_shared_release(buf);
+  return ok;
+}
+
+static bool websocket_write_frame(struct ExpressWebSocket *ws, uint8_t opcode,
+                                  const byte *data, size_t len) {
+  byte head[10];
+  size_t head_len = websocket_frame_header(head, opcode, len);
+  struct iovec iov[2] = {{head, head_len}, {(void *)data, len}};
+  return conn_write_queued(ws->conn, iov, len != 0 ? 2 : 1);
+}
+
+static void websocket_send_close(struct ExpressWebSocket *ws, uint16_t code) {
+  byte payload[2] = {(byte)(code >> 8), (byte)code};
+  // 1005 means "no code" and is never sent on the wire.
+  (void)websocket_write_frame(ws, WS_CLOSE, payload, code == 1005 ? 0 : 2);
+  ws->closing = true;
+  ws->close_sent_ns = monotonic_ns();
+}
+
+// Fails the connection with code and stops reading frames from it.
+static void websocket_fail(struct ExpressWebSocket *ws, uint16_t code) {
+  if (!ws->closing)
+    websocket_send_close(ws, code);
+  ws->closed = true;
+  ws->close_code = code;
+  tcp_conn_close_after_write(ws->conn);
+}
+
+// Codes a peer may send: the registered ones other than 1004-1006 and 1015,
+// which never go on the wire, plus the library and application ranges.
+static bool websocket_close_code_valid(uint16_t code) {
+  return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) ||
+         (code >= 3000 && code <= 4999);
+}
+
+static void websocket_deliver(struct ExpressWebSocket *ws, const byte *data,
+                              size_t len, bool binary) {
+  if (!binary && !utf8_valid(data, len)) {
+    websocket_fail(ws, 1007);
+    return;
+  }
+  // Data that arrives after our close frame is dropped.
+  if (!ws->closing)
+    ws->handlers.on_message(ws->server->user_ctx, ws, data, len, binary);
+}
+
+static void websocket_handle_frame(struct ExpressWebSocket *ws, bool fin,
+                                   uint8_t opcode, const byte *payload,
+                                   size_t len) {
+  switch (opcode) {
+  case WS_TEXT:
+  case WS_BINARY:
+    if (ws->in_message) {
+      websocket_fail(ws, 1002);
+      return;
+    }
+    if (fin) {
+      websocket_deliver(ws, payload, len, opcode == WS_BINARY);
+      return;
+    }
+    ws->in_message = true;
+    ws->message_binary = opcode == WS_BINARY;
+    ws->message_len = 0;
+    // fallthrough
+  case WS_CONTINUATION:
+    if (!ws->in_message) {
+      websocket_fail(ws, 1002);
+      return;
+    }
+    if (ws->message_len + len > ws->message_cap) {
+      size_t cap = ws->message_cap ? ws->message_cap : 4096;
+      while (cap < ws->message_len + len)
+        cap *= 2;
+      byte *next = (byte *)realloc(ws->message, cap);
+      if (next == NULL) {
+        websocket_fail(ws, 1011);
+        return;
+      }
+      ws->message = next;
+      ws->message_cap = cap;
+    }
+    memcpy(ws->message + ws->message_len, payload, len);
+    ws->message_len += len;
+    if (opcode == WS_CONTINUATION && fin) {
+      ws->in_message = false;
+      websocket_deliver(ws, ws->message, ws->message_len, ws->message_binary);
+    }
+    return;
+  case WS_CLOSE: {
+    uint16_t code = 1005;
+    if (len >= 2) {
+      code = (uint16_t)(payload[0] << 8 | payload[1]);
+      if (!websocket_close_code_valid(code) ||
+          !utf8_valid(payload + 2, len - 2)) {
+        websocket_fail(ws, 1002);
+        return;
+      }
+    } else if (len == 1) {
+      websocket_fail(ws, 1002);
+      return;
+    }
+    if (!ws->closing)
+      websocket_send_close(ws, code);
+    ws->closed = true;
+    ws->close_code = code;
+    tcp_conn_close_after_write(ws->conn);
+    return;
+  }
+  case WS_PING:
+    if (!ws->closing)
+      (void)websocket_write_frame(ws, WS_PONG, payload, len);
+    return;
+  case WS_PONG:
+    return;
+  default:
+    websocket_fail(ws, 1002);
+  }
+}
+
+// Parses the complete frames buffered on conn. Payloads are unmasked in
+// place and unfragmented messages are handed out from the buffer itself.
+static void websocket_process(struct HTTPConn *conn) {
+  struct ExpressWebSocket *ws = conn->ws;
+  size_t max = ws->handlers.max_message_size != 0
+                   ? ws->handlers.max_message_size
+                   : ws->server->max_body_size;
+  size_t off = 0;
+
+  while (!ws->closed) {
+    byte *p = conn->bytes + off;
+    size_t avail = conn->bytes_len - off;
+    if (avail < 2)
+      break;
+
+    bool fin = (p[0] & 0x80) != 0;
+    uint8_t opcode = p[0] & 0x0F;
+    // No extensions are negotiated, so RSV bits must be clear, and
+    // clients must mask.
+    if ((p[0] & 0x70) != 0 || (p[1] & 0x80) == 0) {
+      websocket_fail(ws, 1002);
+      break;
+    }
+
+    uint64_t len = p[1] & 0x7F;
+    size_t head = 2;
+    if (len == 126) {
+      if (avail < 4)
+        break;
+      len = (uint64_t)p[2] << 8 | p[3];
+      head = 4;
+    } else if (len == 127) {
+      if (avail < 10)
+        break;
+      len = 0;
+      for (int i = 0; i < 8; i++)
+        len = len << 8 | p[2 + i];
+      head = 10;
+    }
+
+    if ((opcode & 0x8) != 0 && (!fin || len > 125)) {
+      websocket_fail(ws, 1002);
+      break;
+    }
+    size_t used = ws->in_message ? ws->message_len : 0;
+    if ((opcode & 0x8) == 0 && (len > max || used > max - len)) {
+      websocket_fail(ws, 1009);
+      break;
+    }
+
+    head += 4;
+    if (avail < head || avail - head < len)
+      break;
+    byte *payload = p + head;
+    websocket_unmask(payload, (size_t)len, payload - 4);
+    off += head + (size_t)len;
+    ws->last_seen_ns = monotonic_ns();
+    ws->ping_sent = false;
+    websocket_handle_frame(ws, fin, opcode, payload, (size_t)len);
+  }
+
+  http_conn_consume_bytes(conn, ws->closed ? conn->bytes_len : off);
+}
+
+static bool websocket_open(ExpressServer *s, TCPConn *c, struct HTTPConn *conn,
+                           const ExpressWebSocketHandlers *handlers) {
+  if (s->websockets_len == s->websockets_cap) {
+    size_t cap = s->websockets_cap ? s->websockets_cap * 2 : 16;
+    struct ExpressWebSocket **next = (struct ExpressWebSocket **)realloc(
+        s->websockets, cap * sizeof(*next));
+    if (next == NULL)
+      return false;
+    s->websockets = next;
+    s->websockets_cap = cap;
+  }
+
+  struct ExpressWebSocket *ws =
+      (struct ExpressWebSocket *)calloc(1, sizeof(*ws));
+  if (ws == NULL)
+    return false;
+  ws->conn = c;
+  ws->server = s;
+  ws->handlers = *handlers;
+  ws->last_seen_ns = monotonic_ns();
+  ws->ping_ns = (uint64_t)(handlers->ping_interval_ms != 0
+                               ? handlers->ping_interval_ms
+                               : WEBSOCKET_PING_INTERVAL_MS) *
+                1000000ull;
+  ws->index = s->websockets_len;
+  s->websockets[s->websockets_len++] = ws;
+  conn->ws = ws;
+  return true;
+}
+
+static void websocket_destroy(ExpressServer *s, struct ExpressWebSocket *ws) {
+  if (ws->handlers.on_close != NULL)
+    ws->handlers.on_close(s->user_ctx, ws,
+                          ws->close_code != 0 ? ws->close_code : 1006);
+
+  struct ExpressWebSocket *last = s->websockets[--s->websockets_len];
+  s->websockets[ws->index] = last;
+  last->index = ws->index;
+  free(ws->message);
+  free(ws);
+}
+
+// Pings idle sockets and closes those that stopped answering, or that
+// never finished a closing handshake we started.
+static void websocket_tick(ExpressServer *s) {
+  uint64_t now = monotonic_ns();
+  for (size_t i = 0; i < s->websockets_len; i++) {
+    struct ExpressWebSocket *ws = s->websockets[i];
+    if (ws->closed)
+      continue;
+    uint64_t idle = now - ws->last_seen_ns;
+    bool dead = ws->closing ? now - ws->close_sent_ns >= ws->ping_ns
+                            : ws->ping_sent && idle >= 2 * ws->ping_ns;
+    if (dead) {
+      ws->closed = true;
+      tcp_conn_close_now(ws->conn);
+    } else if (!ws->ping_sent && !ws->closing && idle >= ws->ping_ns) {
+      ws->ping_sent = websocket_write_frame(ws, WS_PING, NULL, 0);
+    }
+  }
+}
+
+bool websocket_send(ExpressWebSocket *ws, const byte *data, size_t len,
+                    bool binary) {
+  if (ws == NULL || ws->closing || ws->closed || (data == NULL && len > 0))
+    return false;
+  return websocket_write_frame(ws, binary ? WS_BINARY : WS_TEXT, data, len);
+}
+
+size_t websocket_broadcast(ExpressWebSocket *const *sockets, size_t count,
+                           const byte *data, size_t len, bool binary) {
+  if (sockets == NULL || count == 0 || (data == NULL && len > 0))
+    return 0;
+
+  byte head[10];
+  size_t head_len =
+      websocket_frame_header(head, binary ? WS_BINARY : WS_TEXT, len);
+  TCPSharedBuf *buf = tcp_shared_new(head_len + len);
+  if (buf == NULL)
+    return 0;
+  memcpy(tcp_shared_data(buf), head, head_len);
+  if (len != 0)
+    memcpy(tcp_shared_data(buf) + head_len, data, len);
+
+  size_t sent = 0;
+  for (size_t i = 0; i < count; i++) {
+    ExpressWebSocket *ws = sockets[i];
+    if (ws == NULL || ws->closing || ws->closed)
+      continue;
+    size_t max_pending = ws->handlers.max_pending != 0
+                             ? ws->handlers.max_pending
+                             : WEBSOCKET_MAX_PENDING;
+    if (tcp_conn_pending(ws->conn) > max_pending ||
+        !tcp_conn_write_shared(ws->conn, buf, 0, head_len + len)) {
+      ws->closed = true;
+      tcp_conn_close_now(ws->conn);
+      continue;
+    }
+    sent++;
+  }
+  tcp_shared_release(buf);
+  return sent;
+}
+
+void websocket_close(ExpressWebSocket *ws, uint16_t code) {
+  if (ws == NULL || ws->closing || ws->closed)
+    return;
+  websocket_send_close(ws, websocket_close_code_valid(code) ? code : 1000);
+}
+
+void websocket_set_user(ExpressWebSocket *ws, void *user) {
+  if (ws != NULL)
+    ws->user = user;
+}
+
+void *websocket_get_user(const ExpressWebSocket *ws) {
+  return ws != NULL ? ws->user : NULL;
+}
+
+static void on_accept(void *ctx, TCPConn *c) {
+  (void)ctx;
+
+  struct HTTPConn *conn = (struct HTTPConn *)calloc(1, sizeof(*conn));
+  if (conn == NULL) {
+    tcp_conn_close_now(c);
+    return;
+  }
+  conn->parsed_headers = false;
+
+  tcp_conn_set_user(c, conn);
+}
+
+static void on_close(void *ctx, TCPConn *c) {
+  ExpressServer *s = (ExpressServer *)ctx;
+
+  struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
+  if (conn != NULL) {
+    sse_leave(s, conn);
+    if (conn->ws != NULL)
+      websocket_destroy(s, conn->ws);
+    if (conn->h2 != NULL)
+      h2_destroy(conn->h2);
+  }
+  http_conn_destroy(conn);
+}
+
+// The loop is between event batches, so any request that loaded a router
+// retired before this point has already pinned it. Retired routers are
+// released once their pins drain.
+static void on_tick(void *ctx) {
+  ExpressServer *s = (ExpressServer *)ctx;
+
+  date_block_refresh();
+  websocket_tick(s);
+
+  for (struct SseEvent *ev = sse_take_inbox(s); ev != NULL;) {
+    struct SseEvent *next = ev->next;
+    sse_deliver(s, ev);
+    sse_event_free(ev);
+    ev = next;
+  }
+
+  struct RetiredRouter *node =
+      atomic_exchange_explicit(&s->retired, NULL, memory_order_acquire);
+  while (node != NULL) {
+    struct RetiredRouter *next = node->next;
+    node->next = s->draining;
+    s->draining = node;
+    node = next;
+  }
+
+  for (struct RetiredRouter **link = &s->draining; *link != NULL;) {
+    node = *link;
+    if (node->router->pins != 0) {
+      link = &node->next;
+      continue;
+    }
+    *link = node->next;
+    router_destroy(node->router);
+    free(node);
+  }
+}
+
+static void http_conn_reject(TCPConn *c, struct HTTPConn *conn,
+                             http_request *req, const char *status_code,
+                             const char *body) {
+  http_response failed = response_default();
+  response_set_static(&failed, status_code, body);
+  (void)set_response_header(&failed, "Connection", "close");
+  (void)write_response(c, req, &failed);
+  // log_response(c, req, &failed);
+  response_cleanup(&failed);
+  http_conn_reset(conn);
+}
+
+static const struct MethodRoute *find_stream_route(struct Route *route,
+                                                   http_request *req) {
+  enum Method method = get_method_from_str(req->method);
+  if (route == NULL || method >= MAX_METHODS)
+    return NULL;
+  if (!route->handlers[method].streaming)
+    return NULL;
+  return &route->handlers[method];
+}
+
+// Hands body bytes to a streaming route as they arrive and drops them from
+// the connection buffer, so memory stays at one read slice per connection.
+// Returns 1 once the body is complete, 0 when more bytes are needed and a
+// DECODE_CHUNKED_ERR_* code on framing errors.
+static int32_t http_conn_stream_body(struct HTTPConn *conn, http_request *req,
+                                     size_t body_limit) {
+  const struct MethodRoute *m = conn->stream;
+  byte *body = conn->bytes + conn->bytes_off;
+  size_t body_len = 0;
+  size_t raw_end = 0;
+  int32_t ret = 0;
+
+  if (req->chunked) {
+    ret = http_conn_decode_chunked(conn, req, body_limit);
+    if (ret < 0)
+      return ret;
+    body_len = conn->chunk.body_len;
+    raw_end = conn->chunk.raw_off;
+    conn->chunk.body_len = 0;
+  } else {
+    size_t avail = conn->bytes_len - conn->bytes_off;
+    size_t left = req->content_length - conn->stream_seen;
+    body_len = avail < left ? avail : left;
+    raw_end = conn->bytes_off + body_len;
+    ret = body_len == left ? 1 : 0;
+  }
+
+  conn->stream_seen += body_len;
+  if (body_len > 0 && m->on_body_chunk != NULL)
+    m->on_body_chunk(conn->stream_ctx, req, body, body_len);
+
+  size_t tail = conn->bytes_len - raw_end;
+  memmove(conn->bytes + conn->bytes_off, conn->bytes + raw_end, tail);
+  conn->bytes_len = conn->bytes_off + tail;
+  conn->bytes[conn->bytes_len] = '\0';
+  conn->chunk.raw_off = conn->bytes_off;
+  return ret;
+}
+
+// Runs middleware and the matched handler, or serves a cached response.
+// Returns 1 if the response already went out from the cache, -1 if that
+// write failed, and 0 when res still has to be written.
+static int32_t dispatch_request(ExpressServer *s, TCPConn *c,
+                                const struct VHost *host,
+                                ExpressRouter *router, struct Route *r,
+                                http_request *req, http_response *res,
+                                byte **static_body, struct Arena *arena) {
+  char allow_header[64];
+  enum Method method = get_method_from_str(req->method);
+  res->arena = arena;
+  enum Method handler_method = method;
+  route_handler handler = NULL;
+
+  if (r != NULL && method < MAX_METHODS) {
+    if (method == HEAD && r->handlers[HEAD].handler == NULL) {
+      handler_method = GET;
+    }
+
+    if (handler_method < MAX_METHODS) {
+      handler = r->handlers[handler_method].handler;
+    }
+  }
+
+  if (method == OPTIONS && handler == NULL && r != NULL &&
+      r->options_head != NULL) {
+    s->total_requests++;
+    return write_preserialized(c, req, r->options_head, r->options_head_len,
+                               "\r\n", 2, response_should_close(req, res),
+                               false)
+               ? 1
+               : -1;
+  }
+
+  // The key is taken before middleware runs, since reading params splits
+  // the query string in place.
+  char cache_key[ROUTE_CACHE_KEY_MAX];
+  size_t cache_key_len = 0;
+  bool store = false;
+  size_t cache_path_len = 0;
+  uint64_t cache_hash = 0;
+  struct ResponseCache *cache = NULL;
+  uint64_t cache_ttl_ns = 0;
+  if (handler != NULL && handler_method == GET && r->cache != NULL &&
+      router->cache != NULL) {
+    cache = router->cache;
+    cache_ttl_ns = r->cache->ttl_ns;
+    cache_key_len = route_cache_key(r->cache, req, cache_key,
+                                    sizeof(cache_key), &cache_path_len);
+  } else if (r == NULL && host->static_cache != NULL &&
+             (method == GET || method == HEAD)) {
+    // Static files are keyed on the path alone; the query never picks a
+    // different file.
+    cache = host->static_cache;
+    cache_ttl_ns = s->static_cache_ttl_ns;
+    size_t len = strlen(req->route);
+    if (len < sizeof(cache_key)) {
+      memcpy(cache_key, req->route, len);
+      cache_key_len = cache_path_len = len;
+    }
+  }
+  if (cache_key_len != 0) {
+    // Entries are stored compressed, one per negotiated encoding.
+    if (router->compress_len != 0) {
+      enum ContentEncoding encoding = accept_encoding_pick(req);
+      if (encoding != ENCODING_IDENTITY &&
+          cache_key_len + 2 <= sizeof(cache_key)) {
+        cache_key[cache_key_len++] = '\0';
+        cache_key[cache_key_len++] = (char)('0' + encoding);
+      }
+    }
+    cache_hash = route_hash(cache_key, cache_key_len);
+  }
+
+  bool pass = r != NULL
+                  ? run_middleware(r->chain, r->chain_len, s->user_ctx, req,
+                                   res)
+                  : run_middleware(router->chains, router->global_chain_len,
+                                   s->user_ctx, req, res);
+
+  // Headers and cookies middleware set are kept out of cache entries and
+  // merged in on every hit instead, so they stay per request.
+  size_t live_headers = res->headers_len;
+  size_t live_cookies = res->cookies_len;
+  if (pass && cache_key_len != 0 && response_status(res) == 200) {
+    bool write_ok = false;
+    if (response_cache_send(cache, c, req, cache_key, cache_key_len,
+                            cache_hash, res, response_should_close(req, res),
+                            &write_ok)) {
+      if (r != NULL)
+        s->total_requests++;
+      return write_ok ? 1 : -1;
+    }
+  }
+
+  if (!pass) {
+    // A middleware answered the request.
+  } else if (r == NULL) {
+    if (try_serve_static_file(host, req, res, static_body)) {
+      // Clients revalidate with the ETag, which a cached file answers
+      // with a 304 and no body.
+      (void)set_response_header(res, "Cache-Control", "no-cache");
+      response_etag(req, res);
+      store = cache_key_len != 0;
+    } else if (router->fallback != NULL) {
+      router->fallback(s->user_ctx, req, res);
+    } else {
+      response_set_static(res, "404", "Not Found");
+    }
+  } else if (method >= MAX_METHODS) {
+    response_set_static(res, "405", "Method Not Allowed");
+  } else if (handler == NULL) {
+    response_set_static(res, "405", "Method Not Allowed");
+  } else {
+    if (r->cors != NULL)
+      apply_cors_headers(r->cors, res);
+    handler(s->user_ctx, req, res);
+    s->total_requests++;
+    store = cache_key_len != 0;
+    if (r->etag && handler_method == GET)
+      response_etag(req, res);
+  }
+
+  if (router->compress_len != 0)
+    response_compress(router, req, res, arena,
+                      *static_body != NULL && *static_body == res->body);
+  if (store) {
+    http_response stored = *res;
+    stored.headers += live_headers;
+    stored.headers_len -= live_headers;
+    // Cookies the handler sets keep the response out of the cache, so
+    // stored ones are never written.
+    stored.cookies_len -= live_cookies;
+    if (response_cacheable(&stored))
+      response_cache_store(cache, cache_ttl_ns, cache_key, cache_key_len,
+                           cache_path_len, cache_hash, &stored);
+    // A miss answers with the same headers a hit would.
+    response_drop_shadowed(res, live_headers);
+  }
+
+  if (strcmp(res->status_code, "405") == 0 &&
+      build_allow_header_value(r, allow_header, sizeof(allow_header))) {
+    (void)set_response_header(res, "Allow", allow_header);
+  }
+  return 0;
+}
+
+// Runs the middleware and header handler of a streaming route before any
+// body bytes are read. Returns false if the handler already answered with
+// an error status, in which case the response has been written.
+static bool start_stream_request(ExpressServer *s, TCPConn *c,
+                                 struct HTTPConn *conn, http_request *req) {
+  conn->stream_res = response_default();
+  conn->stream_ctx = s->user_ctx;
+  conn->stream_started = true;
+
+  if (run_middleware(conn->route->chain, conn->route->chain_len,
+                     s->user_ctx, req, &conn->stream_res) &&
+      conn->stream->handler != NULL)
+    conn->stream->handler(s->user_ctx, req, &conn->stream_res);
+
+  if (!conn->stream_res.finished && conn->stream_res.status_code[0] < '4')
+    return true;
+
+  http_response res = conn->stream_res;
+  memset(&conn->stream_res, 0, sizeof(conn->stream_res));
+  (void)set_response_header(&res, "Connection", "close");
+  (void)write_response(c, req, &res);
+  response_cleanup(&res);
+  conn->stream_started = false;
+  http_conn_reset(conn);
+  return false;
+}
+
+// HTTP/2 over cleartext TCP (h2c), entered with the connection preface or
+// an "Upgrade: h2c" request. Each stream becomes an http_request that goes
+// through the same routing, middleware and handlers as HTTP/1; responses
+// are HPACK-encoded and their bodies framed under flow control.
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+// Largest frame either side sends without a SETTINGS change; we never ask
+// for more, nor send more.
+#define H2_FRAME_MAX 16384
+#define H2_WINDOW_DEFAULT 65535
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_HEADER_BLOCK_MAX (1u << 16)
+
+enum {
+  H2_DATA = 0x0,
+  H2_HEADERS = 0x1,
+  H2_PRIORITY = 0x2,
+  H2_RST_STREAM = 0x3,
+  H2_SETTINGS = 0x4,
+  H2_PUSH_PROMISE = 0x5,
+  H2_PING = 0x6,
+  H2_GOAWAY = 0x7,
+  H2_WINDOW_UPDATE = 0x8,
+  H2_CONTINUATION = 0x9,
+};
+
+enum {
+  H2_FLAG_END_STREAM = 0x1,
+  H2_FLAG_ACK = 0x1,
+  H2_FLAG_END_HEADERS = 0x4,
+  H2_FLAG_PADDED = 0x8,
+  H2_FLAG_PRIORITY = 0x20,
+};
+
+enum {
+  H2_NO_ERROR = 0x0,
+  H2_PROTOCOL_ERROR = 0x1,
+  H2_INTERNAL_ERROR = 0x2,
+  H2_FLOW_CONTROL_ERROR = 0x3,
+  H2_STREAM_CLOSED = 0x5,
+  H2_FRAME_SIZE_ERROR = 0x6,
+  H2_REFUSED_STREAM = 0x7,
+  H2_COMPRESSION_ERROR = 0x9,
+  H2_ENHANCE_YOUR_CALM = 0xb,
+  H2_HTTP_1_1_REQUIRED = 0xd,
+};
+
+enum {
+  H2_SETTINGS_ENABLE_PUSH = 0x2,
+  H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+  H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+#define HPACK_ENTRY(name, value) {name, sizeof(name) - 1, value, sizeof(value) - 1}
+
+// RFC 7541 Appendix A; index 1 on the wire is element 0.
+static const struct {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+} hpack_static[61] = {
+    HPACK_ENTRY(":authority", ""),
+    HPACK_ENTRY(":method", "GET"),
+    HPACK_ENTRY(":method", "POST"),
+    HPACK_ENTRY(":path", "/"),
+    HPACK_ENTRY(":path", "/index.html"),
+    HPACK_ENTRY(":scheme", "http"),
+    HPACK_ENTRY(":scheme", "https"),
+    HPACK_ENTRY(":status", "200"),
+    HPACK_ENTRY(":status", "204"),
+    HPACK_ENTRY(":status", "206"),
+    HPACK_ENTRY(":status", "304"),
+    HPACK_ENTRY(":status", "400"),
+    HPACK_ENTRY(":status", "404"),
+    HPACK_ENTRY(":status", "500"),
+    HPACK_ENTRY("accept-charset", ""),
+    HPACK_ENTRY("accept-encoding", "gzip, deflate"),
+    HPACK_ENTRY("accept-language", ""),
+    HPACK_ENTRY("accept-ranges", ""),
+    HPACK_ENTRY("accept", ""),
+    HPACK_ENTRY("access-control-allow-origin", ""),
+    HPACK_ENTRY("age", ""),
+    HPACK_ENTRY("allow", ""),
+    HPACK_ENTRY("authorization", ""),
+    HPACK_ENTRY("cache-control", ""),
+    HPACK_ENTRY("content-disposition", ""),
+    HPACK_ENTRY("content-encoding", ""),
+    HPACK_ENTRY("content-language", ""),
+    HPACK_ENTRY("content-length", ""),
+    HPACK_ENTRY("content-location", ""),
+    HPACK_ENTRY("content-range", ""),
+    HPACK_ENTRY("content-type", ""),
+    HPACK_ENTRY("cookie", ""),
+    HPACK_ENTRY("date", ""),
+    HPACK_ENTRY("etag", ""),
+    HPACK_ENTRY("expect", ""),
+    HPACK_ENTRY("expires", ""),
+    HPACK_ENTRY("from", ""),
+    HPACK_ENTRY("host", ""),
+    HPACK_ENTRY("if-match", ""),
+    HPACK_ENTRY("if-modified-since", ""),
+    HPACK_ENTRY("if-none-match", ""),
+    HPACK_ENTRY("if-range", ""),
+    HPACK_ENTRY("if-unmodified-since", ""),
+    HPACK_ENTRY("last-modified", ""),
+    HPACK_ENTRY("link", ""),
+    HPACK_ENTRY("location", ""),
+    HPACK_ENTRY("max-forwards", ""),
+    HPACK_ENTRY("proxy-authenticate", ""),
+    HPACK_ENTRY("proxy-authorization", ""),
+    HPACK_ENTRY("range", ""),
+    HPACK_ENTRY("referer", ""),
+    HPACK_ENTRY("refresh", ""),
+    HPACK_ENTRY("retry-after", ""),
+    HPACK_ENTRY("server", ""),
+    HPACK_ENTRY("set-cookie", ""),
+    HPACK_ENTRY("strict-transport-security", ""),
+    HPACK_ENTRY("transfer-encoding", ""),
+    HPACK_ENTRY("user-agent", ""),
+    HPACK_ENTRY("vary", ""),
+    HPACK_ENTRY("via", ""),
+    HPACK_ENTRY("www-authenticate", ""),
+};
+
+// Code length of every symbol of the HPACK Huffman code (RFC 7541
+// Appendix B), EOS last. The code is canonical, so the lengths alone
+// rebuild it.
+static const uint8_t hpack_huffman_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28,
+    28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6,  10, 10, 12,
+    13, 6,  8,  11, 10, 10, 8,  11, 8,  6,  6,  6,  5,  5,  5,  6,  6,  6,
+    6,  6,  6,  6,  7,  8,  15, 6,  12, 10, 13, 6,  7,  7,  7,  7,  7,  7,
+    7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,
+    8,  13, 19, 13, 14, 6,  15, 5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,
+    6,  6,  6,  5,  6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7,  15, 11, 14,
+    13, 28, 20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21,
+    20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21,
+    23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26, 26, 20, 19, 22, 23,
+    22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24,
+    21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22,
+    25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27,
+    27, 27, 27, 26, 30,
+};
+
+// Codes of length n run from huffman_first[n] for huffman_count[n] values
+// and stand, in order, for huffman_symbols[huffman_offset[n]...].
+static uint32_t huffman_first[31];
+static uint16_t huffman_count[31];
+static uint16_t huffman_offset[31];
+static uint16_t huffman_symbols[257];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init(void) {
+  for (int sym = 0; sym < 257; sym++)
+    huffman_count[hpack_huffman_len[sym]]++;
+
+  uint32_t code = 0;
+  uint16_t offset = 0;
+  uint16_t fill[31];
+  for (int n = 1; n <= 30; n++) {
+    huffman_first[n] = code;
+    huffman_offset[n] = offset;
+    fill[n] = offset;
+    code = (code + huffman_count[n]) << 1;
+    offset = (uint16_t)(offset + huffman_count[n]);
+  }
+  for (int sym = 0; sym < 257; sym++)
+    huffman_symbols[fill[hpack_huffman_len[sym]]++] = (uint16_t)sym;
+}
+
+// Decodes a Huffman-coded string into out, which needs room for
+// len * 8 / 5 bytes. Returns the decoded length, or -1 for an EOS symbol or
+// padding that is not a short run of ones.
+static ssize_t huffman_decode(const byte *in, size_t len, char *out) {
+  pthread_once(&huffman_once, huffman_init);
+  uint64_t acc = 0;
+  unsigned bits = 0;
+  size_t i = 0;
+  size_t o = 0;
+
+  for (;;) {
+    while (bits <= 56 && i < len) {
+      acc = acc << 8 | in[i++];
+      bits += 8;
+    }
+
+    // Canonical codes: the first length whose code falls inside that
+    // length's range is the symbol's.
+    unsigned n = 5;
+    uint32_t code = 0;
+    for (; n <= bits; n++) {
+      code = (uint32_t)(acc >> (bits - n)) & ((1u << n) - 1);
+      if (code - huffman_first[n] < huffman_count[n])
+        break;
+    }
+    if (n > bits) {
+      uint32_t pad = (1u << bits) - 1;
+      if (bits > 7 || (acc & pad) != pad)
+        return -1;
+      return (ssize_t)o;
+    }
+
+    uint16_t sym = huffman_symbols[huffman_offset[n] + code - huffman_first[n]];
+    if (sym == 256)
+      return -1;
+    out[o++] = (char)sym;
+    bits -= n;
+  }
+}
+
+// Reads an integer with an n-bit prefix. Values past 32 bits are refused.
+static bool hpack_int(const byte **p, const byte *end, unsigned prefix,
+                      uint32_t *out) {
+  if (*p >= end)
+    return false;
+  uint32_t max = (1u << prefix) - 1;
+  uint64_t v = *(*p)++ & max;
+  if (v < max) {
+    *out = (uint32_t)v;
+    return true;
+  }
+
+  for (unsigned shift = 0; shift < 35; shift += 7) {
+    if (*p >= end)
+      return false;
+    byte b = *(*p)++;
+    v += (uint64_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      if (v > UINT32_MAX)
+        return false;
+      *out = (uint32_t)v;
+      return true;
+    }
+  }
+  return false;
+}
+
+struct HpackEntry {
+  size_t name_len;
+  size_t value_len;
+  // name, NUL, value, NUL.
+  char data[];
+};
+
+// Every entry costs at least 32 bytes, so the ring never needs more slots.
+#define HPACK_TABLE_SLOTS (HPACK_TABLE_SIZE / 32)
+
+// The peer's dynamic table as the decoder sees it: a ring with the newest
+// entry at slots[newest], plus scratch space for decoded literals.
+struct HpackDecoder {
+  struct HpackEntry *slots[HPACK_TABLE_SLOTS];
+  size_t newest;
+  size_t len;
+  size_t size;
+  size_t max_size;
+  char *scratch;
+  size_t scratch_cap;
+};
+
+static size_t hpack_entry_size(const struct HpackEntry *e) {
+  return e->name_len + e->value_len + 32;
+}
+
+static void hpack_evict(struct HpackDecoder *d, size_t limit) {
+  while (d->size > limit) {
+    size_t oldest = (d->newest + HPACK_TABLE_SLOTS - (d->len - 1)) %
+                    HPACK_TABLE_SLOTS;
+    d->size -= hpack_entry_size(d->slots[oldest]);
+    free(d->slots[oldest]);
+    d->slots[oldest] = NULL;
+    d->len--;
+  }
+}
+
+// Takes e over. An entry larger than the whole table empties it and is
+// dropped.
+static void hpack_insert(struct HpackDecoder *d, struct HpackEntry *e) {
+  size_t size = hpack_entry_size(e);
+  if (size > d->max_size) {
+    hpack_evict(d, 0);
+    free(e);
+    return;
+  }
+  hpack_evict(d, d->max_size - size);
+  d->newest = (d->newest + 1) % HPACK_TABLE_SLOTS;
+  d->slots[d->newest] = e;
+  d->len++;
+  d->size += size;
+}
+
+static bool hpack_lookup(const struct HpackDecoder *d, uint32_t index,
+                         const char **name, size_t *name_len,
+                         const char **value, size_t *value_len) {
+  if (index == 0)
+    return false;
+  if (index <= 61) {
+    *name = hpack_static[index - 1].name;
+    *name_len = hpack_static[index - 1].name_len;
+    *value = hpack_static[index - 1].value;
+    *value_len = hpack_static[index - 1].value_len;
+    return true;
+  }
+  if (index - 62 >= d->len)
+    return false;
+  const struct HpackEntry *e =
+      d->slots[(d->newest + HPACK_TABLE_SLOTS - (index - 62)) %
+               HPACK_TABLE_SLOTS];
+  *name = e->data;
+  *name_len = e->name_len;
+  *value = e->data + e->name_len + 1;
+  *value_len = e->value_len;
+  return true;
+}
+
+// Reads a string literal into the scratch space at *off, NUL-terminated,
+// and moves *off past it. Offsets rather than pointers, since the scratch
+// may move while a field's second literal is decoded.
+static bool hpack_string(struct HpackDecoder *d, const byte **p,
+                         const byte *end, size_t *off, size_t *len) {
+  if (*p >= end)
+    return false;
+  bool huffman = (**p & 0x80) != 0;
+  uint32_t n = 0;
+  if (!hpack_int(p, end, 7, &n) || (size_t)(end - *p) < n)
+    return false;
+
+  size_t need = *off + (huffman ? (size_t)n * 8 / 5 : n) + 1;
+  if (need > d->scratch_cap) {
+    size_t cap = d->scratch_cap ? d->scratch_cap : 256;
+    while (cap < need)
+      cap *= 2;
+    char *next = (char *)realloc(d->scratch, cap);
+    if (next == NULL)
+      return false;
+    d->scratch = next;
+    d->scratch_cap = cap;
+  }
+
+  char *dst = d->scratch + *off;
+  if (huffman) {
+    ssize_t decoded = huffman_decode(*p, n, dst);
+    if (decoded < 0)
+      return false;
+    *len = (size_t)decoded;
+  } else {
+    memcpy(dst, *p, n);
+    *len = n;
+  }
+  dst[*len] = '\0';
+  *p += n;
+  *off += *len + 1;
+  return true;
+}
+
+// Receives each decoded field. Names and values are NUL-terminated and
+// only valid for the duration of the call.
+typedef void (*hpack_field_fn)(void *ctx, const char *name, size_t name_len,
+                               const char *value, size_t value_len);
+
+// Decodes a complete header block, calling fn for each field in order.
+// Returns false on a compression error, after which the table no longer
+// matches the peer's and the connection has to go.
+static bool hpack_decode(struct HpackDecoder *d, const byte *p, size_t len,
+                         hpack_field_fn fn, void *ctx) {
+  const byte *end = p + len;
+  bool fields = false;
+
+  while (p < end) {
+    byte b = *p;
+    uint32_t index = 0;
+    const char *name = NULL;
+    const char *value = NULL;
+    size_t name_len = 0;
+    size_t value_len = 0;
+
+    if ((b & 0xE0) == 0x20) {
+      // Table size updates may only open a block.
+      if (fields || !hpack_int(&p, end, 5, &index) ||
+          index > HPACK_TABLE_SIZE)
+        return false;
+      d->max_size = index;
+      hpack_evict(d, index);
+      continue;
+    }
+    fields = true;
+
+    if (b & 0x80) {
+      if (!hpack_int(&p, end, 7, &index) ||
+          !hpack_lookup(d, index, &name, &name_len, &value, &value_len))
+        return false;
+      fn(ctx, name, name_len, value, value_len);
+      continue;
+    }
+
+    // Literals: with incremental indexing (01), without (0000) or never
+    // indexed (0001).
+    bool indexing = (b & 0x40) != 0;
+    size_t off = 0;
+    if (!hpack_int(&p, end, indexing ? 6 : 4, &index))
+      return false;
+    if (index != 0) {
+      if (!hpack_lookup(d, index, &name, &name_len, &value, &value_len))
+        return false;
+    } else if (!hpack_string(d, &p, end, &off, &name_len)) {
+      return false;
+    }
+    size_t value_off = off;
+    if (!hpack_string(d, &p, end, &off, &value_len))
+      return false;
+    if (index == 0)
+      name = d->scratch;
+    value = d->scratch + value_off;
+
+    if (!indexing) {
+      fn(ctx, name, name_len, value, value_len);
+      continue;
+    }
+
+    // Copied before inserting: the name may belong to an entry the
+    // insertion evicts.
+    struct HpackEntry *e = (struct HpackEntry *)malloc(
+        sizeof(*e) + name_len + value_len + 2);
+    if (e == NULL)
+      return false;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    memcpy(e->data, name, name_len + 1);
+    memcpy(e->data + name_len + 1, value, value_len + 1);
+    fn(ctx, e->data, name_len, e->data + name_len + 1, value_len);
+    hpack_insert(d, e);
+  }
+  return true;
+}
+
+static void hpack_decoder_clear(struct HpackDecoder *d) {
+  hpack_evict(d, 0);
+  free(d->scratch);
+  d->scratch = NULL;
+  d->scratch_cap = 0;
+}
+
+// Callers reserve first; an integer takes at most 10 bytes.
+static void hpack_put_int(struct OutBuf *b, byte first, unsigned prefix,
+                          size_t v) {
+  size_t max = ((size_t)1 << prefix) - 1;
+  if (v < max) {
+    b->data[b->len++] = (byte)(first | v);
+    return;
+  }
+  b->data[b->len++] = (byte)(first | max);
+  v -= max;
+  while (v >= 128) {
+    b->data[b->len++] = (byte)(0x80 | (v & 0x7F));
+    v >>= 7;
+  }
+  b->data[b->len++] = (byte)v;
+}
+
+// Static-table index of a regular header name, or 0.
+static size_t hpack_static_name(const char *name, size_t len) {
+  for (size_t i = 14; i < 61; i++) {
+    if (hpack_static[i].name_len == len &&
+        strncasecmp(hpack_static[i].name, name, len) == 0)
+      return i + 1;
+  }
+  return 0;
+}
+
+// Appends a field as a literal the peer does not index, naming it by
+// static index where one exists. The encoder never touches the peer's
+// dynamic table, so its size settings never concern us. Names go out
+// lowercased, as HTTP/2 requires.
+static bool hpack_put_field(struct OutBuf *b, const char *name,
+                            size_t name_len, const char *value,
+                            size_t value_len) {
+  if (!outbuf_reserve(b, name_len + value_len + 30))
+    return false;
+  size_t index = hpack_static_name(name, name_len);
+  hpack_put_int(b, 0x00, 4, index);
+  if (index == 0) {
+    hpack_put_int(b, 0x00, 7, name_len);
+    for (size_t i = 0; i < name_len; i++) {
+      char c = name[i];
+      b->data[b->len++] = (byte)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+  }
+  hpack_put_int(b, 0x00, 7, value_len);
+  outbuf_put(b, value, value_len);
+  return true;
+}
+
+static bool hpack_put_status(struct OutBuf *b, uint16_t status) {
+  // Static entries 8 through 14.
+  static const uint16_t indexed[] = {200, 204, 206, 304, 400, 404, 500};
+  if (!outbuf_reserve(b, 5))
+    return false;
+  for (size_t i = 0; i < sizeof(indexed) / sizeof(indexed[0]); i++) {
+    if (indexed[i] == status) {
+      b->data[b->len++] = (byte)(0x80 | (8 + i));
+      return true;
+    }
+  }
+  byte literal[5] = {0x08, 3, (byte)('0' + status / 100),
+                     (byte)('0' + status / 10 % 10), (byte)('0' + status % 10)};
+  outbuf_put(b, literal, sizeof(literal));
+  return true;
+}
+
+// Connection-specific fields make an HTTP/2 message malformed; responses
+// drop them and requests carrying them are refused.
+static bool h2_connection_field(const char *name, size_t len) {
+  return (len == 10 && (strncasecmp(name, "connection", 10) == 0 ||
+                        strncasecmp(name, "keep-alive", 10) == 0)) ||
+         (len == 7 && strncasecmp(name, "upgrade", 7) == 0) ||
+         (len == 16 && strncasecmp(name, "proxy-connection", 16) == 0) ||
+         (len == 17 && strncasecmp(name, "transfer-encoding", 17) == 0);
+}
+
+static bool h2_put_date(struct OutBuf *b, bool own_server) {
+  (void)date_block_for(own_server);
+  // The value between "Date: " and the CRLF.
+  if (!hpack_put_field(b, "date", 4, date_block + 6, date_line_len - 8))
+    return false;
+  return own_server || hpack_put_field(b, "server", 6, SERVER_VERSION,
+                                       sizeof(SERVER_VERSION) - 1);
+}
+
+// The header block for res: the same fields append_response_fields writes
+// for HTTP/1, less the connection-specific ones.
+static bool h2_encode_response(const http_response *res, uint16_t status,
+                               struct OutBuf *b) {
+  bool has_length = false;
+  bool own_server = false;
+  if (!hpack_put_status(b, status))
+    return false;
+
+  for (size_t i = 0; i < res->headers_len; i++) {
+    const header *h = &res->headers[i];
+    if (h->key == NULL || h->value == NULL ||
+        h2_connection_field(h->key, h->key_len))
+      continue;
+    has_length = has_length || header_key_is(h, "Content-Length", 14);
+    own_server = own_server || header_key_is(h, "Server", 6);
+    if (!hpack_put_field(b, h->key, h->key_len, h->value, h->value_len))
+      return false;
+  }
+  for (size_t i = 0; i < res->cookies_len; i++) {
+    size_t name_len = strlen(res->cookies[i].name);
+    size_t value_len = strlen(res->cookies[i].value);
+    if (!outbuf_reserve(b, name_len + value_len + 12))
+      return false;
+    hpack_put_int(b, 0x00, 4, 55);
+    hpack_put_int(b, 0x00, 7, name_len + 1 + value_len);
+    outbuf_put(b, res->cookies[i].name, name_len);
+    outbuf_put(b, "=", 1);
+    outbuf_put(b, res->cookies[i].value, value_len);
+  }
+
+  if (!has_length && res->producer == NULL && status >= 200 &&
+      status != 204 && status != 304) {
+    char digits[20];
+    size_t n = format_u64(digits, res->content_length);
+    if (!hpack_put_field(b, "content-length", 14, digits, n))
+      return false;
+  }
+  return h2_put_date(b, own_server);
+}
+
+struct H2Stream {
+  uint32_t id;
+  http_request *req;
+
+  // Routing, settled once the request headers are in. The router stays
+  // pinned until the stream is freed.
+  const struct VHost *vhost;
+  ExpressRouter *router;
+  struct Route *route;
+  const struct MethodRoute *stream;
+  http_response stream_res;
+  bool stream_started;
+  size_t body_limit;
+  // Content-Length the request announced, or SIZE_MAX.
+  size_t expected_len;
+  size_t body_seen;
+
+  // Request body, buffered unless a streaming route takes it.
+  byte *body;
+  size_t body_len;
+  size_t body_cap;
+  bool remote_closed;
+
+  // Response body not yet framed: bytes from out_off on, or a producer.
+  // out is borrowed from the response until the stream outlives it.
+  int64_t send_window;
+  bool sending;
+  byte *out;
+  size_t out_len;
+  size_t out_off;
+  bool out_owned;
+  response_producer producer;
+  void *producer_ctx;
+};
+
+struct H2Session {
+  ExpressServer *server;
+  TCPConn *conn;
+  struct HTTPConn *http;
+  // Bytes of the client preface matched so far.
+  size_t preface_off;
+  struct HpackDecoder decoder;
+
+  struct H2Stream **streams;
+  size_t streams_len;
+  size_t streams_cap;
+  uint32_t last_stream_id;
+  // Stream whose handler is running, for responses sent preserialized.
+  struct H2Stream *current;
+
+  // A header block still waiting for CONTINUATION frames.
+  uint32_t block_stream;
+  bool block_end_stream;
+  byte *block;
+  size_t block_len;
+  size_t block_cap;
+
+  int64_t send_window;
+  uint32_t peer_window;
+  // Connection window consumed by DATA and not yet handed back.
+  size_t recv_credit;
+  bool goaway;
+  bool failed;
+};
+
+static void h2_frame_head(byte out[9], size_t len, uint8_t type,
+                          uint8_t flags, uint32_t id) {
+  out[0] = (byte)(len >> 16);
+  out[1] = (byte)(len >> 8);
+  out[2] = (byte)len;
+  out[3] = type;
+  out[4] = flags;
+  out[5] = (byte)(id >> 24 & 0x7F);
+  out[6] = (byte)(id >> 16);
+  out[7] = (byte)(id >> 8);
+  out[8] = (byte)id;
+}
+
+static uint32_t read_u32(const byte *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static bool h2_send_frame(struct H2Session *h2, uint8_t type, uint8_t flags,
+                          uint32_t id, const void *payload, size_t len) {
+  byte head[9];
+  h2_frame_head(head, len, type, flags, id);
+  struct iovec iov[2] = {{head, 9}, {(void *)payload, len}};
+  if (conn_write_queued(h2->conn, iov, len != 0 ? 2 : 1))
+    return true;
+  h2->failed = true;
+  tcp_conn_close_now(h2->conn);
+  return false;
+}
+
+static void h2_send_u32(struct H2Session *h2, uint8_t type, uint32_t id,
+                        uint32_t v) {
+  byte payload[4] = {(byte)(v >> 24), (byte)(v >> 16), (byte)(v >> 8),
+                     (byte)v};
+  (void)h2_send_frame(h2, type, 0, id, payload, sizeof(payload));
+}
+
+// A connection error: GOAWAY, then the connection closes.
+static void h2_fail(struct H2Session *h2, uint32_t code) {
+  if (h2->failed)
+    return;
+  byte payload[8];
+  uint32_t last = h2->last_stream_id;
+  for (int i = 0; i < 4; i++) {
+    payload[i] = (byte)(last >> (24 - 8 * i));
+    payload[4 + i] = (byte)(code >> (24 - 8 * i));
+  }
+  (void)h2_send_frame(h2, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  h2->failed = true;
+  tcp_conn_close_after_write(h2->conn);
+}
+
+static struct H2Stream *h2_stream_find(const struct H2Session *h2,
+                                       uint32_t id) {
+  for (size_t i = h2->streams_len; i-- > 0;) {
+    if (h2->streams[i]->id == id)
+      return h2->streams[i];
+  }
+  return NULL;
+}
+
+static struct H2Stream *h2_stream_new(struct H2Session *h2, uint32_t id) {
+  if (h2->streams_len == h2->streams_cap) {
+    size_t cap = h2->streams_cap ? h2->streams_cap * 2 : 8;
+    struct H2Stream **next =
+        (struct H2Stream **)realloc(h2->streams, cap * sizeof(*next));
+    if (next == NULL)
+      return NULL;
+    h2->streams = next;
+    h2->streams_cap = cap;
+  }
+
+  struct H2Stream *st = (struct H2Stream *)calloc(1, sizeof(*st));
+  if (st == NULL)
+    return NULL;
+  st->req = (http_request *)calloc(1, sizeof(*st->req));
+  if (st->req == NULL) {
+    free(st);
+    return NULL;
+  }
+  st->id = id;
+  st->req->conn = h2->conn;
+  st->expected_len = SIZE_MAX;
+  st->send_window = h2->peer_window;
+  h2->streams[h2->streams_len++] = st;
+  return st;
+}
+
+static void h2_stream_free(struct H2Session *h2, struct H2Stream *st) {
+  for (size_t i = 0; i < h2->streams_len; i++) {
+    if (h2->streams[i] == st) {
+      h2->streams[i] = h2->streams[--h2->streams_len];
+      break;
+    }
+  }
+  if (h2->current == st)
+    h2->current = NULL;
+
+  if (st->stream_started && st->stream->on_body_chunk != NULL)
+    st->stream->on_body_chunk(h2->server->user_ctx, st->req, NULL, 0);
+  response_cleanup(&st->stream_res);
+  if (st->producer != NULL)
+    (void)st->producer(st->producer_ctx, NULL, 0);
+  if (st->router != NULL)
+    st->router->pins--;
+  http_request_cleanup(st->req);
+  free(st->body);
+  if (st->out_owned)
+    free(st->out);
+  free(st);
+}
+
+static void h2_stream_reset(struct H2Session *h2, struct H2Stream *st,
+                            uint32_t code) {
+  h2_send_u32(h2, H2_RST_STREAM, st->id, code);
+  h2_stream_free(h2, st);
+}
+
+// The response has ended. A client still sending its request body is
+// told to stop.
+static void h2_stream_done(struct H2Session *h2, struct H2Stream *st) {
+  if (!st->remote_closed)
+    h2_send_u32(h2, H2_RST_STREAM, st->id, H2_NO_ERROR);
+  h2_stream_free(h2, st);
+}
+
+// Sends the next DATA frame of st's response if the windows allow. Returns
+// 1 if a frame went out, 2 if it ended the stream, which is then freed, 0
+// if the windows are shut and -1 if the connection failed.
+static int32_t h2_stream_send_data(struct H2Session *h2, struct H2Stream *st) {
+  int64_t window =
+      h2->send_window < st->send_window ? h2->send_window : st->send_window;
+  size_t max = window <= 0 ? 0
+               : window < H2_FRAME_MAX ? (size_t)window
+                                       : H2_FRAME_MAX;
+  const byte *data = NULL;
+  size_t len = 0;
+  bool end = false;
+  byte buf[H2_FRAME_MAX];
+
+  if (st->producer == NULL) {
+    size_t left = st->out_len - st->out_off;
+    len = left < max ? left : max;
+    if (len == 0 && left != 0)
+      return 0;
+    data = st->out + st->out_off;
+    end = len == left;
+  } else {
+    if (max == 0)
+      return 0;
+    ssize_t n = st->producer(st->producer_ctx, buf, max);
+    if (n < 0) {
+      st->producer = NULL;
+      h2_stream_reset(h2, st, H2_INTERNAL_ERROR);
+      return h2->failed ? -1 : 2;
+    }
+    len = (size_t)n < max ? (size_t)n : max;
+    data = buf;
+    end = n == 0;
+    if (end)
+      st->producer = NULL;
+  }
+
+  if (!h2_send_frame(h2, H2_DATA, end ? H2_FLAG_END_STREAM : 0, st->id, data,
+                     len))
+    return -1;
+  h2->send_window -= (int64_t)len;
+  st->send_window -= (int64_t)len;
+  st->out_off += st->producer == NULL && !end ? len : 0;
+  if (!end)
+    return 1;
+  st->sending = false;
+  h2_stream_done(h2, st);
+  return 2;
+}
+
+// Frames pending response bodies a frame per stream per round, so
+// concurrent responses share the connection. Stops once every stream is
+// finished or shut by flow control, or when output backs up; the drain
+// callback resumes it then.
+static void h2_flush(struct H2Session *h2) {
+  bool progress = true;
+  while (progress && !h2->failed) {
+    progress = false;
+    for (size_t i = 0; i < h2->streams_len;) {
+      struct H2Stream *st = h2->streams[i];
+      if (!st->sending) {
+        i++;
+        continue;
+      }
+      if (tcp_conn_pending(h2->conn) >= H2_SEND_QUEUE) {
+        tcp_conn_want_drain(h2->conn);
+        return;
+      }
+      int32_t sent = h2_stream_send_data(h2, st);
+      if (sent < 0)
+        return;
+      progress = progress || sent > 0;
+      // A finished stream was swapped out for the last one.
+      if (sent != 2)
+        i++;
+    }
+  }
+  if (h2->goaway && h2->streams_len == 0)
+    tcp_conn_close_after_write(h2->conn);
+}
+
+// Frames a header block as HEADERS plus as many CONTINUATION frames as it
+// takes.
+static bool h2_send_headers(struct H2Session *h2, uint32_t id,
+                            const byte *block, size_t len, bool end_stream) {
+  uint8_t type = H2_HEADERS;
+  uint8_t flags = end_stream ? H2_FLAG_END_STREAM : 0;
+  do {
+    size_t n = len < H2_FRAME_MAX ? len : H2_FRAME_MAX;
+    if (n == len)
+      flags |= H2_FLAG_END_HEADERS;
+    if (!h2_send_frame(h2, type, flags, id, block, n))
+      return false;
+    block += n;
+    len -= n;
+    type = H2_CONTINUATION;
+    flags = 0;
+  } while (len > 0);
+  return true;
+}
+
+// Sends a response's header block and as much of body as the windows take
+// right away. The rest is copied unless owned is set, in which case body
+// is owned and handed to the stream.
+static void h2_send_response(struct H2Session *h2, struct H2Stream *st,
+                             const struct OutBuf *block, const byte *body,
+                             size_t len, bool owned) {
+  if (!h2_send_headers(h2, st->id, block->data, block->len, len == 0)) {
+    if (owned)
+      free((void *)body);
+    return;
+  }
+  if (len == 0) {
+    h2_stream_done(h2, st);
+    return;
+  }
+
+  st->out = (byte *)body;
+  st->out_len = len;
+  st->out_owned = owned;
+  st->sending = true;
+  int32_t sent = 1;
+  while (sent == 1 && tcp_conn_pending(h2->conn) < H2_SEND_QUEUE)
+    sent = h2_stream_send_data(h2, st);
+  if (sent == 2 || sent < 0 || st->out_owned)
+    return;
+
+  size_t left = st->out_len - st->out_off;
+  byte *copy = (byte *)malloc(left);
+  if (copy == NULL) {
+    st->sending = false;
+    h2_stream_reset(h2, st, H2_INTERNAL_ERROR);
+    return;
+  }
+  memcpy(copy, st->out + st->out_off, left);
+  st->out = copy;
+  st->out_len = left;
+  st->out_off = 0;
+  st->out_owned = true;
+}
+
+// Answers a stream with the response a handler built. A static file body
+// is taken over from *static_body instead of copied.
+static void h2_respond(struct H2Session *h2, struct H2Stream *st,
+                       http_response *res, byte **static_body) {
+  uint16_t status = response_status(res);
+  // Upgrades and SSE subscriptions hold an HTTP/1.1 connection.
+  if (status < 200 || res->producer == sse_body) {
+    h2_stream_reset(h2, st, H2_HTTP_1_1_REQUIRED);
+    return;
+  }
+
+  byte stack[4096];
+  struct OutBuf block;
+  outbuf_init(&block, stack, sizeof(stack));
+  if (!h2_encode_response(res, status, &block)) {
+    outbuf_release(&block);
+    h2_stream_reset(h2, st, H2_INTERNAL_ERROR);
+    return;
+  }
+
+  bool omit_body = request_is_head(st->req) || !status_allows_body(status);
+  if (!omit_body && res->producer != NULL) {
+    st->producer = res->producer;
+    st->producer_ctx = res->producer_ctx;
+    res->producer = NULL;
+    st->sending = true;
+    if (!h2_send_headers(h2, st->id, block.data, block.len, false))
+      st->sending = false;
+    outbuf_release(&block);
+    return;
+  }
+
+  // DATA frames are cut from one buffer, so segments are joined here.
+  if (!omit_body && res->segments_len != 0) {
+    byte *flat = (byte *)malloc(res->content_length);
+    if (flat == NULL) {
+      outbuf_release(&block);
+      h2_stream_reset(h2, st, H2_INTERNAL_ERROR);
+      return;
+    }
+    response_gather(res, flat);
+    h2_send_response(h2, st, &block, flat, res->content_length, true);
+    outbuf_release(&block);
+    return;
+  }
+
+  size_t len = omit_body || res->body == NULL ? 0 : res->content_length;
+  bool owned = len != 0 && static_body != NULL && *static_body == res->body;
+  if (owned)
+    *static_body = NULL;
+  h2_send_response(h2, st, &block, res->body, len, owned);
+  outbuf_release(&block);
+}
+
+static void h2_reject(struct H2Session *h2, struct H2Stream *st,
+                      const char *status_code, const char *body) {
+  http_response res = response_default();
+  response_set_static(&res, status_code, body);
+  h2_respond(h2, st, &res, NULL);
+  response_cleanup(&res);
+}
+
+static bool h2_send_preserialized(struct H2Session *h2, const void *head,
+                                  size_t head_len, const void *tail,
+                                  size_t tail_len, bool own_server) {
+  struct H2Stream *st = h2->current;
+  if (st == NULL)
+    return false;
+
+  // head is " NNN Reason\r\n" and then "Name: value\r\n" fields.
+  const char *p = (const char *)head;
+  const char *end = p + head_len;
+  while (p < end && *p == ' ')
+    p++;
+  uint16_t status = 0;
+  if (end - p < 3 || !parse_http_status_code((char[]){p[0], p[1], p[2], '\0'},
+                                             &status))
+    return false;
+
+  byte stack[4096];
+  struct OutBuf block;
+  outbuf_init(&block, stack, sizeof(stack));
+  bool ok = hpack_put_status(&block, status);
+  p = memchr(p, '\n', (size_t)(end - p));
+  for (p = p != NULL ? p + 1 : end; ok && p < end;) {
+    const char *eol = memchr(p, '\r', (size_t)(end - p));
+    const char *colon = memchr(p, ':', (size_t)(end - p));
+    if (eol == NULL || colon == NULL || colon > eol)
+      break;
+    size_t name_len = (size_t)(colon - p);
+    const char *value = colon + 2;
+    bool skip = h2_connection_field(p, name_len) ||
+                ((status == 204 || status == 304) && name_len == 14 &&
+                 strncasecmp(p, "content-length", 14) == 0);
+    if (!skip)
+      ok = hpack_put_field(&block, p, name_len, value,
+                           (size_t)(eol - value));
+    p = eol + 2;
+  }
+  ok = ok && h2_put_date(&block, own_server);
+  if (!ok) {
+    outbuf_release(&block);
+    return false;
+  }
+
+  // tail is the blank line and the body.
+  h2_send_response(h2, st, &block, (const byte *)tail + 2, tail_len - 2,
+                   false);
+  outbuf_release(&block);
+  return !h2->failed;
+}
+
+// What a request header block decodes into.
+struct H2Fields {
+  http_request *req;
+  bool trailers;
+  bool regular;
+  bool have_method;
+  bool have_path;
+  bool have_scheme;
+  bool have_authority;
+  header *cookie;
+  size_t expected_len;
+  // malformed resets the stream; bad answers it with 400.
+  bool malformed;
+  bool bad;
+};
+
+static header *h2_add_header(http_request *req, const char *name,
+                             size_t name_len, const char *value,
+                             size_t value_len) {
+  if (req->headers_len >= MAX_HEADERS)
+    return NULL;
+  char *key = (char *)malloc(name_len + 1);
+  char *val = (char *)malloc(value_len + 1);
+  if (key == NULL || val == NULL) {
+    free(key);
+    free(val);
+    return NULL;
+  }
+  memcpy(key, name, name_len + 1);
+  memcpy(val, value, value_len + 1);
+
+  header *h = &req->headers[req->headers_len++];
+  h->key = key;
+  h->value = val;
+  h->key_len = name_len;
+  h->value_len = value_len;
+  return h;
+}
+
+static bool h2_name_is(const char *name, size_t len, const char *expect) {
+  return strlen(expect) == len && memcmp(name, expect, len) == 0;
+}
+
+static void h2_request_field(void *ctx, const char *name, size_t name_len,
+                             const char *value, size_t value_len) {
+  struct H2Fields *f = (struct H2Fields *)ctx;
+  http_request *req = f->req;
+  if (f->malformed || f->bad)
+    return;
+  if (name_len == 0) {
+    f->malformed = true;
+    return;
+  }
+  for (size_t i = 0; i < name_len; i++) {
+    if (name[i] >= 'A' && name[i] <= 'Z') {
+      f->malformed = true;
+      return;
+    }
+  }
+
+  if (name[0] == ':') {
+    if (f->regular || f->trailers) {
+      f->malformed = true;
+    } else if (h2_name_is(name, name_len, ":method")) {
+      f->malformed = f->have_method || value_len == 0 ||
+                     value_len >= sizeof(req->method);
+      if (!f->malformed)
+        memcpy(req->method, value, value_len + 1);
+      f->have_method = true;
+    } else if (h2_name_is(name, name_len, ":path")) {
+      f->malformed = f->have_path || value_len == 0;
+      if (value_len >= sizeof(req->route))
+        f->bad = true;
+      else if (!f->malformed)
+        memcpy(req->route, value, value_len + 1);
+      f->have_path = true;
+    } else if (h2_name_is(name, name_len, ":scheme")) {
+      f->malformed = f->have_scheme;
+      f->have_scheme = true;
+    } else if (h2_name_is(name, name_len, ":authority")) {
+      // Stands in for Host, which handlers and virtual hosts look at.
+      f->malformed = f->have_authority;
+      f->have_authority = true;
+      header *h = f->malformed ? NULL
+                               : h2_add_header(req, "host", 4, value,
+                                               value_len);
+      if (h != NULL)
+        req->host = h->value;
+      f->bad = f->bad || (!f->malformed && h == NULL);
+    } else {
+      f->malformed = true;
+    }
+    return;
+  }
+
+  f->regular = true;
+  if (h2_connection_field(name, name_len) ||
+      (h2_name_is(name, name_len, "te") && strcmp(value, "trailers") != 0)) {
+    f->malformed = true;
+    return;
+  }
+  if (f->trailers) {
+    f->bad = h2_add_header(req, name, name_len, value, value_len) == NULL;
+    return;
+  }
+  if (h2_name_is(name, name_len, "host") && f->have_authority)
+    return;
+
+  // Cookie crumbs split for compression are joined again for HTTP/1
+  // semantics.
+  if (h2_name_is(name, name_len, "cookie") && f->cookie != NULL) {
+    size_t len = f->cookie->value_len + 2 + value_len;
+    char *joined = (char *)realloc(f->cookie->value, len + 1);
+    if (joined == NULL) {
+      f->bad = true;
+      return;
+    }
+    memcpy(joined + f->cookie->value_len, "; ", 2);
+    memcpy(joined + f->cookie->value_len + 2, value, value_len + 1);
+    f->cookie->value = joined;
+    f->cookie->value_len = len;
+    return;
+  }
+
+  header *h = h2_add_header(req, name, name_len, value, value_len);
+  if (h == NULL) {
+    f->bad = true;
+    return;
+  }
+  if (h2_name_is(name, name_len, "host")) {
+    req->host = h->value;
+  } else if (h2_name_is(name, name_len, "content-type")) {
+    req->content_type = h->value;
+  } else if (h2_name_is(name, name_len, "cookie")) {
+    f->cookie = h;
+  } else if (h2_name_is(name, name_len, "content-length")) {
+    f->malformed = f->expected_len != SIZE_MAX ||
+                   !parse_content_length_value(h->value, &f->expected_len);
+  }
+}
+
+// Keeps the decoder in step for blocks whose stream is not served.
+static void h2_ignore_field(void *ctx, const char *name, size_t name_len,
+                            const char *value, size_t value_len) {
+  (void)ctx;
+  (void)name;
+  (void)name_len;
+  (void)value;
+  (void)value_len;
+}
+
+// Runs the middleware and header handler of a streaming route before any
+// body arrives. Returns false if they already answered the stream.
+static bool h2_stream_start(struct H2Session *h2, struct H2Stream *st) {
+  ExpressServer *s = h2->server;
+  st->stream_res = response_default();
+  st->stream_started = true;
+  if (run_middleware(st->route->chain, st->route->chain_len, s->user_ctx,
+                     st->req, &st->stream_res) &&
+      st->stream->handler != NULL)
+    st->stream->handler(s->user_ctx, st->req, &st->stream_res);
+
+  if (!st->stream_res.finished && st->stream_res.status_code[0] < '4')
+    return true;
+
+  http_response res = st->stream_res;
+  memset(&st->stream_res, 0, sizeof(st->stream_res));
+  st->stream_started = false;
+  h2_respond(h2, st, &res, NULL);
+  response_cleanup(&res);
+  return false;
+}
+
+// The request is complete: dispatch it and send what the handler built.
+static void h2_request_end(struct H2Session *h2, struct H2Stream *st) {
+  ExpressServer *s = h2->server;
+  http_request *req = st->req;
+  if (st->expected_len != SIZE_MAX && st->expected_len != st->body_seen) {
+    h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  http_response res;
+  byte *static_body = NULL;
+  int32_t sent = 0;
+  h2->current = st;
+  if (st->stream != NULL) {
+    req->content_length = st->body_seen;
+    req->body = NULL;
+    res = st->stream_res;
+    memset(&st->stream_res, 0, sizeof(st->stream_res));
+    st->stream_started = false;
+    if (st->stream->on_body_end != NULL)
+      st->stream->on_body_end(s->user_ctx, req, &res);
+    s->total_requests++;
+  } else {
+    req->content_length = st->body_len;
+    req->body = st->body_len == 0 ? NULL : st->body;
+    res = response_default();
+    sent = dispatch_request(s, h2->conn, st->vhost, st->router, st->route,
+                            req, &res, &static_body, &h2->http->arena);
+  }
+
+  if (sent == 0)
+    h2_respond(h2, st, &res, &static_body);
+  else if (sent < 0 && !h2->failed)
+    h2_fail(h2, H2_INTERNAL_ERROR);
+  h2->current = NULL;
+  free(static_body);
+  response_cleanup(&res);
+  arena_reset(&h2->http->arena);
+}
+
+// Routes a stream whose request headers are in. Returns false if the
+// stream was answered or reset on the spot.
+static bool h2_request_start(struct H2Session *h2, struct H2Stream *st,
+                             const struct H2Fields *f) {
+  ExpressServer *s = h2->server;
+  http_request *req = st->req;
+  if (f->malformed || !f->have_method || !f->have_path || !f->have_scheme) {
+    h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+    return false;
+  }
+
+  memcpy(req->version, "HTTP/2.0", 9);
+  char *q = strchr(req->route, '?');
+  if (q != NULL) {
+    *q = '\0';
+    req->query = q + 1;
+  }
+  if (f->bad || !canonicalize_path(req->route)) {
+    h2_reject(h2, st, "400", "Bad Request");
+    return false;
+  }
+
+  st->expected_len = f->expected_len;
+  st->vhost = server_find_vhost(s, req->host);
+  st->router = atomic_load_explicit(&st->vhost->router, memory_order_acquire);
+  st->router->pins++;
+  st->route = find_route(st->router, req);
+  st->stream = find_stream_route(st->route, req);
+  st->body_limit = s->max_body_size;
+  if (st->stream != NULL && st->stream->max_body_size != 0)
+    st->body_limit = st->stream->max_body_size;
+
+  if (st->expected_len != SIZE_MAX && st->expected_len > st->body_limit) {
+    h2_reject(h2, st, "413", "Content Too Large");
+    return false;
+  }
+  if (st->stream != NULL && !h2_stream_start(h2, st))
+    return false;
+  if (!st->remote_closed && request_expects_continue(req)) {
+    static const byte interim[] = {0x08, 3, '1', '0', '0'};
+    (void)h2_send_frame(h2, H2_HEADERS, H2_FLAG_END_HEADERS, st->id, interim,
+                        sizeof(interim));
+  }
+  return true;
+}
+
+static void h2_on_header_block(struct H2Session *h2, uint32_t id,
+                               const byte *block, size_t len,
+                               bool end_stream) {
+  struct H2Fields f;
+  memset(&f, 0, sizeof(f));
+  f.expected_len = SIZE_MAX;
+  struct H2Stream *st = h2_stream_find(h2, id);
+
+  if (st == NULL) {
+    if ((id & 1) == 0 || id <= h2->last_stream_id) {
+      h2_fail(h2, id <= h2->last_stream_id ? H2_STREAM_CLOSED
+                                           : H2_PROTOCOL_ERROR);
+      return;
+    }
+    h2->last_stream_id = id;
+    if (!h2->goaway && h2->streams_len < H2_MAX_STREAMS)
+      st = h2_stream_new(h2, id);
+    if (st == NULL) {
+      if (!hpack_decode(&h2->decoder, block, len, h2_ignore_field, NULL))
+        h2_fail(h2, H2_COMPRESSION_ERROR);
+      else
+        h2_send_u32(h2, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+      return;
+    }
+  } else if (st->remote_closed) {
+    if (!hpack_decode(&h2->decoder, block, len, h2_ignore_field, NULL))
+      h2_fail(h2, H2_COMPRESSION_ERROR);
+    else
+      h2_stream_reset(h2, st, H2_STREAM_CLOSED);
+    return;
+  } else {
+    // Trailers, which have to end the stream.
+    f.trailers = true;
+  }
+
+  f.req = st->req;
+  if (!hpack_decode(&h2->decoder, block, len, h2_request_field, &f)) {
+    h2_fail(h2, H2_COMPRESSION_ERROR);
+    return;
+  }
+  st->remote_closed = end_stream;
+
+  if (f.trailers) {
+    if (!end_stream || f.malformed)
+      h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+    else
+      h2_request_end(h2, st);
+    return;
+  }
+  if (h2_request_start(h2, st, &f) && end_stream)
+    h2_request_end(h2, st);
+}
+
+// frame_len is the whole payload, padding included, which is what the
+// stream's flow-control window was charged.
+static void h2_on_data(struct H2Session *h2, uint32_t id, uint8_t flags,
+                       const byte *data, size_t len, size_t frame_len) {
+  struct H2Stream *st = h2_stream_find(h2, id);
+  if (st == NULL) {
+    // A stream already answered or reset; the peer may not know yet.
+    if (id > h2->last_stream_id)
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+  if (st->remote_closed) {
+    h2_stream_reset(h2, st, H2_STREAM_CLOSED);
+    return;
+  }
+  if (len > st->body_limit - st->body_seen) {
+    h2_reject(h2, st, "413", "Content Too Large");
+    return;
+  }
+
+  st->body_seen += len;
+  if (st->stream != NULL) {
+    if (len > 0 && st->stream->on_body_chunk != NULL)
+      st->stream->on_body_chunk(h2->server->user_ctx, st->req, data, len);
+  } else if (len > 0) {
+    if (st->body_len + len > st->body_cap) {
+      size_t cap = st->body_cap ? st->body_cap : 1024;
+      while (cap < st->body_len + len)
+        cap *= 2;
+      byte *next = (byte *)realloc(st->body, cap);
+      if (next == NULL) {
+        h2_stream_reset(h2, st, H2_INTERNAL_ERROR);
+        return;
+      }
+      st->body = next;
+      st->body_cap = cap;
+    }
+    memcpy(st->body + st->body_len, data, len);
+    st->body_len += len;
+  }
+
+  if (flags & H2_FLAG_END_STREAM) {
+    st->remote_closed = true;
+    h2_request_end(h2, st);
+  } else if (frame_len > 0) {
+    h2_send_u32(h2, H2_WINDOW_UPDATE, id, (uint32_t)frame_len);
+  }
+}
+
+// Applies a SETTINGS payload. Returns 0 or the error code for GOAWAY.
+static uint32_t h2_apply_settings(struct H2Session *h2, const byte *p,
+                                  size_t len) {
+  for (size_t off = 0; off + 6 <= len; off += 6) {
+    uint16_t id = (uint16_t)(p[off] << 8 | p[off + 1]);
+    uint32_t value = read_u32(p + off + 2);
+    switch (id) {
+    case H2_SETTINGS_ENABLE_PUSH:
+      if (value > 1)
+        return H2_PROTOCOL_ERROR;
+      break;
+    case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+      if (value > H2_WINDOW_MAX)
+        return H2_FLOW_CONTROL_ERROR;
+      int64_t delta = (int64_t)value - h2->peer_window;
+      for (size_t i = 0; i < h2->streams_len; i++) {
+        h2->streams[i]->send_window += delta;
+        if (h2->streams[i]->send_window > H2_WINDOW_MAX)
+          return H2_FLOW_CONTROL_ERROR;
+      }
+      h2->peer_window = value;
+      break;
+    }
+    case H2_SETTINGS_MAX_FRAME_SIZE:
+      if (value < H2_FRAME_MAX || value > 0xFFFFFF)
+        return H2_PROTOCOL_ERROR;
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+static void h2_on_window_update(struct H2Session *h2, uint32_t id,
+                                uint32_t increment) {
+  if (id == 0) {
+    if (increment == 0) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    h2->send_window += increment;
+    if (h2->send_window > H2_WINDOW_MAX)
+      h2_fail(h2, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+
+  struct H2Stream *st = h2_stream_find(h2, id);
+  if (st == NULL)
+    return;
+  if (increment == 0) {
+    h2_stream_reset(h2, st, H2_PROTOCOL_ERROR);
+    return;
+  }
+  st->send_window += increment;
+  if (st->send_window > H2_WINDOW_MAX)
+    h2_stream_reset(h2, st, H2_FLOW_CONTROL_ERROR);
+}
+
+static void h2_frame(struct H2Session *h2, uint8_t type, uint8_t flags,
+                     uint32_t id, const byte *p, size_t len) {
+  if (h2->block_stream != 0 &&
+      (type != H2_CONTINUATION || id != h2->block_stream)) {
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  switch (type) {
+  case H2_DATA:
+  case H2_HEADERS: {
+    if (id == 0) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    // Padding and flow control cover the whole payload.
+    size_t frame_len = len;
+    if (type == H2_DATA)
+      h2->recv_credit += len;
+    if (flags & H2_FLAG_PADDED) {
+      if (len < 1 || p[0] >= len) {
+        h2_fail(h2, H2_PROTOCOL_ERROR);
+        return;
+      }
+      len -= 1 + (size_t)p[0];
+      p++;
+    }
+    if (type == H2_DATA) {
+      h2_on_data(h2, id, flags, p, len, frame_len);
+      return;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+      if (len < 5) {
+        h2_fail(h2, H2_FRAME_SIZE_ERROR);
+        return;
+      }
+      p += 5;
+      len -= 5;
+    }
+    bool end_stream = (flags & H2_FLAG_END_STREAM) != 0;
+    if (flags & H2_FLAG_END_HEADERS) {
+      h2_on_header_block(h2, id, p, len, end_stream);
+      return;
+    }
+    h2->block_stream = id;
+    h2->block_end_stream = end_stream;
+    h2->block_len = 0;
   }
-
-  if (!response_has_header(res, "Connection")) {
-    const char *connection_value = NULL;
-    if (close) {
-      connection_value = "close";
-    } else if (req != NULL && strcmp(req->version, "HTTP/1.0") == 0) {
-      connection_value = "keep-alive";
+    // fall through
+  case H2_CONTINUATION: {
+    if (h2->block_stream == 0) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
     }
-
-    if (connection_value != NULL) {
-      written =
-          snprintf(headers + header_offset, sizeof(headers) - header_offset,
-                   "Connection: %s\r\n", connection_value);
-      if (written < 0 || (size_t)written >= sizeof(headers) - header_offset)
-        return false;
-      header_offset += (size_t)written;
+    if (len > H2_HEADER_BLOCK_MAX - h2->block_len) {
+      h2_fail(h2, H2_ENHANCE_YOUR_CALM);
+      return;
+    }
+    if (h2->block_len + len > h2->block_cap) {
+      size_t cap = h2->block_cap ? h2->block_cap : 4096;
+      while (cap < h2->block_len + len)
+        cap *= 2;
+      byte *next = (byte *)realloc(h2->block, cap);
+      if (next == NULL) {
+        h2_fail(h2, H2_INTERNAL_ERROR);
+        return;
+      }
+      h2->block = next;
+      h2->block_cap = cap;
+    }
+    if (len != 0)
+      memcpy(h2->block + h2->block_len, p, len);
+    h2->block_len += len;
+    if (type == H2_CONTINUATION && (flags & H2_FLAG_END_HEADERS)) {
+      h2->block_stream = 0;
+      h2_on_header_block(h2, id, h2->block, h2->block_len,
+                         h2->block_end_stream);
     }
+    return;
   }
-
-  if (res != NULL) {
-    for (size_t i = 0; i < res->headers_len; i++) {
-      const char *key = res->headers[i].key;
-      const char *value = res->headers[i].value;
-      if (key == NULL || value == NULL)
-        continue;
-
-      if (has_crlf(key) || has_crlf(value))
-        return false;
-      written =
-          snprintf(headers + header_offset, sizeof(headers) - header_offset,
-                   "%s: %s\r\n", key, value);
-      if (written < 0 || (size_t)written >= sizeof(headers) - header_offset)
-        return false;
-      header_offset += (size_t)written;
+  case H2_PRIORITY:
+    // Advisory; responses go out round-robin.
+    if (id == 0)
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+    else if (len != 5)
+      h2_send_u32(h2, H2_RST_STREAM, id, H2_FRAME_SIZE_ERROR);
+    return;
+  case H2_RST_STREAM: {
+    if (id == 0 || id > h2->last_stream_id) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
     }
-
-    for (size_t i = 0; i < res->cookies_len; i++) {
-      if (has_crlf(res->cookies[i].name) || has_crlf(res->cookies[i].value))
-        return false;
-      written =
-          snprintf(headers + header_offset, sizeof(headers) - header_offset,
-                   "Set-Cookie: %s=%s\r\n", res->cookies[i].name,
-                   res->cookies[i].value);
-      if (written < 0 || (size_t)written >= sizeof(headers) - header_offset)
-        return false;
-      header_offset += (size_t)written;
+    if (len != 4) {
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    struct H2Stream *st = h2_stream_find(h2, id);
+    if (st != NULL)
+      h2_stream_free(h2, st);
+    return;
+  }
+  case H2_SETTINGS: {
+    if (id != 0) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if ((flags & H2_FLAG_ACK) ? len != 0 : len % 6 != 0) {
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+      return;
     }
+    if (flags & H2_FLAG_ACK)
+      return;
+    uint32_t error = h2_apply_settings(h2, p, len);
+    if (error != 0)
+      h2_fail(h2, error);
+    else
+      (void)h2_send_frame(h2, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+    return;
   }
-
-  written = snprintf(headers + header_offset, sizeof(headers) - header_offset,
-                     "\r\n");
-  if (written < 0 || (size_t)written >= sizeof(headers) - header_offset)
-    return false;
-  header_offset += (size_t)written;
-
-  struct iovec iov[2];
-  int iovcnt = 0;
-  iov[iovcnt].iov_base = (void *)headers;
-  iov[iovcnt].iov_len  = header_offset;
-  iovcnt++;
-  if (!omit_body && res != NULL && res->body != NULL && res->content_length > 0) {
-    iov[iovcnt].iov_base = (void *)res->body;
-    iov[iovcnt].iov_len  = res->content_length;
-    iovcnt++;
+  case H2_PING:
+    if (id != 0) {
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (len != 8) {
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    if (!(flags & H2_FLAG_ACK))
+      (void)h2_send_frame(h2, H2_PING, H2_FLAG_ACK, 0, p, 8);
+    return;
+  case H2_GOAWAY:
+    if (id != 0)
+      h2_fail(h2, H2_PROTOCOL_ERROR);
+    else if (len < 8)
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    else
+      h2->goaway = true;
+    return;
+  case H2_WINDOW_UPDATE:
+    if (len != 4)
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+    else
+      h2_on_window_update(h2, id, read_u32(p) & H2_WINDOW_MAX);
+    return;
+  case H2_PUSH_PROMISE:
+    // Clients never push.
+    h2_fail(h2, H2_PROTOCOL_ERROR);
+    return;
+  default:
+    // Unknown frame types are ignored.
+    return;
   }
-  if (!tcp_conn_writev(c, iov, iovcnt))
-    return false;
-
-  if (close)
-    tcp_conn_close_after_write(c);
-  return true;
 }
 
-static enum Method get_method_from_str(char *method) {
-  if (method == NULL) {
-    return (enum Method)MAX_METHODS;
+// Parses the complete frames buffered on the connection, handling payloads
+// straight from the read buffer, then hands back the connection window the
+// DATA consumed and frames whatever responses can go out.
+static void h2_process(struct H2Session *h2) {
+  struct HTTPConn *conn = h2->http;
+  size_t off = 0;
+  if (h2->failed) {
+    http_conn_consume_bytes(conn, conn->bytes_len);
+    return;
   }
 
-  if (strcmp(method, "GET") == 0) {
-    return GET;
-  } else if (strcmp(method, "POST") == 0) {
-    return POST;
-  } else if (strcmp(method, "DELETE") == 0) {
-    return DELETE;
-  } else if (strcmp(method, "PUT") == 0) {
-    return PUT;
-  } else if (strcmp(method, "PATCH") == 0) {
-    return PATCH;
-  } else if (strcmp(method, "HEAD") == 0) {
-    return HEAD;
+  if (h2->preface_off < H2_PREFACE_LEN) {
+    size_t want = H2_PREFACE_LEN - h2->preface_off;
+    off = conn->bytes_len < want ? conn->bytes_len : want;
+    if (memcmp(conn->bytes, H2_PREFACE + h2->preface_off, off) != 0) {
+      h2->failed = true;
+      tcp_conn_close_now(h2->conn);
+      return;
+    }
+    h2->preface_off += off;
   }
 
-  return (enum Method)MAX_METHODS;
-}
-
-static struct Route *find_route(ExpressRouter *r, char *route) {
-  if (r == NULL || route == NULL)
-    return NULL;
-
-  for (size_t i = 0; i < r->routes_off; i++) {
-    if (r->routes[i].route != NULL && strcmp(route, r->routes[i].route) == 0) {
-      return &r->routes[i];
+  while (!h2->failed && conn->bytes_len - off >= 9) {
+    const byte *p = conn->bytes + off;
+    size_t len = (size_t)p[0] << 16 | (size_t)p[1] << 8 | p[2];
+    if (len > H2_FRAME_MAX) {
+      h2_fail(h2, H2_FRAME_SIZE_ERROR);
+      break;
     }
+    if (conn->bytes_len - off - 9 < len)
+      break;
+    off += 9 + len;
+    h2_frame(h2, p[3], p[4], read_u32(p + 5) & 0x7FFFFFFFu, p + 9, len);
   }
-  return NULL;
+
+  http_conn_consume_bytes(conn, h2->failed ? conn->bytes_len : off);
+  if (h2->failed)
+    return;
+  if (h2->recv_credit > 0) {
+    h2_send_u32(h2, H2_WINDOW_UPDATE, 0, (uint32_t)h2->recv_credit);
+    h2->recv_credit = 0;
+  }
+  h2_flush(h2);
 }
 
-ExpressRouter *router_new() {
-  ExpressRouter *r = (ExpressRouter *)calloc(1, sizeof(ExpressRouter));
-  r->mware_func = NULL;
-  return r;
+static struct H2Session *h2_open(ExpressServer *s, TCPConn *c,
+                                 struct HTTPConn *conn) {
+  struct H2Session *h2 = (struct H2Session *)calloc(1, sizeof(*h2));
+  if (h2 == NULL)
+    return NULL;
+  h2->server = s;
+  h2->conn = c;
+  h2->http = conn;
+  h2->decoder.max_size = HPACK_TABLE_SIZE;
+  h2->send_window = H2_WINDOW_DEFAULT;
+  h2->peer_window = H2_WINDOW_DEFAULT;
+  conn->h2 = h2;
+
+  static const byte settings[] = {
+      0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS};
+  (void)h2_send_frame(h2, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  return h2;
 }
 
-int32_t router_add_middleware(ExpressRouter *r, middleware_handler mware_func) {
-  if (r->mware_func != NULL)
-    return -1;
-  r->mware_func = mware_func;
-  return 0;
+static void h2_destroy(struct H2Session *h2) {
+  while (h2->streams_len > 0)
+    h2_stream_free(h2, h2->streams[h2->streams_len - 1]);
+  free(h2->streams);
+  free(h2->block);
+  hpack_decoder_clear(&h2->decoder);
+  h2->http->h2 = NULL;
+  free(h2);
 }
 
-int32_t router_set_fallback(ExpressRouter *r, route_handler handler) {
-  if (r == NULL || handler == NULL) return -1;
-  if (r->fallback != NULL) return -1;
-  r->fallback = handler;
-  return 0;
+// Prior knowledge: a connection opening with the HTTP/2 preface. Returns
+// true while the buffered bytes could still be one, since the HTTP/1
+// parser would only wait for more of them too.
+static bool h2_preface_start(ExpressServer *s, TCPConn *c,
+                             struct HTTPConn *conn) {
+  size_t n = conn->bytes_len < H2_PREFACE_LEN ? conn->bytes_len
+                                              : H2_PREFACE_LEN;
+  if (conn->parsed_headers || memcmp(conn->bytes, H2_PREFACE, n) != 0)
+    return false;
+  if (n < H2_PREFACE_LEN)
+    return true;
+  if (h2_open(s, c, conn) == NULL) {
+    tcp_conn_close_now(c);
+    return true;
+  }
+  h2_process(conn->h2);
+  return true;
 }
 
-int32_t router_add(ExpressRouter *r, char *route, enum Method method,
-                   route_handler routing_func) {
-  if (r == NULL || route == NULL || routing_func == NULL)
-    return -1;
-  if (r->routes_off >= MAX_ROUTES || method >= MAX_METHODS)
-    return -1;
-  struct Route *t = find_route(r, route);
-  if (t == NULL) {
-    r->routes[r->routes_off].route = route;
-    r->routes[r->routes_off].handlers[method].handler = routing_func;
-    r->routes_off++;
-  } else {
-    if (t->handlers[method].handler != NULL)
+// Decodes unpadded base64url, as HTTP2-Settings carries it. Returns the
+// decoded length or -1.
+static ssize_t base64url_decode(const char *in, byte *out, size_t cap) {
+  uint32_t acc = 0;
+  unsigned bits = 0;
+  size_t o = 0;
+  for (; *in != '\0' && *in != '='; in++) {
+    char c = *in;
+    uint32_t v = c >= 'A' && c <= 'Z'   ? (uint32_t)(c - 'A')
+                 : c >= 'a' && c <= 'z' ? (uint32_t)(c - 'a' + 26)
+                 : c >= '0' && c <= '9' ? (uint32_t)(c - '0' + 52)
+                 : c == '-'             ? 62u
+                 : c == '_'             ? 63u
+                                        : 64u;
+    if (v == 64)
       return -1;
-    t->handlers[method].handler = routing_func;
+    acc = acc << 6 | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (o == cap)
+        return -1;
+      out[o++] = (byte)(acc >> bits);
+    }
   }
-  return 0;
+  return (ssize_t)o;
 }
 
-void router_destroy(ExpressRouter *r) { free(r); }
+// "Upgrade: h2c" (RFC 7540 3.2): answers 101, switches the connection to
+// HTTP/2 and serves the upgrading request as stream 1. Returns false,
+// leaving the request to HTTP/1.1, when the upgrade is not acceptable.
+static bool h2_upgrade(ExpressServer *s, TCPConn *c, struct HTTPConn *conn,
+                       size_t body_end) {
+  http_request *req = conn->req;
+  header *upgrade = get_request_header(req, "Upgrade");
+  header *connection = get_request_header(req, "Connection");
+  header *settings = get_request_header(req, "HTTP2-Settings");
+  if (conn->stream != NULL || strcmp(req->version, "HTTP/1.1") != 0 ||
+      upgrade == NULL || !header_value_has_only_token(upgrade->value, "h2c") ||
+      connection == NULL || settings == NULL ||
+      !header_value_has_token(connection->value, "upgrade") ||
+      !header_value_has_token(connection->value, "HTTP2-Settings"))
+    return false;
 
-static void on_accept(void *ctx, TCPConn *c) {
-  (void)ctx;
+  byte payload[256];
+  ssize_t payload_len = base64url_decode(settings->value, payload,
+                                         sizeof(payload));
+  if (payload_len < 0 || payload_len % 6 != 0)
+    return false;
 
-  struct HTTPConn *conn = (struct HTTPConn *)calloc(1, sizeof(*conn));
-  if (conn == NULL) {
+  if (!tcp_conn_write_str(c, "HTTP/1.1 101 Switching Protocols\r\n"
+                             "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n")) {
     tcp_conn_close_now(c);
-    return;
+    return true;
   }
-  conn->parsed_headers = false;
-
-  tcp_conn_set_user(c, conn);
-}
-
-static void on_close(void *ctx, TCPConn *c) {
-  (void)ctx;
-
-  struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
-  http_conn_destroy(conn);
-}
-
-static void on_bytes(void *ctx, TCPConn *c, const byte *bytes, size_t len) {
-  struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
-  ExpressServer *s = (ExpressServer *)ctx;
-
-  if (conn == NULL || s == NULL) {
+  struct H2Session *h2 = h2_open(s, c, conn);
+  struct H2Stream *st = h2 != NULL ? h2_stream_new(h2, 1) : NULL;
+  if (st == NULL) {
     tcp_conn_close_now(c);
-    return;
+    return true;
+  }
+  uint32_t error = h2_apply_settings(h2, payload, (size_t)payload_len);
+  if (error != 0) {
+    h2_fail(h2, error);
+    return true;
   }
 
-  if (len > SIZE_MAX - conn->bytes_len - 1 ||
-      !ensure_http_conn_cap(conn, conn->bytes_len + len + 1)) {
-    tcp_conn_close_now(c);
-    return;
+  // The stream takes the parsed request, its body and its router pin.
+  size_t body_len = req->content_length;
+  if (body_len > 0) {
+    st->body = (byte *)malloc(body_len);
+    if (st->body == NULL) {
+      h2_fail(h2, H2_INTERNAL_ERROR);
+      return true;
+    }
+    memcpy(st->body, conn->bytes + conn->bytes_off, body_len);
+    st->body_len = st->body_cap = st->body_seen = body_len;
   }
+  http_request_cleanup(st->req);
+  st->req = req;
+  conn->req = NULL;
+  memcpy(req->version, "HTTP/2.0", 9);
+  st->vhost = conn->vhost;
+  st->router = conn->router;
+  conn->router = NULL;
+  st->route = conn->route;
+  st->remote_closed = true;
+  h2->last_stream_id = 1;
+  http_conn_clear_request(conn);
+  http_conn_consume_bytes(conn, body_end);
 
-  memcpy(conn->bytes + conn->bytes_len, bytes, len);
-  conn->bytes_len += len;
-  conn->bytes[conn->bytes_len] = '\0';
+  h2_request_end(h2, st);
+  h2_process(h2);
+  return true;
+}
 
+// Parses and answers the requests buffered on conn until it needs more bytes
+// or a streamed response body takes over the connection.
+static void http_conn_process(ExpressServer *s, TCPConn *c,
+                              struct HTTPConn *conn) {
   for (;;) {
     if (conn->req == NULL) {
       conn->req = (http_request *)calloc(1, sizeof(*conn->req));
@@ -1516,145 +7555,273 @@ static void on_bytes(void *ctx, TCPConn *c, const byte *bytes, size_t len) {
       if (header_bytes == -1)
         return;
       if (header_bytes < 0) {
-        http_response bad = response_default();
-        response_set_static(&bad, "400", "Bad Request");
-        (void)set_response_header(&bad, "Connection", "close");
-        (void)write_response(c, req, &bad);
-        // log_response(c, req, &bad);
-        response_cleanup(&bad);
-        http_conn_reset(conn);
+        http_conn_reject(c, conn, req, "400", "Bad Request");
         return;
       }
 
       conn->parsed_headers = true;
       conn->bytes_off = (size_t)header_bytes;
+      req->conn = c;
+      conn->vhost = server_find_vhost(s, req->host);
+      conn->router =
+          atomic_load_explicit(&conn->vhost->router, memory_order_acquire);
+      conn->router->pins++;
+      conn->route = find_route(conn->router, req);
+      conn->stream = find_stream_route(conn->route, req);
     }
 
     if (!request_has_supported_version(req)) {
-      http_response unsupported = response_default();
-      response_set_static(&unsupported, "505", "HTTP Version Not Supported");
-      (void)set_response_header(&unsupported, "Connection", "close");
-      (void)write_response(c, req, &unsupported);
-      // log_response(c, req, &unsupported);
-      response_cleanup(&unsupported);
-      http_conn_reset(conn);
+      http_conn_reject(c, conn, req, "505", "HTTP Version Not Supported");
       return;
     }
 
     if (!request_expectation_supported(req)) {
-      http_response failed = response_default();
-      response_set_static(&failed, "417", "Expectation Failed");
-      (void)set_response_header(&failed, "Connection", "close");
-      (void)write_response(c, req, &failed);
-      // log_response(c, req, &failed);
-      response_cleanup(&failed);
-      http_conn_reset(conn);
+      http_conn_reject(c, conn, req, "417", "Expectation Failed");
       return;
     }
 
-    if (req->content_length > s->max_body_size) {
-      http_response too_large = response_default();
-      response_set_static(&too_large, "413", "Content Too Large");
-      (void)set_response_header(&too_large, "Connection", "close");
-      (void)write_response(c, req, &too_large);
-      response_cleanup(&too_large);
-      http_conn_reset(conn);
+    size_t body_limit = s->max_body_size;
+    if (conn->stream != NULL && conn->stream->max_body_size != 0)
+      body_limit = conn->stream->max_body_size;
+
+    if (req->content_length > body_limit) {
+      http_conn_reject(c, conn, req, "413", "Content Too Large");
       return;
     }
 
-        if (req->chunked) {
-            http_response failed = response_default();
-            response_set_static(&failed, "411", "Length Required");
-            (void)set_response_header(&failed, "Connection", "close");
-            (void)write_response(c, req, &failed);
-            // log_response(c, req, &failed);
-            response_cleanup(&failed);
-            http_conn_reset(conn);
-            return;
-        }
-
-        size_t body_bytes = conn->bytes_len - conn->bytes_off;
-        if (!conn->sent_continue && request_expects_continue(req) &&
-            req->content_length > body_bytes) {
-            if (!write_continue_response(c)) {
-                tcp_conn_close_now(c);
-                return;
-            }
-            conn->sent_continue = true;
-        }
-
-    if (req->content_length > body_bytes)
+    if (conn->stream != NULL && !conn->stream_started &&
+        !start_stream_request(s, c, conn, req))
       return;
 
-    req->body = req->content_length == 0 ? NULL : conn->bytes + conn->bytes_off;
-
-    http_response res = response_default();
-    char allow_header[64];
-    enum Method method = get_method_from_str(req->method);
-    enum Method handler_method = method;
-    struct Route *r = find_route(s->router, req->route);
-    route_handler handler = NULL;
-    byte* static_body = NULL;
-
-    if (r != NULL && method < MAX_METHODS) {
-      if (method == HEAD && r->handlers[HEAD].handler == NULL) {
-        handler_method = GET;
-      }
-
-      if (handler_method < MAX_METHODS) {
-        handler = r->handlers[handler_method].handler;
+    size_t body_bytes = conn->bytes_len - conn->bytes_off;
+    if (!conn->sent_continue && request_expects_continue(req) &&
+        (req->chunked ? body_bytes == 0 : req->content_length > body_bytes)) {
+      if (!write_continue_response(c)) {
+        tcp_conn_close_now(c);
+        return;
       }
+      conn->sent_continue = true;
     }
 
-    if (s->router->mware_func != NULL) {
-      s->router->mware_func(s->user_ctx, req, &res);
+    size_t body_end = conn->bytes_off + req->content_length;
+    int32_t decoded = 1;
+    if (conn->stream != NULL) {
+      decoded = http_conn_stream_body(conn, req, body_limit);
+      body_end = conn->bytes_off;
+    } else if (req->chunked) {
+      decoded = http_conn_decode_chunked(conn, req, body_limit);
+      body_end = conn->chunk.raw_off;
+    } else if (req->content_length > body_bytes) {
+      return;
     }
 
-    if (r == NULL) {
-      if (!try_serve_static_file(s, req, &res, &static_body)) {
-        if (s->router->fallback != NULL)
-          s->router->fallback(s->user_ctx, req, &res);
-        else
-          response_set_static(&res, "404", "Not Found");
-      }
-    } else if (method >= MAX_METHODS) {
-      response_set_static(&res, "405", "Method Not Allowed");
-    } else if (handler == NULL) {
-      response_set_static(&res, "405", "Method Not Allowed");
-    } else {
-      handler(s->user_ctx, req, &res);
-      s->total_requests++;
+    if (decoded == 0)
+      return;
+    if (decoded < 0) {
+      if (decoded == DECODE_CHUNKED_ERR_TOO_LARGE)
+        http_conn_reject(c, conn, req, "413", "Content Too Large");
+      else
+        http_conn_reject(c, conn, req, "400", "Bad Request");
+      return;
     }
 
-    if (strcmp(res.status_code, "405") == 0 &&
-        build_allow_header_value(r, allow_header, sizeof(allow_header))) {
-      (void)set_response_header(&res, "Allow", allow_header);
+    if (req->chunked)
+      req->content_length = conn->chunk.body_len;
+    if (h2_upgrade(s, c, conn, body_end))
+      return;
+
+    http_response res;
+    byte* static_body = NULL;
+    int32_t sent = 0;
+    if (conn->stream != NULL) {
+      req->content_length = conn->stream_seen;
+      req->body = NULL;
+      res = conn->stream_res;
+      memset(&conn->stream_res, 0, sizeof(conn->stream_res));
+      conn->stream_started = false;
+      tcp_conn_resume_read(c);
+      if (conn->stream->on_body_end != NULL)
+        conn->stream->on_body_end(s->user_ctx, req, &res);
+      s->total_requests++;
+    } else {
+      req->body =
+          req->content_length == 0 ? NULL : conn->bytes + conn->bytes_off;
+      res = response_default();
+      sent = dispatch_request(s, c, conn->vhost, conn->router, conn->route,
+                              req, &res, &static_body, &conn->arena);
     }
 
     bool close = response_should_close(req, &res);
-    if (!write_response(c, req, &res)) {
+    if (sent < 0 || (sent == 0 && !write_response(c, req, &res))) {
       free(static_body);
       response_cleanup(&res);
       tcp_conn_close_now(c);
       return;
     }
 
+    if (sent > 0 && close)
+      tcp_conn_close_after_write(c);
+
     // log_response(c, req, &res);
 
+    bool streaming = sent == 0 && res.producer != NULL &&
+                     !request_is_head(req) &&
+                     status_allows_body(response_status(&res));
+    bool sse = streaming && res.producer == sse_body;
+    const ExpressWebSocketHandlers *upgrade =
+        sent == 0 && !close && conn->route != NULL &&
+                response_status(&res) == 101
+            ? conn->route->handlers[GET].websocket
+            : NULL;
+    if (upgrade != NULL && !websocket_open(s, c, conn, upgrade)) {
+      free(static_body);
+      response_cleanup(&res);
+      tcp_conn_close_now(c);
+      return;
+    }
+    if (upgrade != NULL && upgrade->on_open != NULL)
+      upgrade->on_open(s->user_ctx, conn->ws, req);
+    if (sse) {
+      streaming = false;
+      if (!sse_join(s, c, conn, req)) {
+        free(static_body);
+        response_cleanup(&res);
+        tcp_conn_close_now(c);
+        return;
+      }
+    }
+    if (streaming) {
+      conn->producer = res.producer;
+      conn->producer_ctx = res.producer_ctx;
+      conn->producer_chunked = strcmp(req->version, "HTTP/1.0") != 0;
+      conn->producer_close = close;
+      res.producer = NULL;
+    }
+
     free(static_body);
-    size_t consumed = conn->bytes_off + req->content_length;
+    size_t consumed = body_end;
     response_cleanup(&res);
     http_conn_clear_request(conn);
 
-    if (close)
+    if (close && !streaming && !sse)
       return;
 
     http_conn_consume_bytes(conn, consumed);
+    if (upgrade != NULL) {
+      // Frames sent right behind the handshake are already buffered.
+      if (conn->bytes_len > 0)
+        websocket_process(conn);
+      return;
+    }
+    if (sse) {
+      // The connection only carries broadcasts from here on.
+      tcp_conn_pause_read(c);
+      return;
+    }
+    if (streaming) {
+      tcp_conn_pause_read(c);
+      tcp_conn_want_drain(c);
+      return;
+    }
     if (conn->bytes_len == 0)
       return;
   }
 }
 
+static void on_bytes(void *ctx, TCPConn *c, const byte *bytes, size_t len) {
+  struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
+  ExpressServer *s = (ExpressServer *)ctx;
+
+  if (conn == NULL || s == NULL) {
+    tcp_conn_close_now(c);
+    return;
+  }
+
+  if (!http_conn_append(conn, bytes, len)) {
+    tcp_conn_close_now(c);
+    return;
+  }
+
+  if (conn->ws != NULL)
+    websocket_process(conn);
+  else if (conn->h2 != NULL)
+    h2_process(conn->h2);
+  else if (!h2_preface_start(s, c, conn))
+    http_conn_process(s, c, conn);
+}
+
+// Pulls from the connection's producer until the socket stops taking all of
+// it or the burst is used up. Returns 1 once the body has ended, 0 to wait
+// for the next drain and -1 if the connection has to be dropped.
+static int32_t http_conn_pump_stream(TCPConn *c, struct HTTPConn *conn) {
+  static const char hex_digits[] = "0123456789abcdef";
+  // Leaves room for the chunk-size line before the data and CRLF after it.
+  byte buf[RESPONSE_STREAM_CHUNK + 12];
+  byte *data = buf + 10;
+
+  for (int burst = 0; burst < RESPONSE_STREAM_BURST; burst++) {
+    ssize_t n = conn->producer(conn->producer_ctx, data, RESPONSE_STREAM_CHUNK);
+    if (n <= 0) {
+      conn->producer = NULL;
+      if (n < 0)
+        return -1;
+      if (conn->producer_chunked && !tcp_conn_write(c, "0\r\n\r\n", 5))
+        return -1;
+      return 1;
+    }
+
+    size_t len = (size_t)n < RESPONSE_STREAM_CHUNK ? (size_t)n
+                                                    : RESPONSE_STREAM_CHUNK;
+    byte *start = data;
+    if (conn->producer_chunked) {
+      *--start = '\n';
+      *--start = '\r';
+      for (size_t v = len; v != 0; v >>= 4)
+        *--start = (byte)hex_digits[v & 15];
+      data[len] = '\r';
+      data[len + 1] = '\n';
+      len += 2;
+    }
+    if (!tcp_conn_write(c, start, (size_t)(data - start) + len)) {
+      (void)conn->producer(conn->producer_ctx, NULL, 0);
+      conn->producer = NULL;
+      return -1;
+    }
+    if (tcp_conn_pending(c) > 0)
+      break;
+  }
+  return 0;
+}
+
+static void on_drain(void *ctx, TCPConn *c) {
+  struct HTTPConn *conn = (struct HTTPConn *)tcp_conn_get_user(c);
+  ExpressServer *s = (ExpressServer *)ctx;
+  if (conn != NULL && conn->h2 != NULL) {
+    h2_flush(conn->h2);
+    return;
+  }
+  if (conn == NULL || conn->producer == NULL)
+    return;
+
+  int32_t pumped = http_conn_pump_stream(c, conn);
+  if (pumped < 0) {
+    tcp_conn_close_now(c);
+    return;
+  }
+  if (pumped == 0) {
+    tcp_conn_want_drain(c);
+    return;
+  }
+
+  if (conn->producer_close) {
+    tcp_conn_close_after_write(c);
+    return;
+  }
+  tcp_conn_resume_read(c);
+  if (conn->bytes_len > 0)
+    http_conn_process(s, c, conn);
+}
+
 ExpressServer *server_new(ExpressConfig *cnfg, ExpressRouter *router) {
   if (cnfg == NULL || router == NULL)
     return NULL;
@@ -1664,16 +7831,24 @@ ExpressServer *server_new(ExpressConfig *cnfg, ExpressRouter *router) {
     return NULL;
 
   server->user_ctx = cnfg->ctx;
-  server->router = router;
-  server->max_body_size = cnfg->max_body_size ? cnfg->max_body_size : 1048576;
-
-  server->public_path = NULL;
-  memset(&server->static_map, 0, sizeof(server->static_map));
-  if (cnfg->public_path != NULL) {
-    server->public_path = strdup(cnfg->public_path);
-    if (server->public_path)
-      scan_dir(&server->static_map, server->public_path, "");
+  server->static_cache_budget = cnfg->static_cache_bytes
+                                    ? cnfg->static_cache_bytes
+                                    : STATIC_CACHE_DEFAULT_BUDGET;
+  server->static_cache_ttl_ns =
+      (uint64_t)(cnfg->static_cache_ttl_ms ? cnfg->static_cache_ttl_ms
+                                           : STATIC_CACHE_DEFAULT_TTL_MS) *
+      1000000ull;
+  if (!vhost_init(&server->default_host, router, cnfg->public_path,
+                  server->static_cache_budget)) {
+    free(server);
+    return NULL;
   }
+  atomic_init(&server->retired, NULL);
+  server->draining = NULL;
+  server->max_body_size = cnfg->max_body_size ? cnfg->max_body_size : 1048576;
+  atomic_init(&server->sse_inbox, NULL);
+  server->sse_max_pending =
+      cnfg->sse_max_pending ? cnfg->sse_max_pending : 1048576;
 
   TCPServerConfig tcp_cfg;
   memset(&tcp_cfg, 0, sizeof(tcp_cfg));
@@ -1682,19 +7857,28 @@ ExpressServer *server_new(ExpressConfig *cnfg, ExpressRouter *router) {
   tcp_cfg.on_accept = on_accept;
   tcp_cfg.on_bytes = on_bytes;
   tcp_cfg.on_close = on_close;
+  tcp_cfg.on_tick = on_tick;
+  tcp_cfg.on_drain = on_drain;
+  tcp_cfg.tick_ms = 1000;
 
   server->tcp_server = tcp_server_create(&tcp_cfg);
   if (server->tcp_server == NULL) {
+    vhost_clear(&server->default_host);
     free(server);
     return NULL;
   }
 
+  pthread_mutex_lock(&sse_registry_lock);
+  server->sse_next = sse_registry;
+  sse_registry = server;
+  pthread_mutex_unlock(&sse_registry_lock);
+
   return server;
 }
 
 size_t server_static_file_count(ExpressServer *server) {
   if (server == NULL) return 0;
-  return server->static_map.count;
+  return server->default_host.static_map.count;
 }
 
 void server_run(ExpressServer *server) {
@@ -1707,8 +7891,73 @@ void server_destroy(ExpressServer *server) {
   if (server == NULL)
     return;
 
-  static_map_destroy(&server->static_map);
-  free(server->public_path);
+  pthread_mutex_lock(&sse_registry_lock);
+  ExpressServer **link = &sse_registry;
+  while (*link != NULL && *link != server)
+    link = &(*link)->sse_next;
+  if (*link != NULL)
+    *link = server->sse_next;
+  pthread_mutex_unlock(&sse_registry_lock);
+
   tcp_server_destroy(server->tcp_server);
+
+  for (struct SseEvent *ev = sse_take_inbox(server); ev != NULL;) {
+    struct SseEvent *next = ev->next;
+    sse_event_free(ev);
+    ev = next;
+  }
+  for (size_t i = 0; i < server->sse_channels_cap; i++) {
+    while (server->sse_channels[i] != NULL) {
+      struct SseChannel *ch = server->sse_channels[i];
+      server->sse_channels[i] = ch->next;
+      sse_channel_free(ch);
+    }
+  }
+  free(server->sse_channels);
+  for (size_t i = 0; i < server->websockets_len; i++) {
+    free(server->websockets[i]->message);
+    free(server->websockets[i]);
+  }
+  free(server->websockets);
+
+  struct RetiredRouter *retired = atomic_exchange(&server->retired, NULL);
+  while (retired != NULL || server->draining != NULL) {
+    struct RetiredRouter *node = retired != NULL ? retired : server->draining;
+    if (node == retired)
+      retired = node->next;
+    else
+      server->draining = node->next;
+    router_destroy(node->router);
+    free(node);
+  }
+  for (size_t i = 0; i < server->vhosts_cap; i++) {
+    if (server->vhosts[i] != NULL) {
+      vhost_clear(server->vhosts[i]);
+      free(server->vhosts[i]);
+    }
+  }
+  free(server->vhosts);
+  vhost_clear(&server->default_host);
   free(server);
 }
+
+int32_t server_swap_router(ExpressServer *server, ExpressRouter *router) {
+  if (server == NULL || router == NULL || router_freeze(router) != 0)
+    return -1;
+
+  struct RetiredRouter *node =
+      (struct RetiredRouter *)malloc(sizeof(*node));
+  if (node == NULL)
+    return -1;
+
+  router_retain(router);
+  node->router = atomic_exchange_explicit(&server->default_host.router,
+                                          router,
+                                          memory_order_acq_rel);
+  node->next = atomic_load_explicit(&server->retired, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&server->retired, &node->next,
+                                                node, memory_order_release,
+                                                memory_order_relaxed))
+    ;
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include "http_errors.h"
+#include "parser/json.h"
 #include "types.h"
 
 #define SERVER_VERSION "ExpressC/1.5"
@@ -14,21 +15,64 @@ enum Method {
   PUT = 3,
   PATCH = 4,
   HEAD = 5,
+  OPTIONS = 6,
 };
 
 typedef struct ExpressServer ExpressServer;
 
 typedef struct ExpressRouter ExpressRouter;
 
+typedef struct ExpressWebSocket ExpressWebSocket;
+
+// CORS policy answered on OPTIONS by the router. allow_origin is required;
+// NULL strings and a zero max_age leave the matching header out.
+typedef struct ExpressCors {
+  const char *allow_origin;
+  const char *allow_headers;
+  const char *expose_headers;
+  uint32_t max_age;
+  bool allow_credentials;
+} ExpressCors;
+
+typedef struct http_request http_request;
+
+// Callbacks of a WebSocket route; all run on the event loop. on_message
+// gets whole messages, reassembled from fragments, and its data is only
+// valid for the duration of the call.
+typedef struct ExpressWebSocketHandlers {
+  void (*on_open)(void *ctx, ExpressWebSocket *ws, http_request *req);
+  void (*on_message)(void *ctx, ExpressWebSocket *ws, const byte *data,
+                     size_t len, bool binary);
+  // Runs once as the connection goes away. code is the close code the peer
+  // sent, or the one the server failed the connection with; 1006 if the
+  // connection dropped without a close frame.
+  void (*on_close)(void *ctx, ExpressWebSocket *ws, uint16_t code);
+  // Largest message accepted; 0 uses the server's max_body_size.
+  size_t max_message_size;
+  // Idle time before the server pings, and again before an unanswered
+  // ping closes the connection; 0 means 30 seconds.
+  uint32_t ping_interval_ms;
+  // websocket_broadcast drops sockets with more unsent output than this;
+  // 0 means 1 MiB.
+  size_t max_pending;
+} ExpressWebSocketHandlers;
+
 typedef struct ExpressConfig {
   void *ctx;
   uint16_t port;
   size_t max_body_size;
   const char *public_path;
+  // SSE subscribers with more unsent output than this are dropped; 0 means
+  // 1 MiB.
+  size_t sse_max_pending;
+  // Static files are kept in memory, already serialized with their headers,
+  // in an LRU of this many bytes per host; 0 means 16 MiB. A cached file is
+  // read again from disk once static_cache_ttl_ms has passed; 0 means 1
+  // second.
+  size_t static_cache_bytes;
+  uint32_t static_cache_ttl_ms;
 } ExpressConfig;
 
-typedef struct http_request http_request;
-
 typedef struct http_response http_response;
 
 typedef void (*route_handler)(void *ctx, http_request *req, http_response *res);
@@ -36,17 +80,111 @@ typedef void (*route_handler)(void *ctx, http_request *req, http_response *res);
 typedef void (*middleware_handler)(void *ctx, http_request *req,
                                    http_response *res);
 
+// Receives request body bytes for streaming routes as they arrive. data is
+// only valid for the duration of the call. A NULL data pointer means the
+// connection dropped before the body completed.
+typedef void (*body_chunk_handler)(void *ctx, http_request *req,
+                                   const byte *data, size_t len);
+
 ExpressRouter *router_new();
+// Patterns are matched segment-wise: "/users/:id" captures one segment and
+// "/files/*path" captures the rest of the path; both are readable with
+// get_request_route_param. Static segments take precedence over params.
 int32_t router_add(ExpressRouter *r, char *route, enum Method method,
                    route_handler routing_func);
+// Registers a route whose body is streamed instead of buffered. on_headers
+// (optional) runs as soon as the headers are parsed; setting a 4xx/5xx
+// status there rejects the request before any body is read. on_body_end
+// builds the response. max_body_size of 0 uses the server limit.
+int32_t router_add_stream(ExpressRouter *r, char *route, enum Method method,
+                          route_handler on_headers,
+                          body_chunk_handler on_body_chunk,
+                          route_handler on_body_end, size_t max_body_size);
+// Middleware run in scope order: global, then prefix, then route, each in
+// registration order. Global middleware also runs for requests no route
+// matches (static files, fallback). A prefix covers the routes whose pattern
+// starts with it on a segment boundary; route middleware needs the pattern
+// string passed to router_add, registered beforehand.
 int32_t router_add_middleware(ExpressRouter *r, middleware_handler mware_func);
+int32_t router_add_prefix_middleware(ExpressRouter *r, const char *prefix,
+                                     middleware_handler mware_func);
+int32_t router_add_route_middleware(ExpressRouter *r, const char *route,
+                                    middleware_handler mware_func);
 int32_t router_set_fallback(ExpressRouter *r, route_handler handler);
+// Serves GET requests on route as Server-Sent Events: after middleware
+// passes, the connection stays open and subscribes to the channel named by
+// the request path, so "/events/:room" gives one channel per room.
+int32_t router_add_sse(ExpressRouter *r, char *route);
+// Upgrades GET requests on route to WebSocket (RFC 6455) after middleware
+// passes. Requests that are not valid upgrades get 400, or 426 for an
+// unsupported protocol version.
+int32_t router_add_websocket(ExpressRouter *r, char *route,
+                             const ExpressWebSocketHandlers *handlers);
+// Caches 200 responses of an already registered GET route for ttl_ms,
+// keyed on path, query and the named request headers. HEAD requests are
+// answered from the same entries. Responses whose handler sets cookies or
+// Connection are not stored. Middleware still runs on hits; the headers and
+// cookies it sets are not stored but added to each response, replacing a
+// stored header of the same name.
+int32_t router_cache_route(ExpressRouter *r, const char *route,
+                           uint32_t ttl_ms, const char *const *vary,
+                           size_t vary_len);
+// Tags 200 responses of an already registered GET route with a weak ETag
+// hashed from the body, and answers a request whose If-None-Match names it
+// with 304 and no body. Streamed bodies and handlers setting their own ETag
+// are left alone. On cached routes, hits are checked against the stored
+// ETag.
+int32_t router_etag_route(ExpressRouter *r, const char *route);
+// Byte budget shared by the router's cached responses; 8 MiB by default.
+int32_t router_set_cache_budget(ExpressRouter *r, size_t bytes);
+// Compresses responses whose Content-Type starts with content_type (e.g.
+// "text/" or "application/json") with gzip or deflate, as the client's
+// Accept-Encoding prefers. Buffered bodies need at least min_size bytes;
+// streamed bodies are compressed as they are produced. Cached routes store
+// each encoding's compressed output, and static files are compressed once
+// into an LRU.
+int32_t router_add_compression(ExpressRouter *r, const char *content_type,
+                               size_t min_size);
+// Byte budget of the compressed static files; 4 MiB by default.
+int32_t router_set_compression_budget(ExpressRouter *r, size_t bytes);
+// Routes without an OPTIONS handler get OPTIONS answered by the router
+// from their registered methods, without running middleware. Routes under
+// prefix (the longest registered prefix wins) also carry this CORS policy
+// in that answer, and Access-Control-Allow-Origin on their other responses.
+int32_t router_add_cors(ExpressRouter *r, const char *prefix,
+                        const ExpressCors *cors);
+// Compiles the routes without parameters into a perfect-hash table and
+// rejects further router_add calls. server_new freezes its router.
+int32_t router_freeze(ExpressRouter *r);
+// Drops the caller's reference. A router published by a server is freed
+// once the server and its in-flight requests are done with it.
 void router_destroy(ExpressRouter *r);
 
 ExpressServer *server_new(ExpressConfig *cnfg, ExpressRouter *router);
 void server_run(ExpressServer *server);
 void server_destroy(ExpressServer *server);
+// Freezes router and publishes it as the default host's router for new
+// requests; safe to call from any thread. Requests already matched finish
+// on the old router, which is released after the event loop passes its
+// next quiescent point.
+int32_t server_swap_router(ExpressServer *server, ExpressRouter *router);
+// Serves requests whose Host is host (or, for "*.example.com", any name
+// under example.com) from router and public_path instead of the defaults
+// given to server_new. Exact names win over wildcards and longer wildcards
+// over shorter ones. Call before server_run.
+int32_t server_add_vhost(ExpressServer *server, const char *host,
+                         ExpressRouter *router, const char *public_path);
 size_t server_static_file_count(ExpressServer *server);
+// Drops cached responses whose path starts with prefix from every router
+// and static file cache.
+// Safe to call from any thread; returns the number of entries dropped.
+size_t express_cache_invalidate(const char *prefix);
+// Sends data as one event to every subscriber of channel on every server.
+// The event is formatted once into a shared buffer and queued on each
+// subscriber without copying; delivery happens on the event loop. Safe to
+// call from any thread.
+int32_t express_sse_broadcast(const char *channel, const char *data,
+                              size_t len);
 
 param *get_request_param(http_request *req, const char *key);
 param *get_request_route_param(http_request *req, const char *key);
@@ -54,15 +192,62 @@ header *get_request_header(http_request *req, const char *key);
 byte *get_request_body(http_request *req);
 size_t get_request_body_len(http_request *req);
 char *get_request_content_type(http_request *req);
+// The body parsed as JSON on first call, in memory that lives as long as
+// the request. Returns a JSON_MISSING value if there is no buffered body or
+// it is not valid JSON.
+json_value get_request_json(http_request *req);
+// Backpressure for streaming routes: stop reading the socket until resumed.
+void pause_request_body(http_request *req);
+void resume_request_body(http_request *req);
 
 header *get_response_header(http_response *res, const char *key);
 bool set_response_header(http_response *res, const char *key,
                          const char *value);
 bool set_response_body(http_response *res, const byte *body,
                        const size_t body_len);
+// Drops the body and every appended segment, e.g. to answer with an error
+// instead of a half-written body.
+void clear_response_body(http_response *res);
+// Appends len bytes to the body without copying them. A borrowed segment
+// must outlive the response (static data); SEGMENT_FREE hands a malloc'd
+// block to the server; SEGMENT_SHARED takes a reference on a TCPSharedBuf
+// from TCPServer.h, so one buffer can back many responses at once.
+#define SEGMENT_BORROWED ((segment_ownership){NULL, NULL, NULL})
+#define SEGMENT_FREE(p) ((segment_ownership){free, (p), NULL})
+#define SEGMENT_SHARED(b) ((segment_ownership){NULL, NULL, (b)})
+bool append_response_segment(http_response *res, const byte *data,
+                             size_t len, segment_ownership ownership);
+// Scratch memory that lives until the response has been sent, for bodies
+// and segments built by the handler. Taken from the connection's arena, so
+// it costs no malloc per request once the arena is warm.
+void *alloc_response_buffer(http_response *res, size_t len);
+// Streams the body from producer instead of a buffer: chunked for HTTP/1.1
+// clients and delimited by closing the connection for HTTP/1.0. The server
+// calls producer each time the socket has drained, so one buffer of output
+// is held per response. It returns the bytes written, 0 to end the body or
+// a negative value to abort the connection; either is its last call. If the
+// body is never sent or the connection drops first, it is called once with
+// a NULL buf so it can release ctx.
+bool set_response_stream(http_response *res, response_producer producer,
+                         void *ctx);
 bool set_response_status(http_response *res, const char *status);
 bool set_response_redirect(http_response *res, const char *location,
                            const char *status);
+// Called from a middleware: the response is sent as it stands and the rest
+// of the chain and the route handler are skipped.
+void end_response(http_response *res);
+
+bool websocket_send(ExpressWebSocket *ws, const byte *data, size_t len,
+                    bool binary);
+// Sends data as one frame, encoded once and shared by every socket in
+// sockets. Returns the number of sockets it was queued on.
+size_t websocket_broadcast(ExpressWebSocket *const *sockets, size_t count,
+                           const byte *data, size_t len, bool binary);
+// Starts the closing handshake; the connection closes once the peer
+// answers or a ping interval passes.
+void websocket_close(ExpressWebSocket *ws, uint16_t code);
+void websocket_set_user(ExpressWebSocket *ws, void *user);
+void *websocket_get_user(const ExpressWebSocket *ws);
 
 char *get_cookie(http_request *req, char *key);
 bool set_response_cookie(http_response *res, const char *name,
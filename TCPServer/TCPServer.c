@@ -4,18 +4,34 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+struct TCPSharedBuf {
+    atomic_size_t refs;
+    size_t len;
+    byte data[];
+};
+
+// Shared output queued behind out, sent from off up to end.
+struct TCPSegment {
+    TCPSharedBuf* buf;
+    size_t off;
+    size_t end;
+};
+
 struct TCPConn {
     int fd;
     byte* out;
@@ -23,11 +39,20 @@ struct TCPConn {
     size_t out_cap;
     size_t out_off;
 
+    // Ring of shared segments, power-of-two capacity.
+    struct TCPSegment* segs;
+    size_t segs_head;
+    size_t segs_len;
+    size_t segs_cap;
+    size_t segs_bytes;
+
     char ip[INET_ADDRSTRLEN];
     uint16_t port;
 
     bool close_after_write;
     bool close_now;
+    bool read_paused;
+    bool want_drain;
     void* user;
 
     struct TCPServer* server;
@@ -36,9 +61,13 @@ struct TCPConn {
 struct TCPServer {
     int server_fd;
     int epfd;
+    int wake_fd;
     tcp_on_accept_fn on_accept;
     tcp_on_bytes_fn on_bytes;
     tcp_on_close_fn on_close;
+    tcp_on_tick_fn on_tick;
+    tcp_on_drain_fn on_drain;
+    int tick_timeout;
     uint16_t port;
     void* ctx;
     struct epoll_event events[MAX_EVENTS];
@@ -65,11 +94,50 @@ static TCPConn* conn_create(int fd) {
     return c;
 }
 
+static size_t conn_pending(const TCPConn* c) {
+    return c->out_len - c->out_off + c->segs_bytes;
+}
+
+static struct TCPSegment* conn_segment(TCPConn* c, size_t i) {
+    return &c->segs[(c->segs_head + i) & (c->segs_cap - 1)];
+}
+
+static void conn_drop_segments(TCPConn* c) {
+    for (size_t i = 0; i < c->segs_len; i++)
+        tcp_shared_release(conn_segment(c, i)->buf);
+    c->segs_head = c->segs_len = c->segs_bytes = 0;
+}
+
+static bool conn_push_segment(TCPConn* c, TCPSharedBuf* b, size_t off,
+                              size_t end) {
+    if (c->segs_len == c->segs_cap) {
+        size_t cap = c->segs_cap ? c->segs_cap * 2 : 8;
+        struct TCPSegment* next =
+            (struct TCPSegment*)malloc(cap * sizeof(*next));
+        if (!next) return false;
+        for (size_t i = 0; i < c->segs_len; i++) next[i] = *conn_segment(c, i);
+        free(c->segs);
+        c->segs = next;
+        c->segs_cap = cap;
+        c->segs_head = 0;
+    }
+    tcp_shared_retain(b);
+    struct TCPSegment* sg = conn_segment(c, c->segs_len);
+    sg->buf = b;
+    sg->off = off;
+    sg->end = end;
+    c->segs_len++;
+    c->segs_bytes += end - off;
+    return true;
+}
+
 static void conn_close(int epfd, TCPConn* c, TCPServer* s) {
     if (!c) return;
     epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
     close(c->fd);
     if (s->on_close) s->on_close(s->ctx, c);
+    conn_drop_segments(c);
+    free(c->segs);
     free(c->out);
     free(c);
 }
@@ -90,6 +158,17 @@ static int mod_epoll(int epfd, int fd, uint32_t events, void* ptr) {
     return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
+static uint32_t conn_events(const TCPConn* c) {
+    uint32_t ev = EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+    if (!c->read_paused) ev |= EPOLLIN;
+    if (conn_pending(c) > 0 || c->want_drain) ev |= EPOLLOUT;
+    return ev;
+}
+
+static void conn_update_events(TCPConn* c) {
+    (void)mod_epoll(c->server->epfd, c->fd, conn_events(c), c);
+}
+
 static int create_listen_socket(uint16_t port) {
     int s = socket(AF_INET, SOCK_STREAM, 0);
     if (s == -1) return -1;
@@ -157,6 +236,43 @@ static void accept_loop(TCPServer* s) {
     }
 }
 
+// Sends queued segments until the kernel stops taking all of them. Returns
+// false on a socket error.
+static bool flush_segments(TCPConn* c) {
+    while (c->segs_len > 0) {
+        struct iovec iov[64];
+        int iovcnt = 0;
+        size_t total = 0;
+        for (; iovcnt < 64 && (size_t)iovcnt < c->segs_len; iovcnt++) {
+            struct TCPSegment* sg = conn_segment(c, (size_t)iovcnt);
+            iov[iovcnt].iov_base = sg->buf->data + sg->off;
+            iov[iovcnt].iov_len = sg->end - sg->off;
+            total += sg->end - sg->off;
+        }
+        ssize_t n = writev(c->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        size_t sent = (size_t)n;
+        c->segs_bytes -= sent;
+        while (sent > 0) {
+            struct TCPSegment* sg = conn_segment(c, 0);
+            if (sent < sg->end - sg->off) {
+                sg->off += sent;
+                break;
+            }
+            sent -= sg->end - sg->off;
+            tcp_shared_release(sg->buf);
+            c->segs_head = (c->segs_head + 1) & (c->segs_cap - 1);
+            c->segs_len--;
+        }
+        if ((size_t)n < total) return true;
+    }
+    return true;
+}
+
 static bool flush_out(int epfd, TCPConn* c) {
     while (c->out_off < c->out_len) {
         ssize_t n =
@@ -166,33 +282,35 @@ static bool flush_out(int epfd, TCPConn* c) {
             continue;
         }
         if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            uint32_t ev = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-            (void)mod_epoll(epfd, c->fd, ev, c);
+            (void)mod_epoll(epfd, c->fd, conn_events(c), c);
             return true;
         }
         return false;
     }
 
     c->out_len = c->out_off = 0;
-    uint32_t ev = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-    (void)mod_epoll(epfd, c->fd, ev, c);
+    if (!flush_segments(c)) return false;
+    (void)mod_epoll(epfd, c->fd, conn_events(c), c);
     return true;
 }
 
 static bool handle_read(int epfd, TCPConn* c, TCPServer* s) {
     uint8_t buf[4096];
 
-    for (;;) {
+    while (!c->read_paused && !c->close_now) {
         ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
 
-        if (s->on_bytes) {
-            s->on_bytes(s->ctx, c, buf, (size_t)n);
+        if (n > 0) {
+            if (s->on_bytes) {
+                s->on_bytes(s->ctx, c, buf, (size_t)n);
 
-            if (c->out_len > c->out_off) {
-                if (!flush_out(epfd, c)) {
-                    return false;
+                if (conn_pending(c) > 0) {
+                    if (!flush_out(epfd, c)) {
+                        return false;
+                    }
                 }
             }
+            continue;
         }
 
         if (n == 0) {
@@ -212,12 +330,16 @@ static bool handle_read(int epfd, TCPConn* c, TCPServer* s) {
     return true;
 }
 
-static bool handle_write(int epfd, TCPConn* c) {
-    if (c->out_len > c->out_off) {
-        return flush_out(epfd, c);
+static bool handle_write(int epfd, TCPConn* c, TCPServer* s) {
+    if (conn_pending(c) > 0) {
+        if (!flush_out(epfd, c)) return false;
+        if (conn_pending(c) > 0) return true;
+    }
+    if (c->want_drain && !c->close_now) {
+        c->want_drain = false;
+        if (s->on_drain) s->on_drain(s->ctx, c);
     }
-    uint32_t ev = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-    (void)mod_epoll(epfd, c->fd, ev, c);
+    (void)mod_epoll(epfd, c->fd, conn_events(c), c);
     return true;
 }
 
@@ -237,10 +359,17 @@ TCPServer* tcp_server_create(const TCPServerConfig* cnfg) {
 
     server->epfd = epfd;
 
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->wake_fd == -1) die("eventfd");
+
     server->port = cnfg->port;
     server->on_accept = cnfg->on_accept;
     server->on_bytes = cnfg->on_bytes;
     server->on_close = cnfg->on_close;
+    server->on_tick = cnfg->on_tick;
+    server->on_drain = cnfg->on_drain;
+    server->tick_timeout =
+        cnfg->on_tick && cnfg->tick_ms ? (int)cnfg->tick_ms : -1;
 
     server->ctx = cnfg->ctx;
 
@@ -250,6 +379,9 @@ TCPServer* tcp_server_create(const TCPServerConfig* cnfg) {
     ev.data.fd = server->server_fd;
     if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->server_fd, &ev) == -1)
         die("epoll_ctl ADD listen");
+    ev.data.fd = server->wake_fd;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->wake_fd, &ev) == -1)
+        die("epoll_ctl ADD wake");
 
     return server;
 }
@@ -260,12 +392,15 @@ int tcp_server_run(TCPServer* s) {
     signal(SIGPIPE, SIG_IGN);
 
     for (;;) {
-        int n = epoll_wait(s->epfd, s->events, MAX_EVENTS, -1);
+        int n = epoll_wait(s->epfd, s->events, MAX_EVENTS, s->tick_timeout);
         if (n == -1) {
             if (errno == EINTR) continue;
             die("epoll_wait");
         }
 
+        // No callback is running on this thread between batches.
+        if (s->on_tick) s->on_tick(s->ctx);
+
         for (int i = 0; i < n; i++) {
             uint32_t e = s->events[i].events;
 
@@ -273,6 +408,13 @@ int tcp_server_run(TCPServer* s) {
                 accept_loop(s);
                 continue;
             }
+            if (s->events[i].data.fd == s->wake_fd) {
+                // on_tick already ran for this batch.
+                uint64_t count;
+                ssize_t r = read(s->wake_fd, &count, sizeof(count));
+                (void)r;
+                continue;
+            }
 
             TCPConn* c = (TCPConn*)s->events[i].data.ptr;
             if (!c) continue;
@@ -290,7 +432,7 @@ int tcp_server_run(TCPServer* s) {
             }
 
             if (e & EPOLLOUT) {
-                if (!handle_write(s->epfd, c)) {
+                if (!handle_write(s->epfd, c, s)) {
                     conn_close(s->epfd, c, s);
                     continue;
                 }
@@ -300,7 +442,7 @@ int tcp_server_run(TCPServer* s) {
                 conn_close(s->epfd, c, s);
                 continue;
             }
-            if (c->close_after_write && c->out_len == c->out_off) {
+            if (c->close_after_write && conn_pending(c) == 0) {
                 conn_close(s->epfd, c, s);
                 continue;
             }
@@ -314,9 +456,36 @@ void tcp_server_destroy(TCPServer* s) {
     if (!s) return;
     if (s->epfd != -1) close(s->epfd);
     if (s->server_fd != -1) close(s->server_fd);
+    if (s->wake_fd != -1) close(s->wake_fd);
     free(s);
 }
 
+void tcp_server_wake(TCPServer* s) {
+    if (!s) return;
+    uint64_t one = 1;
+    ssize_t w = write(s->wake_fd, &one, sizeof(one));
+    (void)w;
+}
+
+TCPSharedBuf* tcp_shared_new(size_t len) {
+    TCPSharedBuf* b = (TCPSharedBuf*)malloc(sizeof(*b) + len);
+    if (!b) return NULL;
+    atomic_init(&b->refs, 1);
+    b->len = len;
+    return b;
+}
+
+byte* tcp_shared_data(TCPSharedBuf* b) { return b ? b->data : NULL; }
+
+void tcp_shared_retain(TCPSharedBuf* b) {
+    if (b) atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+void tcp_shared_release(TCPSharedBuf* b) {
+    if (b && atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1)
+        free(b);
+}
+
 static bool resize_conn_cap(TCPConn* c, size_t need) {
     if (!c) return false;
 
@@ -340,6 +509,16 @@ bool tcp_conn_write(TCPConn* c, const void* data, size_t len) {
     if (len == 0) return true;
     if (c->close_now) return false;
 
+    // Keep ordering behind queued segments by queueing a copy after them.
+    if (c->segs_len > 0) {
+        TCPSharedBuf* b = tcp_shared_new(len);
+        if (!b) return false;
+        memcpy(b->data, data, len);
+        bool ok = conn_push_segment(c, b, 0, len);
+        tcp_shared_release(b);
+        return ok;
+    }
+
     if (c->out_len == c->out_off) {
         c->out_len = 0;
         c->out_off = 0;
@@ -362,8 +541,7 @@ bool tcp_conn_write(TCPConn* c, const void* data, size_t len) {
         c->out_len = rem;
         c->out_off = 0;
 
-        uint32_t ev = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-        (void)mod_epoll(c->server->epfd, c->fd, ev, c);
+        conn_update_events(c);
         return true;
     }
 
@@ -379,8 +557,7 @@ bool tcp_conn_write(TCPConn* c, const void* data, size_t len) {
     memcpy(c->out + c->out_len, data, len);
     c->out_len += len;
 
-    uint32_t ev = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-    (void)mod_epoll(c->server->epfd, c->fd, ev, c);
+    conn_update_events(c);
 
     return true;
 }
@@ -397,7 +574,7 @@ bool tcp_conn_writev(TCPConn* c, const struct iovec* iov, int iovcnt) {
     for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
     if (total == 0) return true;
 
-    if (c->out_len == c->out_off) {
+    if (conn_pending(c) == 0) {
         c->out_len = c->out_off = 0;
         ssize_t n = writev(c->fd, iov, iovcnt);
         if (n == (ssize_t)total) return true;
@@ -419,8 +596,7 @@ bool tcp_conn_writev(TCPConn* c, const struct iovec* iov, int iovcnt) {
         }
         c->out_len = rem;
         c->out_off = 0;
-        uint32_t ev = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
-        (void)mod_epoll(c->server->epfd, c->fd, ev, c);
+        conn_update_events(c);
         return true;
     }
 
@@ -431,11 +607,118 @@ bool tcp_conn_writev(TCPConn* c, const struct iovec* iov, int iovcnt) {
     return true;
 }
 
+// Queues a copy of data behind everything pending. Unlike tcp_conn_write
+// it grows the buffer instead of failing, since a response body already
+// half-written cannot be refused.
+static bool conn_queue_copy(TCPConn* c, const byte* data, size_t len) {
+    if (c->segs_len > 0) {
+        TCPSharedBuf* b = tcp_shared_new(len);
+        if (!b) return false;
+        memcpy(b->data, data, len);
+        bool ok = conn_push_segment(c, b, 0, len);
+        tcp_shared_release(b);
+        return ok;
+    }
+
+    size_t pending = c->out_len - c->out_off;
+    if (c->out_off > 0 && pending > 0)
+        memmove(c->out, c->out + c->out_off, pending);
+    c->out_off = 0;
+    c->out_len = pending;
+    if (pending + len > c->out_cap && !resize_conn_cap(c, pending + len))
+        return false;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
+
+bool tcp_conn_writev_shared(TCPConn* c, const struct iovec* iov,
+                            TCPSharedBuf* const* shared, int iovcnt) {
+    if (!c || c->close_now || !iov || !shared || iovcnt <= 0) return false;
+
+    size_t skip = 0;
+    if (conn_pending(c) == 0) {
+        c->out_len = c->out_off = 0;
+        // Pieces past IOV_MAX are queued below as if the kernel had
+        // refused them.
+        int first = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+        if (total == 0) return true;
+        ssize_t n = writev(c->fd, iov, first);
+        if (n == (ssize_t)total) return true;
+        if (n < 0) {
+            if (!(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return false;
+            n = 0;
+        }
+        skip = (size_t)n;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        const byte* base = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        base += skip;
+        len -= skip;
+        skip = 0;
+
+        bool ok;
+        if (shared[i]) {
+            size_t off = (size_t)(base - shared[i]->data);
+            ok = conn_push_segment(c, shared[i], off, off + len);
+        } else {
+            ok = conn_queue_copy(c, base, len);
+        }
+        if (!ok) return false;
+    }
+    conn_update_events(c);
+    return true;
+}
+
+size_t tcp_conn_pending(const TCPConn* c) {
+    if (!c) return 0;
+    return conn_pending(c);
+}
+
+void tcp_conn_want_drain(TCPConn* c) {
+    if (!c || c->want_drain) return;
+    c->want_drain = true;
+    conn_update_events(c);
+}
+
+bool tcp_conn_write_shared(TCPConn* c, TCPSharedBuf* b, size_t off,
+                           size_t len) {
+    if (!c || !b || c->close_now || off > b->len || len > b->len - off)
+        return false;
+    if (len == 0) return true;
+
+    bool idle = conn_pending(c) == 0;
+    if (idle) {
+        ssize_t n = send(c->fd, b->data + off, len, 0);
+        if (n == (ssize_t)len) return true;
+        if (n < 0) {
+            if (!(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return false;
+            n = 0;
+        }
+        off += (size_t)n;
+        len -= (size_t)n;
+    }
+    if (!conn_push_segment(c, b, off, off + len)) return false;
+    // A connection with output already pending is already polled for it.
+    if (idle) conn_update_events(c);
+    return true;
+}
+
 void tcp_conn_close_after_write(TCPConn* c) {
     if (!c) return;
     c->close_after_write = true;
 
-    if (c->out_len == c->out_off) {
+    if (conn_pending(c) == 0) {
         c->close_now = true;
         shutdown(c->fd, SHUT_RDWR);
     }
@@ -446,9 +729,22 @@ void tcp_conn_close_now(TCPConn* c) {
     c->close_now = true;
     c->close_after_write = false;
     c->out_len = c->out_off = 0;
+    conn_drop_segments(c);
     shutdown(c->fd, SHUT_RDWR);
 }
 
+void tcp_conn_pause_read(TCPConn* c) {
+    if (!c || c->read_paused) return;
+    c->read_paused = true;
+    conn_update_events(c);
+}
+
+void tcp_conn_resume_read(TCPConn* c) {
+    if (!c || !c->read_paused) return;
+    c->read_paused = false;
+    conn_update_events(c);
+}
+
 void tcp_conn_set_user(TCPConn* c, void* user) {
     if (!c) return;
     c->user = user;
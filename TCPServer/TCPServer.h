@@ -16,16 +16,29 @@ typedef struct TCPServer TCPServer;
 
 typedef struct TCPConn TCPConn;
 
+// Reference-counted output that many connections can queue without each
+// taking a copy, e.g. one broadcast message sent to every subscriber.
+typedef struct TCPSharedBuf TCPSharedBuf;
+
 typedef void (*tcp_on_bytes_fn)(void* ctx, TCPConn* c, const byte* data,
                                 size_t len);
 
 typedef void (*tcp_on_accept_fn)(void* ctx, TCPConn* conn);
 typedef void (*tcp_on_close_fn)(void* ctx, TCPConn* c);
+// Runs before each batch of events, where no other callback is active, and
+// at least every tick_ms while idle.
+typedef void (*tcp_on_tick_fn)(void* ctx);
+// Runs once per tcp_conn_want_drain, after all queued output has been
+// handed to the kernel.
+typedef void (*tcp_on_drain_fn)(void* ctx, TCPConn* c);
 
 typedef struct TCPServerConfig {
     tcp_on_accept_fn on_accept;
     tcp_on_bytes_fn on_bytes;
     tcp_on_close_fn on_close;
+    tcp_on_tick_fn on_tick;
+    tcp_on_drain_fn on_drain;
+    uint32_t tick_ms;
     uint16_t port;
     void* ctx;
 } TCPServerConfig;
@@ -33,12 +46,42 @@ typedef struct TCPServerConfig {
 TCPServer* tcp_server_create(const TCPServerConfig* cfg);
 int tcp_server_run(TCPServer* s);
 void tcp_server_destroy(TCPServer* s);
+// Makes tcp_server_run return from epoll_wait and run on_tick; safe to call
+// from any thread.
+void tcp_server_wake(TCPServer* s);
+
+// Returns len uninitialised bytes holding one reference. References may be
+// dropped from any thread.
+TCPSharedBuf* tcp_shared_new(size_t len);
+byte* tcp_shared_data(TCPSharedBuf* b);
+void tcp_shared_retain(TCPSharedBuf* b);
+void tcp_shared_release(TCPSharedBuf* b);
 
 bool tcp_conn_write(TCPConn* c, const void* data, size_t len);
 bool tcp_conn_write_str(TCPConn* c, const char* s);
 bool tcp_conn_writev(TCPConn* c, const struct iovec* iov, int iovcnt);
+// Queues len bytes of b from off after any pending output. Whatever the
+// kernel does not take at once is sent from b itself; the connection holds
+// a reference until then.
+bool tcp_conn_write_shared(TCPConn* c, TCPSharedBuf* b, size_t off,
+                           size_t len);
+// Writes iov in order. Where shared[i] is set, iov[i] lies inside that
+// buffer and whatever the kernel does not take of it is queued by
+// reference; other pieces are copied as with tcp_conn_writev.
+bool tcp_conn_writev_shared(TCPConn* c, const struct iovec* iov,
+                            TCPSharedBuf* const* shared, int iovcnt);
+
+// Bytes accepted by tcp_conn_write* that the kernel has not taken yet.
+size_t tcp_conn_pending(const TCPConn* c);
+// Asks for one on_drain call once the pending output reaches zero and the
+// socket is writable, so producers can refill without buffering ahead.
+void tcp_conn_want_drain(TCPConn* c);
 
 void tcp_conn_close_after_write(TCPConn* c);
+// Stops delivering on_bytes until resumed; unread data stays in the kernel
+// socket buffer so the peer sees TCP backpressure.
+void tcp_conn_pause_read(TCPConn* c);
+void tcp_conn_resume_read(TCPConn* c);
 void tcp_conn_close_now(TCPConn* c);
 
 void tcp_conn_set_user(TCPConn* c, void* user);
@@ -8,6 +8,16 @@
 #define PARSE_HEADERS_ERR_CONTENT_LENGTH  (-5)
 #define PARSE_HEADERS_ERR_ALLOC           (-6)
 
+// http_conn_decode_chunked() error codes
+#define DECODE_CHUNKED_ERR_INVALID    (-1)
+#define DECODE_CHUNKED_ERR_TOO_LARGE  (-2)
+
+// multipart_feed() / multipart_finish() error codes
+#define MULTIPART_ERR_INVALID  (-1)
+#define MULTIPART_ERR_HEADERS  (-2)
+#define MULTIPART_ERR_ALLOC    (-3)
+#define MULTIPART_ERR_IO       (-4)
+
 // add_cookie_to_request() error codes
 #define ADD_COOKIE_ERR_CAPACITY  (-1)
 #define ADD_COOKIE_ERR_NULL_ARG  (-2)
@@ -0,0 +1,1379 @@
+#include "json.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ExpressC.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Parsing runs in two stages, after simdjson. Stage 1 classifies the input
+// 64 bytes at a time into bitmasks (quotes, backslashes, structural
+// characters, whitespace), works out which bytes sit inside strings with
+// carry-free bit tricks, and writes the offset of every structural
+// character, quote and start of a number or literal to an index. Stage 2
+// walks that index, a batch at a time, checks the grammar and writes the
+// tape: one 64-bit entry per value, tag in the top byte, so skipping a
+// container is a single jump.
+
+#define TAPE_ROOT 'r'
+#define TAPE_NULL 'N'
+#define TAPE_PAYLOAD_MASK 0x00ffffffffffffffull
+// Containers keep their element count next to the index past their end;
+// counts from here up are found by walking.
+#define TAPE_COUNT_MAX 0xffffffu
+
+struct json_doc {
+  const byte *src;
+  size_t len;
+  uint64_t *tape;
+  uint32_t tape_len;
+};
+
+static uint64_t tape_entry(char tag, uint64_t payload) {
+  return (uint64_t)(byte)tag << 56 | (payload & TAPE_PAYLOAD_MASK);
+}
+
+static char tape_tag(const json_doc *d, uint32_t at) {
+  return (char)(d->tape[at] >> 56);
+}
+
+static uint64_t tape_payload(const json_doc *d, uint32_t at) {
+  return d->tape[at] & TAPE_PAYLOAD_MASK;
+}
+
+// Stage 1.
+
+struct BlockMasks {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t op;
+  uint64_t ws;
+  uint64_t ctrl;
+  // Nonzero if any byte has the high bit set.
+  uint64_t high;
+};
+
+static void classify_block(const byte *p, struct BlockMasks *m) {
+  memset(m, 0, sizeof(*m));
+#if defined(__AVX2__)
+  // Only whether any byte is non-ASCII matters, so those are collected
+  // across the block and masked once.
+  __m256i high = _mm256_setzero_si256();
+  for (int k = 0; k < 2; k++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * k));
+    // '[' and ']' become '{' and '}' with bit 5 set.
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i op = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                        _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    __m256i ctrl = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+    int shift = 32 * k;
+    m->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')))
+                << shift;
+    m->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')))
+                    << shift;
+    m->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << shift;
+    m->ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ws) << shift;
+    m->ctrl |= (uint64_t)(uint32_t)_mm256_movemask_epi8(ctrl) << shift;
+    high = _mm256_or_si256(high, v);
+  }
+  m->high = (uint32_t)_mm256_movemask_epi8(high);
+#elif defined(__SSE2__)
+  // Only whether any byte is non-ASCII matters, so those are collected
+  // across the block and masked once.
+  __m128i high = _mm_setzero_si128();
+  for (int k = 0; k < 4; k++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+    // '[' and ']' become '{' and '}' with bit 5 set.
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i op = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                     _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+    __m128i ws = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    __m128i ctrl =
+        _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+    int shift = 16 * k;
+    m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('"')))
+                << shift;
+    m->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))
+                    << shift;
+    m->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << shift;
+    m->ws |= (uint64_t)(uint16_t)_mm_movemask_epi8(ws) << shift;
+    m->ctrl |= (uint64_t)(uint16_t)_mm_movemask_epi8(ctrl) << shift;
+    high = _mm_or_si128(high, v);
+  }
+  m->high = (uint16_t)_mm_movemask_epi8(high);
+#else
+  for (int i = 0; i < 64; i++) {
+    uint64_t bit = 1ull << i;
+    byte c = p[i];
+    if (c == '"')
+      m->quote |= bit;
+    else if (c == '\\')
+      m->backslash |= bit;
+    else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' ||
+             c == ',')
+      m->op |= bit;
+    else if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+      m->ws |= bit;
+    if (c < 0x20)
+      m->ctrl |= bit;
+    if (c >= 0x80)
+      m->high |= bit;
+  }
+#endif
+}
+
+// Bit i set when an odd number of quotes lie at or before i.
+static uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+static bool is_digit(byte c) { return c >= '0' && c <= '9'; }
+
+static bool is_hex(byte c) {
+  return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
+
+// Whether the character at i, which follows a backslash, makes a valid
+// escape.
+static bool escape_valid(const byte *src, size_t len, size_t i) {
+  if (i >= len)
+    return false;
+  switch (src[i]) {
+  case '"':
+  case '\\':
+  case '/':
+  case 'b':
+  case 'f':
+  case 'n':
+  case 'r':
+  case 't':
+    return true;
+  case 'u':
+    return len - i > 4 && is_hex(src[i + 1]) && is_hex(src[i + 2]) &&
+           is_hex(src[i + 3]) && is_hex(src[i + 4]);
+  }
+  return false;
+}
+
+// Stage 1 runs this far ahead of stage 2, so the index stays small and
+// hot in cache.
+#define STAGE1_BATCH 2048
+
+struct Stage1 {
+  const byte *src;
+  size_t len;
+  size_t pos;
+  // State carried from one block to the next.
+  uint64_t prev_escaped;
+  uint64_t prev_in_string;
+  uint64_t prev_scalar;
+  uint64_t ctrl_in_string;
+  uint64_t high;
+  bool bad_escape;
+  size_t count;
+  // Room for a whole batch plus the overshoot of the last block's flatten.
+  uint32_t index[STAGE1_BATCH + 8];
+};
+
+static void stage1_block(struct Stage1 *s, const byte *p, uint32_t base) {
+  struct BlockMasks m;
+  classify_block(p, &m);
+
+  // Characters escaped by a backslash: runs of backslashes cancel in
+  // pairs, so only those after an odd-length run count. Adding the run
+  // starts at odd positions carries each run to its end. Most blocks have
+  // no backslashes at all.
+  uint64_t escaped = 0;
+  if ((m.backslash | s->prev_escaped) != 0) {
+    const uint64_t even = 0x5555555555555555ull;
+    uint64_t backslash = m.backslash & ~s->prev_escaped;
+    uint64_t follows_escape = backslash << 1 | s->prev_escaped;
+    uint64_t odd_starts = backslash & ~even & ~follows_escape;
+    uint64_t even_runs;
+    s->prev_escaped =
+        __builtin_add_overflow(odd_starts, backslash, &even_runs) ? 1 : 0;
+    escaped = (even ^ (even_runs << 1)) & follows_escape;
+
+    for (uint64_t e = escaped; e != 0; e &= e - 1) {
+      if (!escape_valid(s->src, s->len, base + (size_t)__builtin_ctzll(e)))
+        s->bad_escape = true;
+    }
+  }
+
+  uint64_t quote = m.quote & ~escaped;
+  // Includes each opening quote, excludes each closing one.
+  uint64_t in_string = prefix_xor(quote) ^ s->prev_in_string;
+  s->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+  // Numbers and literals are marked where they start.
+  uint64_t scalar = ~(m.op | m.ws | quote);
+  uint64_t follows_scalar = scalar << 1 | s->prev_scalar;
+  s->prev_scalar = scalar >> 63;
+  uint64_t structural =
+      ((m.op | (scalar & ~follows_scalar)) & ~in_string) | quote;
+
+  s->ctrl_in_string |= m.ctrl & in_string;
+  s->high |= m.high;
+
+  // Offsets are written eight at a time whatever the count, which keeps
+  // the loop branch predictable; the index has room for the overshoot.
+  uint32_t *out = s->index + s->count;
+  int n = __builtin_popcountll(structural);
+  for (int i = 0; i < n; i += 8) {
+    for (int k = 0; k < 8; k++) {
+      out[i + k] = base + (uint32_t)__builtin_ctzll(structural | 1ull << 63);
+      structural &= structural - 1;
+    }
+  }
+  s->count += (size_t)n;
+}
+
+// Indexes the next batch of input, skipping batches that are all
+// whitespace or string contents. Returns 0 at the end of the input.
+static size_t stage1_fill(struct Stage1 *s) {
+  s->count = 0;
+  while (s->count == 0 && s->pos < s->len) {
+    size_t end = s->len - s->pos > STAGE1_BATCH ? s->pos + STAGE1_BATCH
+                                                 : s->len;
+    for (; end - s->pos >= 64; s->pos += 64)
+      stage1_block(s, s->src + s->pos, (uint32_t)s->pos);
+    if (s->pos < end) {
+      // The tail is padded with whitespace rather than read past the body.
+      byte tail[64];
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, s->src + s->pos, end - s->pos);
+      stage1_block(s, tail, (uint32_t)s->pos);
+      s->pos = end;
+    }
+  }
+  return s->count;
+}
+
+static bool json_utf8_valid(const byte *s, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    byte c = s[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+    size_t n;
+    uint32_t cp;
+    if ((c & 0xe0) == 0xc0) {
+      n = 1;
+      cp = c & 0x1f;
+    } else if ((c & 0xf0) == 0xe0) {
+      n = 2;
+      cp = c & 0x0f;
+    } else if ((c & 0xf8) == 0xf0) {
+      n = 3;
+      cp = c & 0x07;
+    } else {
+      return false;
+    }
+    if (len - i <= n)
+      return false;
+    for (size_t k = 1; k <= n; k++) {
+      if ((s[i + k] & 0xc0) != 0x80)
+        return false;
+      cp = cp << 6 | (s[i + k] & 0x3f);
+    }
+    if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) ||
+        (n == 3 && cp < 0x10000) || cp > 0x10ffff ||
+        (cp >= 0xd800 && cp <= 0xdfff))
+      return false;
+    i += n + 1;
+  }
+  return true;
+}
+
+// Stage 2.
+
+struct Frame {
+  uint32_t open;
+  uint32_t count;
+  bool object;
+};
+
+// Whether a number or literal may end before p.
+static bool at_delimiter(const byte *src, size_t len, size_t p) {
+  if (p == len)
+    return true;
+  byte c = src[p];
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' ||
+         c == '}' || c == ']' || c == ':';
+}
+
+// Returns the end of the number starting at p, or 0 if it is malformed.
+static size_t scan_number(const byte *src, size_t len, size_t p) {
+  if (src[p] == '-')
+    p++;
+  if (p == len)
+    return 0;
+  if (src[p] == '0') {
+    p++;
+  } else if (src[p] >= '1' && src[p] <= '9') {
+    while (p < len && is_digit(src[p]))
+      p++;
+  } else {
+    return 0;
+  }
+  if (p < len && src[p] == '.') {
+    p++;
+    if (p == len || !is_digit(src[p]))
+      return 0;
+    while (p < len && is_digit(src[p]))
+      p++;
+  }
+  if (p < len && (src[p] | 0x20) == 'e') {
+    p++;
+    if (p < len && (src[p] == '+' || src[p] == '-'))
+      p++;
+    if (p == len || !is_digit(src[p]))
+      return 0;
+    while (p < len && is_digit(src[p]))
+      p++;
+  }
+  return at_delimiter(src, len, p) ? p : 0;
+}
+
+// Makes room for need more entries after the first used.
+static bool tape_reserve(json_doc *d, size_t *cap, size_t used, size_t need,
+                         json_alloc_fn alloc, void *ctx) {
+  if (*cap - used >= need)
+    return true;
+  size_t n = *cap * 2 > used + need ? *cap * 2 : used + need;
+  uint64_t *tape = (uint64_t *)alloc(ctx, n * sizeof(uint64_t));
+  if (tape == NULL)
+    return false;
+  memcpy(tape, d->tape, used * sizeof(uint64_t));
+  d->tape = tape;
+  *cap = n;
+  return true;
+}
+
+static bool stage2(json_doc *d, struct Stage1 *s, json_alloc_fn alloc,
+                   void *ctx) {
+  const byte *src = d->src;
+  size_t len = d->len;
+  // Even dense documents rarely need more than one entry per three bytes.
+  size_t cap = len / 3 + 16;
+  uint64_t *tape = d->tape = (uint64_t *)alloc(ctx, cap * sizeof(uint64_t));
+  if (tape == NULL)
+    return false;
+  uint32_t t = 1;
+  struct Frame stack[JSON_MAX_DEPTH];
+  struct Frame *top = NULL;
+  size_t depth = 0;
+  size_t k = 0;
+  uint32_t pos;
+  byte c;
+
+  // Each state reads the next indexed character into pos and c. Every
+  // index entry adds at most one tape entry, so room is made per batch.
+#define ADVANCE()                                                            \
+  do {                                                                       \
+    if (k == s->count) {                                                     \
+      if (stage1_fill(s) == 0 ||                                             \
+          !tape_reserve(d, &cap, t, s->count + 2, alloc, ctx))               \
+        return false;                                                        \
+      tape = d->tape;                                                        \
+      k = 0;                                                                 \
+    }                                                                        \
+    pos = s->index[k++];                                                     \
+    c = src[pos];                                                            \
+  } while (0)
+
+  ADVANCE();
+value:
+  switch (c) {
+  case '{':
+  case '[':
+    if (depth == JSON_MAX_DEPTH)
+      return false;
+    top = &stack[depth++];
+    top->open = t;
+    top->count = 0;
+    top->object = c == '{';
+    tape[t++] = tape_entry((char)c, 0);
+    ADVANCE();
+    if (c == (top->object ? '}' : ']'))
+      goto close;
+    if (top->object)
+      goto key;
+    top->count++;
+    goto value;
+  case '"': {
+    // Stage 1 indexes both quotes and nothing in between.
+    uint32_t open = pos;
+    ADVANCE();
+    tape[t++] = tape_entry('"', open + 1);
+    tape[t++] = pos - open - 1;
+    goto after_value;
+  }
+  case 't':
+    if (len - pos < 4 || memcmp(src + pos, "true", 4) != 0 ||
+        !at_delimiter(src, len, pos + 4))
+      return false;
+    tape[t++] = tape_entry('t', 0);
+    goto after_value;
+  case 'f':
+    if (len - pos < 5 || memcmp(src + pos, "false", 5) != 0 ||
+        !at_delimiter(src, len, pos + 5))
+      return false;
+    tape[t++] = tape_entry('f', 0);
+    goto after_value;
+  case 'n':
+    if (len - pos < 4 || memcmp(src + pos, "null", 4) != 0 ||
+        !at_delimiter(src, len, pos + 4))
+      return false;
+    tape[t++] = tape_entry(TAPE_NULL, 0);
+    goto after_value;
+  default: {
+    if (c != '-' && !is_digit(c))
+      return false;
+    size_t end = scan_number(src, len, pos);
+    if (end == 0)
+      return false;
+    tape[t++] = tape_entry('n', pos | (uint64_t)(end - pos) << 32);
+    goto after_value;
+  }
+  }
+
+key:
+  // A member name, then its colon.
+  if (c != '"')
+    return false;
+  top->count++;
+  {
+    uint32_t open = pos;
+    ADVANCE();
+    tape[t++] = tape_entry('"', open + 1);
+    tape[t++] = pos - open - 1;
+  }
+  ADVANCE();
+  if (c != ':')
+    return false;
+  ADVANCE();
+  goto value;
+
+after_value:
+  if (depth == 0) {
+    if (k != s->count || stage1_fill(s) != 0)
+      return false;
+    tape[0] = tape_entry(TAPE_ROOT, t);
+    d->tape_len = t;
+    return true;
+  }
+  ADVANCE();
+  if (c == ',') {
+    ADVANCE();
+    if (top->object)
+      goto key;
+    top->count++;
+    goto value;
+  }
+  if (c != (top->object ? '}' : ']'))
+    return false;
+
+close: {
+  uint32_t n = top->count < TAPE_COUNT_MAX ? top->count : TAPE_COUNT_MAX;
+  tape[top->open] = tape_entry(top->object ? '{' : '[',
+                               (uint64_t)(t + 1) | (uint64_t)n << 32);
+  tape[t++] = tape_entry((char)c, top->open);
+  depth--;
+  top = depth > 0 ? &stack[depth - 1] : NULL;
+  goto after_value;
+}
+#undef ADVANCE
+}
+
+json_doc *json_parse(const byte *src, size_t len, json_alloc_fn alloc,
+                     void *ctx) {
+  if (src == NULL || alloc == NULL || len == 0 || len >= UINT32_MAX)
+    return NULL;
+
+  json_doc *d = (json_doc *)alloc(ctx, sizeof(*d));
+  if (d == NULL)
+    return NULL;
+  d->src = src;
+  d->len = len;
+
+  struct Stage1 s;
+  memset(&s, 0, offsetof(struct Stage1, index));
+  s.src = src;
+  s.len = len;
+  // Stage 2 pulls batches from stage 1 as it goes; what stage 1 finds
+  // wrong inside strings is only checked once the structure is sound.
+  if (!stage2(d, &s, alloc, ctx))
+    return NULL;
+  if (s.prev_in_string != 0 || s.ctrl_in_string != 0 || s.bad_escape ||
+      (s.high != 0 && !json_utf8_valid(src, len)))
+    return NULL;
+  return d;
+}
+
+// Accessors.
+
+static const json_value json_missing = {NULL, 0, false};
+
+json_value json_root(const json_doc *doc) {
+  if (doc == NULL)
+    return json_missing;
+  return (json_value){doc, 1, false};
+}
+
+json_type json_typeof(json_value v) {
+  if (v.doc == NULL)
+    return JSON_MISSING;
+  switch (tape_tag(v.doc, v.at)) {
+  case '{':
+    return JSON_OBJECT;
+  case '[':
+    return JSON_ARRAY;
+  case '"':
+    return JSON_STRING;
+  case 'n':
+    return JSON_NUMBER;
+  case 't':
+    return JSON_TRUE;
+  case 'f':
+    return JSON_FALSE;
+  case TAPE_NULL:
+    return JSON_NULL;
+  }
+  return JSON_MISSING;
+}
+
+// The tape index just past v.
+static uint32_t tape_skip(const json_doc *d, uint32_t at) {
+  switch (tape_tag(d, at)) {
+  case '{':
+  case '[':
+    return (uint32_t)tape_payload(d, at);
+  case '"':
+    return at + 2;
+  }
+  return at + 1;
+}
+
+json_value json_child(json_value v) {
+  json_type type = json_typeof(v);
+  if (type != JSON_OBJECT && type != JSON_ARRAY)
+    return json_missing;
+  uint32_t first = v.at + 1;
+  char tag = tape_tag(v.doc, first);
+  if (tag == '}' || tag == ']')
+    return json_missing;
+  if (type == JSON_OBJECT)
+    return (json_value){v.doc, first + 2, true};
+  return (json_value){v.doc, first, false};
+}
+
+json_value json_next(json_value v) {
+  if (v.doc == NULL)
+    return json_missing;
+  uint32_t next = tape_skip(v.doc, v.at);
+  char tag = tape_tag(v.doc, next);
+  if (tag == '}' || tag == ']')
+    return json_missing;
+  if (v.member)
+    return (json_value){v.doc, next + 2, true};
+  return (json_value){v.doc, next, false};
+}
+
+const char *json_key(json_value member, size_t *len) {
+  if (member.doc == NULL || !member.member)
+    return NULL;
+  json_value key = {member.doc, member.at - 2, false};
+  return json_str(key, len, NULL);
+}
+
+size_t json_len(json_value v) {
+  json_type type = json_typeof(v);
+  if (type != JSON_OBJECT && type != JSON_ARRAY)
+    return 0;
+  uint32_t n = (uint32_t)(tape_payload(v.doc, v.at) >> 32);
+  if (n < TAPE_COUNT_MAX)
+    return n;
+  size_t count = 0;
+  for (json_value c = json_child(v); c.doc != NULL; c = json_next(c))
+    count++;
+  return count;
+}
+
+json_value json_at(json_value v, size_t i) {
+  if (json_typeof(v) != JSON_ARRAY)
+    return json_missing;
+  json_value c = json_child(v);
+  while (c.doc != NULL && i-- > 0)
+    c = json_next(c);
+  return c;
+}
+
+// Compares a key against name. Escapes only ever shorten a string, so a
+// key is decoded only when it is longer than name and has some.
+static bool key_equals(json_value key, const char *name, size_t name_len) {
+  size_t len;
+  const char *raw = json_str(key, &len, NULL);
+  if (raw == NULL || len < name_len)
+    return false;
+  if (len == name_len)
+    return memcmp(raw, name, len) == 0 && memchr(raw, '\\', len) == NULL;
+  if (memchr(raw, '\\', len) == NULL)
+    return false;
+  char stack[256];
+  char *buf = name_len < sizeof(stack) ? stack : (char *)malloc(name_len + 1);
+  if (buf == NULL)
+    return false;
+  size_t n = json_str_copy(key, buf, name_len + 1);
+  bool equal = n == name_len && memcmp(buf, name, name_len) == 0;
+  if (buf != stack)
+    free(buf);
+  return equal;
+}
+
+json_value json_field(json_value v, const char *key, size_t key_len) {
+  if (json_typeof(v) != JSON_OBJECT || key == NULL)
+    return json_missing;
+  for (json_value c = json_child(v); c.doc != NULL; c = json_next(c)) {
+    if (key_equals((json_value){c.doc, c.at - 2, false}, key, key_len))
+      return c;
+  }
+  return json_missing;
+}
+
+json_value json_get(json_value v, const char *path) {
+  if (path == NULL)
+    return json_missing;
+  const char *p = path;
+  while (*p != '\0' && v.doc != NULL) {
+    if (*p == '.') {
+      p++;
+      continue;
+    }
+    if (*p == '[') {
+      char *end;
+      unsigned long long i = strtoull(p + 1, &end, 10);
+      if (end == p + 1 || *end != ']')
+        return json_missing;
+      v = json_at(v, (size_t)i);
+      p = end + 1;
+      continue;
+    }
+    const char *start = p;
+    bool digits = true;
+    while (*p != '\0' && *p != '.' && *p != '[') {
+      digits = digits && *p >= '0' && *p <= '9';
+      p++;
+    }
+    if (digits && json_typeof(v) == JSON_ARRAY)
+      v = json_at(v, (size_t)strtoull(start, NULL, 10));
+    else
+      v = json_field(v, start, (size_t)(p - start));
+  }
+  return v;
+}
+
+bool json_bool(json_value v, bool *out) {
+  json_type type = json_typeof(v);
+  if (type != JSON_TRUE && type != JSON_FALSE)
+    return false;
+  if (out != NULL)
+    *out = type == JSON_TRUE;
+  return true;
+}
+
+static const byte *number_text(json_value v, size_t *len) {
+  if (json_typeof(v) != JSON_NUMBER)
+    return NULL;
+  uint64_t payload = tape_payload(v.doc, v.at);
+  *len = (size_t)(payload >> 32);
+  return v.doc->src + (uint32_t)payload;
+}
+
+bool json_i64(json_value v, int64_t *out) {
+  size_t len;
+  const byte *s = number_text(v, &len);
+  if (s == NULL)
+    return false;
+  bool negative = s[0] == '-';
+  uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+  uint64_t n = 0;
+  for (size_t i = negative ? 1 : 0; i < len; i++) {
+    if (!is_digit(s[i]))
+      return false;
+    uint64_t d = (uint64_t)(s[i] - '0');
+    if (n > (limit - d) / 10)
+      return false;
+    n = n * 10 + d;
+  }
+  if (out != NULL)
+    *out = negative ? (int64_t)(0 - n) : (int64_t)n;
+  return true;
+}
+
+bool json_double(json_value v, double *out) {
+  size_t len;
+  const byte *s = number_text(v, &len);
+  if (s == NULL)
+    return false;
+  // strtod wants a terminator, which the body does not have.
+  char stack[64];
+  char *buf = len < sizeof(stack) ? stack : (char *)malloc(len + 1);
+  if (buf == NULL)
+    return false;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  double d = strtod(buf, NULL);
+  if (buf != stack)
+    free(buf);
+  if (out != NULL)
+    *out = d;
+  return true;
+}
+
+const char *json_str(json_value v, size_t *len, bool *escaped) {
+  if (json_typeof(v) != JSON_STRING)
+    return NULL;
+  const char *s = (const char *)v.doc->src + tape_payload(v.doc, v.at);
+  size_t n = (size_t)v.doc->tape[v.at + 1];
+  if (len != NULL)
+    *len = n;
+  if (escaped != NULL)
+    *escaped = memchr(s, '\\', n) != NULL;
+  return s;
+}
+
+static uint32_t hex4(const byte *p) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    byte c = p[i];
+    v = v << 4 | (uint32_t)(is_digit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+  }
+  return v;
+}
+
+size_t json_str_copy(json_value v, char *buf, size_t cap) {
+  size_t len;
+  const byte *s = (const byte *)json_str(v, &len, NULL);
+  if (s == NULL)
+    return SIZE_MAX;
+
+  size_t n = 0;
+  // Bytes go to buf only while they fit; n keeps counting.
+#define PUT(ch)                                                              \
+  do {                                                                       \
+    if (n + 1 < cap)                                                         \
+      buf[n] = (char)(ch);                                                   \
+    n++;                                                                     \
+  } while (0)
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] != '\\') {
+      PUT(s[i]);
+      continue;
+    }
+    byte e = s[++i];
+    switch (e) {
+    case 'b':
+      PUT('\b');
+      break;
+    case 'f':
+      PUT('\f');
+      break;
+    case 'n':
+      PUT('\n');
+      break;
+    case 'r':
+      PUT('\r');
+      break;
+    case 't':
+      PUT('\t');
+      break;
+    case 'u': {
+      uint32_t cp = hex4(s + i + 1);
+      i += 4;
+      if (cp >= 0xd800 && cp <= 0xdbff && i + 6 < len && s[i + 1] == '\\' &&
+          s[i + 2] == 'u') {
+        uint32_t lo = hex4(s + i + 3);
+        if (lo >= 0xdc00 && lo <= 0xdfff) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          i += 6;
+        }
+      }
+      // Unpaired surrogates cannot be encoded.
+      if (cp >= 0xd800 && cp <= 0xdfff)
+        cp = 0xfffd;
+      if (cp < 0x80) {
+        PUT(cp);
+      } else if (cp < 0x800) {
+        PUT(0xc0 | cp >> 6);
+        PUT(0x80 | (cp & 0x3f));
+      } else if (cp < 0x10000) {
+        PUT(0xe0 | cp >> 12);
+        PUT(0x80 | (cp >> 6 & 0x3f));
+        PUT(0x80 | (cp & 0x3f));
+      } else {
+        PUT(0xf0 | cp >> 18);
+        PUT(0x80 | (cp >> 12 & 0x3f));
+        PUT(0x80 | (cp >> 6 & 0x3f));
+        PUT(0x80 | (cp & 0x3f));
+      }
+      break;
+    }
+    default:
+      PUT(e);
+      break;
+    }
+  }
+#undef PUT
+  if (cap > 0)
+    buf[n < cap ? n : cap - 1] = '\0';
+  return n;
+}
+
+// Writing.
+
+#define JSON_WRITER_CHUNK 4096
+
+// Output collects in run, a stretch of response scratch memory, and goes
+// out as one segment per chunk. Chunks double in size so a large body
+// takes a handful of allocations.
+struct JsonWriter {
+  byte *run;
+  size_t run_len;
+  size_t run_cap;
+  size_t next_cap;
+  size_t depth;
+  bool done;
+  bool failed;
+  // Bit d - 1 describes the container open at depth d.
+  uint64_t object[JSON_MAX_DEPTH / 64];
+  uint64_t nonempty[JSON_MAX_DEPTH / 64];
+};
+
+static struct JsonWriter *writer_of(http_response *res) {
+  if (res == NULL)
+    return NULL;
+  struct JsonWriter *w = (struct JsonWriter *)res->json;
+  if (w == NULL) {
+    // The state and the first chunk share one allocation.
+    w = (struct JsonWriter *)alloc_response_buffer(
+        res, sizeof(*w) + JSON_WRITER_CHUNK);
+    if (w == NULL)
+      return NULL;
+    memset(w, 0, sizeof(*w));
+    w->run = (byte *)(w + 1);
+    w->run_cap = JSON_WRITER_CHUNK;
+    w->next_cap = 2 * JSON_WRITER_CHUNK;
+    res->json = w;
+  }
+  return w->failed ? NULL : w;
+}
+
+static bool writer_flush(http_response *res, struct JsonWriter *w) {
+  if (w->run_len == 0)
+    return true;
+  if (!append_response_segment(res, w->run, w->run_len, SEGMENT_BORROWED))
+    return false;
+  w->run += w->run_len;
+  w->run_cap -= w->run_len;
+  w->run_len = 0;
+  return true;
+}
+
+static byte *writer_reserve(http_response *res, struct JsonWriter *w,
+                            size_t n) {
+  if (w->run_cap - w->run_len >= n)
+    return w->run + w->run_len;
+  if (!writer_flush(res, w))
+    return NULL;
+  size_t cap = n > w->next_cap ? n : w->next_cap;
+  w->run = (byte *)alloc_response_buffer(res, cap);
+  if (w->run == NULL)
+    return NULL;
+  w->run_cap = cap;
+  w->next_cap *= 2;
+  return w->run;
+}
+
+static bool writer_copy(http_response *res, struct JsonWriter *w,
+                        const void *p, size_t n) {
+  byte *dst = writer_reserve(res, w, n);
+  if (dst == NULL)
+    return false;
+  memcpy(dst, p, n);
+  w->run_len += n;
+  return true;
+}
+
+static bool writer_special(byte c) { return c == '"' || c == '\\' || c < 0x20; }
+
+#if defined(__SSE2__)
+static int writer_special_mask(__m128i v) {
+  __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  hit = _mm_or_si128(
+      hit, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v));
+  return _mm_movemask_epi8(hit);
+}
+#endif
+
+// Index of the first byte of s that needs escaping, or len.
+static size_t writer_scan(const byte *s, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    int mask = writer_special_mask(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  // Keys and short values are cheaper to check byte by byte than to pad.
+  if (len - i >= 8) {
+    byte tail[16];
+    memset(tail, ' ', sizeof(tail));
+    memcpy(tail, s + i, len - i);
+    int mask = writer_special_mask(_mm_loadu_si128((const __m128i *)tail));
+    return mask != 0 ? i + (size_t)__builtin_ctz((unsigned)mask) : len;
+  }
+#endif
+  for (; i < len; i++) {
+    if (writer_special(s[i]))
+      return i;
+  }
+  return len;
+}
+
+// Writes p as a string, preceded by sep if nonzero and followed by end if
+// nonzero. Strings with nothing to escape go out in one copy.
+static bool writer_string(http_response *res, struct JsonWriter *w, char sep,
+                          const char *p, size_t n, char end) {
+  const byte *s = (const byte *)p;
+  size_t clean = writer_scan(s, n);
+  if (clean == n) {
+    byte *dst = writer_reserve(res, w, n + 4);
+    if (dst == NULL)
+      return false;
+    byte *o = dst;
+    if (sep != 0)
+      *o++ = (byte)sep;
+    *o++ = '"';
+    memcpy(o, s, n);
+    o += n;
+    *o++ = '"';
+    if (end != 0)
+      *o++ = (byte)end;
+    w->run_len += (size_t)(o - dst);
+    return true;
+  }
+
+  char open[2] = {sep, '"'};
+  if (!writer_copy(res, w, sep != 0 ? open : open + 1, sep != 0 ? 2 : 1))
+    return false;
+  for (bool first = true; n > 0; first = false) {
+    if (!first)
+      clean = writer_scan(s, n);
+    if (clean > 0 && !writer_copy(res, w, s, clean))
+      return false;
+    if (clean == n)
+      break;
+
+    char esc[6] = {'\\', 0};
+    size_t esc_len = 2;
+    switch (s[clean]) {
+    case '"':
+    case '\\':
+      esc[1] = (char)s[clean];
+      break;
+    case '\b':
+      esc[1] = 'b';
+      break;
+    case '\f':
+      esc[1] = 'f';
+      break;
+    case '\n':
+      esc[1] = 'n';
+      break;
+    case '\r':
+      esc[1] = 'r';
+      break;
+    case '\t':
+      esc[1] = 't';
+      break;
+    default:
+      memcpy(esc + 1, "u00", 3);
+      esc[4] = "0123456789abcdef"[s[clean] >> 4];
+      esc[5] = "0123456789abcdef"[s[clean] & 15];
+      esc_len = 6;
+      break;
+    }
+    if (!writer_copy(res, w, esc, esc_len))
+      return false;
+    s += clean + 1;
+    n -= clean + 1;
+  }
+  char close[2] = {'"', end};
+  return writer_copy(res, w, close, end != 0 ? 2 : 1);
+}
+
+static const char writer_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+// Writes v in decimal, two digits per division, right-aligned to end, and
+// returns where it starts.
+static char *writer_format_u64(char *end, uint64_t v) {
+  char *p = end;
+  while (v >= 100) {
+    p -= 2;
+    memcpy(p, writer_pairs + (v % 100) * 2, 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, writer_pairs + v * 2, 2);
+  } else {
+    *--p = (char)('0' + v);
+  }
+  return p;
+}
+
+static bool writer_u64(http_response *res, struct JsonWriter *w, uint64_t v,
+                       bool negative) {
+  char digits[21];
+  char *p = writer_format_u64(digits + sizeof(digits), v);
+  if (negative)
+    *--p = '-';
+  return writer_copy(res, w, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+static bool writer_i64(http_response *res, struct JsonWriter *w, int64_t v) {
+  if (v < 0)
+    return writer_u64(res, w, (uint64_t)0 - (uint64_t)v, true);
+  return writer_u64(res, w, (uint64_t)v, false);
+}
+
+// Writes the shortest decimal that reads back as d, which must be finite,
+// and returns its length; dst needs 32 bytes. Values with few decimal
+// places, the common case for prices, ratios and timings, come out of
+// integer arithmetic: d scaled by the smallest power of ten that gives an
+// integer below 2^53 which divides back to d (both operands exact, so the
+// quotient rounds the way a parser reading the digits would). The rest go
+// through printf at increasing precision.
+static size_t writer_format_double(char *dst, double d) {
+  static const double scale[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+  static const uint64_t scale_int[] = {1ull,
+                                       10ull,
+                                       100ull,
+                                       1000ull,
+                                       10000ull,
+                                       100000ull,
+                                       1000000ull,
+                                       10000000ull,
+                                       100000000ull,
+                                       1000000000ull,
+                                       10000000000ull,
+                                       100000000000ull,
+                                       1000000000000ull,
+                                       10000000000000ull,
+                                       100000000000000ull,
+                                       1000000000000000ull,
+                                       10000000000000000ull,
+                                       100000000000000000ull};
+  bool negative = signbit(d);
+  double a = negative ? -d : d;
+  if (a < 9007199254740992.0) {
+    for (size_t k = 0; k < sizeof(scale) / sizeof(scale[0]); k++) {
+      double scaled = a * scale[k];
+      if (scaled >= 9007199254740992.0)
+        break;
+      // The product itself may be rounded off an integer.
+      uint64_t m = (uint64_t)(scaled + 0.5);
+      if ((double)m / scale[k] != a)
+        continue;
+
+      char digits[32];
+      char *end = digits + sizeof(digits);
+      char *p = end;
+      if (k > 0) {
+        // Fraction digits, zero-padded, then the point.
+        char *frac = writer_format_u64(end, m % scale_int[k]);
+        while (frac > end - k)
+          *--frac = '0';
+        p = frac;
+        *--p = '.';
+      }
+      p = writer_format_u64(p, m / scale_int[k]);
+      if (negative)
+        *--p = '-';
+      size_t n = (size_t)(end - p);
+      memcpy(dst, p, n);
+      return n;
+    }
+  }
+
+  int n = 0;
+  for (int precision = 15; precision <= 17; precision++) {
+    n = snprintf(dst, 32, "%.*g", precision, d);
+    if (strtod(dst, NULL) == d)
+      break;
+  }
+  return (size_t)n;
+}
+
+static bool writer_double(http_response *res, struct JsonWriter *w,
+                          double v) {
+  if (!isfinite(v))
+    return writer_copy(res, w, "null", 4);
+  byte *dst = writer_reserve(res, w, 32);
+  if (dst == NULL)
+    return false;
+  w->run_len += writer_format_double((char *)dst, v);
+  return true;
+}
+
+static bool bit_get(const uint64_t *bits, size_t i) {
+  return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void bit_set(uint64_t *bits, size_t i, bool on) {
+  if (on)
+    bits[i / 64] |= 1ull << (i % 64);
+  else
+    bits[i / 64] &= ~(1ull << (i % 64));
+}
+
+// Starts a value: a member of the innermost object if key is set, or an
+// element of the innermost array (or the top-level value) if not. Writes
+// the separator and key.
+static struct JsonWriter *writer_item(http_response *res, const char *key,
+                                      size_t key_len) {
+  struct JsonWriter *w = writer_of(res);
+  if (w == NULL)
+    return NULL;
+  bool ok;
+  if (w->depth == 0) {
+    ok = key == NULL && !w->done;
+  } else {
+    size_t top = w->depth - 1;
+    char sep = bit_get(w->nonempty, top) ? ',' : 0;
+    ok = bit_get(w->object, top) == (key != NULL);
+    bit_set(w->nonempty, top, true);
+    if (ok && key != NULL)
+      ok = writer_string(res, w, sep, key, key_len, ':');
+    else if (ok && sep != 0)
+      ok = writer_copy(res, w, ",", 1);
+  }
+  if (!ok) {
+    w->failed = true;
+    return NULL;
+  }
+  return w;
+}
+
+static bool writer_done(struct JsonWriter *w, bool ok) {
+  if (!ok)
+    w->failed = true;
+  return ok;
+}
+
+static bool writer_open(http_response *res, const char *key, bool object) {
+  struct JsonWriter *w =
+      writer_item(res, key, key != NULL ? strlen(key) : 0);
+  if (w == NULL)
+    return false;
+  if (w->depth == JSON_MAX_DEPTH)
+    return writer_done(w, false);
+  bit_set(w->object, w->depth, object);
+  bit_set(w->nonempty, w->depth, false);
+  w->depth++;
+  return writer_done(w, writer_copy(res, w, object ? "{" : "[", 1));
+}
+
+static bool writer_close(http_response *res, bool object) {
+  struct JsonWriter *w = writer_of(res);
+  if (w == NULL)
+    return false;
+  if (w->depth == 0 || bit_get(w->object, w->depth - 1) != object)
+    return writer_done(w, false);
+  w->depth--;
+  if (!writer_copy(res, w, object ? "}" : "]", 1))
+    return writer_done(w, false);
+  if (w->depth > 0)
+    return true;
+
+  w->done = true;
+  if (!writer_flush(res, w))
+    return writer_done(w, false);
+  if (get_response_header(res, "Content-Type") == NULL)
+    return set_response_header(res, "Content-Type", "application/json");
+  return true;
+}
+
+bool json_begin_object(http_response *res) {
+  return writer_open(res, NULL, true);
+}
+
+bool json_end_object(http_response *res) { return writer_close(res, true); }
+
+bool json_begin_array(http_response *res) {
+  return writer_open(res, NULL, false);
+}
+
+bool json_end_array(http_response *res) { return writer_close(res, false); }
+
+// Scalars may not stand at the top level; writer_item only allows that
+// for containers.
+static struct JsonWriter *writer_scalar(http_response *res, const char *key) {
+  struct JsonWriter *w = writer_of(res);
+  if (w == NULL)
+    return NULL;
+  if (w->depth == 0) {
+    w->failed = true;
+    return NULL;
+  }
+  return writer_item(res, key, key != NULL ? strlen(key) : 0);
+}
+
+// A NULL key or string fails the writer before anything is written, like
+// any other misuse.
+static bool writer_reject(http_response *res) {
+  struct JsonWriter *w = writer_of(res);
+  if (w != NULL)
+    w->failed = true;
+  return false;
+}
+
+static struct JsonWriter *writer_member(http_response *res, const char *key) {
+  if (key == NULL) {
+    (void)writer_reject(res);
+    return NULL;
+  }
+  return writer_scalar(res, key);
+}
+
+bool json_kv_strn(http_response *res, const char *key, const char *value,
+                  size_t len) {
+  if (value == NULL)
+    return writer_reject(res);
+  struct JsonWriter *w = writer_member(res, key);
+  return w != NULL &&
+         writer_done(w, writer_string(res, w, 0, value, len, 0));
+}
+
+bool json_kv_str(http_response *res, const char *key, const char *value) {
+  return value != NULL ? json_kv_strn(res, key, value, strlen(value))
+                       : writer_reject(res);
+}
+
+bool json_kv_i64(http_response *res, const char *key, int64_t value) {
+  struct JsonWriter *w = writer_member(res, key);
+  return w != NULL && writer_done(w, writer_i64(res, w, value));
+}
+
+bool json_kv_u64(http_response *res, const char *key, uint64_t value) {
+  struct JsonWriter *w = writer_member(res, key);
+  return w != NULL && writer_done(w, writer_u64(res, w, value, false));
+}
+
+bool json_kv_double(http_response *res, const char *key, double value) {
+  struct JsonWriter *w = writer_member(res, key);
+  return w != NULL && writer_done(w, writer_double(res, w, value));
+}
+
+bool json_kv_bool(http_response *res, const char *key, bool value) {
+  struct JsonWriter *w = writer_member(res, key);
+  return w != NULL &&
+         writer_done(w, value ? writer_copy(res, w, "true", 4)
+                              : writer_copy(res, w, "false", 5));
+}
+
+bool json_kv_null(http_response *res, const char *key) {
+  struct JsonWriter *w = writer_member(res, key);
+  return w != NULL && writer_done(w, writer_copy(res, w, "null", 4));
+}
+
+bool json_kv_object(http_response *res, const char *key) {
+  return key != NULL ? writer_open(res, key, true) : writer_reject(res);
+}
+
+bool json_kv_array(http_response *res, const char *key) {
+  return key != NULL ? writer_open(res, key, false) : writer_reject(res);
+}
+
+bool json_add_strn(http_response *res, const char *value, size_t len) {
+  if (value == NULL)
+    return writer_reject(res);
+  struct JsonWriter *w = writer_scalar(res, NULL);
+  return w != NULL &&
+         writer_done(w, writer_string(res, w, 0, value, len, 0));
+}
+
+bool json_add_str(http_response *res, const char *value) {
+  return value != NULL ? json_add_strn(res, value, strlen(value))
+                       : writer_reject(res);
+}
+
+bool json_add_i64(http_response *res, int64_t value) {
+  struct JsonWriter *w = writer_scalar(res, NULL);
+  return w != NULL && writer_done(w, writer_i64(res, w, value));
+}
+
+bool json_add_u64(http_response *res, uint64_t value) {
+  struct JsonWriter *w = writer_scalar(res, NULL);
+  return w != NULL && writer_done(w, writer_u64(res, w, value, false));
+}
+
+bool json_add_double(http_response *res, double value) {
+  struct JsonWriter *w = writer_scalar(res, NULL);
+  return w != NULL && writer_done(w, writer_double(res, w, value));
+}
+
+bool json_add_bool(http_response *res, bool value) {
+  struct JsonWriter *w = writer_scalar(res, NULL);
+  return w != NULL &&
+         writer_done(w, value ? writer_copy(res, w, "true", 4)
+                              : writer_copy(res, w, "false", 5));
+}
+
+bool json_add_null(http_response *res) {
+  struct JsonWriter *w = writer_scalar(res, NULL);
+  return w != NULL && writer_done(w, writer_copy(res, w, "null", 4));
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../types.h"
+
+#define JSON_MAX_DEPTH 1024
+
+typedef enum json_type {
+  JSON_MISSING = 0,
+  JSON_NULL,
+  JSON_FALSE,
+  JSON_TRUE,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+} json_type;
+
+typedef struct json_doc json_doc;
+
+// A position in a parsed document, cheap to copy. Lookups that find
+// nothing return a JSON_MISSING value, and every accessor accepts one, so
+// chains of lookups need a single check at the end.
+typedef struct json_value {
+  const json_doc *doc;
+  uint32_t at;
+  // Set for object member values, which json_key can name.
+  bool member;
+} json_value;
+
+typedef void *(*json_alloc_fn)(void *ctx, size_t len);
+
+// Parses len bytes of src, which must hold exactly one JSON text. Strings
+// and numbers are not copied: the document points back into src, which
+// must outlive it. All memory comes from alloc and is never freed by the
+// parser. Returns NULL if src is not valid JSON (including UTF-8) or
+// nests deeper than JSON_MAX_DEPTH.
+json_doc *json_parse(const byte *src, size_t len, json_alloc_fn alloc,
+                     void *ctx);
+json_value json_root(const json_doc *doc);
+
+json_type json_typeof(json_value v);
+// Follows a path of member names and array indices, e.g. "user.tags[0]"
+// or "items.2.id". Names containing '.' or '[' need json_field.
+json_value json_get(json_value v, const char *path);
+json_value json_field(json_value v, const char *key, size_t key_len);
+json_value json_at(json_value v, size_t i);
+// Elements of an array or members of an object.
+size_t json_len(json_value v);
+// The first element or member value, and the one after v. For object
+// members, json_key gives the name.
+json_value json_child(json_value v);
+json_value json_next(json_value v);
+const char *json_key(json_value member, size_t *len);
+
+bool json_bool(json_value v, bool *out);
+// Fails for numbers with a fraction or exponent, or out of range.
+bool json_i64(json_value v, int64_t *out);
+bool json_double(json_value v, double *out);
+// The string as written in the body, escapes included; *escaped is set if
+// it has any. Either out-parameter may be NULL.
+const char *json_str(json_value v, size_t *len, bool *escaped);
+// Decodes the string into buf, NUL-terminated if cap allows, and returns
+// its decoded length, which is more than cap - 1 if it was cut short.
+// Returns SIZE_MAX if v is not a string.
+size_t json_str_copy(json_value v, char *buf, size_t cap);
+
+// Writing. A response body is written as one JSON object or array, a call
+// per value, straight into the response's scratch memory and appended as
+// segments; no tree is built and the writer state lives in the first
+// scratch chunk. Closing the outermost container sets Content-Type to
+// application/json unless the handler already has. Every call returns
+// false once one has failed, or when used out of place (a member outside
+// an object, a second top-level value, a NULL key or string); the body is
+// then incomplete and should be dropped with clear_response_body and
+// replaced with an error status. Non-finite doubles are written
+// as null.
+bool json_begin_object(http_response *res);
+bool json_end_object(http_response *res);
+bool json_begin_array(http_response *res);
+bool json_end_array(http_response *res);
+
+// Members of the innermost open object. json_kv_object and json_kv_array
+// open a nested container under key.
+bool json_kv_str(http_response *res, const char *key, const char *value);
+bool json_kv_strn(http_response *res, const char *key, const char *value,
+                  size_t len);
+bool json_kv_i64(http_response *res, const char *key, int64_t value);
+bool json_kv_u64(http_response *res, const char *key, uint64_t value);
+bool json_kv_double(http_response *res, const char *key, double value);
+bool json_kv_bool(http_response *res, const char *key, bool value);
+bool json_kv_null(http_response *res, const char *key);
+bool json_kv_object(http_response *res, const char *key);
+bool json_kv_array(http_response *res, const char *key);
+
+// Elements of the innermost open array; json_begin_object and
+// json_begin_array add containers.
+bool json_add_str(http_response *res, const char *value);
+bool json_add_strn(http_response *res, const char *value, size_t len);
+bool json_add_i64(http_response *res, int64_t value);
+bool json_add_u64(http_response *res, uint64_t value);
+bool json_add_double(http_response *res, double value);
+bool json_add_bool(http_response *res, bool value);
+bool json_add_null(http_response *res);
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include "multipart.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define DELIM_MAX (4 + MULTIPART_BOUNDARY_MAX)
+
+enum MultipartState {
+  MP_PREAMBLE = 0,
+  MP_DELIM_TAIL,
+  MP_HEADERS,
+  MP_BODY,
+  MP_EPILOGUE,
+};
+
+// What follows a delimiter: "--" closes the body, optional whitespace and
+// CRLF starts the next part.
+enum DelimTailState {
+  DT_START = 0,
+  DT_DASH,
+  DT_PADDING,
+  DT_CR,
+};
+
+struct MultipartParser {
+  MultipartCallbacks cb;
+  void *user;
+  enum MultipartState state;
+  enum DelimTailState delim_tail;
+
+  // "\r\n--" + boundary, with a Boyer-Moore-Horspool shift table.
+  byte delim[DELIM_MAX];
+  size_t delim_len;
+  uint8_t shift[256];
+
+  // Bytes at the end of the last slice that may start a delimiter; they are
+  // held back until the next slice decides.
+  byte tail[DELIM_MAX];
+  size_t tail_len;
+
+  char head[MULTIPART_HEADERS_MAX_BYTES];
+  size_t head_len;
+
+  multipart_part part;
+
+  char *spill_dir;
+  size_t spill_threshold;
+  byte *spill_buf;
+  size_t spill_len;
+};
+
+static int caseless_ncmp(const char *lhs, const char *rhs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    int l = tolower((unsigned char)lhs[i]);
+    int r = tolower((unsigned char)rhs[i]);
+    if (l != r || l == '\0')
+      return l - r;
+  }
+  return 0;
+}
+
+static char *clone_range(const char *start, const char *end) {
+  while (start < end && isspace((unsigned char)*start))
+    start++;
+  while (end > start && isspace((unsigned char)*(end - 1)))
+    end--;
+
+  size_t len = (size_t)(end - start);
+  char *copy = (char *)malloc(len + 1);
+  if (copy == NULL)
+    return NULL;
+  memcpy(copy, start, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+// Finds a `key=value` or `key="value"` parameter in a header value such as
+// `form-data; name="file"; filename="a.txt"` and returns a copy of it.
+static char *header_param(const char *value, const char *key) {
+  size_t key_len = strlen(key);
+  const char *cursor = strchr(value, ';');
+
+  while (cursor != NULL) {
+    cursor++;
+    while (*cursor == ' ' || *cursor == '\t')
+      cursor++;
+
+    if (caseless_ncmp(cursor, key, key_len) == 0 && cursor[key_len] == '=') {
+      const char *start = cursor + key_len + 1;
+      if (*start == '"') {
+        const char *end = strchr(start + 1, '"');
+        if (end == NULL)
+          return NULL;
+        return clone_range(start + 1, end);
+      }
+      const char *end = start;
+      while (*end != '\0' && *end != ';')
+        end++;
+      return clone_range(start, end);
+    }
+
+    cursor = strchr(cursor, ';');
+  }
+  return NULL;
+}
+
+static void part_reset(MultipartParser *p) {
+  for (size_t i = 0; i < p->part.headers_len; i++) {
+    free(p->part.headers[i].key);
+    free(p->part.headers[i].value);
+  }
+  free(p->part.name);
+  free(p->part.filename);
+  if (p->part.fd >= 0)
+    close(p->part.fd);
+
+  memset(&p->part, 0, sizeof(p->part));
+  p->part.fd = -1;
+  p->spill_len = 0;
+}
+
+static int open_spill_file(const char *dir) {
+#ifdef O_TMPFILE
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    return fd;
+#endif
+  char path[PATH_MAX];
+  int n = snprintf(path, sizeof(path), "%s/expressc-part-XXXXXX", dir);
+  if (n < 0 || (size_t)n >= sizeof(path))
+    return -1;
+  int tmp = mkstemp(path);
+  if (tmp >= 0)
+    unlink(path);
+  return tmp;
+}
+
+static bool write_all(int fd, const byte *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static int32_t part_data(MultipartParser *p, const byte *data, size_t len) {
+  if (len == 0 || p->state == MP_PREAMBLE)
+    return 0;
+
+  p->part.size += len;
+  if (p->spill_dir == NULL) {
+    if (p->cb.on_part_data != NULL)
+      p->cb.on_part_data(p->user, &p->part, data, len);
+    return 0;
+  }
+
+  if (p->part.fd < 0) {
+    if (p->spill_len + len <= p->spill_threshold) {
+      memcpy(p->spill_buf + p->spill_len, data, len);
+      p->spill_len += len;
+      return 0;
+    }
+
+    p->part.fd = open_spill_file(p->spill_dir);
+    if (p->part.fd < 0 || !write_all(p->part.fd, p->spill_buf, p->spill_len))
+      return MULTIPART_ERR_IO;
+    p->spill_len = 0;
+  }
+
+  return write_all(p->part.fd, data, len) ? 0 : MULTIPART_ERR_IO;
+}
+
+static int32_t part_begin(MultipartParser *p) {
+  // head holds "\r\n" + header lines + "\r\n\r\n".
+  const char *line = p->head + 2;
+  const char *end = p->head + p->head_len - 2;
+
+  while (line < end) {
+    const char *line_end = strstr(line, "\r\n");
+    if (line_end == NULL || line_end > end)
+      return MULTIPART_ERR_HEADERS;
+
+    const char *colon = memchr(line, ':', (size_t)(line_end - line));
+    if (colon == NULL || p->part.headers_len >= MULTIPART_MAX_HEADERS)
+      return MULTIPART_ERR_HEADERS;
+
+    header *h = &p->part.headers[p->part.headers_len];
+    h->key = clone_range(line, colon);
+    h->value = clone_range(colon + 1, line_end);
+    if (h->key == NULL || h->value == NULL) {
+      free(h->key);
+      free(h->value);
+      return MULTIPART_ERR_ALLOC;
+    }
+    h->key_len = strlen(h->key);
+    h->value_len = strlen(h->value);
+    p->part.headers_len++;
+
+    if (strcasecmp(h->key, "Content-Disposition") == 0) {
+      p->part.name = header_param(h->value, "name");
+      p->part.filename = header_param(h->value, "filename");
+    } else if (strcasecmp(h->key, "Content-Type") == 0) {
+      p->part.content_type = h->value;
+    }
+
+    line = line_end + 2;
+  }
+
+  if (p->cb.on_part_begin != NULL)
+    p->cb.on_part_begin(p->user, &p->part);
+  return 0;
+}
+
+static int32_t part_end(MultipartParser *p) {
+  if (p->spill_dir != NULL) {
+    if (p->part.fd >= 0) {
+      if (lseek(p->part.fd, 0, SEEK_SET) < 0)
+        return MULTIPART_ERR_IO;
+    } else if (p->spill_len > 0 && p->cb.on_part_data != NULL) {
+      p->cb.on_part_data(p->user, &p->part, p->spill_buf, p->spill_len);
+    }
+  }
+
+  if (p->cb.on_part_end != NULL)
+    p->cb.on_part_end(p->user, &p->part);
+  part_reset(p);
+  return 0;
+}
+
+// Scans for the delimiter, passing every byte before it to the current part.
+// Sets *found and returns the bytes consumed, delimiter included. Bytes that
+// could be the start of a delimiter split across slices are kept in tail.
+static int32_t scan_delimited(MultipartParser *p, const byte *data,
+                              size_t len, size_t *consumed, bool *found) {
+  const size_t dlen = p->delim_len;
+  int32_t ret = 0;
+  *found = false;
+
+  if (p->tail_len > 0) {
+    byte scratch[2 * DELIM_MAX];
+    size_t t = p->tail_len;
+    size_t take = len < dlen ? len : dlen;
+    memcpy(scratch, p->tail, t);
+    memcpy(scratch + t, data, take);
+    size_t n = t + take;
+
+    for (size_t i = 0; i < t; i++) {
+      size_t avail = n - i;
+      size_t cmp = avail < dlen ? avail : dlen;
+      if (memcmp(scratch + i, p->delim, cmp) != 0)
+        continue;
+
+      if ((ret = part_data(p, scratch, i)) != 0)
+        return ret;
+      if (cmp == dlen) {
+        p->tail_len = 0;
+        *consumed = i + dlen - t;
+        *found = true;
+        return 0;
+      }
+      // Still undecided: everything we were given is a delimiter prefix.
+      memmove(p->tail, scratch + i, avail);
+      p->tail_len = avail;
+      *consumed = len;
+      return 0;
+    }
+
+    if ((ret = part_data(p, p->tail, t)) != 0)
+      return ret;
+    p->tail_len = 0;
+  }
+
+  const byte last = p->delim[dlen - 1];
+  size_t pos = 0;
+  while (pos + dlen <= len) {
+    byte c = data[pos + dlen - 1];
+    if (c == last && memcmp(data + pos, p->delim, dlen - 1) == 0) {
+      if ((ret = part_data(p, data, pos)) != 0)
+        return ret;
+      *consumed = pos + dlen;
+      *found = true;
+      return 0;
+    }
+    pos += p->shift[c];
+  }
+
+  size_t q = len >= dlen ? len - dlen + 1 : 0;
+  for (; q < len; q++) {
+    const byte *cr = memchr(data + q, '\r', len - q);
+    if (cr == NULL) {
+      q = len;
+      break;
+    }
+    q = (size_t)(cr - data);
+    if (memcmp(data + q, p->delim, len - q) == 0)
+      break;
+  }
+
+  if ((ret = part_data(p, data, q)) != 0)
+    return ret;
+  memcpy(p->tail, data + q, len - q);
+  p->tail_len = len - q;
+  *consumed = len;
+  return 0;
+}
+
+static int32_t scan_delim_tail(MultipartParser *p, const byte *data,
+                               size_t len, size_t *consumed) {
+  size_t i = 0;
+  while (i < len && p->state == MP_DELIM_TAIL) {
+    byte c = data[i++];
+    switch (p->delim_tail) {
+    case DT_START:
+      if (c == '-') {
+        p->delim_tail = DT_DASH;
+        break;
+      }
+      /* fallthrough */
+    case DT_PADDING:
+      if (c == ' ' || c == '\t')
+        p->delim_tail = DT_PADDING;
+      else if (c == '\r')
+        p->delim_tail = DT_CR;
+      else
+        return MULTIPART_ERR_INVALID;
+      break;
+    case DT_DASH:
+      if (c != '-')
+        return MULTIPART_ERR_INVALID;
+      p->state = MP_EPILOGUE;
+      break;
+    case DT_CR:
+      if (c != '\n')
+        return MULTIPART_ERR_INVALID;
+      p->state = MP_HEADERS;
+      memcpy(p->head, "\r\n", 2);
+      p->head_len = 2;
+      break;
+    }
+  }
+
+  *consumed = i;
+  return 0;
+}
+
+static int32_t scan_headers(MultipartParser *p, const byte *data, size_t len,
+                            size_t *consumed) {
+  size_t room = sizeof(p->head) - 1 - p->head_len;
+  size_t take = len < room ? len : room;
+  size_t from = p->head_len >= 3 ? p->head_len - 3 : 0;
+
+  memcpy(p->head + p->head_len, data, take);
+  p->head_len += take;
+  p->head[p->head_len] = '\0';
+
+  char *end = strstr(p->head + from, "\r\n\r\n");
+  if (end == NULL) {
+    if (take == room)
+      return MULTIPART_ERR_HEADERS;
+    *consumed = take;
+    return 0;
+  }
+
+  size_t block_len = (size_t)(end - p->head) + 4;
+  *consumed = take - (p->head_len - block_len);
+  p->head_len = block_len;
+  p->head[p->head_len] = '\0';
+  p->state = MP_BODY;
+  return part_begin(p);
+}
+
+MultipartParser *multipart_new(const char *content_type,
+                               const MultipartCallbacks *callbacks,
+                               void *user) {
+  if (content_type == NULL || callbacks == NULL)
+    return NULL;
+  if (caseless_ncmp(content_type, "multipart/", 10) != 0)
+    return NULL;
+
+  char *boundary = header_param(content_type, "boundary");
+  if (boundary == NULL)
+    return NULL;
+  size_t boundary_len = strlen(boundary);
+  if (boundary_len == 0 || boundary_len > MULTIPART_BOUNDARY_MAX) {
+    free(boundary);
+    return NULL;
+  }
+
+  MultipartParser *p = (MultipartParser *)calloc(1, sizeof(*p));
+  if (p == NULL) {
+    free(boundary);
+    return NULL;
+  }
+
+  p->cb = *callbacks;
+  p->user = user;
+  p->part.fd = -1;
+
+  memcpy(p->delim, "\r\n--", 4);
+  memcpy(p->delim + 4, boundary, boundary_len);
+  p->delim_len = 4 + boundary_len;
+  free(boundary);
+
+  for (size_t i = 0; i < 256; i++)
+    p->shift[i] = (uint8_t)p->delim_len;
+  for (size_t i = 0; i + 1 < p->delim_len; i++)
+    p->shift[p->delim[i]] = (uint8_t)(p->delim_len - 1 - i);
+
+  // The first boundary may open the body without a preceding CRLF; priming
+  // the tail lets the preamble share the regular delimiter search.
+  memcpy(p->tail, "\r\n", 2);
+  p->tail_len = 2;
+  return p;
+}
+
+bool multipart_set_spill(MultipartParser *p, size_t threshold,
+                         const char *dir) {
+  if (p == NULL || dir == NULL || p->spill_dir != NULL)
+    return false;
+
+  p->spill_dir = strdup(dir);
+  p->spill_buf = (byte *)malloc(threshold > 0 ? threshold : 1);
+  if (p->spill_dir == NULL || p->spill_buf == NULL) {
+    free(p->spill_dir);
+    free(p->spill_buf);
+    p->spill_dir = NULL;
+    p->spill_buf = NULL;
+    return false;
+  }
+  p->spill_threshold = threshold;
+  return true;
+}
+
+int32_t multipart_feed(MultipartParser *p, const byte *data, size_t len) {
+  if (p == NULL || (data == NULL && len > 0))
+    return MULTIPART_ERR_INVALID;
+
+  size_t off = 0;
+  while (off < len && p->state != MP_EPILOGUE) {
+    size_t consumed = 0;
+    int32_t ret = 0;
+
+    if (p->state == MP_PREAMBLE || p->state == MP_BODY) {
+      bool found = false;
+      ret = scan_delimited(p, data + off, len - off, &consumed, &found);
+      if (ret == 0 && found) {
+        if (p->state == MP_BODY)
+          ret = part_end(p);
+        p->state = MP_DELIM_TAIL;
+        p->delim_tail = DT_START;
+      }
+    } else if (p->state == MP_DELIM_TAIL) {
+      ret = scan_delim_tail(p, data + off, len - off, &consumed);
+    } else {
+      ret = scan_headers(p, data + off, len - off, &consumed);
+    }
+
+    if (ret != 0)
+      return ret;
+    off += consumed;
+  }
+  return 0;
+}
+
+int32_t multipart_finish(MultipartParser *p) {
+  if (p == NULL || p->state != MP_EPILOGUE)
+    return MULTIPART_ERR_INVALID;
+  return 0;
+}
+
+void multipart_destroy(MultipartParser *p) {
+  if (p == NULL)
+    return;
+  part_reset(p);
+  free(p->spill_dir);
+  free(p->spill_buf);
+  free(p);
+}
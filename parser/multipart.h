@@ -0,0 +1,57 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../http_errors.h"
+#include "../types.h"
+
+#define MULTIPART_MAX_HEADERS 16
+#define MULTIPART_HEADERS_MAX_BYTES 8192
+#define MULTIPART_BOUNDARY_MAX 70
+
+typedef struct MultipartParser MultipartParser;
+
+typedef struct multipart_part {
+  header headers[MULTIPART_MAX_HEADERS];
+  size_t headers_len;
+  // From Content-Disposition / Content-Type; NULL when absent. content_type
+  // is borrowed from headers.
+  char *name;
+  char *filename;
+  char *content_type;
+  size_t size;
+  // Set once a spilled part has been written to a temp file. The parser
+  // closes it after on_part_end unless the callback takes it over by
+  // setting it to -1.
+  int fd;
+} multipart_part;
+
+typedef struct MultipartCallbacks {
+  void (*on_part_begin)(void *user, multipart_part *part);
+  void (*on_part_data)(void *user, multipart_part *part, const byte *data,
+                       size_t len);
+  void (*on_part_end)(void *user, multipart_part *part);
+} MultipartCallbacks;
+
+// Creates a parser for the boundary named in a multipart/form-data
+// Content-Type value. Returns NULL if the value carries no usable boundary.
+MultipartParser *multipart_new(const char *content_type,
+                               const MultipartCallbacks *callbacks,
+                               void *user);
+
+// Parts larger than threshold bytes are written to an anonymous temp file in
+// dir (O_TMPFILE) instead of being handed to on_part_data. Smaller parts are
+// delivered in one on_part_data call before on_part_end.
+bool multipart_set_spill(MultipartParser *p, size_t threshold,
+                         const char *dir);
+
+// Feeds the next slice of the body. Slices may split anywhere, including
+// inside a boundary. Returns 0 or a MULTIPART_ERR_* code.
+int32_t multipart_feed(MultipartParser *p, const byte *data, size_t len);
+
+// Returns 0 if the closing boundary has been seen, MULTIPART_ERR_INVALID
+// if the body ended early.
+int32_t multipart_finish(MultipartParser *p);
+
+void multipart_destroy(MultipartParser *p);
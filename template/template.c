@@ -0,0 +1,466 @@
+#include "template.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Literals up to this size are copied next to the values around them
+// rather than sent as segments of their own.
+#define TEMPLATE_COPY_MAX 64
+#define TEMPLATE_CHUNK 4096
+
+enum TemplateOpKind {
+  OP_TEXT = 0,
+  OP_VALUE,
+  OP_RAW,
+  OP_SECTION,
+  OP_INVERTED,
+};
+
+// off/len locate the literal or the name in ExpressTemplate.text. Sections
+// run from the next op up to end.
+struct TemplateOp {
+  enum TemplateOpKind kind;
+  uint32_t off;
+  uint32_t len;
+  uint32_t end;
+};
+
+struct ExpressTemplate {
+  // Literals and names, with adjacent literals joined.
+  char *text;
+  size_t text_len;
+  struct TemplateOp *ops;
+  size_t ops_len;
+};
+
+struct TemplateBuilder {
+  ExpressTemplate *t;
+  size_t ops_cap;
+  bool last_text;
+};
+
+static bool builder_push(struct TemplateBuilder *b, enum TemplateOpKind kind,
+                         const char *s, size_t len) {
+  ExpressTemplate *t = b->t;
+  if (kind == OP_TEXT && len == 0)
+    return true;
+  if (kind == OP_TEXT && b->last_text) {
+    memcpy(t->text + t->text_len, s, len);
+    t->text_len += len;
+    t->ops[t->ops_len - 1].len += (uint32_t)len;
+    return true;
+  }
+
+  if (t->ops_len == b->ops_cap) {
+    size_t cap = b->ops_cap == 0 ? 16 : b->ops_cap * 2;
+    struct TemplateOp *next =
+        (struct TemplateOp *)realloc(t->ops, cap * sizeof(*next));
+    if (next == NULL)
+      return false;
+    t->ops = next;
+    b->ops_cap = cap;
+  }
+  struct TemplateOp *op = &t->ops[t->ops_len++];
+  op->kind = kind;
+  op->off = (uint32_t)t->text_len;
+  op->len = (uint32_t)len;
+  op->end = 0;
+  memcpy(t->text + t->text_len, s, len);
+  t->text_len += len;
+  b->last_text = kind == OP_TEXT;
+  return true;
+}
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// First run of n copies of c in [p, end), or NULL.
+static const char *find_run(const char *p, const char *end, char c,
+                            size_t n) {
+  while ((size_t)(end - p) >= n) {
+    p = (const char *)memchr(p, c, (size_t)(end - p) - (n - 1));
+    if (p == NULL)
+      return NULL;
+    size_t k = 1;
+    while (k < n && p[k] == c)
+      k++;
+    if (k == n)
+      return p;
+    p += k;
+  }
+  return NULL;
+}
+
+static bool compile(struct TemplateBuilder *b, const char *src, size_t len) {
+  ExpressTemplate *t = b->t;
+  size_t open[TEMPLATE_MAX_DEPTH];
+  size_t depth = 0;
+  size_t i = 0;
+
+  while (i < len) {
+    const char *tag = find_run(src + i, src + len, '{', 2);
+    if (tag == NULL) {
+      if (!builder_push(b, OP_TEXT, src + i, len - i))
+        return false;
+      break;
+    }
+    size_t start = (size_t)(tag - src);
+    if (!builder_push(b, OP_TEXT, src + i, start - i))
+      return false;
+
+    bool triple = start + 2 < len && src[start + 2] == '{';
+    size_t body = start + (triple ? 3 : 2);
+    const char *close = find_run(src + body, src + len, '}', triple ? 3 : 2);
+    if (close == NULL)
+      return false;
+    i = (size_t)(close - src) + (triple ? 3 : 2);
+
+    char sigil = triple ? '&' : src[body];
+    if (!triple && (sigil == '#' || sigil == '^' || sigil == '/' ||
+                    sigil == '!' || sigil == '&'))
+      body++;
+    if (sigil == '!')
+      continue;
+
+    const char *name = src + body;
+    const char *name_end = close;
+    while (name < name_end && is_space(*name))
+      name++;
+    while (name_end > name && is_space(name_end[-1]))
+      name_end--;
+    size_t name_len = (size_t)(name_end - name);
+    if (name_len == 0 || name_len > UINT32_MAX)
+      return false;
+
+    if (sigil == '/') {
+      if (depth == 0)
+        return false;
+      struct TemplateOp *op = &t->ops[open[--depth]];
+      if (op->len != name_len ||
+          memcmp(t->text + op->off, name, name_len) != 0)
+        return false;
+      op->end = (uint32_t)t->ops_len;
+      b->last_text = false;
+      continue;
+    }
+
+    enum TemplateOpKind kind = sigil == '#'   ? OP_SECTION
+                               : sigil == '^' ? OP_INVERTED
+                               : sigil == '&' ? OP_RAW
+                                              : OP_VALUE;
+    if (kind == OP_SECTION || kind == OP_INVERTED) {
+      if (depth == TEMPLATE_MAX_DEPTH)
+        return false;
+      open[depth++] = t->ops_len;
+    }
+    if (!builder_push(b, kind, name, name_len))
+      return false;
+  }
+  return depth == 0;
+}
+
+ExpressTemplate *template_compile(const char *src, size_t len) {
+  if (src == NULL || len > UINT32_MAX)
+    return NULL;
+
+  ExpressTemplate *t = (ExpressTemplate *)calloc(1, sizeof(*t));
+  // Literals and names never add up to more than the source.
+  if (t == NULL || (t->text = (char *)malloc(len > 0 ? len : 1)) == NULL) {
+    free(t);
+    return NULL;
+  }
+  struct TemplateBuilder b = {t, 0, false};
+  if (!compile(&b, src, len)) {
+    template_destroy(t);
+    return NULL;
+  }
+  return t;
+}
+
+void template_destroy(ExpressTemplate *t) {
+  if (t == NULL)
+    return;
+  free(t->text);
+  free(t->ops);
+  free(t);
+}
+
+// Output under construction: short pieces collect in run, a stretch of
+// scratch memory, until a long literal or the end of the page flushes them
+// as one segment.
+struct Render {
+  const ExpressTemplate *t;
+  http_response *res;
+  byte *run;
+  size_t run_len;
+  size_t run_cap;
+  const template_scope *scopes[TEMPLATE_MAX_DEPTH + 1];
+  size_t depth;
+};
+
+static bool render_flush(struct Render *r) {
+  if (r->run_len == 0)
+    return true;
+  if (!append_response_segment(r->res, r->run, r->run_len, SEGMENT_BORROWED))
+    return false;
+  r->run += r->run_len;
+  r->run_cap -= r->run_len;
+  r->run_len = 0;
+  return true;
+}
+
+static byte *render_reserve(struct Render *r, size_t n) {
+  if (r->run_cap - r->run_len < n) {
+    if (!render_flush(r))
+      return NULL;
+    size_t cap = n > TEMPLATE_CHUNK ? n : TEMPLATE_CHUNK;
+    r->run = (byte *)alloc_response_buffer(r->res, cap);
+    if (r->run == NULL)
+      return NULL;
+    r->run_cap = cap;
+  }
+  return r->run + r->run_len;
+}
+
+static bool render_copy(struct Render *r, const void *p, size_t n) {
+  byte *dst = render_reserve(r, n);
+  if (dst == NULL)
+    return false;
+  memcpy(dst, p, n);
+  r->run_len += n;
+  return true;
+}
+
+static bool render_literal(struct Render *r, const char *p, size_t n) {
+  if (n <= TEMPLATE_COPY_MAX)
+    return render_copy(r, p, n);
+  return render_flush(r) &&
+         append_response_segment(r->res, (const byte *)p, n,
+                                 SEGMENT_BORROWED);
+}
+
+static bool html_special(byte c) {
+  return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+}
+
+#if defined(__SSE2__)
+static int html_mask(__m128i v) {
+  __m128i hit = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\''))));
+  return _mm_movemask_epi8(hit);
+}
+#endif
+
+// Index of the first byte of s that needs escaping, or len.
+static size_t html_scan(const byte *s, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    int mask = html_mask(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0)
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+  }
+  // Most values are short: finish them in one padded compare.
+  if (i < len) {
+    byte tail[16] = {0};
+    memcpy(tail, s + i, len - i);
+    int mask = html_mask(_mm_loadu_si128((const __m128i *)tail));
+    return mask != 0 ? i + (size_t)__builtin_ctz((unsigned)mask) : len;
+  }
+#endif
+  for (; i < len; i++) {
+    if (html_special(s[i]))
+      return i;
+  }
+  return len;
+}
+
+static bool render_escaped(struct Render *r, const char *p, size_t n) {
+  const byte *s = (const byte *)p;
+  while (n > 0) {
+    size_t clean = html_scan(s, n);
+    if (clean > 0 && !render_copy(r, s, clean))
+      return false;
+    if (clean == n)
+      return true;
+
+    const char *entity;
+    switch (s[clean]) {
+    case '&':
+      entity = "&amp;";
+      break;
+    case '<':
+      entity = "&lt;";
+      break;
+    case '>':
+      entity = "&gt;";
+      break;
+    case '"':
+      entity = "&quot;";
+      break;
+    default:
+      entity = "&#39;";
+      break;
+    }
+    if (!render_copy(r, entity, strlen(entity)))
+      return false;
+    s += clean + 1;
+    n -= clean + 1;
+  }
+  return true;
+}
+
+static bool render_int(struct Render *r, int64_t v) {
+  static const char pairs[] = "00010203040506070809101112131415161718192021222324"
+                              "25262728293031323334353637383940414243444546474849"
+                              "50515253545556575859606162636465666768697071727374"
+                              "75767778798081828384858687888990919293949596979899";
+  char digits[21];
+  char *p = digits + sizeof(digits);
+  uint64_t u = v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+  // Two digits per division.
+  while (u >= 100) {
+    p -= 2;
+    memcpy(p, pairs + (u % 100) * 2, 2);
+    u /= 100;
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, pairs + u * 2, 2);
+  } else {
+    *--p = (char)('0' + u);
+  }
+  if (v < 0)
+    *--p = '-';
+  return render_copy(r, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+static bool name_is(const char *v, const char *name, size_t len) {
+  for (size_t k = 0; k < len; k++) {
+    if (v[k] != name[k])
+      return false;
+  }
+  return v[len] == '\0';
+}
+
+static const template_var *render_lookup(const struct Render *r,
+                                         const struct TemplateOp *op) {
+  const char *name = r->t->text + op->off;
+  for (size_t d = r->depth; d-- > 0;) {
+    const template_scope *s = r->scopes[d];
+    for (size_t i = 0; s != NULL && i < s->vars_len; i++) {
+      const char *v = s->vars[i].name;
+      if (v != NULL && name_is(v, name, op->len))
+        return &s->vars[i];
+    }
+  }
+  return NULL;
+}
+
+static bool var_truthy(const template_var *v) {
+  if (v == NULL)
+    return false;
+  switch (v->kind) {
+  case TEMPLATE_KIND_STR:
+    return v->str != NULL && v->str[0] != '\0';
+  case TEMPLATE_KIND_INT:
+    return v->num != 0;
+  case TEMPLATE_KIND_BOOL:
+    return v->flag;
+  case TEMPLATE_KIND_LIST:
+    return v->list.len != 0;
+  }
+  return false;
+}
+
+static bool render_value(struct Render *r, const template_var *v,
+                         bool escape) {
+  if (v == NULL)
+    return true;
+  switch (v->kind) {
+  case TEMPLATE_KIND_STR:
+    if (v->str == NULL)
+      return true;
+    return escape ? render_escaped(r, v->str, strlen(v->str))
+                  : render_copy(r, v->str, strlen(v->str));
+  case TEMPLATE_KIND_INT:
+    return render_int(r, v->num);
+  case TEMPLATE_KIND_BOOL:
+    return v->flag ? render_copy(r, "true", 4) : render_copy(r, "false", 5);
+  case TEMPLATE_KIND_LIST:
+    return true;
+  }
+  return true;
+}
+
+static bool render_ops(struct Render *r, size_t begin, size_t end) {
+  const ExpressTemplate *t = r->t;
+  for (size_t i = begin; i < end; i++) {
+    const struct TemplateOp *op = &t->ops[i];
+    switch (op->kind) {
+    case OP_TEXT:
+      if (!render_literal(r, t->text + op->off, op->len))
+        return false;
+      break;
+    case OP_VALUE:
+    case OP_RAW:
+      if (!render_value(r, render_lookup(r, op), op->kind == OP_VALUE))
+        return false;
+      break;
+    case OP_SECTION: {
+      const template_var *v = render_lookup(r, op);
+      if (v != NULL && v->kind == TEMPLATE_KIND_LIST) {
+        if (r->depth == TEMPLATE_MAX_DEPTH + 1)
+          return false;
+        for (size_t k = 0; k < v->list.len; k++) {
+          r->scopes[r->depth++] = &v->list.items[k];
+          bool ok = render_ops(r, i + 1, op->end);
+          r->depth--;
+          if (!ok)
+            return false;
+        }
+      } else if (var_truthy(v) && !render_ops(r, i + 1, op->end)) {
+        return false;
+      }
+      i = op->end - 1;
+      break;
+    }
+    case OP_INVERTED:
+      if (!var_truthy(render_lookup(r, op)) && !render_ops(r, i + 1, op->end))
+        return false;
+      i = op->end - 1;
+      break;
+    }
+  }
+  return true;
+}
+
+bool template_render(const ExpressTemplate *t, const template_scope *scope,
+                     http_response *res) {
+  if (t == NULL || res == NULL)
+    return false;
+
+  struct Render r;
+  r.t = t;
+  r.res = res;
+  r.run = NULL;
+  r.run_len = 0;
+  r.run_cap = 0;
+  r.scopes[0] = scope;
+  r.depth = 1;
+  if (!render_ops(&r, 0, t->ops_len) || !render_flush(&r))
+    return false;
+  if (get_response_header(res, "Content-Type") == NULL)
+    return set_response_header(res, "Content-Type",
+                               "text/html; charset=utf-8");
+  return true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../ExpressC.h"
+
+// Mustache-style templates compiled once into an instruction list:
+//
+//   {{name}}            value, HTML-escaped
+//   {{{name}}} {{&name}} value as is
+//   {{#name}}..{{/name}} once if name is true, or once per item of a list
+//   {{^name}}..{{/name}} once if name is missing, false, empty or zero
+//   {{! comment}}
+//
+// Names are looked up from the innermost list item outwards. Whitespace
+// around tags is kept as written.
+
+#define TEMPLATE_MAX_DEPTH 32
+
+typedef struct ExpressTemplate ExpressTemplate;
+
+typedef struct template_scope template_scope;
+
+enum template_kind {
+  TEMPLATE_KIND_STR = 0,
+  TEMPLATE_KIND_INT,
+  TEMPLATE_KIND_BOOL,
+  TEMPLATE_KIND_LIST,
+};
+
+typedef struct template_var {
+  const char *name;
+  enum template_kind kind;
+  union {
+    const char *str;
+    int64_t num;
+    bool flag;
+    struct {
+      const template_scope *items;
+      size_t len;
+    } list;
+  };
+} template_var;
+
+struct template_scope {
+  const template_var *vars;
+  size_t vars_len;
+};
+
+#define TEMPLATE_STR(n, s)                                                   \
+  ((template_var){.name = (n), .kind = TEMPLATE_KIND_STR, .str = (s)})
+#define TEMPLATE_INT(n, v)                                                   \
+  ((template_var){.name = (n), .kind = TEMPLATE_KIND_INT, .num = (v)})
+#define TEMPLATE_BOOL(n, v)                                                  \
+  ((template_var){.name = (n), .kind = TEMPLATE_KIND_BOOL, .flag = (v)})
+#define TEMPLATE_LIST(n, v, count)                                           \
+  ((template_var){.name = (n),                                               \
+                  .kind = TEMPLATE_KIND_LIST,                                \
+                  .list = {(v), (count)}})
+
+// Returns NULL if src is malformed: an unterminated tag, or sections that
+// do not nest.
+ExpressTemplate *template_compile(const char *src, size_t len);
+
+// Appends the rendered page to res as segments: literal text straight from
+// the template, values escaped into the response's scratch buffer. Short
+// literals between values are copied alongside them so the writev stays
+// short. Sets Content-Type to text/html unless the handler already has.
+// The template must outlive the response. On failure part of the page may
+// already be appended; replace it with an error status.
+bool template_render(const ExpressTemplate *t, const template_scope *scope,
+                     http_response *res);
+
+void template_destroy(ExpressTemplate *t);
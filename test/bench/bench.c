@@ -0,0 +1,807 @@
+// Microbenchmarks for ExpressC internals.
+//
+// The library is compiled into this translation unit so static helpers can
+// be driven directly without a socket in the way:
+//
+//   gcc -O3 -o bench test/bench/bench.c TCPServer/TCPServer.c -lz
+//   ./bench [name]
+#include "../../ExpressC.c"
+#include "../../parser/json.c"
+#include "../../template/template.c"
+
+#include <time.h>
+
+typedef void (*bench_fn)(void);
+
+typedef struct {
+    const char* name;
+    bench_fn fn;
+} Bench;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Feeds a complete request through the connection buffer in recv()-sized
+// slices, the same way on_bytes sees it, and returns the decoded body size.
+static size_t feed_request(struct HTTPConn* conn, const byte* wire,
+                           size_t wire_len, size_t max_body_size) {
+    const size_t slice = 4096;
+    http_request req;
+    memset(&req, 0, sizeof(req));
+
+    for (size_t off = 0; off < wire_len; off += slice) {
+        size_t n = wire_len - off < slice ? wire_len - off : slice;
+        if (!http_conn_append(conn, wire + off, n)) return 0;
+
+        if (!conn->parsed_headers) {
+            int32_t header_bytes = parse_headers(conn, &req);
+            if (header_bytes == PARSE_HEADERS_ERR_INCOMPLETE) continue;
+            if (header_bytes < 0) return 0;
+            conn->parsed_headers = true;
+            conn->bytes_off = (size_t)header_bytes;
+        }
+
+        if (req.chunked) {
+            int32_t done = http_conn_decode_chunked(conn, &req, max_body_size);
+            if (done < 0) return 0;
+            if (done == 1) break;
+        }
+    }
+
+    size_t body_len = req.chunked ? conn->chunk.body_len : req.content_length;
+    for (size_t i = 0; i < req.headers_len; i++) {
+        free(req.headers[i].key);
+        free(req.headers[i].value);
+    }
+    conn->req = NULL;
+    http_conn_clear_request(conn);
+    conn->bytes_len = 0;
+    return body_len;
+}
+
+static byte* build_body_request(size_t body_len, size_t chunk_len,
+                                size_t* out_len) {
+    size_t cap = body_len + body_len / (chunk_len ? chunk_len : 1) * 32 + 256;
+    byte* wire = malloc(cap);
+    size_t off = 0;
+
+    if (chunk_len == 0) {
+        off += (size_t)sprintf((char*)wire,
+                               "POST /upload HTTP/1.1\r\nHost: bench\r\n"
+                               "Content-Length: %zu\r\n\r\n",
+                               body_len);
+        memset(wire + off, 'x', body_len);
+        off += body_len;
+    } else {
+        off += (size_t)sprintf((char*)wire,
+                               "POST /upload HTTP/1.1\r\nHost: bench\r\n"
+                               "Transfer-Encoding: chunked\r\n\r\n");
+        for (size_t left = body_len; left > 0;) {
+            size_t n = left < chunk_len ? left : chunk_len;
+            off += (size_t)sprintf((char*)wire + off, "%zx\r\n", n);
+            memset(wire + off, 'x', n);
+            off += n;
+            memcpy(wire + off, "\r\n", 2);
+            off += 2;
+            left -= n;
+        }
+        off += (size_t)sprintf((char*)wire + off, "0\r\n\r\n");
+    }
+
+    *out_len = off;
+    return wire;
+}
+
+static void bench_chunked(void) {
+    const size_t body_len = 8u << 20;
+    const size_t chunk_sizes[] = {0, 16384, 1024, 64};
+    const int rounds = 20;
+
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+        size_t wire_len = 0;
+        byte* wire = build_body_request(body_len, chunk_sizes[i], &wire_len);
+        struct HTTPConn conn;
+        memset(&conn, 0, sizeof(conn));
+
+        double start = now_sec();
+        for (int r = 0; r < rounds; r++) {
+            if (feed_request(&conn, wire, wire_len, body_len) != body_len) {
+                fprintf(stderr, "chunked: decode failed\n");
+                exit(1);
+            }
+        }
+        double elapsed = now_sec() - start;
+
+        if (chunk_sizes[i] == 0)
+            printf("chunked: content-length  %8.1f MB/s\n",
+                   (double)body_len * rounds / elapsed / 1e6);
+        else
+            printf("chunked: %5zu-byte chunks %8.1f MB/s\n", chunk_sizes[i],
+                   (double)body_len * rounds / elapsed / 1e6);
+
+        http_conn_reset(&conn);
+        free(wire);
+    }
+}
+
+static void bench_noop_route(void* ctx, http_request* req,
+                             http_response* res) {
+    (void)ctx;
+    (void)req;
+    (void)res;
+}
+
+// Looks up a mix of exact and parameterised API paths, resolving the method
+// token too, against a linear strcmp table (the old router), the radix tree
+// alone and the frozen router with its perfect-hash table in front.
+static void bench_router(void) {
+    enum { NROUTES = 300, NPATHS = 1024 };
+    static const char* const method_names[] = {"GET", "POST", "PUT",
+                                               "DELETE", "PATCH"};
+    static const char* const resources[] = {"users",  "orders", "items",
+                                            "carts",  "tokens", "teams"};
+    const long lookups = 4000000;
+
+    char* patterns[NROUTES];
+    ExpressRouter* tree = router_new();
+    ExpressRouter* frozen = router_new();
+    for (int i = 0; i < NROUTES; i++) {
+        char buf[128];
+        const char* res = resources[i % 6];
+        switch (i % 3) {
+        case 0:
+            snprintf(buf, sizeof(buf), "/api/v%d/%s", i / 18 + 1, res);
+            break;
+        case 1:
+            snprintf(buf, sizeof(buf), "/api/v%d/%s/stats/%d", i / 18 + 1,
+                     res, i);
+            break;
+        default:
+            snprintf(buf, sizeof(buf), "/api/v%d/%s/:id/%d", i / 18 + 1, res,
+                     i);
+            break;
+        }
+        patterns[i] = strdup(buf);
+        enum Method m = (enum Method)(i % 5 == 4 ? POST : GET);
+        router_add(tree, patterns[i], m, bench_noop_route);
+        router_add(frozen, patterns[i], m, bench_noop_route);
+    }
+    if (router_freeze(frozen) != 0) {
+        fprintf(stderr, "router: freeze failed\n");
+        exit(1);
+    }
+
+    char* paths[NPATHS];
+    size_t path_lens[NPATHS];
+    const char* methods[NPATHS];
+    for (int i = 0; i < NPATHS; i++) {
+        int k = (i * 7919) % NROUTES;
+        char buf[128];
+        if (k % 3 == 2) {
+            // Substitute a concrete segment for ":id".
+            const char* colon = strchr(patterns[k], ':');
+            snprintf(buf, sizeof(buf), "%.*s%d%s", (int)(colon - patterns[k]),
+                     patterns[k], 1000 + i, strchr(colon, '/'));
+        } else {
+            snprintf(buf, sizeof(buf), "%s", patterns[k]);
+        }
+        paths[i] = strdup(buf);
+        path_lens[i] = strlen(buf);
+        methods[i] = method_names[i % 5 == 4 ? 1 : 0];
+    }
+
+    http_request req;
+    memset(&req, 0, sizeof(req));
+    size_t hits = 0;
+
+    double start = now_sec();
+    for (long n = 0; n < lookups; n++) {
+        int i = (int)(n & (NPATHS - 1));
+        memcpy(req.route, paths[i], path_lens[i] + 1);
+        memcpy(req.method, methods[i], 4 + (i % 5 == 4));
+        enum Method m = MAX_METHODS;
+        for (size_t j = 0; j < 5; j++) {
+            if (strcmp(req.method, method_names[j]) == 0) {
+                m = (enum Method)j;
+                break;
+            }
+        }
+        for (int k = 0; k < NROUTES; k++) {
+            if (strcmp(patterns[k], req.route) == 0) {
+                hits += m < MAX_METHODS;
+                break;
+            }
+        }
+    }
+    double linear = now_sec() - start;
+
+    ExpressRouter* routers[] = {tree, frozen};
+    double elapsed[2];
+    for (int r = 0; r < 2; r++) {
+        start = now_sec();
+        for (long n = 0; n < lookups; n++) {
+            int i = (int)(n & (NPATHS - 1));
+            memcpy(req.route, paths[i], path_lens[i] + 1);
+            memcpy(req.method, methods[i], 4 + (i % 5 == 4));
+            enum Method m = get_method_from_str(req.method);
+            struct Route* t = find_route(routers[r], &req);
+            hits += t != NULL && route_supports_method(t, m);
+        }
+        elapsed[r] = now_sec() - start;
+    }
+
+    printf("router: linear strcmp (exact only) %7.1f ns/lookup\n",
+           linear * 1e9 / lookups);
+    printf("router: radix tree                 %7.1f ns/lookup\n",
+           elapsed[0] * 1e9 / lookups);
+    printf("router: frozen perfect hash        %7.1f ns/lookup\n",
+           elapsed[1] * 1e9 / lookups);
+    if (hits == 0) printf("router: no hits\n");
+
+    for (int i = 0; i < NPATHS; i++) free(paths[i]);
+    router_destroy(tree);
+    router_destroy(frozen);
+    for (int i = 0; i < NROUTES; i++) free(patterns[i]);
+}
+
+// The serializer before the status-line table: one snprintf per line into
+// a fixed 8 KiB buffer. Kept here as the baseline for bench_serialize.
+static size_t legacy_serialize(const http_request* req,
+                               const http_response* res, char* out,
+                               size_t cap) {
+    const char* status = validated_response_status_code(res);
+    int n = snprintf(out, cap, "%s %s %s\r\n", response_http_version(req),
+                     status, reason_phrase(status));
+    size_t off = (size_t)n;
+    if (!response_has_header(res, "Content-Length"))
+        off += (size_t)snprintf(out + off, cap - off,
+                                "Content-Length: %zu\r\n", res->content_length);
+    for (size_t i = 0; i < res->headers_len; i++) {
+        if (has_crlf(res->headers[i].key) || has_crlf(res->headers[i].value))
+            return 0;
+        off += (size_t)snprintf(out + off, cap - off, "%s: %s\r\n",
+                                res->headers[i].key, res->headers[i].value);
+    }
+    off += (size_t)snprintf(out + off, cap - off, "\r\n");
+    return off;
+}
+
+static void bench_serialize(void) {
+    const long rounds = 5000000;
+    static const byte body[] = "{\"ok\":true,\"items\":[1,2,3]}";
+
+    http_request req;
+    memset(&req, 0, sizeof(req));
+    strcpy(req.version, "HTTP/1.1");
+    strcpy(req.method, "GET");
+
+    http_response res = response_default();
+    set_response_header(&res, "Content-Type", "application/json");
+    set_response_header(&res, "Cache-Control", "no-cache");
+    set_response_header(&res, "X-Request-Id", "4f9c2a7e-1b3d-4c8e-9a6f");
+    set_response_body(&res, body, sizeof(body) - 1);
+
+    char legacy[8192];
+    size_t total = 0;
+    double start = now_sec();
+    for (long n = 0; n < rounds; n++) {
+        res.content_length = sizeof(body) - 1 + (size_t)(n & 7);
+        total += legacy_serialize(&req, &res, legacy, sizeof(legacy));
+    }
+    double elapsed_legacy = now_sec() - start;
+
+    byte stack[8192];
+    start = now_sec();
+    for (long n = 0; n < rounds; n++) {
+        struct OutBuf head;
+        outbuf_init(&head, stack, sizeof(stack));
+        res.content_length = sizeof(body) - 1 + (size_t)(n & 7);
+        serialize_response_head(&req, &res, response_status(&res), false,
+                                &head);
+        total += head.len;
+        outbuf_release(&head);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("serialize: snprintf      %6.2f M responses/s\n",
+           rounds / elapsed_legacy / 1e6);
+    printf("serialize: status table  %6.2f M responses/s\n",
+           rounds / elapsed / 1e6);
+    if (total == 0) printf("serialize: empty\n");
+    response_cleanup(&res);
+}
+
+static void bench_websocket(void) {
+    const size_t frame_len = 16384;
+    const int rounds = 40000;
+    static const byte key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    byte* payload = (byte*)malloc(frame_len);
+    for (size_t i = 0; i < frame_len; i++) payload[i] = (byte)i;
+
+    // Read back each round so neither loop is optimised away.
+    volatile byte sink = 0;
+    double start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        for (size_t i = 0; i < frame_len; i++)
+            payload[i] ^= key[i & 3];
+        sink ^= payload[n & 1023];
+    }
+    double elapsed_bytes = now_sec() - start;
+
+    start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        websocket_unmask(payload, frame_len, key);
+        sink ^= payload[n & 1023];
+    }
+    double elapsed = now_sec() - start;
+
+    double gb = (double)frame_len * rounds / 1e9;
+    printf("websocket: unmask bytewise %6.2f GB/s\n", gb / elapsed_bytes);
+    printf("websocket: unmask SSE2     %6.2f GB/s\n", gb / elapsed);
+    (void)sink;
+    free(payload);
+}
+
+static void bench_etag(void) {
+    const size_t body_len = 65536;
+    const int rounds = 20000;
+    byte* body = (byte*)malloc(body_len);
+    for (size_t i = 0; i < body_len; i++) body[i] = (byte)(i * 31);
+
+    volatile uint64_t sink = 0;
+    double start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        body[n & 1023] ^= 1;
+        sink ^= route_hash((const char*)body, body_len);
+    }
+    double elapsed_fnv = now_sec() - start;
+
+    start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        body[n & 1023] ^= 1;
+        sink ^= body_hash(body, body_len, 0);
+    }
+    double elapsed = now_sec() - start;
+
+    double gb = (double)body_len * rounds / 1e9;
+    printf("etag: FNV-1a %6.2f GB/s\n", gb / elapsed_fnv);
+    printf("etag: XXH64  %6.2f GB/s\n", gb / elapsed);
+    (void)sink;
+    free(body);
+}
+
+// What a handler writes without templates: snprintf per row into a
+// scratch buffer, escaping a byte at a time.
+static size_t legacy_escape(char* out, size_t cap, const char* s) {
+    size_t n = 0;
+    for (; *s != '\0' && n + 6 < cap; s++) {
+        switch (*s) {
+        case '&': n += (size_t)snprintf(out + n, cap - n, "&amp;"); break;
+        case '<': n += (size_t)snprintf(out + n, cap - n, "&lt;"); break;
+        case '>': n += (size_t)snprintf(out + n, cap - n, "&gt;"); break;
+        case '"': n += (size_t)snprintf(out + n, cap - n, "&quot;"); break;
+        case '\'': n += (size_t)snprintf(out + n, cap - n, "&#39;"); break;
+        default: out[n++] = *s;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+#define TPL_ROWS 20
+
+static const char tpl_head[] =
+    "<!doctype html><html><head><meta charset=\"utf-8\"><title>%s</title>"
+    "<link rel=\"stylesheet\" href=\"/assets/index.css\"></head><body>"
+    "<header><nav><a href=\"/\">Home</a> <a href=\"/orders\">Orders</a>"
+    "</nav></header><main><h1>%s</h1><table><thead><tr><th>#</th>"
+    "<th>Customer</th><th>Total</th></tr></thead><tbody>";
+static const char tpl_row[] =
+    "<tr class=\"row\"><td>%lld</td><td>%s</td><td>%lld</td></tr>";
+static const char tpl_tail[] =
+    "</tbody></table></main><footer>Generated by ExpressC</footer>"
+    "</body></html>";
+
+static void bench_template(void) {
+    const int rounds = 200000;
+    static const char* names[4] = {
+        "Ada Lovelace", "Grace \"Amazing\" Hopper",
+        "Barbara Liskov & co", "Edsger <Dijkstra>"};
+
+    // The same page with template tags in place of the formats.
+    char* src = (char*)malloc(8192);
+    size_t src_len = (size_t)snprintf(
+        src, 8192,
+        "<!doctype html><html><head><meta charset=\"utf-8\"><title>{{title}}"
+        "</title><link rel=\"stylesheet\" href=\"/assets/index.css\"></head>"
+        "<body><header><nav><a href=\"/\">Home</a> <a href=\"/orders\">"
+        "Orders</a></nav></header><main><h1>{{title}}</h1><table><thead><tr>"
+        "<th>#</th><th>Customer</th><th>Total</th></tr></thead><tbody>"
+        "{{#rows}}<tr class=\"row\"><td>{{id}}</td><td>{{name}}</td><td>"
+        "{{total}}</td></tr>{{/rows}}%s",
+        tpl_tail);
+    ExpressTemplate* t = template_compile(src, src_len);
+    if (t == NULL) {
+        printf("template: compile failed\n");
+        free(src);
+        return;
+    }
+
+    template_var row_vars[TPL_ROWS][3];
+    template_scope rows[TPL_ROWS];
+    for (int i = 0; i < TPL_ROWS; i++) {
+        row_vars[i][0] = TEMPLATE_INT("id", i + 1);
+        row_vars[i][1] = TEMPLATE_STR("name", names[i & 3]);
+        row_vars[i][2] = TEMPLATE_INT("total", 1000 + i * 37);
+        rows[i] = (template_scope){row_vars[i], 3};
+    }
+    template_var top[] = {TEMPLATE_STR("title", "Orders & Returns"),
+                          TEMPLATE_LIST("rows", rows, TPL_ROWS)};
+    template_scope scope = {top, 2};
+
+    char* page = (char*)malloc(65536);
+    char esc[256];
+    size_t total = 0;
+    double start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        size_t off = 0;
+        legacy_escape(esc, sizeof(esc), "Orders & Returns");
+        off += (size_t)snprintf(page + off, 65536 - off, tpl_head, esc, esc);
+        for (int i = 0; i < TPL_ROWS; i++) {
+            legacy_escape(esc, sizeof(esc), names[i & 3]);
+            off += (size_t)snprintf(page + off, 65536 - off, tpl_row,
+                                    (long long)(i + 1), esc,
+                                    (long long)(1000 + i * 37));
+        }
+        off += (size_t)snprintf(page + off, 65536 - off, "%s", tpl_tail);
+        total += off;
+    }
+    double elapsed_legacy = now_sec() - start;
+
+    struct Arena arena = {NULL};
+    http_response res = response_default();
+    res.arena = &arena;
+    size_t segments = 0;
+    start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        template_render(t, &scope, &res);
+        total += res.content_length;
+        segments = res.segments_len;
+        response_drop_segments(&res);
+        res.content_length = 0;
+        arena_reset(&arena);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("template: snprintf  %6.2f M pages/s\n",
+           rounds / elapsed_legacy / 1e6);
+    printf("template: compiled  %6.2f M pages/s (%zu segments)\n",
+           rounds / elapsed / 1e6, segments);
+    if (total == 0) printf("template: empty\n");
+    response_cleanup(&res);
+    arena_free(&arena);
+    template_destroy(t);
+    free(page);
+    free(src);
+}
+
+// A recursive-descent parser reading one byte at a time, writing the same
+// kind of tape: one entry per value, containers patched with their end.
+struct NaiveJson {
+    const byte* start;
+    const byte* end;
+    uint64_t* tape;
+    size_t t;
+};
+
+static const byte* naive_ws(const byte* p, const byte* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
+
+static const byte* naive_value(struct NaiveJson* j, const byte* p,
+                               int depth) {
+    const byte* end = j->end;
+    p = naive_ws(p, end);
+    if (p == end || depth > JSON_MAX_DEPTH) return NULL;
+    size_t at = j->t++;
+    j->tape[at] = (uint64_t)*p << 56 | (uint64_t)(p - j->start);
+    if (*p == '{' || *p == '[') {
+        byte close = *p == '{' ? '}' : ']';
+        p = naive_ws(p + 1, end);
+        if (p < end && *p == close) {
+            j->tape[at] = (uint64_t)*p << 56 | j->t;
+            return p + 1;
+        }
+        for (;;) {
+            if (close == '}') {
+                p = naive_ws(p, end);
+                if (p == end || *p != '"') return NULL;
+                if ((p = naive_value(j, p, depth + 1)) == NULL) return NULL;
+                p = naive_ws(p, end);
+                if (p == end || *p++ != ':') return NULL;
+            }
+            if ((p = naive_value(j, p, depth + 1)) == NULL) return NULL;
+            p = naive_ws(p, end);
+            if (p == end) return NULL;
+            if (*p == close) {
+                j->tape[at] = (uint64_t)*p << 56 | j->t;
+                return p + 1;
+            }
+            if (*p++ != ',') return NULL;
+        }
+    }
+    if (*p == '"') {
+        for (p++; p < end && *p != '"'; p++) {
+            if (*p < 0x20) return NULL;
+            if (*p == '\\' && (++p == end || !escape_valid(p, (size_t)(end - p), 0)))
+                return NULL;
+        }
+        return p < end ? p + 1 : NULL;
+    }
+    if (*p == '-' || (*p >= '0' && *p <= '9')) {
+        size_t e = scan_number(p, (size_t)(end - p), 0);
+        return e == 0 ? NULL : p + e;
+    }
+    static const char* const words[] = {"true", "false", "null"};
+    for (int i = 0; i < 3; i++) {
+        size_t n = strlen(words[i]);
+        if ((size_t)(end - p) >= n && memcmp(p, words[i], n) == 0 &&
+            at_delimiter(p, (size_t)(end - p), n))
+            return p + n;
+    }
+    return NULL;
+}
+
+static void* bench_json_alloc(void* ctx, size_t len) {
+    return arena_alloc((struct Arena*)ctx, len);
+}
+
+static void bench_json(void) {
+    // About the size of an API request body.
+    const int rounds = 250000;
+    static const char item[] =
+        "{\"id\": %d, \"name\": \"Ada Lovelace\", \"email\": "
+        "\"ada@example.com\", \"tags\": [\"admin\", \"ops\", \"billing\"], "
+        "\"active\": true, \"score\": 12.75, \"manager\": null, "
+        "\"bio\": \"Wrote the first published algorithm intended for a "
+        "machine, notes on the Analytical Engine, and speculated that it "
+        "might compose music.\\n\\\"Poetical science\\\"\"}";
+    size_t cap = 8192, len = 0;
+    byte* doc = (byte*)malloc(cap);
+    doc[len++] = '[';
+    for (int i = 0; len < 4096; i++) {
+        if (i > 0) doc[len++] = ',';
+        len += (size_t)snprintf((char*)doc + len, cap - len, item, i);
+    }
+    doc[len++] = ']';
+
+    struct NaiveJson naive = {doc, doc + len,
+                              (uint64_t*)malloc((len + 2) * sizeof(uint64_t)),
+                              0};
+    size_t valid = 0;
+    double start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        naive.t = 0;
+        const byte* end = naive_value(&naive, doc, 0);
+        valid += end != NULL && naive_ws(end, doc + len) == doc + len;
+    }
+    double elapsed_naive = now_sec() - start;
+
+    struct Arena arena = {NULL};
+    int64_t ids = 0;
+    start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        json_doc* d = json_parse(doc, len, bench_json_alloc, &arena);
+        int64_t id = 0;
+        if (d != NULL && json_i64(json_get(json_root(d), "[3].id"), &id)) {
+            valid++;
+            ids += id;
+        }
+        arena_reset(&arena);
+    }
+    double elapsed = now_sec() - start;
+
+    double gb = (double)len * rounds / 1e9;
+    printf("json: byte-at-a-time %6.2f GB/s\n", gb / elapsed_naive);
+    printf("json: 64-byte blocks %6.2f GB/s\n", gb / elapsed);
+    if (valid != 2 * (size_t)rounds || ids != 3 * rounds)
+        printf("json: unexpected result\n");
+    arena_free(&arena);
+    free(naive.tape);
+    free(doc);
+}
+
+// What a handler writes without the writer: snprintf per field into a
+// scratch buffer, escaping strings a byte at a time.
+static size_t legacy_json_string(char* out, size_t cap, const char* s) {
+    size_t n = 0;
+    out[n++] = '"';
+    for (; *s != '\0' && n + 8 < cap; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char)c;
+        } else if (c < 0x20) {
+            n += (size_t)snprintf(out + n, cap - n, "\\u%04x", c);
+        } else {
+            out[n++] = (char)c;
+        }
+    }
+    out[n++] = '"';
+    return n;
+}
+
+#define JSONW_ROWS 50
+
+static void bench_jsonwrite(void) {
+    const int rounds = 100000;
+    static const char* names[4] = {"Ada Lovelace", "Grace \"Amazing\" Hopper",
+                                   "Barbara Liskov", "Edsger Dijkstra\n"};
+
+    char* page = (char*)malloc(65536);
+    size_t total = 0;
+    double start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        size_t off = (size_t)snprintf(page, 65536, "{\"items\":[");
+        for (int i = 0; i < JSONW_ROWS; i++) {
+            if (i > 0) page[off++] = ',';
+            off += (size_t)snprintf(page + off, 65536 - off,
+                                    "{\"id\":%d,\"name\":", i);
+            off += legacy_json_string(page + off, 65536 - off, names[i & 3]);
+            off += (size_t)snprintf(page + off, 65536 - off,
+                                    ",\"score\":%.17g,\"active\":%s,"
+                                    "\"tags\":[\"admin\",\"ops\"]}",
+                                    12.75 + i / 100.0,
+                                    i & 1 ? "true" : "false");
+        }
+        off += (size_t)snprintf(page + off, 65536 - off, "],\"total\":%d}",
+                                JSONW_ROWS);
+        total += off;
+    }
+    double elapsed_legacy = now_sec() - start;
+
+    struct Arena arena = {NULL};
+    start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        http_response res = response_default();
+        res.arena = &arena;
+        json_begin_object(&res);
+        json_kv_array(&res, "items");
+        for (int i = 0; i < JSONW_ROWS; i++) {
+            json_begin_object(&res);
+            json_kv_i64(&res, "id", i);
+            json_kv_str(&res, "name", names[i & 3]);
+            json_kv_double(&res, "score", 12.75 + i / 100.0);
+            json_kv_bool(&res, "active", i & 1);
+            json_kv_array(&res, "tags");
+            json_add_str(&res, "admin");
+            json_add_str(&res, "ops");
+            json_end_array(&res);
+            json_end_object(&res);
+        }
+        json_end_array(&res);
+        json_kv_u64(&res, "total", JSONW_ROWS);
+        if (!json_end_object(&res)) printf("jsonwrite: failed\n");
+        total += res.content_length;
+        response_cleanup(&res);
+        arena_reset(&arena);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("jsonwrite: snprintf %7.1f k docs/s\n",
+           rounds / elapsed_legacy / 1e3);
+    printf("jsonwrite: writer   %7.1f k docs/s\n", rounds / elapsed / 1e3);
+    if (total == 0) printf("jsonwrite: empty\n");
+    arena_free(&arena);
+    free(page);
+}
+
+// A hot static file: opened, read and serialized on every request, vs
+// found already serialized in the host's cache. Run from the repository
+// root so the example site is found.
+static void bench_static(void) {
+    const int rounds = 200000;
+    struct VHost host;
+    memset(&host, 0, sizeof(host));
+    if (!vhost_init(&host, router_new(), "test/static_server/public",
+                    STATIC_CACHE_DEFAULT_BUDGET)) {
+        printf("static: no test/static_server/public\n");
+        return;
+    }
+
+    http_request req;
+    memset(&req, 0, sizeof(req));
+    strcpy(req.version, "HTTP/1.1");
+    strcpy(req.method, "GET");
+    strcpy(req.route, "/assets/index-UwAqmgiG.css");
+
+    // The first read seeds the cache; vhost_init succeeds on a missing
+    // directory, so this is where a wrong working directory shows.
+    size_t key_len = strlen(req.route);
+    uint64_t hash = route_hash(req.route, key_len);
+    http_response res = response_default();
+    byte* body = NULL;
+    if (!try_serve_static_file(&host, &req, &res, &body)) {
+        printf("static: no test/static_server/public%s\n", req.route);
+        vhost_clear(&host);
+        return;
+    }
+    response_cache_store(host.static_cache, UINT64_MAX / 2, req.route,
+                         key_len, key_len, hash, &res);
+    response_cleanup(&res);
+    free(body);
+    if (cache_shard_find(response_cache_shard(host.static_cache, hash), hash,
+                         req.route, key_len) == NULL) {
+        printf("static: %s was not cached\n", req.route);
+        vhost_clear(&host);
+        return;
+    }
+
+    byte stack[8192];
+    size_t total = 0;
+    double start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        res = response_default();
+        body = NULL;
+        if (!try_serve_static_file(&host, &req, &res, &body)) {
+            printf("static: reading %s failed\n", req.route);
+            vhost_clear(&host);
+            return;
+        }
+        struct OutBuf head;
+        outbuf_init(&head, stack, sizeof(stack));
+        serialize_response_head(&req, &res, 200, false, &head);
+        total += head.len + res.content_length;
+        outbuf_release(&head);
+        response_cleanup(&res);
+        free(body);
+    }
+    double elapsed_disk = now_sec() - start;
+
+    start = now_sec();
+    for (int n = 0; n < rounds; n++) {
+        struct CacheShard* shard =
+            response_cache_shard(host.static_cache, hash);
+        pthread_mutex_lock(&shard->lock);
+        struct CacheEntry* e =
+            cache_shard_find(shard, hash, req.route, key_len);
+        if (e != NULL) {
+            cache_lru_unlink(e);
+            cache_lru_push_front(shard, e);
+            total += e->head_len + 2 + e->body_len;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("static: fopen/fread  %8.1f k req/s\n",
+           rounds / elapsed_disk / 1e3);
+    printf("static: cache hit    %8.1f k req/s\n", rounds / elapsed / 1e3);
+    if (total == 0) printf("static: empty\n");
+    vhost_clear(&host);
+}
+
+static const Bench benches[] = {
+    {"chunked", bench_chunked},
+    {"router", bench_router},
+    {"serialize", bench_serialize},
+    {"websocket", bench_websocket},
+    {"etag", bench_etag},
+    {"template", bench_template},
+    {"json", bench_json},
+    {"jsonwrite", bench_jsonwrite},
+    {"static", bench_static},
+};
+
+int main(int argc, char** argv) {
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (argc >= 2 && strcmp(argv[1], benches[i].name) != 0) continue;
+        benches[i].fn();
+    }
+    return 0;
+}
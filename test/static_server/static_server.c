@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "../ExpressC.h"
 
@@ -37,12 +38,13 @@ static void api_echo(void* ctx, http_request* req, http_response* res) {
 static void api_stats(void* ctx, http_request* req, http_response* res) {
     (void)req;
     ServerCtx* s = ctx;
-    static char body[128];
-    int n = snprintf(body, sizeof(body),
-        "{\"requests\":%zu,\"files\":%zu}",
-        s->requests, server_static_file_count(s->server));
-    set_response_header(res, "Content-Type", "application/json");
-    set_response_body(res, (byte*)body, (size_t)n);
+    if (!json_begin_object(res) ||
+        !json_kv_u64(res, "requests", s->requests) ||
+        !json_kv_u64(res, "files", server_static_file_count(s->server)) ||
+        !json_end_object(res)) {
+        clear_response_body(res);
+        set_response_status(res, "500");
+    }
 }
 
 static void spa_fallback(void* ctx, http_request* req, http_response* res) {
@@ -52,11 +54,17 @@ static void spa_fallback(void* ctx, http_request* req, http_response* res) {
     snprintf(path, sizeof(path), "%s/index.html", s->public_path);
     FILE* f = fopen(path, "rb");
     if (!f) { set_response_status(res, "404"); return; }
-    static byte buf[524288];
-    size_t n = fread(buf, 1, sizeof(buf), f);
+    struct stat st;
+    byte* buf = fstat(fileno(f), &st) == 0 ? malloc(st.st_size + 1) : NULL;
+    if (!buf) { fclose(f); set_response_status(res, "500"); return; }
+    size_t n = fread(buf, 1, st.st_size, f);
     fclose(f);
     set_response_header(res, "Content-Type", "text/html; charset=utf-8");
-    set_response_body(res, buf, n);
+    // The server frees buf once the response has gone out.
+    if (!append_response_segment(res, buf, n, SEGMENT_FREE(buf))) {
+        free(buf);
+        set_response_status(res, "500");
+    }
 }
 
 int main(int argc, char** argv) {
@@ -80,7 +88,10 @@ int main(int argc, char** argv) {
         router_add(router, (char*)"/api/ping",  GET,  api_ping)    != 0 ||
         router_add(router, (char*)"/api/echo",  POST, api_echo)    != 0 ||
         router_add(router, (char*)"/api/stats", GET,  api_stats)   != 0 ||
-        router_set_fallback(router, spa_fallback) != 0) {
+        router_set_fallback(router, spa_fallback) != 0 ||
+        router_add_compression(router, "text/", 1024) != 0 ||
+        router_add_compression(router, "application/javascript", 1024) != 0 ||
+        router_add_compression(router, "application/json", 1024) != 0) {
         fprintf(stderr, "router setup failed\n");
         router_destroy(router);
         return 1;
@@ -17,6 +17,8 @@ typedef struct param {
 typedef struct header {
     char* key;
     char* value;
+    size_t key_len;
+    size_t value_len;
 } header;
 
 typedef struct cookie {
@@ -28,12 +30,16 @@ typedef struct http_request {
     char route[1024];
     char method[16];
     char version[16];
+    char* query;
+    bool params_parsed;
     param request_params[MAX_PARAMS];
     size_t request_params_len;
     param route_params[MAX_PARAMS];
     size_t route_params_len;
+    char params_buf[1024];
     header headers[MAX_HEADERS];
     size_t headers_len;
+    bool cookies_parsed;
     cookie cookies[MAX_COOKIES];
     size_t cookie_len;
     char* host;
@@ -41,8 +47,30 @@ typedef struct http_request {
     char* content_type;
     byte* body;
     bool chunked;
+    void* conn;
+    bool json_parsed;
+    void* json;
 } http_request;
 
+// Fills buf with up to cap bytes of a streamed response body.
+typedef ssize_t (*response_producer)(void* ctx, byte* buf, size_t cap);
+
+typedef struct TCPSharedBuf TCPSharedBuf;
+
+// Who frees a response segment once it has been sent. release(ctx) runs
+// when set; shared is released by reference. Both empty means borrowed.
+typedef struct segment_ownership {
+    void (*release)(void* ctx);
+    void* ctx;
+    TCPSharedBuf* shared;
+} segment_ownership;
+
+typedef struct response_segment {
+    const byte* data;
+    size_t len;
+    segment_ownership owner;
+} response_segment;
+
 typedef struct http_response {
     header* headers;
     size_t headers_len;
@@ -52,4 +80,15 @@ typedef struct http_response {
     size_t content_length;
     byte* body;
     char* status_code;
+    bool finished;
+    response_producer producer;
+    void* producer_ctx;
+    // Appended after body, in order.
+    response_segment* segments;
+    size_t segments_len;
+    size_t segments_cap;
+    // Request arena backing alloc_response_buffer; NULL outside dispatch.
+    void* arena;
+    // State of the JSON writer (json_begin_object and friends).
+    void* json;
 } http_response;